@@ -0,0 +1,247 @@
+#include "activity_buckets.hpp"
+#include <algorithm>
+#include <atomic>
+#include <limits>
+
+namespace {
+std::int64_t floor_div(std::int64_t a, std::int64_t b) {
+    return a / b - (a % b < 0 ? 1 : 0);
+}
+
+std::int64_t ceil_div(std::int64_t a, std::int64_t b) {
+    return -floor_div(-a, b);
+}
+
+std::atomic<std::size_t> next_shard = 0;
+// Shard of the calling thread in every shared_activity_buckets.
+thread_local const std::size_t thread_shard = next_shard++;
+}  // namespace
+
+// Coarser levels have to reach back further than finer ones, by at least a
+// bucket of the next coarser level, so that query() can hand over between
+// them on an aligned boundary.
+static_assert(
+    bank::activity_buckets::MINUTES * 60 + 3600 + 86400 <=
+    bank::activity_buckets::HOURS * 3600
+);
+static_assert(
+    bank::activity_buckets::HOURS * 3600 + 86400 <=
+    bank::activity_buckets::DAYS * 86400
+);
+
+bank::activity_buckets::stamp
+bank::activity_buckets::stamp_at(std::chrono::sys_seconds at) noexcept {
+    const std::int64_t seconds = at.time_since_epoch().count();
+    return {
+        {floor_div(seconds, 60), floor_div(seconds, 3600),
+         floor_div(seconds, 86400)}};
+}
+
+void bank::activity_buckets::add(
+    const stamp &at,
+    long long in_xts,
+    long long out_xts
+) noexcept {
+    if (current_.transfers != 0 && at.periods[0] == current_at_.periods[0]) {
+        current_.transfers++;
+        current_.in_xts += in_xts;
+        current_.out_xts += out_xts;
+        return;
+    }
+    const bucket delta{0, 1, in_xts, out_xts};
+    if (current_.transfers != 0 && at.periods[0] < current_at_.periods[0]) {
+        // Late commit for an earlier minute.
+        fold(at, delta);
+        return;
+    }
+    if (current_.transfers != 0) {
+        fold(current_at_, current_);
+    }
+    current_at_ = at;
+    current_ = delta;
+}
+
+void bank::activity_buckets::fold(const stamp &at, const bucket &totals) {
+    for (std::size_t i = 0; i < levels_.size(); i++) {
+        bucket b = totals;
+        b.period = at.periods[i];
+        add(levels_[i], b.period, b);
+    }
+}
+
+void bank::activity_buckets::add(
+    std::chrono::sys_seconds at,
+    long long in_xts,
+    long long out_xts
+) noexcept {
+    add(stamp_at(at), in_xts, out_xts);
+}
+
+void bank::activity_buckets::add(
+    level &l,
+    std::int64_t period,
+    const bucket &delta
+) {
+    std::vector<bucket> &buckets = l.buckets;
+    auto accumulate = [&](bucket &b) {
+        b.transfers += delta.transfers;
+        b.in_xts += delta.in_xts;
+        b.out_xts += delta.out_xts;
+    };
+    // Commits usually land in the newest bucket.
+    if (!buckets.empty() && buckets.back().period == period) {
+        accumulate(buckets.back());
+        return;
+    }
+    const std::int64_t newest =
+        buckets.empty() ? period : std::max(buckets.back().period, period);
+    if (period <= newest - l.retained) {
+        return;
+    }
+    // Expired buckets are dropped in batches. At most `retained` of them
+    // are still live, so the vector never grows past twice that.
+    if (buckets.size() >= 2 * static_cast<std::size_t>(l.retained)) {
+        buckets.erase(
+            buckets.begin(),
+            std::find_if(
+                buckets.begin(), buckets.end(),
+                [&](const bucket &b) {
+                    return b.period > newest - l.retained;
+                }
+            )
+        );
+    }
+    // A commit that raced past a newer one may belong to an older bucket.
+    const auto it = std::lower_bound(
+        buckets.begin(), buckets.end(), period,
+        [](const bucket &b, std::int64_t p) { return b.period < p; }
+    );
+    if (it != buckets.end() && it->period == period) {
+        accumulate(*it);
+    } else {
+        buckets.insert(it, delta);
+    }
+}
+
+bank::activity_totals bank::activity_buckets::query(
+    std::chrono::sys_seconds from,
+    std::chrono::sys_seconds to,
+    std::chrono::sys_seconds now
+) const {
+    const std::int64_t f = from.time_since_epoch().count();
+    const std::int64_t t = to.time_since_epoch().count();
+    const std::int64_t n = now.time_since_epoch().count();
+    // Each level answers from the start of its retention, rounded up to
+    // the next coarser boundary, to where the finer level takes over.
+    std::array<std::int64_t, 3> starts{};
+    for (std::size_t i = 0; i < levels_.size(); i++) {
+        const level &l = levels_[i];
+        const std::int64_t retained_from =
+            (floor_div(n, l.width) - l.retained + 1) * l.width;
+        starts[i] = i + 1 == levels_.size()
+                        ? retained_from
+                        : ceil_div(retained_from, levels_[i + 1].width) *
+                              levels_[i + 1].width;
+    }
+
+    activity_totals totals;
+    std::int64_t covered_from = std::numeric_limits<std::int64_t>::max();
+    std::int64_t covered_to = std::numeric_limits<std::int64_t>::min();
+    for (std::size_t i = 0; i < levels_.size(); i++) {
+        const level &l = levels_[i];
+        const std::int64_t lo = std::max(f, starts[i]);
+        const std::int64_t hi =
+            i == 0 ? t : std::min(t, starts[i - 1]);
+        if (lo >= hi) {
+            continue;
+        }
+        // Widened to whole buckets; the starts are aligned, so this only
+        // ever happens at the ends of the window.
+        const std::int64_t first = floor_div(lo, l.width);
+        const std::int64_t last = ceil_div(hi, l.width);
+        covered_from = std::min(covered_from, first * l.width);
+        covered_to = std::max(covered_to, last * l.width);
+        auto it = std::lower_bound(
+            l.buckets.begin(), l.buckets.end(), first,
+            [](const bucket &b, std::int64_t p) { return b.period < p; }
+        );
+        for (; it != l.buckets.end() && it->period < last; ++it) {
+            totals.transfers += it->transfers;
+            totals.in_xts += it->in_xts;
+            totals.out_xts += it->out_xts;
+        }
+        const std::int64_t current = current_at_.periods[i];
+        if (current_.transfers != 0 && current >= first && current < last) {
+            totals.transfers += current_.transfers;
+            totals.in_xts += current_.in_xts;
+            totals.out_xts += current_.out_xts;
+        }
+    }
+    if (covered_from > covered_to) {
+        // Nothing of the window is retained (or it is empty).
+        covered_from = covered_to = f >= t ? f : starts.back();
+    }
+    totals.from = std::chrono::sys_seconds(std::chrono::seconds(covered_from));
+    totals.to = std::chrono::sys_seconds(std::chrono::seconds(covered_to));
+    return totals;
+}
+
+namespace {
+// Buckets a level holds at most: add() drops expired ones once there are
+// twice `retained`, and every bucket takes at least one transfer.
+std::size_t level_capacity(std::size_t retained, std::size_t transfers) {
+    return std::min(2 * retained, transfers);
+}
+}  // namespace
+
+void bank::activity_buckets::reserve(std::size_t transfers) {
+    for (level &l : levels_) {
+        l.buckets.reserve(
+            level_capacity(static_cast<std::size_t>(l.retained), transfers)
+        );
+    }
+}
+
+std::size_t bank::activity_buckets::reserved_bytes(std::size_t transfers
+) noexcept {
+    return (level_capacity(MINUTES, transfers) +
+            level_capacity(HOURS, transfers) +
+            level_capacity(DAYS, transfers)) *
+           sizeof(bucket);
+}
+
+void bank::shared_activity_buckets::add(
+    const activity_buckets::stamp &at,
+    long long in_xts,
+    long long out_xts
+) noexcept {
+    shard &s = shards_[thread_shard % SHARDS];
+    const std::unique_lock lock(s.mutex);
+    s.buckets.add(at, in_xts, out_xts);
+}
+
+bank::activity_totals bank::shared_activity_buckets::query(
+    std::chrono::sys_seconds from,
+    std::chrono::sys_seconds to,
+    std::chrono::sys_seconds now
+) {
+    activity_totals totals;
+    for (shard &s : shards_) {
+        const std::unique_lock lock(s.mutex);
+        // Every shard covers the same window for the same `now`.
+        const activity_totals part = s.buckets.query(from, to, now);
+        totals.from = part.from;
+        totals.to = part.to;
+        totals.transfers += part.transfers;
+        totals.in_xts += part.in_xts;
+        totals.out_xts += part.out_xts;
+    }
+    return totals;
+}
+
+void bank::shared_activity_buckets::reserve() {
+    for (shard &s : shards_) {
+        const std::unique_lock lock(s.mutex);
+        s.buckets.reserve();
+    }
+}
@@ -0,0 +1,113 @@
+#ifndef ACTIVITY_BUCKETS_H
+#define ACTIVITY_BUCKETS_H
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+namespace bank {
+// Transfers committed in a time window. `from` and `to` are the window that
+// was actually covered: the requested one widened to bucket boundaries and
+// clipped to what is still retained.
+struct activity_totals {
+    std::chrono::sys_seconds from;
+    std::chrono::sys_seconds to;
+    std::uint64_t transfers = 0;
+    long long in_xts = 0;
+    long long out_xts = 0;
+};
+
+// Per-minute, per-hour and per-day transfer totals, kept for the last
+// MINUTES minutes, HOURS hours and DAYS days. Only periods with transfers
+// take space, so a quiet account costs next to nothing. Not thread-safe;
+// bank::user updates it under the account lock.
+class activity_buckets {
+public:
+    static constexpr std::size_t MINUTES = 120;
+    static constexpr std::size_t HOURS = 48;
+    static constexpr std::size_t DAYS = 366;
+
+    // Bucket of every level that a point in time falls into. Computed once
+    // per transfer, before the account locks are taken.
+    struct stamp {
+        std::array<std::int64_t, 3> periods;
+    };
+    [[nodiscard]] static stamp stamp_at(std::chrono::sys_seconds at
+    ) noexcept;
+
+    void add(const stamp &at, long long in_xts, long long out_xts) noexcept;
+    void add(std::chrono::sys_seconds at, long long in_xts, long long out_xts)
+        noexcept;
+    // Totals for [from, to) as of `now`, from the finest buckets still
+    // retained for each part of the window: minutes for the last MINUTES
+    // minutes, then hours, then days. Costs O(buckets) however long the
+    // window is.
+    [[nodiscard]] activity_totals query(
+        std::chrono::sys_seconds from,
+        std::chrono::sys_seconds to,
+        std::chrono::sys_seconds now
+    ) const;
+    // Room for every bucket that can be retained, or that `transfers`
+    // transfers can create if that is fewer, so that add() never allocates
+    // for them afterwards.
+    void reserve(std::size_t transfers = SIZE_MAX);
+    // Bytes that reserve(transfers) allocates.
+    [[nodiscard]] static std::size_t reserved_bytes(std::size_t transfers
+    ) noexcept;
+
+private:
+    struct bucket {
+        std::int64_t period;  // Seconds since the epoch / width.
+        std::uint64_t transfers;
+        long long in_xts;
+        long long out_xts;
+    };
+    struct level {
+        std::int64_t width;  // Seconds.
+        std::int64_t retained;  // Periods.
+        std::vector<bucket> buckets;  // Ordered by period.
+    };
+    std::array<level, 3> levels_ = {
+        level{60, MINUTES, {}}, level{3600, HOURS, {}},
+        level{86400, DAYS, {}}};
+    // Totals of the latest minute written, folded into the levels once a
+    // later minute starts. Commits within a minute only touch these.
+    stamp current_at_{};
+    bucket current_{0, 0, 0, 0};
+
+    void fold(const stamp &at, const bucket &totals);
+    static void add(level &l, std::int64_t period, const bucket &delta);
+};
+
+// activity_buckets for the whole ledger, split into shards with a lock each
+// so that concurrent commits rarely contend. A thread always uses the same
+// shard; queries add up all of them.
+class shared_activity_buckets {
+public:
+    void add(
+        const activity_buckets::stamp &at,
+        long long in_xts,
+        long long out_xts
+    ) noexcept;
+    [[nodiscard]] activity_totals query(
+        std::chrono::sys_seconds from,
+        std::chrono::sys_seconds to,
+        std::chrono::sys_seconds now
+    );
+    void reserve();
+
+private:
+    static constexpr std::size_t SHARDS = 16;
+
+    struct alignas(64) shard {
+        std::mutex mutex;
+        activity_buckets buckets;
+    };
+    std::array<shard, SHARDS> shards_;
+};
+}  // namespace bank
+
+#endif  // ACTIVITY_BUCKETS_H
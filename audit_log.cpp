@@ -0,0 +1,254 @@
+#include "audit_log.hpp"
+#include <algorithm>
+#include <thread>
+
+namespace {
+// Domain tags, so that a chain link can never pass for a Merkle node.
+constexpr std::uint8_t LINK_TAG = 0;
+constexpr std::uint8_t NODE_TAG = 1;
+constexpr std::uint32_t NO_COUNTERPARTY = 0xFFFFFFFF;
+
+template <typename T>
+void append_le(std::string &out, T value) {
+    const auto bits = static_cast<std::uint64_t>(value);
+    for (std::size_t i = 0; i < sizeof(T); i++) {
+        out += static_cast<char>(static_cast<std::uint8_t>(bits >> (8 * i)));
+    }
+}
+
+void append_field(std::string &out, const std::string &field) {
+    append_le(out, static_cast<std::uint32_t>(field.size()));
+    out += field;
+}
+
+bank::sha256_digest
+hash_node(const bank::sha256_digest &left, const bank::sha256_digest &right) {
+    bank::sha256 h;
+    h.update(&NODE_TAG, 1);
+    h.update(left.data(), left.size());
+    h.update(right.data(), right.size());
+    return h.finish();
+}
+}  // namespace
+
+void bank::audit_log::cursor::add(std::string_view body) {
+    sha256 h;
+    h.update(&LINK_TAG, 1);
+    h.update(head.data(), head.size());
+    h.update(body.data(), body.size());
+    head = h.finish();
+    bytes += 1 + head.size() + body.size();
+
+    // The digest is the next leaf of the segment's Merkle tree: merge it
+    // with the complete subtrees to its left, like carrying in a counter.
+    const std::uint64_t left = seq % SEGMENT_RECORDS;
+    sha256_digest node = head;
+    std::size_t level = 0;
+    for (; ((left >> level) & 1U) != 0; level++) {
+        node = hash_node(nodes[level], node);
+    }
+    nodes[level] = node;
+    seq++;
+}
+
+bank::sha256_digest
+bank::audit_log::root_of(const frontier &nodes, std::uint64_t leaves) {
+    // Smaller subtrees hang off the right of larger ones.
+    std::optional<sha256_digest> root;
+    for (std::size_t level = 0; level < MERKLE_LEVELS; level++) {
+        if (((leaves >> level) & 1U) != 0) {
+            root = root ? hash_node(nodes[level], *root) : nodes[level];
+        }
+    }
+    return root.value_or(sha256_digest{});
+}
+
+bank::audit_log::chain &bank::audit_log::chain_of(const std::string &name) {
+    const std::unique_lock lock(mutex_);
+    std::unique_ptr<chain> &c = chains_[name];
+    if (!c) {
+        c = std::make_unique<chain>();
+    }
+    return *c;
+}
+
+bank::audit_log::record_bytes bank::audit_log::copy_records(
+    const user &u,
+    std::uint64_t from,
+    std::size_t count
+) {
+    // <seq> <counterparty> <delta> <comment>: little-endian integers,
+    // strings prefixed with a 32-bit length, no counterparty as length
+    // 0xFFFFFFFF. Serialized under the lock so that hashing needs none.
+    record_bytes out;
+    out.ends.reserve(count);
+    u.snapshot_transactions([&](const auto &transactions, int) {
+        const std::uint64_t end =
+            std::min<std::uint64_t>(transactions.size(), from + count);
+        for (std::uint64_t i = from; i < end; i++) {
+            const transaction &t = transactions[i];
+            append_le(out.bytes, i);
+            if (t.counterparty == nullptr) {
+                append_le(out.bytes, NO_COUNTERPARTY);
+            } else {
+                append_field(out.bytes, t.counterparty->name());
+            }
+            append_le(
+                out.bytes, static_cast<std::int64_t>(t.balance_delta_xts)
+            );
+            append_field(out.bytes, t.comment);
+            out.ends.push_back(out.bytes.size());
+        }
+    });
+    return out;
+}
+
+std::size_t bank::audit_log::update(const user &u) {
+    chain &c = chain_of(u.name());
+    const std::unique_lock lock(c.mutex);
+    // Read first: records committed meanwhile are hashed now or next time.
+    const std::uint64_t version = u.version();
+    if (version == c.version) {
+        return 0;
+    }
+    cursor cur{c.records, c.head, c.nodes};
+    std::size_t hashed = 0;
+    while (true) {
+        const record_bytes chunk = copy_records(u, cur.seq, COPY_CHUNK);
+        std::size_t begin = 0;
+        for (const std::size_t end : chunk.ends) {
+            cur.add(std::string_view(chunk.bytes).substr(begin, end - begin));
+            begin = end;
+            if (cur.seq % SEGMENT_RECORDS == 0) {
+                c.seals.push_back({cur.head, cur.nodes.back()});
+            }
+        }
+        hashed += chunk.ends.size();
+        if (chunk.ends.size() < COPY_CHUNK) {
+            break;
+        }
+    }
+    c.version = version;
+    c.records = cur.seq;
+    c.head = cur.head;
+    c.nodes = cur.nodes;
+    records_ += hashed;
+    bytes_ += cur.bytes;
+    return hashed;
+}
+
+bank::audit_head bank::audit_log::head(const user &u) {
+    chain &c = chain_of(u.name());
+    const std::unique_lock lock(c.mutex);
+    return {c.records, c.head};
+}
+
+std::vector<bank::audit_seal> bank::audit_log::seals(const user &u) {
+    chain &c = chain_of(u.name());
+    const std::unique_lock lock(c.mutex);
+    return c.seals;
+}
+
+bank::audit_report bank::audit_log::verify(
+    const std::vector<const user *> &users,
+    unsigned threads
+) {
+    struct job {
+        const user *u;
+        std::size_t segment;
+        std::uint64_t records;
+        sha256_digest start;
+        sha256_digest end;
+        sha256_digest root;
+    };
+    std::vector<job> jobs;
+    for (const user *u : users) {
+        chain *c = nullptr;
+        {
+            const std::unique_lock lock(mutex_);
+            const auto it = chains_.find(u->name());
+            if (it == chains_.end()) {
+                continue;
+            }
+            c = it->second.get();
+        }
+        const std::unique_lock lock(c->mutex);
+        sha256_digest start{};
+        for (std::size_t k = 0; k < c->seals.size(); k++) {
+            const audit_seal &s = c->seals[k];
+            jobs.push_back({u, k, SEGMENT_RECORDS, start, s.end, s.root});
+            start = s.end;
+        }
+        if (const std::uint64_t rest = c->records % SEGMENT_RECORDS; rest > 0) {
+            jobs.push_back(
+                {u, c->seals.size(), rest, start, c->head,
+                 root_of(c->nodes, rest)}
+            );
+        }
+    }
+
+    audit_report report;
+    report.segments = jobs.size();
+    std::mutex report_mutex;
+    std::atomic<std::size_t> next = 0;
+    auto work = [&] {
+        std::uint64_t records = 0;
+        std::uint64_t bytes = 0;
+        std::vector<std::pair<std::string, std::size_t>> mismatches;
+        for (std::size_t i = next++; i < jobs.size(); i = next++) {
+            const job &j = jobs[i];
+            const std::uint64_t first = j.segment * SEGMENT_RECORDS;
+            cursor cur{first, j.start, {}};
+            bool complete = true;
+            while (cur.seq < first + j.records) {
+                const std::uint64_t left = first + j.records - cur.seq;
+                const record_bytes chunk = copy_records(
+                    *j.u, cur.seq, std::min<std::uint64_t>(COPY_CHUNK, left)
+                );
+                if (chunk.ends.empty()) {
+                    complete = false;  // The history got shorter.
+                    break;
+                }
+                std::size_t begin = 0;
+                for (const std::size_t end : chunk.ends) {
+                    cur.add(
+                        std::string_view(chunk.bytes).substr(begin, end - begin)
+                    );
+                    begin = end;
+                }
+            }
+            records += cur.seq - first;
+            bytes += cur.bytes;
+            if (!complete || cur.head != j.end ||
+                root_of(cur.nodes, j.records) != j.root) {
+                mismatches.emplace_back(j.u->name(), j.segment);
+            }
+        }
+        const std::unique_lock lock(report_mutex);
+        report.records += records;
+        report.bytes += bytes;
+        report.mismatches.insert(
+            report.mismatches.end(), mismatches.begin(), mismatches.end()
+        );
+    };
+    // The calling thread takes a share too.
+    std::vector<std::thread> helpers;
+    const std::size_t count =
+        std::min<std::size_t>(std::max(threads, 1U), jobs.size());
+    for (std::size_t i = 1; i < count; i++) {
+        helpers.emplace_back(work);
+    }
+    work();
+    for (auto &h : helpers) {
+        h.join();
+    }
+    std::sort(report.mismatches.begin(), report.mismatches.end());
+    verified_bytes_ += report.bytes;
+    return report;
+}
+
+void bank::audit_log::print_metrics(std::ostream &os) const {
+    os << "audit.records\t" << records_ << '\n'
+       << "audit.bytes\t" << bytes_ << '\n'
+       << "audit.verified_bytes\t" << verified_bytes_ << '\n';
+}
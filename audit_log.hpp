@@ -0,0 +1,121 @@
+#ifndef AUDIT_LOG_H
+#define AUDIT_LOG_H
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "bank.hpp"
+#include "sha256.hpp"
+
+namespace bank {
+// End of a sealed segment of an account's audit chain.
+struct audit_seal {
+    sha256_digest end;   // Chain digest of the segment's last record.
+    sha256_digest root;  // Merkle root over the segment's chain digests.
+};
+
+struct audit_head {
+    std::uint64_t records = 0;
+    sha256_digest digest{};  // All zeros for an empty chain.
+};
+
+struct audit_report {
+    std::uint64_t records = 0;
+    std::uint64_t bytes = 0;  // Encoded record bytes hashed.
+    std::uint64_t segments = 0;
+    // Accounts and segments whose records no longer match their chain.
+    std::vector<std::pair<std::string, std::size_t>> mismatches;
+};
+
+// Tamper-evident SHA-256 chain over each account's history. Record i hashes
+// the digest of record i - 1 with i, the counterparty's name, the delta and
+// the comment. Every SEGMENT_RECORDS records the chain is sealed with the
+// Merkle root of the segment's digests, so that segments verify
+// independently and in parallel.
+//
+// Chains are extended on demand by update(). Records are copied out under
+// the account lock a chunk at a time and hashed outside it. Accounts are
+// keyed by name, so seals recorded for one ledger can check another one
+// restored from a snapshot.
+class audit_log {
+public:
+    static constexpr std::size_t SEGMENT_RECORDS = 4096;
+
+    // Hashes the records added since the last call, unless the account's
+    // version hasn't changed since. Returns the number of records hashed.
+    std::size_t update(const user &u);
+    [[nodiscard]] audit_head head(const user &u);
+    // Seals of the complete segments hashed so far.
+    [[nodiscard]] std::vector<audit_seal> seals(const user &u);
+
+    // Rehashes everything chained so far for `users`, one segment per task
+    // on `threads` threads, the calling one included, and compares with the
+    // stored seals and heads. Records added after the last update() are not
+    // checked.
+    audit_report
+    verify(const std::vector<const user *> &users, unsigned threads);
+
+    void print_metrics(std::ostream &os) const;
+
+private:
+    // Records copied per snapshot_transactions() call.
+    static constexpr std::size_t COPY_CHUNK = 256;
+    // log2(SEGMENT_RECORDS) + 1.
+    static constexpr std::size_t MERKLE_LEVELS = 13;
+    using frontier = std::array<sha256_digest, MERKLE_LEVELS>;
+
+    // Hashed fields of consecutive records, serialized back to back.
+    struct record_bytes {
+        std::string bytes;
+        std::vector<std::size_t> ends;  // Offset past each record.
+    };
+
+    struct chain {
+        std::mutex mutex;
+        std::uint64_t version = 0;  // Of the account at the last update().
+        std::uint64_t records = 0;
+        sha256_digest head{};
+        std::vector<audit_seal> seals;
+        // Roots of the complete subtrees of the current segment, one per
+        // set bit of its record count.
+        frontier nodes{};
+    };
+
+    // Running state while hashing a run of records.
+    struct cursor {
+        std::uint64_t seq;
+        sha256_digest head;
+        frontier nodes;
+        std::uint64_t bytes = 0;
+
+        // Adds the record whose fields are `body`.
+        void add(std::string_view body);
+    };
+
+    std::mutex mutex_;
+    std::unordered_map<std::string, std::unique_ptr<chain>> chains_;
+    std::atomic<std::uint64_t> records_ = 0;
+    std::atomic<std::uint64_t> bytes_ = 0;
+    std::atomic<std::uint64_t> verified_bytes_ = 0;
+
+    chain &chain_of(const std::string &name);
+    // Up to `count` records from position `from`; fewer if the history is
+    // shorter.
+    static record_bytes
+    copy_records(const user &u, std::uint64_t from, std::size_t count);
+    // Merkle root of the first `leaves` digests of a segment.
+    static sha256_digest root_of(const frontier &nodes, std::uint64_t leaves);
+};
+}  // namespace bank
+
+#endif  // AUDIT_LOG_H
@@ -1,8 +1,34 @@
 #include "bank.hpp"
 #include <algorithm>
+#include <array>
+#include <charconv>
+#include <ctime>
+#include <istream>
+#include <ostream>
+#include <sstream>
 #include <string>
+#include <unordered_map>
+#include <utility>
+#include "snapshot_io.hpp"
 
-bank::user::user(std::string name) : name_(std::move(name)), balance_(100) {
+namespace {
+// Timestamp for the activity buckets. Whole seconds are all they need, so
+// on Linux the coarse clock does, at a fraction of the cost.
+std::chrono::sys_seconds now_seconds() {
+#ifdef __linux__
+    timespec ts{};
+    clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+    return std::chrono::sys_seconds(std::chrono::seconds(ts.tv_sec));
+#else
+    return std::chrono::floor<std::chrono::seconds>(
+        std::chrono::system_clock::now()
+    );
+#endif
+}
+}  // namespace
+
+bank::user::user(std::string name)
+    : name_(std::move(name)), balance_(100), rollup_xts_(100) {
     const std::unique_lock lock(mutex_);
     add_transaction(nullptr, 100, "Initial deposit for " + name_);
 }
@@ -16,19 +42,144 @@ int bank::user::balance_xts() const {
     return balance_;
 }
 
+std::uint64_t bank::user::version() const noexcept {
+    return version_.load(std::memory_order_acquire);
+}
+
+std::pair<int, std::uint64_t> bank::user::versioned_balance_xts() const {
+    const std::unique_lock lock(mutex_);
+    return {balance_, version_.load(std::memory_order_relaxed)};
+}
+
+std::uint64_t bank::user::wait_for_change(
+    std::uint64_t known_version,
+    std::chrono::milliseconds timeout
+) const {
+    if (version() != known_version) {
+        return version();
+    }
+    std::unique_lock lock(mutex_);
+    cv_new_transaction_.wait_for(lock, timeout, [&] {
+        return version_.load(std::memory_order_relaxed) != known_version;
+    });
+    return version_.load(std::memory_order_relaxed);
+}
+
 void bank::user::add_transaction(
     const bank::user *to,
     int delta,
     const std::string &comment
 ) noexcept {
-    transactions_.emplace_back(to, delta, comment);
+    if (netting_window_.count() == 0) {
+        transactions_.emplace_back(to, delta, comment);
+    } else {
+        const auto now = std::chrono::steady_clock::now();
+        if (pending_ &&
+            (pending_->counterparty != to || pending_->deadline <= now)) {
+            flush_netting();
+        }
+        if (!pending_) {
+            pending_.emplace(netting_batch{
+                to, 0, std::make_shared<netted_items>(), now + netting_window_}
+            );
+        }
+        pending_->balance_delta_xts += delta;
+        pending_->items->add(delta, comment);
+    }
+    version_.fetch_add(1, std::memory_order_release);
+    cv_new_transaction_.notify_all();
+}
+
+void bank::user::flush_netting() const noexcept {
+    if (!pending_) {
+        return;
+    }
+    netting_batch batch = std::move(*pending_);
+    pending_.reset();
+    if (batch.items->size() == 1) {
+        transactions_.emplace_back(
+            batch.counterparty, batch.balance_delta_xts,
+            (*batch.items)[0].comment
+        );
+    } else {
+        transactions_.emplace_back(
+            batch.counterparty, batch.balance_delta_xts,
+            "Netted " + std::to_string(batch.items->size()) + " transfers",
+            std::move(batch.items)
+        );
+    }
     cv_new_transaction_.notify_all();
 }
 
+void bank::user::set_netting_window(std::chrono::microseconds window) {
+    const std::unique_lock lock(mutex_);
+    if (history_capacity_ != 0 && window.count() != 0) {
+        throw capacity_exceeded_error(
+            "Netting is not available with fixed history capacity"
+        );
+    }
+    flush_netting();
+    netting_window_ = window;
+}
+
+// Must be called under the user's lock.
+void bank::user::check_capacity(const std::string &comment) const {
+    if (history_capacity_ == 0) {
+        return;
+    }
+    if (transactions_.size() >= history_capacity_) {
+        throw capacity_exceeded_error(
+            "History capacity exceeded for " + name_ + ": " +
+            std::to_string(history_capacity_) + " transactions"
+        );
+    }
+    // Longer comments would need a heap allocation per record.
+    if (comment.size() > std::string().capacity()) {
+        throw capacity_exceeded_error(
+            "Comment exceeds " + std::to_string(std::string().capacity()) +
+            " bytes in fixed-capacity mode"
+        );
+    }
+}
+
 void bank::user::transfer(
     bank::user &counterparty,
     int amount_xts,
     const std::string &comment
+) {
+    transfer_impl(
+        counterparty, amount_xts, comment, std::nullopt, std::nullopt
+    );
+}
+
+std::uint64_t bank::user::transfer_if_version(
+    bank::user &counterparty,
+    int amount_xts,
+    const std::string &comment,
+    std::uint64_t expected_version
+) {
+    return transfer_impl(
+        counterparty, amount_xts, comment, expected_version, std::nullopt
+    );
+}
+
+std::uint64_t bank::user::transfer_if_balance(
+    bank::user &counterparty,
+    int amount_xts,
+    const std::string &comment,
+    int expected_balance_xts
+) {
+    return transfer_impl(
+        counterparty, amount_xts, comment, std::nullopt, expected_balance_xts
+    );
+}
+
+std::uint64_t bank::user::transfer_impl(
+    bank::user &counterparty,
+    int amount_xts,
+    const std::string &comment,
+    const std::optional<std::uint64_t> &expected_version,
+    const std::optional<int> &expected_balance_xts
 ) {
     if (this == &counterparty) {
         throw invalid_transfer_error("Self-transfer");
@@ -36,43 +187,652 @@ void bank::user::transfer(
     if (amount_xts < 0) {
         throw invalid_transfer_error("Negative amount, you're lose:(");
     }
+    // Fail fast without touching the locks if the client is already stale.
+    if (expected_version && version() != *expected_version) {
+        throw precondition_failed_error(
+            "expected version " + std::to_string(*expected_version), version()
+        );
+    }
+
+    const activity_buckets::stamp at =
+        activity_buckets::stamp_at(now_seconds());
+    balance_alerts alerts;
+    std::uint64_t committed_version = 0;
+    {
+        const std::scoped_lock lock(mutex_, counterparty.mutex_);
+
+        const std::uint64_t current_version =
+            version_.load(std::memory_order_relaxed);
+        if (expected_version && current_version != *expected_version) {
+            throw precondition_failed_error(
+                "expected version " + std::to_string(*expected_version),
+                current_version
+            );
+        }
+        if (expected_balance_xts && balance_ != *expected_balance_xts) {
+            throw precondition_failed_error(
+                "expected balance " + std::to_string(*expected_balance_xts) +
+                    " XTS, current balance " + std::to_string(balance_) +
+                    " XTS",
+                current_version
+            );
+        }
+
+        check_capacity(comment);
+        counterparty.check_capacity(comment);
 
-    const std::scoped_lock lock(mutex_, counterparty.mutex_);
+        const int new_user_amount = balance_ - amount_xts;
+        if (new_user_amount < 0) {
+            throw not_enough_funds_error(balance_, amount_xts);
+        }
 
-    const int new_user_amount = balance_ - amount_xts;
-    if (new_user_amount < 0) {
-        throw not_enough_funds_error(balance_, amount_xts);
+        balance_ -= amount_xts;
+        add_transaction(&counterparty, -amount_xts, comment);
+        counterparty.balance_ += amount_xts;
+        counterparty.add_transaction(this, amount_xts, comment);
+        activity_.add(at, 0, amount_xts);
+        counterparty.activity_.add(at, amount_xts, 0);
+        update_rollups(counterparty, amount_xts);
+        publish_to_groups(&counterparty, -amount_xts, comment);
+        counterparty.publish_to_groups(this, amount_xts, comment);
+        check_watches(alerts);
+        counterparty.check_watches(alerts);
+        committed_version = version_.load(std::memory_order_relaxed);
     }
+    if (ledger_activity_ != nullptr) {
+        ledger_activity_->add(at, amount_xts, amount_xts);
+    }
+    for (const auto &[callback, balance_xts] : alerts) {
+        try {
+            (*callback)(balance_xts);
+        } catch (...) {  // NOLINT(bugprone-empty-catch)
+            // The transfer has committed; a failing watcher can't undo it.
+        }
+    }
+    return committed_version;
+}
+
+const bank::user *bank::user::parent() const noexcept {
+    return parent_;
+}
+
+std::vector<const bank::user *> bank::user::sub_accounts() const {
+    const std::unique_lock lock(mutex_);
+    return sub_accounts_;
+}
+
+long long bank::user::rollup_xts() const noexcept {
+    return rollup_xts_.load(std::memory_order_relaxed);
+}
+
+bank::activity_totals bank::user::activity(
+    std::chrono::sys_seconds from,
+    std::chrono::sys_seconds to
+) const {
+    const std::chrono::sys_seconds now = now_seconds();
+    const std::unique_lock lock(mutex_);
+    return activity_.query(from, to, now);
+}
+
+void bank::user::update_rollups(user &to, int amount_xts) noexcept {
+    // Parents never change, so the chains need no locking. Common ancestors
+    // would see -amount and +amount; they are skipped.
+    user *from = this;
+    user *into = &to;
+    while (from != into) {
+        if (into == nullptr ||
+            (from != nullptr && from->depth_ >= into->depth_)) {
+            from->rollup_xts_.fetch_sub(amount_xts, std::memory_order_relaxed);
+            from = from->parent_;
+        } else {
+            into->rollup_xts_.fetch_add(amount_xts, std::memory_order_relaxed);
+            into = into->parent_;
+        }
+    }
+}
+
+void bank::user::publish_to_groups(
+    const user *counterparty,
+    int delta,
+    const std::string &comment
+) const {
+    for (const user *group = this; group != nullptr; group = group->parent_) {
+        if (group->group_monitors_.load(std::memory_order_relaxed) == 0) {
+            continue;
+        }
+        const std::unique_lock lock(group->group_mutex_);
+        for (const auto &feed : group->group_feeds_) {
+            {
+                const std::unique_lock feed_lock(feed->mutex);
+                if (feed->events.size() >= feed->max_events) {
+                    feed->events.pop_front();
+                    feed->dropped++;
+                }
+                feed->events.push_back({this, counterparty, delta, comment});
+            }
+            feed->cv.notify_one();
+        }
+    }
+}
+
+bank::group_monitor::group_monitor(
+    const user &group,
+    std::size_t max_pending
+)
+    : group_(group), feed_(std::make_shared<group_feed>()) {
+    feed_->max_events = std::max<std::size_t>(max_pending, 1);
+    const std::unique_lock lock(group_.group_mutex_);
+    group_.group_feeds_.push_back(feed_);
+    group_.group_monitors_++;
+}
+
+bank::group_monitor::~group_monitor() {
+    const std::unique_lock lock(group_.group_mutex_);
+    std::erase(group_.group_feeds_, feed_);
+    group_.group_monitors_--;
+}
+
+bank::group_event bank::group_monitor::wait_next_event() {
+    std::unique_lock lock(feed_->mutex);
+    feed_->cv.wait(lock, [&] { return !feed_->events.empty(); });
+    group_event event = std::move(feed_->events.front());
+    feed_->events.pop_front();
+    event.dropped_before = std::exchange(feed_->dropped, 0);
+    return event;
+}
+
+std::optional<bank::group_event>
+bank::group_monitor::wait_next_event(std::chrono::milliseconds timeout) {
+    std::unique_lock lock(feed_->mutex);
+    if (!feed_->cv.wait_for(lock, timeout, [&] {
+            return !feed_->events.empty();
+        })) {
+        return std::nullopt;
+    }
+    group_event event = std::move(feed_->events.front());
+    feed_->events.pop_front();
+    event.dropped_before = std::exchange(feed_->dropped, 0);
+    return event;
+}
+
+std::uint64_t bank::user::watch_balance(
+    threshold direction,
+    int limit_xts,
+    balance_callback callback
+) {
+    const std::unique_lock lock(mutex_);
+    const bool fired = direction == threshold::BELOW ? balance_ < limit_xts
+                                                     : balance_ > limit_xts;
+    const std::uint64_t id = next_watch_id_++;
+    watches_.push_back(
+        {id, direction, limit_xts, fired,
+         std::make_shared<const balance_callback>(std::move(callback))}
+    );
+    update_watch_bounds();
+    return id;
+}
+
+bool bank::user::unwatch_balance(std::uint64_t id) {
+    const std::unique_lock lock(mutex_);
+    const auto removed = std::erase_if(watches_, [&](const balance_watch &w) {
+        return w.id == id;
+    });
+    update_watch_bounds();
+    return removed > 0;
+}
+
+void bank::user::check_watches(balance_alerts &alerts) {
+    if (balance_ >= watch_low_xts_ && balance_ <= watch_high_xts_) {
+        return;
+    }
+    for (balance_watch &w : watches_) {
+        const bool beyond = w.direction == threshold::BELOW
+                                ? balance_ < w.limit_xts
+                                : balance_ > w.limit_xts;
+        if (beyond && !w.fired) {
+            alerts.emplace_back(w.callback, balance_);
+        }
+        w.fired = beyond;
+    }
+    update_watch_bounds();
+}
 
-    balance_ -= amount_xts;
-    add_transaction(&counterparty, -amount_xts, comment);
-    counterparty.balance_ += amount_xts;
-    counterparty.add_transaction(this, amount_xts, comment);
+// The interval of balances that keep every watch in its current state.
+void bank::user::update_watch_bounds() noexcept {
+    watch_low_xts_ = std::numeric_limits<int>::min();
+    watch_high_xts_ = std::numeric_limits<int>::max();
+    for (const balance_watch &w : watches_) {
+        if (w.direction == threshold::BELOW) {
+            if (w.fired) {
+                watch_high_xts_ = std::min(watch_high_xts_, w.limit_xts - 1);
+            } else {
+                watch_low_xts_ = std::max(watch_low_xts_, w.limit_xts);
+            }
+        } else {
+            if (w.fired) {
+                watch_low_xts_ = std::max(watch_low_xts_, w.limit_xts + 1);
+            } else {
+                watch_high_xts_ = std::min(watch_high_xts_, w.limit_xts);
+            }
+        }
+    }
 }
 
 bank::user_transactions_iterator bank::user::snapshot_transactions(
     const std::function<void(const std::vector<transaction> &, int)> &f
 ) const {
     const std::unique_lock lock(mutex_);
+    flush_netting();
     f(transactions_, balance_);
     return bank::user_transactions_iterator{this, transactions_.size()};
 }
 
+std::uint64_t bank::extend_history_checksum(
+    std::uint64_t checksum,
+    std::string_view counterparty,
+    int balance_delta_xts,
+    std::string_view comment
+) noexcept {
+    static constexpr std::uint64_t FNV_PRIME = 0x100000001b3ULL;
+    auto mix = [&](std::string_view text) {
+        for (const char c : text) {
+            checksum = (checksum ^ static_cast<unsigned char>(c)) * FNV_PRIME;
+        }
+    };
+    std::array<char, 16> delta{};
+    const auto [delta_end, error] = std::to_chars(
+        delta.data(), delta.data() + delta.size(), balance_delta_xts
+    );
+    static_cast<void>(error);  // 16 characters fit any int.
+    mix(counterparty);
+    mix("\t");
+    mix(std::string_view(
+        delta.data(), static_cast<std::size_t>(delta_end - delta.data())
+    ));
+    mix("\t");
+    mix(comment);
+    mix("\n");
+    return checksum;
+}
+
+std::optional<std::uint64_t>
+bank::user::history_checksum(std::size_t records) const {
+    // Bounds how long one call holds the account lock while catching up.
+    static constexpr std::size_t CHUNK = 4096;
+    while (true) {
+        const std::unique_lock lock(mutex_);
+        if (records > transactions_.size()) {
+            return std::nullopt;
+        }
+        if (checksums_.size() >= records) {
+            return records == 0 ? EMPTY_HISTORY_CHECKSUM
+                                : checksums_[records - 1];
+        }
+        const std::size_t to = std::min(records, checksums_.size() + CHUNK);
+        for (std::size_t i = checksums_.size(); i < to; i++) {
+            const transaction &t = transactions_[i];
+            checksums_.push_back(extend_history_checksum(
+                i == 0 ? EMPTY_HISTORY_CHECKSUM : checksums_[i - 1],
+                t.counterparty == nullptr ? "-" : t.counterparty->name(),
+                t.balance_delta_xts, t.comment
+            ));
+        }
+    }
+}
+
 bank::user_transactions_iterator bank::user::monitor() const {
     const std::unique_lock lock(mutex_);
+    flush_netting();
     return bank::user_transactions_iterator{this, transactions_.size()};
 }
 
 bank::user &bank::ledger::get_or_create_user(const std::string &name) {
+    const std::size_t hash = user_table::hash(name);
     const std::unique_lock lock(mutex_);
-    if (users_.contains(name)) {
-        return users_.at(name);
-    } else {
-        users_.emplace(
-            std::piecewise_construct, std::tuple{name}, std::tuple{name}
+    if (user *u = users_.find(name, hash)) {
+        return *u;
+    }
+    return create_user(name, hash);
+}
+
+bank::user &
+bank::ledger::create_user(const std::string &name, std::size_t hash) {
+    if (users_.size() >= max_users_) {
+        throw capacity_exceeded_error(
+            "User limit reached: " + std::to_string(max_users_) + " users"
         );
-        return users_.at(name);
     }
+    user &u = users_.emplace(name, hash);
+    if (history_reserve_ > 0) {
+        u.transactions_.reserve(history_reserve_);
+    }
+    u.history_capacity_ = history_capacity_;
+    if (history_capacity_ != 0) {
+        // Every transfer adds a record, so the history capacity bounds the
+        // buckets the account can ever fill.
+        u.activity_.reserve(history_capacity_);
+    }
+    u.ledger_activity_ = &activity_;
+    return u;
+}
+
+bank::user &bank::ledger::get_or_create_sub_account(
+    user &parent,
+    const std::string &name
+) {
+    const std::size_t hash = user_table::hash(name);
+    const std::unique_lock lock(mutex_);
+    if (users_.find(parent.name_, user_table::hash(parent.name_)) != &parent) {
+        throw hierarchy_error("Parent account is not in this ledger");
+    }
+    if (user *u = users_.find(name, hash)) {
+        if (u->parent_ != &parent) {
+            throw hierarchy_error(
+                "Account " + name + " exists outside " + parent.name_
+            );
+        }
+        return *u;
+    }
+    user &u = create_user(name, hash);
+    // Linked before anyone else can see the account, so transfers always
+    // find the parent set.
+    u.parent_ = &parent;
+    u.depth_ = parent.depth_ + 1;
+    {
+        const std::unique_lock parent_lock(parent.mutex_);
+        parent.sub_accounts_.push_back(&u);
+    }
+    // The initial deposit is new money for every ancestor.
+    for (user *a = &parent; a != nullptr; a = a->parent_) {
+        a->rollup_xts_.fetch_add(u.balance_, std::memory_order_relaxed);
+    }
+    return u;
+}
+
+std::size_t bank::ledger::user_count() {
+    const std::unique_lock lock(mutex_);
+    return users_.size();
+}
+
+std::vector<const bank::user *> bank::ledger::users() {
+    const std::unique_lock lock(mutex_);
+    std::vector<const user *> users;
+    users.reserve(users_.size());
+    for (std::size_t i = 0; i < users_.size(); i++) {
+        users.push_back(&users_.at(i));
+    }
+    return users;
+}
+
+void bank::ledger::reserve(std::size_t users, std::size_t history_per_user) {
+    const std::unique_lock lock(mutex_);
+    users_.reserve(users);
+    history_reserve_ = history_per_user;
+}
+
+std::size_t bank::ledger::reserved_bytes_per_user() {
+    const std::unique_lock lock(mutex_);
+    std::size_t bytes = history_reserve_ * sizeof(transaction);
+    if (history_capacity_ != 0) {
+        bytes += activity_buckets::reserved_bytes(history_capacity_);
+    }
+    return bytes;
+}
+
+void bank::ledger::set_fixed_capacity(
+    std::size_t users,
+    std::size_t history_per_user
+) {
+    reserve(users, history_per_user);
+    const std::unique_lock lock(mutex_);
+    max_users_ = std::min(max_users_, users);
+    history_capacity_ = history_per_user;
+    activity_.reserve();
+}
+
+bank::activity_totals bank::ledger::activity(
+    std::chrono::sys_seconds from,
+    std::chrono::sys_seconds to
+) {
+    return activity_.query(from, to, now_seconds());
+}
+
+std::size_t bank::ledger::prefault(unsigned threads) {
+    const std::unique_lock lock(mutex_);
+    return users_.prefault(threads);
+}
+
+void bank::ledger::set_max_users(std::size_t max_users) {
+    const std::unique_lock lock(mutex_);
+    max_users_ = max_users;
+}
+
+void bank::snapshot_io::write_string(std::ostream &os, const std::string &s) {
+    os << s.size() << ':' << s;
+}
+
+std::string bank::snapshot_io::read_string(std::istream &is) {
+    std::size_t size = 0;
+    if (!(is >> size) || is.get() != ':') {
+        throw bank::snapshot_error("Malformed string in snapshot");
+    }
+    std::string s;
+    while (s.size() < size) {
+        const std::size_t read = s.size();
+        s.resize(read + std::min(size - read, MAX_UNREAD_RESERVE));
+        if (!is.read(
+                s.data() + read, static_cast<std::streamsize>(s.size() - read)
+            )) {
+            throw bank::snapshot_error("Truncated string in snapshot");
+        }
+    }
+    return s;
+}
+
+bank::snapshot_io::record bank::snapshot_io::read_record(std::istream &is) {
+    record r;
+    r.counterparty = read_number<long long>(is);
+    r.balance_delta_xts = read_number<int>(is);
+    r.comment = read_string(is);
+    const auto items = read_number<std::size_t>(is);
+    r.items.reserve(std::min(items, MAX_UNREAD_RESERVE));
+    for (std::size_t i = 0; i < items; i++) {
+        const int delta = read_number<int>(is);
+        r.items.emplace_back(delta, read_string(is));
+    }
+    return r;
+}
+
+// Format: a header, all user names, then each user's state and history in
+// the same order. Counterparties are referenced by user index. The state
+// line ends with the size of the history that follows it, so that readers
+// can skip histories they don't need, and its history_checksum(), so that
+// they can tell whether one history extends another.
+void bank::ledger::save(std::ostream &os) {
+    using snapshot_io::write_string;
+    const std::unique_lock lock(mutex_);
+    std::vector<user *> users;
+    users.reserve(users_.size());
+    for (std::size_t i = 0; i < users_.size(); i++) {
+        users.push_back(&users_.at(i));
+    }
+    // Any fixed order avoids deadlocks with transfers, which use std::lock.
+    std::vector<user *> lock_order = users;
+    std::sort(lock_order.begin(), lock_order.end());
+    std::vector<std::unique_lock<std::mutex>> user_locks;
+    user_locks.reserve(lock_order.size());
+    for (user *u : lock_order) {
+        user_locks.emplace_back(u->mutex_);
+    }
+
+    std::unordered_map<const user *, std::size_t> index;
+    index.reserve(users.size());
+    os << snapshot_io::MAGIC << ' ' << snapshot_io::FORMAT << ' '
+       << users.size() << '\n';
+    for (user *u : users) {
+        index.emplace(u, index.size());
+        write_string(os, u->name_);
+        os << '\n';
+    }
+    std::ostringstream history;
+    for (user *u : users) {
+        u->flush_netting();
+        history.str({});
+        std::uint64_t checksum = user::EMPTY_HISTORY_CHECKSUM;
+        for (const transaction &t : u->transactions_) {
+            checksum = extend_history_checksum(
+                checksum,
+                t.counterparty == nullptr ? "-" : t.counterparty->name(),
+                t.balance_delta_xts, t.comment
+            );
+            history << (t.counterparty == nullptr
+                            ? -1
+                            : static_cast<long long>(index.at(t.counterparty)))
+                    << ' ' << t.balance_delta_xts << ' ';
+            write_string(history, t.comment);
+            const std::size_t items = t.items ? t.items->size() : 0;
+            history << ' ' << items;
+            for (std::size_t i = 0; i < items; i++) {
+                const auto item = (*t.items)[i];
+                history << ' ' << item.balance_delta_xts << ' ';
+                write_string(history, item.comment);
+            }
+            history << '\n';
+        }
+        const std::string text = std::move(history).str();
+        os << u->balance_ << ' ' << u->version_.load() << ' '
+           << u->netting_window_.count() << ' '
+           << (u->parent_ == nullptr
+                   ? -1
+                   : static_cast<long long>(index.at(u->parent_)))
+           << ' ' << u->transactions_.size() << ' ' << text.size() << ' '
+           << checksum << '\n'
+           << text;
+    }
+    os.flush();
+}
+
+void bank::ledger::load(std::istream &is) {
+    using snapshot_io::read_number;
+    using snapshot_io::read_string;
+    const std::unique_lock lock(mutex_);
+    if (users_.size() != 0) {
+        throw snapshot_error("Snapshot can only be loaded into empty ledger");
+    }
+    std::string magic;
+    is >> magic;
+    const int format =
+        magic == snapshot_io::MAGIC ? read_number<int>(is) : 0;
+    if (format < 1 || format > snapshot_io::FORMAT) {
+        throw snapshot_error("Not a ledger snapshot");
+    }
+    const auto count = read_number<std::size_t>(is);
+    std::vector<user *> users;
+    users.reserve(std::min(count, snapshot_io::MAX_UNREAD_RESERVE));
+    for (std::size_t i = 0; i < count; i++) {
+        const std::string name = read_string(is);
+        const std::size_t hash = user_table::hash(name);
+        if (users_.find(name, hash) != nullptr) {
+            throw snapshot_error("Duplicate user in snapshot: " + name);
+        }
+        users.push_back(&users_.emplace(name, hash));
+        users.back()->ledger_activity_ = &activity_;
+    }
+    auto user_at = [&](long long i) -> user * {
+        if (i == -1) {
+            return nullptr;
+        }
+        if (i < 0 || static_cast<std::size_t>(i) >= users.size()) {
+            throw snapshot_error("Bad counterparty in snapshot");
+        }
+        return users[static_cast<std::size_t>(i)];
+    };
+    for (user *u : users) {
+        const std::unique_lock user_lock(u->mutex_);
+        u->balance_ = read_number<int>(is);
+        u->version_ = read_number<std::uint64_t>(is);
+        u->netting_window_ =
+            std::chrono::microseconds(read_number<long long>(is));
+        if (format >= 2) {
+            u->parent_ = user_at(read_number<long long>(is));
+        }
+        const auto transactions = read_number<std::size_t>(is);
+        if (format >= 3) {
+            read_number<std::uint64_t>(is);  // History size.
+        }
+        if (format >= 4) {
+            read_number<std::uint64_t>(is);  // History checksum.
+        }
+        u->transactions_.clear();
+        u->checksums_.clear();
+        u->transactions_.reserve(
+            std::min(transactions, snapshot_io::MAX_UNREAD_RESERVE)
+        );
+        for (std::size_t i = 0; i < transactions; i++) {
+            snapshot_io::record r = snapshot_io::read_record(is);
+            std::shared_ptr<netted_items> items;
+            if (!r.items.empty()) {
+                items = std::make_shared<netted_items>();
+            }
+            for (const auto &[delta, comment] : r.items) {
+                items->add(delta, comment);
+            }
+            u->transactions_.emplace_back(
+                user_at(r.counterparty), r.balance_delta_xts,
+                std::move(r.comment), std::move(items)
+            );
+        }
+    }
+    // Hierarchy state derived from the parents: depths, sub-account lists
+    // and rollups.
+    for (user *u : users) {
+        u->depth_ = 0;
+        for (const user *a = u->parent_; a != nullptr; a = a->parent_) {
+            if (++u->depth_ > users.size()) {
+                throw snapshot_error("Cyclic sub-accounts in snapshot");
+            }
+        }
+        u->sub_accounts_.clear();
+        u->rollup_xts_ = 0;
+    }
+    for (user *u : users) {
+        if (u->parent_ != nullptr) {
+            u->parent_->sub_accounts_.push_back(u);
+        }
+        for (user *a = u; a != nullptr; a = a->parent_) {
+            a->rollup_xts_ += u->balance_;
+        }
+    }
+}
+
+std::size_t bank::netted_items::size() const noexcept {
+    return items_.size();
+}
+
+bank::netted_items::item bank::netted_items::operator[](std::size_t index
+) const {
+    const auto &[delta, comment_index] = items_[index];
+    return {delta, comments_[comment_index]};
+}
+
+void bank::netted_items::add(
+    int balance_delta_xts,
+    const std::string &comment
+) {
+    // High-frequency pairs tend to repeat a handful of recent comments.
+    std::size_t lookup = std::min(comments_.size(), MAX_DICTIONARY_LOOKUP);
+    for (std::size_t i = comments_.size(); lookup > 0; lookup--) {
+        if (comments_[--i] == comment) {
+            items_.emplace_back(
+                balance_delta_xts, static_cast<std::uint32_t>(i)
+            );
+            return;
+        }
+    }
+    items_.emplace_back(
+        balance_delta_xts, static_cast<std::uint32_t>(comments_.size())
+    );
+    comments_.push_back(comment);
 }
 
 bank::user_transactions_iterator::user_transactions_iterator(
@@ -83,8 +843,54 @@ bank::user_transactions_iterator::user_transactions_iterator(
 
 bank::transaction bank::user_transactions_iterator::wait_next_transaction() {
     std::unique_lock lock(user_->mutex_);
-    user_->cv_new_transaction_.wait(lock, [this] {
-        return index_ < user_->transactions_.size();
-    });
+    while (index_ >= user_->transactions_.size()) {
+        if (!user_->pending_) {
+            user_->cv_new_transaction_.wait(lock);
+        } else if (user_->cv_new_transaction_.wait_until(
+                       lock, user_->pending_->deadline
+                   ) == std::cv_status::timeout) {
+            // Nobody closed the batch in time, do it ourselves.
+            if (user_->pending_ &&
+                user_->pending_->deadline <= std::chrono::steady_clock::now()) {
+                user_->flush_netting();
+            }
+        }
+    }
+    return user_->transactions_[index_++];
+}
+
+std::optional<bank::transaction>
+bank::user_transactions_iterator::wait_next_transaction(
+    std::chrono::milliseconds timeout
+) {
+    const auto give_up = std::chrono::steady_clock::now() + timeout;
+    std::unique_lock lock(user_->mutex_);
+    while (index_ >= user_->transactions_.size()) {
+        const auto now = std::chrono::steady_clock::now();
+        if (user_->pending_ && user_->pending_->deadline <= now) {
+            user_->flush_netting();
+            continue;
+        }
+        if (now >= give_up) {
+            return std::nullopt;
+        }
+        user_->cv_new_transaction_.wait_until(
+            lock, user_->pending_ ? std::min(user_->pending_->deadline, give_up)
+                                  : give_up
+        );
+    }
+    return user_->transactions_[index_++];
+}
+
+std::optional<bank::transaction>
+bank::user_transactions_iterator::try_next_transaction() {
+    const std::unique_lock lock(user_->mutex_);
+    if (index_ >= user_->transactions_.size() && user_->pending_ &&
+        user_->pending_->deadline <= std::chrono::steady_clock::now()) {
+        user_->flush_netting();
+    }
+    if (index_ >= user_->transactions_.size()) {
+        return std::nullopt;
+    }
     return user_->transactions_[index_++];
 }
@@ -1,26 +1,52 @@
 #ifndef BANK_H
 #define BANK_H
 
+#include <atomic>
+#include <chrono>
 #include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
 #include <functional>
+#include <iosfwd>
+#include <limits>
 #include <memory>
 #include <mutex>
+#include <optional>
 #include <stdexcept>
 #include <string>
+#include <string_view>
 #include <thread>
-#include <unordered_map>
 #include <utility>
 #include <vector>
+#include "activity_buckets.hpp"
+#include "user_table.hpp"
 
 namespace bank {
 struct transaction;
+class netted_items;
 class user_transactions_iterator;
+struct group_feed;
+
+enum class threshold { BELOW, ABOVE };
+using balance_callback = std::function<void(int balance_xts)>;
 
 class user {
 public:
     explicit user(std::string name);
     [[nodiscard]] std::string name() const noexcept;
     [[nodiscard]] int balance_xts() const;
+    // Incremented on every committed transaction, starts at 1 after the
+    // initial deposit. Readable without taking the account lock.
+    [[nodiscard]] std::uint64_t version() const noexcept;
+    // Balance together with the version it corresponds to.
+    [[nodiscard]] std::pair<int, std::uint64_t> versioned_balance_xts() const;
+    // Blocks until version() differs from known_version or the timeout
+    // expires. Returns the version observed on wakeup.
+    std::uint64_t wait_for_change(
+        std::uint64_t known_version,
+        std::chrono::milliseconds timeout
+    ) const;
 
     user_transactions_iterator snapshot_transactions(
         const std::function<void(const std::vector<transaction> &, int)> &f
@@ -28,31 +54,230 @@ public:
 
     void
     transfer(user &counterparty, int amount_xts, const std::string &comment);
+    // Optimistic variants: commit only if the sender still has the expected
+    // version (or balance), otherwise throw precondition_failed_error with
+    // the current version. Return the sender's version after the commit.
+    std::uint64_t transfer_if_version(
+        user &counterparty,
+        int amount_xts,
+        const std::string &comment,
+        std::uint64_t expected_version
+    );
+    std::uint64_t transfer_if_balance(
+        user &counterparty,
+        int amount_xts,
+        const std::string &comment,
+        int expected_balance_xts
+    );
     user_transactions_iterator monitor() const;
 
+    // Checksum of the first `records` history records, or nothing if the
+    // history is shorter: 64-bit FNV-1a over their text as in `transactions`
+    // replies, "<counterparty or ->\t<delta>\t<comment>\n" each. Kept per
+    // record and extended on demand, so the cost is proportional to the
+    // records added since the last call.
+    [[nodiscard]] std::optional<std::uint64_t>
+    history_checksum(std::size_t records) const;
+    static constexpr std::uint64_t EMPTY_HISTORY_CHECKSUM =
+        0xcbf29ce484222325ULL;
+
+    // Sub-accounts, see ledger::get_or_create_sub_account(). The parent is
+    // fixed when the account is created.
+    [[nodiscard]] const user *parent() const noexcept;
+    [[nodiscard]] std::vector<const user *> sub_accounts() const;
+    // Balance of this account plus all its sub-accounts, read without
+    // locking. Maintained by every commit, so a transfer within the group
+    // never moves it.
+    [[nodiscard]] long long rollup_xts() const noexcept;
+
+    // Transfers to and from this account in [from, to), answered from
+    // per-minute, per-hour and per-day totals; see activity_buckets::query()
+    // for what is retained.
+    [[nodiscard]] activity_totals
+    activity(std::chrono::sys_seconds from, std::chrono::sys_seconds to) const;
+
+    // Balance threshold watch: `callback` gets the new balance each time it
+    // crosses from at or above `limit_xts` to below it (BELOW), or from at
+    // or below to above it (ABOVE). Crossing back re-arms the watch; a
+    // balance already beyond the limit at registration doesn't fire.
+    // Callbacks run after the transfer has committed and released the
+    // account locks, on the transferring thread, so they should be quick.
+    // Returns an id for unwatch_balance().
+    std::uint64_t watch_balance(
+        threshold direction,
+        int limit_xts,
+        balance_callback callback
+    );
+    // A callback already picked by a concurrent transfer may still run
+    // once. Returns false if there is no such watch.
+    bool unwatch_balance(std::uint64_t id);
+
+    // Opt-in netting: transfers with the same counterparty within `window`
+    // are posted to this user's history as one net transaction carrying the
+    // individual items. Balances and version are still updated immediately;
+    // the net record is written when the window closes, on the next read of
+    // the history, or on a transfer with another counterparty. Zero disables.
+    void set_netting_window(std::chrono::microseconds window);
+
 private:
+    struct netting_batch {
+        const user *counterparty;
+        int balance_delta_xts;
+        std::shared_ptr<netted_items> items;
+        std::chrono::steady_clock::time_point deadline;
+    };
+
     std::string name_;
     int balance_;
-    std::vector<transaction> transactions_;
+    // Mutable so that readers can materialize a pending netting batch.
+    mutable std::vector<transaction> transactions_;
+    mutable std::optional<netting_batch> pending_;
+    // history_checksum() of the first i + 1 records, for a prefix of the
+    // history.
+    mutable std::vector<std::uint64_t> checksums_;
+
+    struct balance_watch {
+        std::uint64_t id;
+        threshold direction;
+        int limit_xts;
+        bool fired;  // The balance is beyond the limit.
+        std::shared_ptr<const balance_callback> callback;
+    };
+    using balance_alerts =
+        std::vector<std::pair<std::shared_ptr<const balance_callback>, int>>;
+    std::vector<balance_watch> watches_;
+    std::uint64_t next_watch_id_ = 1;
+    // No watch changes state while the balance stays within these bounds,
+    // so a commit only compares against them.
+    int watch_low_xts_ = std::numeric_limits<int>::min();
+    int watch_high_xts_ = std::numeric_limits<int>::max();
+
+    user *parent_ = nullptr;
+    std::size_t depth_ = 0;  // Number of ancestors.
+    std::vector<const user *> sub_accounts_;  // Guarded by mutex_.
+    std::atomic<long long> rollup_xts_;
+    // Group monitors subscribed to this account's subtree; the count lets
+    // commits skip group_mutex_ while there are none.
+    mutable std::mutex group_mutex_;
+    mutable std::vector<std::shared_ptr<group_feed>> group_feeds_;
+    mutable std::atomic<std::size_t> group_monitors_ = 0;
+    activity_buckets activity_;  // Guarded by mutex_.
+    // Ledger-wide totals; set by the ledger that owns the account.
+    shared_activity_buckets *ledger_activity_ = nullptr;
+    std::chrono::microseconds netting_window_{0};
+    // Maximum number of history records, zero if unlimited.
+    std::size_t history_capacity_ = 0;
+    std::atomic<std::uint64_t> version_ = 0;
     mutable std::mutex mutex_;
     mutable std::condition_variable cv_new_transaction_;
 
+    std::uint64_t transfer_impl(
+        user &counterparty,
+        int amount_xts,
+        const std::string &comment,
+        const std::optional<std::uint64_t> &expected_version,
+        const std::optional<int> &expected_balance_xts
+    );
     void add_transaction(
         const user *to,
         int delta,
         const std::string &comment
     ) noexcept;
+    void flush_netting() const noexcept;
+    // Collects the watches the current balance has just crossed, if it left
+    // the watch bounds. Must be called under mutex_.
+    void check_watches(balance_alerts &alerts);
+    void update_watch_bounds() noexcept;
+    // Applies `amount_xts` moving from this account to `to` to the rollups
+    // of both chains of ancestors, up to their common one.
+    void update_rollups(user &to, int amount_xts) noexcept;
+    // Hands a committed leg of a transfer to the group monitors of this
+    // account and its ancestors.
+    void publish_to_groups(
+        const user *counterparty,
+        int delta,
+        const std::string &comment
+    ) const;
+    void check_capacity(const std::string &comment) const;
     friend class ledger;
+    friend class user_table;
     friend class user_transactions_iterator;
+    friend class group_monitor;
 };
 
 class ledger {
 public:
     user &get_or_create_user(const std::string &name);
+    // Creates `name` as a sub-account of `parent`, or returns it if it
+    // already is one. Throws hierarchy_error if `name` exists elsewhere or
+    // `parent` belongs to another ledger.
+    user &get_or_create_sub_account(user &parent, const std::string &name);
+    [[nodiscard]] std::size_t user_count();
+    // All users in creation order.
+    [[nodiscard]] std::vector<const user *> users();
+    // Creating users beyond the limit throws capacity_exceeded_error.
+    void set_max_users(std::size_t max_users);
+
+    // Startup tuning: sizes the user table for `users` users and reserves
+    // room for `history_per_user` transactions in every user created later.
+    void reserve(std::size_t users, std::size_t history_per_user = 0);
+    // Pre-faults the reserved memory from `threads` threads, see
+    // user_table::prefault(). Returns the number of bytes touched.
+    std::size_t prefault(unsigned threads);
+    // Allocation-free steady state: at most `users` users, each with room
+    // for `history_per_user` transactions, all reserved up front. Comments
+    // must fit into std::string's inline buffer. Exceeding any of these
+    // throws capacity_exceeded_error. Call before creating users.
+    void set_fixed_capacity(std::size_t users, std::size_t history_per_user);
+    // Heap memory reserved up front for every user created from now on:
+    // its history and, in fixed-capacity mode, its activity buckets.
+    [[nodiscard]] std::size_t reserved_bytes_per_user();
+
+    // All transfers in the ledger in [from, to), see user::activity(). Every
+    // transfer stays within the ledger, so in_xts and out_xts are equal.
+    [[nodiscard]] activity_totals
+    activity(std::chrono::sys_seconds from, std::chrono::sys_seconds to);
+
+    // Writes a consistent snapshot of all users and their histories. All
+    // accounts are locked for the duration, so transfers stall meanwhile.
+    void save(std::ostream &os);
+    // Restores a snapshot written by save() into an empty ledger. Throws
+    // snapshot_error on malformed input.
+    void load(std::istream &is);
 
 private:
-    std::unordered_map<std::string, user> users_;
+    user_table users_;
+    std::size_t max_users_ = SIZE_MAX;
+    std::size_t history_reserve_ = 0;
+    std::size_t history_capacity_ = 0;
     std::mutex mutex_;
+    shared_activity_buckets activity_;
+
+    // Adds a user that doesn't exist yet. Must be called under mutex_.
+    user &create_user(const std::string &name, std::size_t hash);
+};
+
+// Itemized record of the transfers aggregated into one net transaction.
+// Stores a delta and an index into a small comment dictionary per item, so
+// that repeated comments are kept once.
+class netted_items {
+public:
+    struct item {
+        int balance_delta_xts;
+        const std::string &comment;
+    };
+
+    [[nodiscard]] std::size_t size() const noexcept;
+    item operator[](std::size_t index) const;
+
+private:
+    static constexpr std::size_t MAX_DICTIONARY_LOOKUP = 8;
+    std::vector<std::pair<int, std::uint32_t>> items_;
+    std::vector<std::string> comments_;
+
+    void add(int balance_delta_xts, const std::string &comment);
+    friend class user;
+    friend class ledger;
 };
 
 struct transaction {
@@ -60,16 +285,87 @@ public:
     const user *const counterparty;  // NOLINT
     const int balance_delta_xts;     // NOLINT
     const std::string comment;       // NOLINT
-    transaction(const user *from, int balance_delta_xts, std::string comment)
+    // Individual transfers aggregated into this one by netting, if any.
+    const std::shared_ptr<const netted_items> items;  // NOLINT
+    transaction(
+        const user *from,
+        int balance_delta_xts,
+        std::string comment,
+        std::shared_ptr<const netted_items> items = nullptr
+    )
         : counterparty(from),
           balance_delta_xts(balance_delta_xts),
-          comment(std::move(comment)){};
+          comment(std::move(comment)),
+          items(std::move(items)){};
+};
+
+// Extends a history checksum, see user::history_checksum(), by the record
+// "<counterparty>\t<delta>\t<comment>\n"; the counterparty is "-" for none.
+[[nodiscard]] std::uint64_t extend_history_checksum(
+    std::uint64_t checksum,
+    std::string_view counterparty,
+    int balance_delta_xts,
+    std::string_view comment
+) noexcept;
+
+// One leg of a committed transfer, as seen by a group monitor.
+struct group_event {
+    const user *account;
+    const user *counterparty;
+    int balance_delta_xts;
+    std::string comment;
+    // Older events dropped unread right before this one.
+    std::size_t dropped_before = 0;
+};
+
+struct group_feed {
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<group_event> events;
+    std::size_t max_events;
+    std::size_t dropped = 0;
+};
+
+// Feed of the transfers of an account and all its sub-accounts, from the
+// moment of construction. A transfer between two members shows up as two
+// events, one per leg. At most `max_pending` events wait to be read; a
+// monitor that falls further behind loses the oldest ones and learns how
+// many from the next event it reads.
+class group_monitor {
+public:
+    static constexpr std::size_t DEFAULT_MAX_PENDING = 4096;
+
+    explicit group_monitor(
+        const user &group,
+        std::size_t max_pending = DEFAULT_MAX_PENDING
+    );
+    group_monitor(const group_monitor &) = delete;
+    group_monitor(group_monitor &&) = delete;
+    group_monitor &operator=(const group_monitor &) = delete;
+    group_monitor &operator=(group_monitor &&) = delete;
+    ~group_monitor();
+
+    group_event wait_next_event();
+    // Gives up after `timeout`.
+    std::optional<group_event> wait_next_event(std::chrono::milliseconds timeout
+    );
+
+private:
+    const user &group_;
+    std::shared_ptr<group_feed> feed_;
 };
 
 class user_transactions_iterator {
 public:
     user_transactions_iterator(const user *_user, std::size_t index);
     transaction wait_next_transaction();
+    // Gives up after `timeout`.
+    std::optional<transaction>
+    wait_next_transaction(std::chrono::milliseconds timeout);
+    // Non-blocking variant for callers that poll: the next transaction if
+    // one is committed, otherwise nothing. Closes an expired netting batch
+    // like wait_next_transaction() does.
+    std::optional<transaction> try_next_transaction();
 
 private:
     const user *user_;
@@ -99,5 +395,46 @@ public:
     explicit invalid_transfer_error(const std::string &msg)
         : transfer_error(msg){};
 };
+
+class precondition_failed_error : public transfer_error {
+public:
+    precondition_failed_error(
+        const std::string &what_failed,
+        std::uint64_t current_version
+    )
+        : transfer_error(
+              "Precondition failed: " + what_failed + ", current version " +
+              std::to_string(current_version)
+          ),
+          current_version_(current_version){};
+
+    [[nodiscard]] std::uint64_t current_version() const noexcept {
+        return current_version_;
+    }
+
+private:
+    std::uint64_t current_version_;
+};
+class snapshot_error : public std::runtime_error {
+public:
+    explicit snapshot_error(const std::string &msg)
+        : std::runtime_error(msg){};
+};
+
+// A limit of the ledger was hit: a full history or a comment that doesn't
+// fit in fixed-capacity mode, or too many users. The transfer that runs
+// into one fails like any other, hence a transfer_error, although creating
+// a user beyond the limit throws it too.
+class capacity_exceeded_error : public transfer_error {
+public:
+    explicit capacity_exceeded_error(const std::string &msg)
+        : transfer_error(msg){};
+};
+
+class hierarchy_error : public std::runtime_error {
+public:
+    explicit hierarchy_error(const std::string &msg)
+        : std::runtime_error(msg){};
+};
 }  // end namespace bank
 #endif  // BANK_H
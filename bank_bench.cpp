@@ -0,0 +1,1330 @@
+#ifdef __linux__
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <linux/perf_event.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include "audit_log.hpp"
+#include "bank.hpp"
+#include "ledger_diff.hpp"
+#include "sha256.hpp"
+#include "task_executor.hpp"
+#include "workload.hpp"
+
+// Micro-benchmarks for the bank library.
+// Usage: bank-bench [scenario...]; runs every scenario if none is given.
+
+namespace {
+using bench_clock = std::chrono::steady_clock;
+
+void report(
+    const std::string &name,
+    long long operations,
+    bench_clock::duration elapsed
+) {
+    const double seconds = std::chrono::duration<double>(elapsed).count();
+    std::cout << std::left << std::setw(40) << name << std::right
+              << std::setw(14) << std::fixed << std::setprecision(0)
+              << static_cast<double>(operations) / seconds << " ops/s"
+              << std::setw(12) << std::setprecision(1)
+              << seconds * 1e9 / static_cast<double>(operations) << " ns/op\n";
+}
+
+std::int64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               bench_clock::now().time_since_epoch()
+    )
+        .count();
+}
+
+// Prints p50/p99/p99.9/max of latencies given in nanoseconds.
+void print_latencies(const std::string &what, std::vector<std::int64_t> &ns) {
+    if (ns.empty()) {
+        std::cout << "    " << what << ": no samples\n";
+        return;
+    }
+    std::sort(ns.begin(), ns.end());
+    auto us = [&](double quantile) {
+        return static_cast<double>(ns[static_cast<std::size_t>(
+                   static_cast<double>(ns.size() - 1) * quantile
+               )]) /
+               1000;
+    };
+    std::cout << "    " << what << ": p50 " << us(0.5) << " us, p99 "
+              << us(0.99) << " us, p99.9 " << us(0.999) << " us, max "
+              << us(1) << " us\n";
+}
+
+// Hardware and software counters of the calling thread, read with
+// perf_event_open. Counters the kernel refuses (no PMU in a VM, a strict
+// perf_event_paranoid in a container) are reported as unavailable and the
+// benchmark runs as usual.
+class perf_counters {
+public:
+    perf_counters() {
+#ifdef __linux__
+        for (std::size_t i = 0; i < EVENTS.size(); i++) {
+            perf_event_attr attr{};
+            attr.size = sizeof(attr);
+            attr.type = EVENTS[i].type;
+            attr.config = EVENTS[i].config;
+            attr.disabled = 1;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+                               PERF_FORMAT_TOTAL_TIME_RUNNING;
+            fds_[i] = static_cast<int>(
+                syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0)
+            );
+            if (fds_[i] < 0 && error_.empty()) {
+                error_ = std::strerror(errno);  // NOLINT(concurrency-mt-unsafe)
+            }
+        }
+#endif
+    }
+
+    perf_counters(const perf_counters &) = delete;
+    perf_counters(perf_counters &&) = delete;
+    perf_counters &operator=(const perf_counters &) = delete;
+    perf_counters &operator=(perf_counters &&) = delete;
+
+    ~perf_counters() {
+#ifdef __linux__
+        for (const int fd : fds_) {
+            if (fd >= 0) {
+                close(fd);
+            }
+        }
+#endif
+    }
+
+    void start() {
+#ifdef __linux__
+        for (const int fd : fds_) {
+            if (fd >= 0) {
+                ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+                ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+            }
+        }
+#endif
+    }
+
+    void stop() {
+#ifdef __linux__
+        for (std::size_t i = 0; i < EVENTS.size(); i++) {
+            values_[i] = -1;
+            if (fds_[i] < 0) {
+                continue;
+            }
+            ioctl(fds_[i], PERF_EVENT_IOC_DISABLE, 0);
+            // value, time enabled, time running
+            std::array<std::uint64_t, 3> data{};
+            if (read(fds_[i], data.data(), sizeof(data)) !=
+                    static_cast<ssize_t>(sizeof(data)) ||
+                data[2] == 0) {
+                continue;
+            }
+            // Scale up if the kernel multiplexed the counter.
+            values_[i] = static_cast<double>(data[0]) *
+                         static_cast<double>(data[1]) /
+                         static_cast<double>(data[2]);
+        }
+#endif
+    }
+
+    // Prints the counters of the last start()/stop() divided by `ops`.
+    void report(long long operations) const {
+        std::cout << "    per op:" << std::setprecision(3);
+        std::string unavailable;
+        for (std::size_t i = 0; i < EVENTS.size(); i++) {
+            if (values_[i] < 0) {
+                unavailable += std::string(unavailable.empty() ? "" : ", ") +
+                               EVENTS[i].name;
+                continue;
+            }
+            std::cout << ' ' << values_[i] / static_cast<double>(operations)
+                      << ' ' << EVENTS[i].name << ';';
+        }
+        if (EVENTS.size() >= 2 && values_[0] > 0 && values_[1] >= 0) {
+            std::cout << " IPC " << values_[1] / values_[0] << ';';
+        }
+        if (EVENTS.empty()) {
+            std::cout << " perf counters not supported on this platform";
+        } else if (!unavailable.empty()) {
+            std::cout << " unavailable: " << unavailable;
+            if (!error_.empty()) {
+                std::cout << " (" << error_ << ')';
+            }
+        }
+        std::cout << '\n';
+    }
+
+private:
+    struct event {
+        std::uint32_t type;
+        std::uint64_t config;
+        const char *name;
+    };
+#ifdef __linux__
+    static constexpr std::array<event, 5> EVENTS = {{
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, "cycles"},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, "instructions"},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, "LLC misses"},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, "branch misses"},
+        {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES,
+         "context switches"},
+    }};
+#else
+    static constexpr std::array<event, 0> EVENTS = {};
+#endif
+    std::array<int, EVENTS.size()> fds_{};
+    std::array<double, EVENTS.size()> values_{};
+    std::string error_;
+};
+
+// Alice and Bob ping-pong 10 XTS while another thread polls balances, as in
+// the "Single producer, single consumer" test.
+void ping_pong(std::chrono::microseconds netting_window) {
+    const int ROUNDS = 1'000'000;
+    bank::ledger l;
+    bank::user &alice = l.get_or_create_user("Alice");
+    bank::user &bob = l.get_or_create_user("Bob");
+    alice.set_netting_window(netting_window);
+    bob.set_netting_window(netting_window);
+
+    std::atomic<bool> done = false;
+    std::thread reader([&]() {
+        while (!done.load()) {
+            static_cast<void>(alice.balance_xts() + bob.balance_xts());
+        }
+    });
+    perf_counters counters;
+    const auto start = bench_clock::now();
+    counters.start();
+    for (int op = 0; op < ROUNDS; op++) {
+        alice.transfer(bob, 10, "A2B");
+        bob.transfer(alice, 10, "B2A");
+    }
+    counters.stop();
+    const auto elapsed = bench_clock::now() - start;
+    done = true;
+    reader.join();
+    report(
+        "ping-pong, netting " + std::to_string(netting_window.count()) + "us",
+        2LL * ROUNDS, elapsed
+    );
+    counters.report(2LL * ROUNDS);
+    alice.snapshot_transactions([](const auto &ts, int) {
+        std::cout << "    history records per side: " << ts.size() << '\n';
+    });
+}
+
+// Creates users one by one and reports the slowest single creation, which
+// is where a stop-the-world rehash under the ledger lock would show up.
+void create_users(int users) {
+    bank::ledger l;
+    std::vector<std::string> names;
+    names.reserve(users);
+    for (int i = 0; i < users; i++) {
+        names.push_back("user-" + std::to_string(i));
+    }
+    std::vector<bench_clock::duration> latencies;
+    latencies.reserve(users);
+    perf_counters counters;
+    const auto start = bench_clock::now();
+    counters.start();
+    for (const auto &name : names) {
+        const auto op_start = bench_clock::now();
+        l.get_or_create_user(name);
+        latencies.push_back(bench_clock::now() - op_start);
+    }
+    counters.stop();
+    const auto elapsed = bench_clock::now() - start;
+    report("create " + std::to_string(users) + " users", users, elapsed);
+    counters.report(users);
+    std::sort(latencies.begin(), latencies.end());
+    auto us = [](bench_clock::duration d) {
+        return std::chrono::duration<double, std::micro>(d).count();
+    };
+    std::cout << "    p99.99 " << us(latencies[latencies.size() * 9999 / 10000])
+              << " us, max " << us(latencies.back()) << " us\n";
+}
+
+// Models the first minutes after startup: new users keep arriving and pay
+// each other. Reports latency percentiles of all operations, with and
+// without reserving and pre-faulting the ledger first.
+void startup(bool prepared) {
+    const int USERS = 2'000'000;
+    bank::ledger l;
+    const auto prepare_start = bench_clock::now();
+    if (prepared) {
+        l.reserve(USERS, 8);
+        l.prefault(std::thread::hardware_concurrency());
+    }
+    const auto prepare_time = bench_clock::now() - prepare_start;
+
+    std::vector<bench_clock::duration> latencies;
+    latencies.reserve(2 * USERS);
+    bank::user *previous = &l.get_or_create_user("user-0");
+    const auto start = bench_clock::now();
+    for (int i = 1; i < USERS; i++) {
+        const std::string name = "user-" + std::to_string(i);
+        auto op_start = bench_clock::now();
+        bank::user &u = l.get_or_create_user(name);
+        latencies.push_back(bench_clock::now() - op_start);
+        op_start = bench_clock::now();
+        previous->transfer(u, 1, "Welcome");
+        latencies.push_back(bench_clock::now() - op_start);
+        previous = &u;
+    }
+    const auto elapsed = bench_clock::now() - start;
+    report(
+        std::string("startup, ") + (prepared ? "prepared" : "cold"),
+        static_cast<long long>(latencies.size()), elapsed
+    );
+    std::sort(latencies.begin(), latencies.end());
+    auto us = [&](double quantile) {
+        return std::chrono::duration<double, std::micro>(
+                   latencies[static_cast<std::size_t>(
+                       static_cast<double>(latencies.size() - 1) * quantile
+                   )]
+        )
+            .count();
+    };
+    std::cout << "    preparation "
+              << std::chrono::duration<double, std::milli>(prepare_time).count()
+              << " ms; p50 " << us(0.5) << " us, p99 " << us(0.99)
+              << " us, p99.9 " << us(0.999) << " us, max " << us(1) << " us\n";
+}
+
+// Cost of extending the audit chains, per transfer, next to the cost of the
+// transfers themselves; then verification throughput on one thread and on
+// all of them.
+void audit(int users, int transfers) {
+    bank::ledger l;
+    std::vector<bank::user *> accounts;
+    for (int i = 0; i < users; i++) {
+        accounts.push_back(&l.get_or_create_user("acct-" + std::to_string(i)));
+    }
+    auto start = bench_clock::now();
+    for (int i = 0; i < transfers; i++) {
+        accounts[i % users]->transfer(
+            *accounts[(i + 1) % users], 1, "audited transfer"
+        );
+    }
+    const auto transfer_time = bench_clock::now() - start;
+    report("audit: transfers", transfers, transfer_time);
+
+    bank::audit_log log;
+    start = bench_clock::now();
+    for (const bank::user *u : accounts) {
+        log.update(*u);
+    }
+    const auto hash_time = bench_clock::now() - start;
+    report("audit: chain update", transfers, hash_time);
+    std::cout << "    SHA-256 "
+              << (bank::sha256::accelerated() ? "with SHA extensions"
+                                              : "portable")
+              << ", hashing adds "
+              << std::chrono::duration<double>(hash_time).count() * 100 /
+                     std::chrono::duration<double>(transfer_time).count()
+              << "% to the transfers\n";
+
+    const std::vector<const bank::user *> all = l.users();
+    std::vector<unsigned> thread_counts = {1};
+    if (const unsigned cores = std::thread::hardware_concurrency(); cores > 1) {
+        thread_counts.push_back(cores);
+    }
+    for (const unsigned threads : thread_counts) {
+        start = bench_clock::now();
+        const bank::audit_report r = log.verify(all, threads);
+        const double seconds =
+            std::chrono::duration<double>(bench_clock::now() - start).count();
+        std::cout << std::left << std::setw(40)
+                  << "audit: verify, " + std::to_string(threads) + " threads"
+                  << std::right << std::setw(14) << std::setprecision(2)
+                  << static_cast<double>(r.bytes) / seconds / 1e9 << " GB/s"
+                  << " (" << r.segments << " segments, "
+                  << r.mismatches.size() << " mismatches)\n";
+    }
+}
+
+// Builds a ledger, snapshots it, changes 1% of the accounts and snapshots
+// it again, then compares loading both snapshots (what comparing two full
+// dumps costs) with indexing both and diffing them.
+void diff(int users, int transfers) {
+    bank::ledger l;
+    std::vector<bank::user *> accounts;
+    for (int i = 0; i < users; i++) {
+        accounts.push_back(&l.get_or_create_user("acct-" + std::to_string(i)));
+    }
+    for (int i = 0; i < transfers; i++) {
+        accounts[i % users]->transfer(
+            *accounts[(i + 1) % users], 1, "snapshot transfer"
+        );
+    }
+    const std::filesystem::path dir = std::filesystem::temp_directory_path();
+    const std::string before_path = dir / "bank-bench-before.snapshot";
+    const std::string after_path = dir / "bank-bench-after.snapshot";
+    auto save = [&](const std::string &path) {
+        std::ofstream f(path, std::ios::binary);
+        l.save(f);
+    };
+    save(before_path);
+    for (int i = 0; i < users / 100; i++) {
+        accounts[i * 100]->transfer(*accounts[i * 100 + 1], 1, "changed");
+    }
+    save(after_path);
+    const auto bytes = std::filesystem::file_size(after_path);
+
+    auto print = [](const std::string &name, bench_clock::duration elapsed) {
+        std::cout << std::left << std::setw(40) << name << std::right
+                  << std::setw(14) << std::fixed << std::setprecision(1)
+                  << std::chrono::duration<double, std::milli>(elapsed).count()
+                  << " ms\n";
+    };
+    auto start = bench_clock::now();
+    for (const std::string &path : {before_path, after_path}) {
+        std::ifstream f(path, std::ios::binary);
+        bank::ledger loaded;
+        loaded.load(f);
+    }
+    print(
+        "diff: load both, " + std::to_string(bytes >> 20U) + " MiB each",
+        bench_clock::now() - start
+    );
+
+    std::vector<unsigned> thread_counts = {1};
+    if (const unsigned cores = std::thread::hardware_concurrency(); cores > 1) {
+        thread_counts.push_back(cores);
+    }
+    for (const unsigned threads : thread_counts) {
+        start = bench_clock::now();
+        std::ifstream before_file(before_path, std::ios::binary);
+        std::ifstream after_file(after_path, std::ios::binary);
+        const bank::snapshot_index before =
+            bank::snapshot_index::read(before_file);
+        const bank::snapshot_index after =
+            bank::snapshot_index::read(after_file);
+        const auto index_time = bench_clock::now() - start;
+        const bank::ledger_diff d =
+            bank::diff_snapshots(before, after_path, after, threads);
+        print(
+            "diff: index and diff, " + std::to_string(threads) + " threads",
+            bench_clock::now() - start
+        );
+        std::cout << "    indexing "
+                  << std::chrono::duration<double, std::milli>(index_time)
+                         .count()
+                  << " ms; " << d.changed.size() << " changed, "
+                  << d.unchanged << " unchanged, " << d.bytes_parsed
+                  << " history bytes parsed\n";
+    }
+    std::filesystem::remove(before_path);
+    std::filesystem::remove(after_path);
+}
+
+// Sums a long history through snapshot_transactions(), which is what
+// `transactions N` and ledger snapshots do under the user's lock.
+void scan(int records) {
+    const int SCANS = 20;
+    bank::ledger l;
+    bank::user &alice = l.get_or_create_user("Alice");
+    bank::user &bob = l.get_or_create_user("Bob");
+    for (int i = 0; i < records / 2; i++) {
+        alice.transfer(bob, 1, "A2B");
+        bob.transfer(alice, 1, "B2A");
+    }
+    long long sum = 0;
+    perf_counters counters;
+    const auto start = bench_clock::now();
+    counters.start();
+    for (int i = 0; i < SCANS; i++) {
+        alice.snapshot_transactions([&](const auto &ts, int) {
+            for (const bank::transaction &t : ts) {
+                sum += t.balance_delta_xts +
+                       static_cast<long long>(t.comment.size());
+            }
+        });
+    }
+    counters.stop();
+    const auto elapsed = bench_clock::now() - start;
+    const long long scanned = static_cast<long long>(SCANS) * (records + 1);
+    report("scan " + std::to_string(records) + " records", scanned, elapsed);
+    counters.report(scanned);
+    if (sum == 0) {
+        std::cout << '\n';  // Keeps the loop from being optimized out.
+    }
+}
+
+// Monitor delivery latency: a producer makes zero-amount transfers whose
+// comment is the send time, and every monitor records how long it took
+// until wait_next_transaction() returned it. With a hot account all
+// monitors watch one user; otherwise each watches its own. The producer
+// waits for all deliveries of a transfer before the next one, so the
+// numbers are wakeup latency, not queueing.
+void monitor_fanout(int monitors, bool hot) {
+    const int TRANSFERS = std::max(20, 20'000 / (hot ? monitors : 1));
+    bank::ledger l;
+    bank::user &source = l.get_or_create_user("Source");
+    std::vector<bank::user *> targets;
+    if (hot) {
+        targets.push_back(&l.get_or_create_user("Hot"));
+    } else {
+        for (int i = 0; i < monitors; i++) {
+            targets.push_back(
+                &l.get_or_create_user("acct-" + std::to_string(i))
+            );
+        }
+    }
+    std::atomic<long long> delivered = 0;
+    std::vector<std::vector<std::int64_t>> samples(monitors);
+    std::vector<std::thread> threads;
+    threads.reserve(monitors);
+    for (int i = 0; i < monitors; i++) {
+        bank::user &target = *targets[hot ? 0 : i];
+        threads.emplace_back([&, i, it = target.monitor()]() mutable {
+            while (true) {
+                const bank::transaction t = it.wait_next_transaction();
+                if (t.comment == "stop") {
+                    return;
+                }
+                samples[i].push_back(now_ns() - std::stoll(t.comment));
+                delivered.fetch_add(1, std::memory_order_release);
+            }
+        });
+    }
+
+    long long expected = 0;
+    const auto start = bench_clock::now();
+    for (int k = 0; k < TRANSFERS; k++) {
+        bank::user &target = *targets[hot ? 0 : k % monitors];
+        expected += hot ? monitors : 1;
+        source.transfer(target, 0, std::to_string(now_ns()));
+        while (delivered.load(std::memory_order_acquire) < expected) {
+            std::this_thread::yield();
+        }
+    }
+    const auto elapsed = bench_clock::now() - start;
+    for (bank::user *target : targets) {
+        source.transfer(*target, 0, "stop");
+    }
+    for (auto &t : threads) {
+        t.join();
+    }
+
+    std::vector<std::int64_t> all;
+    for (auto &v : samples) {
+        all.insert(all.end(), v.begin(), v.end());
+    }
+    report(
+        "monitor, " + std::to_string(monitors) +
+            (hot ? " on one account" : " on own accounts"),
+        expected, elapsed
+    );
+    print_latencies("delivery", all);
+}
+
+// User-selection patterns compared by the skewed scenarios.
+const std::vector<std::pair<std::string, bank::workload_options>> &
+skew_patterns() {
+    static const std::vector<std::pair<std::string, bank::workload_options>>
+        patterns = [] {
+            using distribution = bank::workload_options::distribution;
+            std::vector<std::pair<std::string, bank::workload_options>> p(3);
+            p[0].first = "uniform";
+            p[1].first = "zipf 0.99";
+            p[1].second.users_distribution = distribution::ZIPF;
+            p[1].second.zipf_s = 0.99;
+            p[2].first = "hot set 1%/90%";
+            p[2].second.users_distribution = distribution::HOT_SET;
+            return p;
+        }();
+    return patterns;
+}
+
+// Several threads run a generated mix of transfers, balance reads and
+// history reads against one ledger. Skewed user selection concentrates
+// them on a few accounts and their locks.
+void skewed(const std::string &pattern, bank::workload_options options) {
+    const int THREADS = 4;
+    const int OPS_PER_THREAD = 250'000;
+    options.users = 10'000;
+    bank::ledger l;
+    std::vector<bank::user *> users;
+    for (std::size_t i = 0; i < options.users; i++) {
+        users.push_back(
+            &l.get_or_create_user(bank::workload_generator::user_name(i))
+        );
+    }
+    std::vector<std::vector<bank::workload_operation>> ops(THREADS);
+    for (int t = 0; t < THREADS; t++) {
+        options.seed = static_cast<std::uint64_t>(t) + 1;
+        bank::workload_generator g(options);
+        for (int i = 0; i < OPS_PER_THREAD; i++) {
+            ops[t].push_back(g.next());
+        }
+    }
+
+    std::vector<std::vector<std::int64_t>> latencies(THREADS);
+    std::atomic<long long> failed = 0;
+    auto worker = [&](int t) {
+        latencies[t].reserve(OPS_PER_THREAD);
+        for (const bank::workload_operation &op : ops[t]) {
+            const std::int64_t op_start = now_ns();
+            bank::user &u = *users[op.user];
+            switch (op.type) {
+                case bank::workload_operation::kind::TRANSFER:
+                    try {
+                        u.transfer(
+                            *users[op.counterparty], op.amount, op.comment
+                        );
+                    } catch (const bank::transfer_error &) {
+                        failed++;
+                    }
+                    break;
+                case bank::workload_operation::kind::BALANCE:
+                    static_cast<void>(u.balance_xts());
+                    break;
+                case bank::workload_operation::kind::TRANSACTIONS:
+                    u.snapshot_transactions([&](const auto &ts, int) {
+                        static_cast<void>(ts.size() > op.count);
+                    });
+                    break;
+            }
+            latencies[t].push_back(now_ns() - op_start);
+        }
+    };
+    const auto start = bench_clock::now();
+    std::vector<std::thread> threads;
+    for (int t = 0; t < THREADS; t++) {
+        threads.emplace_back(worker, t);
+    }
+    for (auto &t : threads) {
+        t.join();
+    }
+    const auto elapsed = bench_clock::now() - start;
+
+    std::vector<std::int64_t> all;
+    for (auto &v : latencies) {
+        all.insert(all.end(), v.begin(), v.end());
+    }
+    report("skewed, " + pattern, THREADS * OPS_PER_THREAD, elapsed);
+    print_latencies("operation", all);
+    std::cout << "    failed transfers " << failed << '\n';
+}
+
+void spin_for(std::chrono::nanoseconds d) {
+    const std::int64_t until = now_ns() + d.count();
+    while (now_ns() < until) {
+    }
+}
+
+// Short tasks spread over the workers at a fixed rate, plus a long scan
+// every thousand of them, always on the first worker like a hot user's
+// history dump. The scan yields between chunks. Reports how long short
+// tasks wait in queues.
+void executor(bank::task_executor::mode mode) {
+    const unsigned WORKERS = 4;
+    const int SHORT_TASKS = 200'000;
+    const int SCAN_EVERY = 1'000;
+    const int SCAN_CHUNKS = 20;
+    const std::chrono::microseconds INTERVAL(10);
+    std::vector<std::int64_t> latencies(SHORT_TASKS);
+    std::atomic<int> done = 0;
+    bench_clock::duration elapsed{};
+    {
+        bank::task_executor ex(WORKERS, mode);
+        const auto start = bench_clock::now();
+        for (int i = 0; i < SHORT_TASKS; i++) {
+            const auto due = start + i * INTERVAL;
+            while (bench_clock::now() < due) {
+                std::this_thread::yield();
+            }
+            if (i % SCAN_EVERY == 0) {
+                ex.submit(
+                    [] {
+                        for (int chunk = 0; chunk < SCAN_CHUNKS; chunk++) {
+                            spin_for(std::chrono::microseconds(50));
+                            bank::task_executor::yield();
+                        }
+                    },
+                    0
+                );
+            }
+            const std::int64_t submitted = now_ns();
+            ex.submit(
+                [&, i, submitted] {
+                    latencies[i] = now_ns() - submitted;
+                    spin_for(std::chrono::nanoseconds(500));
+                    done++;
+                },
+                static_cast<std::size_t>(i) % WORKERS
+            );
+        }
+        while (done < SHORT_TASKS) {
+            std::this_thread::yield();
+        }
+        elapsed = bench_clock::now() - start;
+        report(
+            std::string("executor, ") +
+                (mode == bank::task_executor::mode::SHARED ? "shared queue"
+                                                           : "work stealing"),
+            SHORT_TASKS, elapsed
+        );
+        print_latencies("queueing", latencies);
+        std::cout << "    tasks/stolen per worker:";
+        for (unsigned w = 0; w < WORKERS; w++) {
+            const auto stats = ex.stats(w);
+            std::cout << ' ' << stats.tasks << '/' << stats.stolen;
+        }
+        std::cout << '\n';
+    }
+}
+
+#ifdef __linux__
+// Minimal blocking line-protocol client for bank-server.
+class server_client {
+public:
+    explicit server_client(unsigned short port)
+        : fd_(socket(AF_INET, SOCK_STREAM, 0)) {
+        sockaddr_in address{};
+        address.sin_family = AF_INET;
+        address.sin_port = htons(port);
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        // NOLINTNEXTLINE(cppcoreguidelines-pro-type-reinterpret-cast)
+        if (fd_ < 0 || connect(
+                           fd_, reinterpret_cast<sockaddr *>(&address),
+                           sizeof(address)
+                       ) != 0) {
+            throw std::runtime_error(
+                "Cannot connect to port " + std::to_string(port)
+            );
+        }
+        const int one = 1;
+        setsockopt(fd_, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+
+    server_client(const server_client &) = delete;
+    server_client(server_client &&) = delete;
+    server_client &operator=(const server_client &) = delete;
+    server_client &operator=(server_client &&) = delete;
+
+    ~server_client() {
+        close(fd_);
+    }
+
+    [[nodiscard]] int fd() const noexcept {
+        return fd_;
+    }
+
+    void login(const std::string &name) {
+        read_line();
+        send_line(name);
+        read_line();
+    }
+
+    void send_line(const std::string &line) const {
+        send(line + '\n');
+    }
+
+    void send(const std::string &data) const {
+        for (std::size_t sent = 0; sent < data.size();) {
+            const ssize_t n = ::send(
+                fd_, data.data() + sent, data.size() - sent, MSG_NOSIGNAL
+            );
+            if (n <= 0) {
+                throw std::runtime_error("Connection lost");
+            }
+            sent += static_cast<std::size_t>(n);
+        }
+    }
+
+    std::string read_line() {
+        std::string line;
+        while (!next_line(line)) {
+            if (fill() <= 0) {
+                throw std::runtime_error("Connection lost");
+            }
+        }
+        return line;
+    }
+
+    // Reads whatever is available; returns what recv() returned.
+    ssize_t fill() {
+        std::array<char, 4096> chunk{};
+        const ssize_t n = recv(fd_, chunk.data(), chunk.size(), 0);
+        if (n > 0) {
+            buffer_.append(chunk.data(), static_cast<std::size_t>(n));
+        }
+        return n;
+    }
+
+    std::string read_bytes(std::size_t n) {
+        while (buffer_.size() < n) {
+            if (fill() <= 0) {
+                throw std::runtime_error("Connection lost");
+            }
+        }
+        std::string data = buffer_.substr(0, n);
+        buffer_.erase(0, n);
+        return data;
+    }
+
+    // Takes a complete buffered line, if any.
+    bool next_line(std::string &line) {
+        const auto end = buffer_.find('\n');
+        if (end == std::string::npos) {
+            return false;
+        }
+        line = buffer_.substr(0, end);
+        buffer_.erase(0, end + 1);
+        return true;
+    }
+
+private:
+    int fd_;
+    std::string buffer_;
+};
+
+// Port of the server for the *-server scenarios, or zero if not given.
+unsigned short server_port(const std::string &scenario) {
+    // NOLINTNEXTLINE(concurrency-mt-unsafe)
+    const char *port = std::getenv("BANK_SERVER_PORT");
+    if (port == nullptr) {
+        std::cout << scenario << ": set BANK_SERVER_PORT to run\n";
+        return 0;
+    }
+    return static_cast<unsigned short>(std::stoi(port));
+}
+
+// The same measurement through a running bank-server: from just before the
+// producer sends `transfer` to the monitor line arriving at a client. The
+// server's monitor sessions stay subscribed afterwards, so use a scratch
+// server.
+void monitor_fanout_server(unsigned short port, int monitors, bool hot) {
+    const int TRANSFERS = std::max(20, 20'000 / (hot ? monitors : 1));
+    const std::string run = std::to_string(now_ns());
+    auto target_name = [&](int i) {
+        return hot ? "hot-" + run : "acct-" + run + "-" + std::to_string(i);
+    };
+    std::vector<std::unique_ptr<server_client>> clients;
+    const int epoll_fd = epoll_create1(0);
+    for (int i = 0; i < monitors; i++) {
+        auto &c = clients.emplace_back(std::make_unique<server_client>(port));
+        c->login(target_name(i));
+        c->send_line("monitor 0");
+        while (c->read_line().rfind("=====", 0) != 0) {
+        }
+        fcntl(c->fd(), F_SETFL, fcntl(c->fd(), F_GETFL) | O_NONBLOCK);
+        epoll_event event{};
+        event.events = EPOLLIN;
+        event.data.u32 = static_cast<std::uint32_t>(i);
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, c->fd(), &event);
+    }
+
+    server_client producer(port);
+    producer.login("source-" + run);
+
+    std::atomic<long long> delivered = 0;
+    std::atomic<bool> done = false;
+    std::vector<std::int64_t> samples;
+    std::thread reader([&]() {
+        std::array<epoll_event, 256> events{};
+        std::string line;
+        while (!done.load()) {
+            const int n = epoll_wait(epoll_fd, events.data(), 256, 100);
+            for (int e = 0; e < n; e++) {
+                server_client &c = *clients[events.at(e).data.u32];
+                while (c.fill() > 0) {
+                }
+                while (c.next_line(line)) {
+                    const auto tab = line.rfind('\t');
+                    samples.push_back(
+                        now_ns() - std::stoll(line.substr(tab + 1))
+                    );
+                    delivered.fetch_add(1, std::memory_order_release);
+                }
+            }
+        }
+    });
+
+    long long expected = 0;
+    const auto start = bench_clock::now();
+    for (int k = 0; k < TRANSFERS; k++) {
+        expected += hot ? monitors : 1;
+        producer.send_line(
+            "transfer " + target_name(k % monitors) + " 0 " +
+            std::to_string(now_ns())
+        );
+        producer.read_line();
+        while (delivered.load(std::memory_order_acquire) < expected) {
+            std::this_thread::yield();
+        }
+    }
+    const auto elapsed = bench_clock::now() - start;
+    done = true;
+    reader.join();
+    close(epoll_fd);
+    report(
+        "monitor over loopback, " + std::to_string(monitors) +
+            (hot ? " on one account" : " on own accounts"),
+        expected, elapsed
+    );
+    print_latencies("end-to-end", samples);
+}
+
+// The generated workload replayed through a running bank-server, one session
+// per user. Operations are sent at their scheduled times (or as soon as the
+// previous reply arrives, if behind) and latency is counted from the
+// scheduled time, so queueing behind slow replies is included.
+void skewed_server(
+    unsigned short port,
+    const std::string &pattern,
+    bank::workload_options options
+) {
+    const int OPS = 20'000;
+    options.users = 100;
+    options.rate = 5'000;
+    const std::string run = std::to_string(now_ns());
+    std::vector<std::unique_ptr<server_client>> sessions;
+    for (std::size_t i = 0; i < options.users; i++) {
+        sessions.push_back(std::make_unique<server_client>(port));
+        sessions.back()->login(
+            bank::workload_generator::user_name(i) + "-" + run
+        );
+    }
+    bank::workload_generator g(options);
+    std::vector<std::int64_t> latencies;
+    const std::int64_t start = now_ns();
+    for (int i = 0; i < OPS; i++) {
+        bank::workload_operation op = g.next();
+        const std::int64_t scheduled = start + op.at.count();
+        while (now_ns() < scheduled) {
+            std::this_thread::yield();
+        }
+        server_client &c = *sessions[op.user];
+        if (op.type == bank::workload_operation::kind::TRANSFER) {
+            c.send_line(
+                "transfer " +
+                bank::workload_generator::user_name(op.counterparty) + "-" +
+                run + " " + std::to_string(op.amount) + " " + op.comment
+            );
+            c.read_line();
+        } else if (op.type == bank::workload_operation::kind::BALANCE) {
+            c.send_line(op.command());
+            c.read_line();
+        } else {
+            c.send_line(op.command());
+            while (c.read_line().rfind("=====", 0) != 0) {
+            }
+        }
+        latencies.push_back(now_ns() - scheduled);
+    }
+    report(
+        "skewed over loopback, " + pattern, OPS,
+        std::chrono::nanoseconds(now_ns() - start)
+    );
+    print_latencies("operation", latencies);
+}
+
+// Request latency of a single client, for comparing server modes such as
+// the default and --busy-poll: `balance` round trips, then transfers to an
+// account watched by a second session, timed from sending `transfer` to
+// the monitor line arriving.
+void latency_server(unsigned short port) {
+    const int ROUNDS = 20'000;
+    const std::string run = std::to_string(now_ns());
+    const std::string watched = "watched-" + run;
+    server_client monitor(port);
+    monitor.login(watched);
+    monitor.send_line("monitor 0");
+    while (monitor.read_line().rfind("=====", 0) != 0) {
+    }
+    server_client client(port);
+    client.login("client-" + run);
+
+    std::vector<std::int64_t> round_trips;
+    auto start = bench_clock::now();
+    for (int i = 0; i < ROUNDS; i++) {
+        const std::int64_t sent = now_ns();
+        client.send_line("balance");
+        client.read_line();
+        round_trips.push_back(now_ns() - sent);
+    }
+    report("balance over loopback", ROUNDS, bench_clock::now() - start);
+    print_latencies("round trip", round_trips);
+
+    std::vector<std::int64_t> deliveries;
+    start = bench_clock::now();
+    for (int i = 0; i < ROUNDS; i++) {
+        const std::int64_t sent = now_ns();
+        client.send_line("transfer " + watched + " 0 " + std::to_string(i));
+        monitor.read_line();
+        deliveries.push_back(now_ns() - sent);
+        client.read_line();
+    }
+    report("transfer to a monitor", ROUNDS, bench_clock::now() - start);
+    print_latencies("delivery", deliveries);
+}
+
+// The same account's balance through the line protocol and through the
+// server's HTTP gateway (--http): one request at a time, then pipelined.
+void http_server(unsigned short port, unsigned short http_port) {
+    const int ROUNDS = 20'000;
+    const std::string name = "http-" + std::to_string(now_ns());
+    server_client native(port);
+    native.login(name);
+    server_client http(http_port);
+    const std::string request =
+        "GET /users/" + name + "/balance HTTP/1.1\r\nHost: bench\r\n\r\n";
+    auto read_response = [&] {
+        std::size_t length = 0;
+        for (std::string line = http.read_line(); line != "\r";
+             line = http.read_line()) {
+            if (line.rfind("Content-Length: ", 0) == 0) {
+                length = std::stoul(line.substr(16));
+            }
+        }
+        http.read_bytes(length);
+    };
+    for (const int depth : {1, 16}) {
+        std::string lines;
+        std::string requests;
+        for (int d = 0; d < depth; d++) {
+            lines += "balance\n";
+            requests += request;
+        }
+        lines.pop_back();
+        auto start = bench_clock::now();
+        for (int i = 0; i < ROUNDS; i += depth) {
+            native.send_line(lines);
+            for (int d = 0; d < depth; d++) {
+                native.read_line();
+            }
+        }
+        const std::string pipelined =
+            depth == 1 ? "" : ", " + std::to_string(depth) + " pipelined";
+        report("line balance" + pipelined, ROUNDS, bench_clock::now() - start);
+        start = bench_clock::now();
+        for (int i = 0; i < ROUNDS; i += depth) {
+            http.send(requests);
+            for (int d = 0; d < depth; d++) {
+                read_response();
+            }
+        }
+        report(
+            "HTTP GET balance" + pipelined, ROUNDS, bench_clock::now() - start
+        );
+    }
+}
+
+// The same users served over a connection each and as logical sessions of
+// one multiplexed connection: logging all of them in, then rounds of one
+// `balance` per user, sent together.
+void mux_server(unsigned short port, int users) {
+    const int ROUNDS = 10;
+    const std::string run = std::to_string(now_ns());
+    auto name = [&](int i) { return "mux-" + run + "-" + std::to_string(i); };
+    const std::string label = ", " + std::to_string(users) + " users";
+
+    auto start = bench_clock::now();
+    std::vector<std::unique_ptr<server_client>> connections;
+    for (int i = 0; i < users; i++) {
+        connections.push_back(std::make_unique<server_client>(port));
+        connections.back()->login(name(i));
+    }
+    report(
+        "login, a connection each" + label, users, bench_clock::now() - start
+    );
+    start = bench_clock::now();
+    for (int r = 0; r < ROUNDS; r++) {
+        for (auto &c : connections) {
+            c->send_line("balance");
+        }
+        for (auto &c : connections) {
+            c->read_line();
+        }
+    }
+    report(
+        "balance, a connection each" + label, ROUNDS * users,
+        bench_clock::now() - start
+    );
+    connections.clear();
+
+    start = bench_clock::now();
+    server_client mux(port);
+    mux.login("*mux");
+    std::string logins;
+    for (int i = 0; i < users; i++) {
+        logins += std::to_string(i) + ' ' + name(i) + '\n';
+    }
+    mux.send(logins);
+    for (int i = 0; i < users; i++) {
+        mux.read_line();
+    }
+    report("login, one connection" + label, users, bench_clock::now() - start);
+    std::string round;
+    for (int i = 0; i < users; i++) {
+        round += std::to_string(i) + " balance\n";
+    }
+    start = bench_clock::now();
+    for (int r = 0; r < ROUNDS; r++) {
+        mux.send(round);
+        for (int i = 0; i < users; i++) {
+            mux.read_line();
+        }
+    }
+    report(
+        "balance, one connection" + label, ROUNDS * users,
+        bench_clock::now() - start
+    );
+}
+
+// Reads a metric from the server's `metrics` reply, or -1 if it is absent.
+long long server_metric(server_client &c, const std::string &name) {
+    c.send_line("metrics");
+    long long value = -1;
+    for (std::string line = c.read_line(); line.rfind("=====", 0) != 0;
+         line = c.read_line()) {
+        if (line.rfind(name + '\t', 0) == 0) {
+            value = std::stoll(line.substr(name.size() + 1));
+        }
+    }
+    return value;
+}
+
+// Full-history replies of a large account from a running bank-server: reply
+// throughput and the server's CPU time per GB sent, which it reports as
+// command.transactions.cpu_ns when started with --instrument. Compare the
+// --history-send modes with one server per mode.
+void history_server(unsigned short port) {
+    const int RECORDS = 100'000;
+    const int BATCH = 1'000;
+    const int REPLIES = 20;
+    const std::string run = std::to_string(now_ns());
+    server_client account(port);
+    account.login("history-" + run);
+    server_client source(port);
+    source.login("history-source-" + run);
+    for (int i = 0; i < RECORDS; i += BATCH) {
+        std::string batch;
+        for (int k = i; k < i + BATCH; k++) {
+            batch += "transfer history-" + run + " 0 record " +
+                     std::to_string(k) + '\n';
+        }
+        batch.pop_back();
+        source.send_line(batch);
+        for (int k = 0; k < BATCH; k++) {
+            source.read_line();
+        }
+    }
+
+    const long long cpu_before =
+        server_metric(account, "command.transactions.cpu_ns");
+    long long bytes = 0;
+    const auto start = bench_clock::now();
+    for (int r = 0; r < REPLIES; r++) {
+        account.send_line("transactions " + std::to_string(RECORDS + 1));
+        for (std::string line = account.read_line();
+             line.rfind("=====", 0) != 0; line = account.read_line()) {
+            bytes += static_cast<long long>(line.size()) + 1;
+        }
+    }
+    const auto elapsed = bench_clock::now() - start;
+    const long long cpu_after =
+        server_metric(account, "command.transactions.cpu_ns");
+    report(
+        "full history, " + std::to_string(RECORDS) + " records", REPLIES,
+        elapsed
+    );
+    const double gb = static_cast<double>(bytes) / 1e9;
+    std::cout << "    " << std::setprecision(2)
+              << gb / std::chrono::duration<double>(elapsed).count()
+              << " GB/s";
+    if (cpu_after < 0) {
+        std::cout << ", start the server with --instrument for CPU per GB\n";
+    } else {
+        // The first reply also builds the segments; counted in.
+        const double cpu_seconds =
+            static_cast<double>(cpu_after - std::max(cpu_before, 0LL)) / 1e9;
+        std::cout << ", server CPU " << cpu_seconds / gb << " s/GB\n";
+    }
+}
+#endif
+
+const std::map<std::string, std::function<void()>> scenarios = {
+    {"ping-pong",
+     [] {
+         ping_pong(std::chrono::microseconds(0));
+         ping_pong(std::chrono::microseconds(100));
+         ping_pong(std::chrono::microseconds(10'000));
+     }},
+    {"create-users", [] { create_users(4'000'000); }},
+    {"scan", [] { scan(1'000'000); }},
+    {"audit", [] { audit(1000, 2'000'000); }},
+    {"diff", [] { diff(100'000, 2'000'000); }},
+    {"monitor",
+     [] {
+         for (const int monitors : {1, 100, 10'000}) {
+             monitor_fanout(monitors, true);
+             monitor_fanout(monitors, false);
+         }
+     }},
+    {"executor",
+     [] {
+         executor(bank::task_executor::mode::SHARED);
+         executor(bank::task_executor::mode::STEALING);
+     }},
+    {"skewed",
+     [] {
+         for (const auto &[name, options] : skew_patterns()) {
+             skewed(name, options);
+         }
+     }},
+    // The *-server scenarios need a running server:
+    // BANK_SERVER_PORT=<port> bank-bench monitor-server
+    {"monitor-server",
+     [] {
+#ifdef __linux__
+         const unsigned short port = server_port("monitor-server");
+         if (port == 0) {
+             return;
+         }
+         for (const int monitors : {1, 100, 10'000}) {
+             for (const bool hot : {true, false}) {
+                 try {
+                     monitor_fanout_server(port, monitors, hot);
+                 } catch (const std::exception &e) {
+                     // Typically the server running out of descriptors or
+                     // threads; monitors of earlier runs are still there.
+                     std::cout << "monitor over loopback, " << monitors
+                               << (hot ? " on one account" : " on own accounts")
+                               << ": " << e.what() << '\n';
+                 }
+             }
+         }
+#else
+         std::cout << "monitor-server: not supported on this platform\n";
+#endif
+     }},
+    {"skewed-server",
+     [] {
+#ifdef __linux__
+         const unsigned short port = server_port("skewed-server");
+         if (port == 0) {
+             return;
+         }
+         for (const auto &[name, options] : skew_patterns()) {
+             skewed_server(port, name, options);
+         }
+#else
+         std::cout << "skewed-server: not supported on this platform\n";
+#endif
+     }},
+    // Run once against a default server and once against one started with
+    // --busy-poll <two CPUs>; the bench's two sessions take both.
+    {"latency-server",
+     [] {
+#ifdef __linux__
+         const unsigned short port = server_port("latency-server");
+         if (port != 0) {
+             latency_server(port);
+         }
+#else
+         std::cout << "latency-server: not supported on this platform\n";
+#endif
+     }},
+    // Once per --history-send mode, with --instrument.
+    {"history-server",
+     [] {
+#ifdef __linux__
+         const unsigned short port = server_port("history-server");
+         if (port != 0) {
+             history_server(port);
+         }
+#else
+         std::cout << "history-server: not supported on this platform\n";
+#endif
+     }},
+    {"mux-server",
+     [] {
+#ifdef __linux__
+         const unsigned short port = server_port("mux-server");
+         if (port != 0) {
+             for (const int users : {100, 1000}) {
+                 mux_server(port, users);
+             }
+         }
+#else
+         std::cout << "mux-server: not supported on this platform\n";
+#endif
+     }},
+    // Needs the --http port of the same server in BANK_HTTP_PORT as well.
+    {"http-server",
+     [] {
+#ifdef __linux__
+         const unsigned short port = server_port("http-server");
+         // NOLINTNEXTLINE(concurrency-mt-unsafe)
+         const char *http_port = std::getenv("BANK_HTTP_PORT");
+         if (port != 0 && http_port == nullptr) {
+             std::cout << "http-server: set BANK_HTTP_PORT to run\n";
+         } else if (port != 0) {
+             http_server(
+                 port, static_cast<unsigned short>(std::stoi(http_port))
+             );
+         }
+#else
+         std::cout << "http-server: not supported on this platform\n";
+#endif
+     }},
+    {"startup",
+     [] {
+         startup(false);
+         startup(true);
+     }},
+};
+}  // namespace
+
+int main(int argc, char *argv[]) {
+    if (argc == 1) {
+        for (const auto &[name, run] : scenarios) {
+            run();
+        }
+        return 0;
+    }
+    // NOLINTNEXTLINE(cppcoreguidelines-pro-bounds-pointer-arithmetic)
+    for (const std::string name : std::vector(argv + 1, argv + argc)) {
+        auto it = scenarios.find(name);
+        if (it == scenarios.end()) {
+            std::cerr << "Unknown scenario: " << name << '\n';
+            return 1;
+        }
+        it->second();
+    }
+}
@@ -0,0 +1,122 @@
+#include <algorithm>
+#include <exception>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "bank.hpp"
+#include "ledger_diff.hpp"
+
+// Prints what changed between two snapshots of the same ledger, written by
+// ledger::save() or by a bank-server hot restart (one ledger per tenant).
+// Usage: bank-diff <before> <after> [threads]
+
+namespace {
+struct snapshot_file {
+    bool server = false;
+    std::map<std::string, bank::snapshot_index> ledgers;  // By tenant.
+};
+
+snapshot_file read_snapshot(const std::string &path) {
+    std::ifstream f(path, std::ios::binary);
+    if (!f) {
+        throw std::runtime_error("Unable to read " + path);
+    }
+    snapshot_file s;
+    std::string magic;
+    f >> magic;
+    if (magic != "bank-server-snapshot") {
+        f.seekg(0);
+        s.ledgers.emplace("", bank::snapshot_index::read(f));
+        return s;
+    }
+    // Format: see bank::server::save_snapshot().
+    s.server = true;
+    int format = 0;
+    std::size_t tenants = 0;
+    if (!(f >> format >> tenants) || format != 1 || f.get() != '\n') {
+        throw bank::snapshot_error("Not a server snapshot: " + path);
+    }
+    for (std::size_t i = 0; i < tenants; i++) {
+        std::string tenant;
+        std::getline(f, tenant);
+        s.ledgers.emplace(std::move(tenant), bank::snapshot_index::read(f));
+    }
+    return s;
+}
+
+void print(const bank::ledger_diff &diff) {
+    std::size_t records = 0;
+    for (const bank::account_diff &d : diff.changed) {
+        if (d.added) {
+            std::cout << "ADDED " << d.name << " BALANCE "
+                      << d.balance_after_xts << " VERSION " << d.version_after
+                      << '\n';
+        } else {
+            const long long delta =
+                static_cast<long long>(d.balance_after_xts) -
+                d.balance_before_xts;
+            std::cout << "CHANGED " << d.name << " BALANCE "
+                      << d.balance_before_xts << " -> " << d.balance_after_xts
+                      << " (" << (delta >= 0 ? "+" : "") << delta
+                      << ") VERSION " << d.version_before << " -> "
+                      << d.version_after << " FROM RECORD " << d.first_record
+                      << '\n';
+        }
+        for (const bank::diff_record &r : d.records) {
+            std::cout << '+' << r.seq << '\t' << r.counterparty.value_or("-")
+                      << '\t' << r.balance_delta_xts << '\t' << r.comment
+                      << '\n';
+        }
+        records += d.records.size();
+    }
+    for (const std::string &name : diff.removed) {
+        std::cout << "REMOVED " << name << '\n';
+    }
+    std::cout << "===== " << diff.changed.size() << " CHANGED, "
+              << diff.unchanged << " UNCHANGED, " << diff.removed.size()
+              << " REMOVED, " << records << " NEW RECORDS =====\n";
+}
+}  // namespace
+
+int main(int argc, char *argv[]) {
+    // NOLINTNEXTLINE(cppcoreguidelines-pro-bounds-pointer-arithmetic)
+    const std::vector<std::string> args(argv + 1, argv + argc);
+    if (args.size() < 2 || args.size() > 3) {
+        std::cerr << "Usage: bank-diff <before> <after> [threads]\n";
+        return 1;
+    }
+    const std::string &before_path = args[0];
+    const std::string &after_path = args[1];
+    try {
+        unsigned threads = std::max(std::thread::hardware_concurrency(), 1U);
+        if (args.size() == 3) {
+            threads = static_cast<unsigned>(std::stoul(args[2]));
+        }
+        const snapshot_file before = read_snapshot(before_path);
+        const snapshot_file after = read_snapshot(after_path);
+        const bank::snapshot_index none;
+        for (const auto &[tenant, index] : after.ledgers) {
+            if (after.server) {
+                std::cout << "TENANT " << tenant << '\n';
+            }
+            const auto it = before.ledgers.find(tenant);
+            print(bank::diff_snapshots(
+                it == before.ledgers.end() ? none : it->second, after_path,
+                index, threads
+            ));
+        }
+        for (const auto &[tenant, index] : before.ledgers) {
+            if (after.ledgers.count(tenant) == 0) {
+                std::cout << "REMOVED TENANT " << tenant << '\n';
+            }
+        }
+    } catch (const std::exception &e) {
+        std::cerr << "bank-diff: " << e.what() << '\n';
+        return 1;
+    }
+}
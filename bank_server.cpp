@@ -2,22 +2,79 @@
 #include <crtdbg.h>
 #endif
 
+#ifndef _WIN32
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <ctime>
+#endif
+
+#ifdef __linux__
+#include <linux/errqueue.h>
+#include <pthread.h>
+#include <sched.h>
+#endif
+
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
 #include <fstream>
 #include <iostream>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <optional>
+#include <shared_mutex>
 #include <sstream>
+#include <system_error>
 #include <thread>
 #include <unordered_map>
+#include <unordered_set>
 #include <utility>
+#include <vector>
+#include "audit_log.hpp"
 #include "bank.hpp"
 #include "boost/asio.hpp"
+#include "command_scheduler.hpp"
+#include "cost_meter.hpp"
+#include "counterparty_cache.hpp"
+#include "history_segments.hpp"
+#include "http.hpp"
+#include "login.hpp"
+#include "reply_buffer.hpp"
+#include "session_mux.hpp"
+#include "task_executor.hpp"
 using boost::asio::ip::tcp;
 
 enum class Commands {
     BALANCE,
     TRANSACTIONS,
     MONITOR,
+    WATCH,
+    SUB_ACCOUNT,
+    ROLLUP,
+    GROUP,
+    GROUP_MONITOR,
     TRANSFER,
+    TRANSFER_IF,
+    NETTING,
+    SYNC,
+    ACTIVITY,
+    AUDIT,
+    AUDIT_VERIFY,
+    METRICS,
     BAD_COMMAND
 
 };
@@ -25,7 +82,19 @@ const std::unordered_map<std::string, Commands> command_map = {
     {"balance", Commands::BALANCE},
     {"transactions", Commands::TRANSACTIONS},
     {"monitor", Commands::MONITOR},
-    {"transfer", Commands::TRANSFER}};
+    {"watch", Commands::WATCH},
+    {"sub-account", Commands::SUB_ACCOUNT},
+    {"rollup", Commands::ROLLUP},
+    {"group", Commands::GROUP},
+    {"group-monitor", Commands::GROUP_MONITOR},
+    {"transfer", Commands::TRANSFER},
+    {"transfer-if", Commands::TRANSFER_IF},
+    {"netting", Commands::NETTING},
+    {"sync", Commands::SYNC},
+    {"activity", Commands::ACTIVITY},
+    {"audit", Commands::AUDIT},
+    {"audit-verify", Commands::AUDIT_VERIFY},
+    {"metrics", Commands::METRICS}};
 
 static Commands get_command(const std::string &cmd) {
     auto it = command_map.find(cmd);
@@ -35,178 +104,2830 @@ static Commands get_command(const std::string &cmd) {
     return Commands::BAD_COMMAND;
 };
 
+static bank::qos_class classify(Commands type) {
+    switch (type) {
+        case Commands::BALANCE:
+        case Commands::SUB_ACCOUNT:
+        case Commands::ROLLUP:
+        case Commands::TRANSFER:
+        case Commands::TRANSFER_IF:
+        case Commands::NETTING:
+        case Commands::ACTIVITY:
+            return bank::qos_class::INTERACTIVE;
+        case Commands::TRANSACTIONS:
+        case Commands::MONITOR:
+        case Commands::WATCH:
+        case Commands::GROUP:
+        case Commands::GROUP_MONITOR:
+        case Commands::SYNC:
+        case Commands::AUDIT:
+            return bank::qos_class::BULK;
+        case Commands::AUDIT_VERIFY:
+        case Commands::METRICS:
+        case Commands::BAD_COMMAND:
+            break;
+    }
+    return bank::qos_class::ADMIN;
+}
+
+// Commands that turn the session into a stream of events, sent until the
+// client disconnects: they wait indefinitely and never modify the ledger.
+static bool is_stream(Commands type) {
+    return type == Commands::MONITOR || type == Commands::WATCH ||
+           type == Commands::GROUP_MONITOR;
+}
+
+constexpr std::size_t COMMAND_COUNT =
+    static_cast<std::size_t>(Commands::BAD_COMMAND) + 1;
+
+static std::string command_name(Commands type) {
+    for (const auto &[name, command] : command_map) {
+        if (command == type) {
+            return name;
+        }
+    }
+    return "unknown";
+}
+
+// Spin-wait hint for the busy-polling loops.
+static void cpu_relax() noexcept {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+}
+
+// Optional suffix of `balance` and `transactions N`:
+//   if-changed <version>         -- answer "NOT MODIFIED" without locking
+//   wait <version> <timeout-ms>  -- long-poll until the version changes
+struct version_condition {
+    // Longer waits are rejected as invalid.
+    static constexpr std::chrono::milliseconds MAX_TIMEOUT =
+        std::chrono::hours(24);
+
+    enum class kind { NONE, IF_CHANGED, WAIT, INVALID };
+    kind type = kind::NONE;
+    std::uint64_t known_version = 0;
+    std::chrono::milliseconds timeout{0};
+};
+
+static version_condition get_version_condition(std::istringstream &iss) {
+    version_condition cond;
+    std::string mode;
+    if (!(iss >> mode)) {
+        return cond;
+    }
+    if (mode == "if-changed" && iss >> cond.known_version) {
+        cond.type = version_condition::kind::IF_CHANGED;
+    } else if (long long timeout_ms = 0;
+               mode == "wait" && iss >> cond.known_version >> timeout_ms &&
+               timeout_ms >= 0 &&
+               timeout_ms <= version_condition::MAX_TIMEOUT.count()) {
+        cond.type = version_condition::kind::WAIT;
+        cond.timeout = std::chrono::milliseconds(timeout_ms);
+    } else {
+        cond.type = version_condition::kind::INVALID;
+    }
+    return cond;
+}
+
+// Bound of an `activity` window: Unix time in seconds, "now", or "-<n>" for
+// n seconds before now.
+static std::optional<std::chrono::sys_seconds>
+parse_time_bound(const std::string &s, std::chrono::sys_seconds now) {
+    if (s == "now") {
+        return now;
+    }
+    try {
+        std::size_t used = 0;
+        const long long value = std::stoll(s, &used);
+        if (used != s.size()) {
+            return std::nullopt;
+        }
+        if (s[0] == '-') {
+            return now + std::chrono::seconds(value);
+        }
+        return std::chrono::sys_seconds(std::chrono::seconds(value));
+    } catch (const std::logic_error &) {
+        return std::nullopt;
+    }
+}
+
 namespace bank {
+struct tenant_quota {
+    std::size_t max_sessions = SIZE_MAX;
+    std::size_t max_users = SIZE_MAX;
+    double transfers_per_second = 0;  // Zero means unlimited.
+};
+
+// An isolated ledger with its own quotas and counters. Tenants never share
+// locks, so a noisy tenant only contends with itself.
+class tenant {
+public:
+    tenant(std::string name, const tenant_quota &quota)
+        : name_(std::move(name)),
+          quota_(quota),
+          tokens_(quota.transfers_per_second),
+          last_refill_(std::chrono::steady_clock::now()) {
+        ledger_.set_max_users(quota.max_users);
+    }
+
+    [[nodiscard]] const std::string &name() const noexcept {
+        return name_;
+    }
+
+    ledger &get_ledger() noexcept {
+        return ledger_;
+    }
+
+    bool try_open_session() {
+        std::size_t active = sessions_active_.load();
+        do {
+            if (active >= quota_.max_sessions) {
+                sessions_rejected_++;
+                return false;
+            }
+        } while (!sessions_active_.compare_exchange_weak(active, active + 1));
+        sessions_total_++;
+        return true;
+    }
+
+    void close_session() noexcept {
+        sessions_active_--;
+    }
+
+    // Token bucket with a one second burst.
+    bool try_start_transfer() {
+        if (quota_.transfers_per_second <= 0) {
+            return true;
+        }
+        const std::unique_lock lock(rate_mutex_);
+        const auto now = std::chrono::steady_clock::now();
+        tokens_ = std::min(
+            quota_.transfers_per_second,
+            tokens_ + quota_.transfers_per_second *
+                          std::chrono::duration<double>(now - last_refill_)
+                              .count()
+        );
+        last_refill_ = now;
+        if (tokens_ < 1) {
+            transfers_throttled_++;
+            return false;
+        }
+        tokens_ -= 1;
+        return true;
+    }
+
+    void count_command() noexcept {
+        commands_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void count_transfer(bool ok) noexcept {
+        (ok ? transfers_ok_ : transfers_failed_)
+            .fetch_add(1, std::memory_order_relaxed);
+    }
+
+    history_segments &history() noexcept {
+        return history_;
+    }
+
+    audit_log &audit() noexcept {
+        return audit_;
+    }
+
+    // Each `audit-verify` rehashes every chain, so they run one at a time
+    // per tenant. The lock is empty if another one is running.
+    std::unique_lock<std::mutex> try_start_verify() {
+        return std::unique_lock(verify_mutex_, std::try_to_lock);
+    }
+
+    void count_history_send(bool zerocopy) noexcept {
+        (zerocopy ? zerocopy_sends_ : segment_sends_)
+            .fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void count_zerocopy_copied(std::uint64_t sends) noexcept {
+        zerocopy_copied_.fetch_add(sends, std::memory_order_relaxed);
+    }
+
+    void count_counterparty_lookup(bool cache_hit) noexcept {
+        (cache_hit ? cache_hits_ : cache_misses_)
+            .fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // Resources spent on one command, recorded with --instrument.
+    void count_command_cost(Commands type, const work_cost &cost) noexcept {
+        command_cost &c = command_costs_[static_cast<std::size_t>(type)];
+        c.count.fetch_add(1, std::memory_order_relaxed);
+        c.cpu_ns.fetch_add(cost.cpu_ns, std::memory_order_relaxed);
+        c.allocations.fetch_add(cost.allocations, std::memory_order_relaxed);
+        c.allocated_bytes.fetch_add(
+            cost.allocated_bytes, std::memory_order_relaxed
+        );
+    }
+
+    void print_metrics(std::ostream &os) {
+        os << "tenant\t" << (name_.empty() ? "-" : name_) << '\n'
+           << "sessions.active\t" << sessions_active_ << '\n'
+           << "sessions.total\t" << sessions_total_ << '\n'
+           << "sessions.rejected\t" << sessions_rejected_ << '\n'
+           << "users\t" << ledger_.user_count() << '\n'
+           << "commands\t" << commands_ << '\n'
+           << "transfers.ok\t" << transfers_ok_ << '\n'
+           << "transfers.failed\t" << transfers_failed_ << '\n'
+           << "transfers.throttled\t" << transfers_throttled_ << '\n'
+           << "counterparty_cache.hits\t" << cache_hits_ << '\n'
+           << "counterparty_cache.misses\t" << cache_misses_ << '\n';
+        history_.print_metrics(os);
+        audit_.print_metrics(os);
+        os << "history.segment_sends\t" << segment_sends_ << '\n'
+           << "history.zerocopy_sends\t" << zerocopy_sends_ << '\n'
+           << "history.zerocopy_copied\t" << zerocopy_copied_ << '\n';
+        for (std::size_t i = 0; i < COMMAND_COUNT; i++) {
+            const command_cost &c = command_costs_[i];
+            const std::uint64_t count = c.count;
+            if (count == 0) {
+                continue;
+            }
+            const std::string prefix =
+                "command." + command_name(static_cast<Commands>(i)) + '.';
+            os << prefix << "count\t" << count << '\n'
+               << prefix << "cpu_ns\t" << c.cpu_ns << '\n'
+               << prefix << "cpu_ns_per_op\t" << c.cpu_ns / count << '\n'
+               << prefix << "allocations\t" << c.allocations << '\n'
+               << prefix << "allocations_per_op\t"
+               << static_cast<double>(c.allocations) /
+                      static_cast<double>(count)
+               << '\n'
+               << prefix << "allocated_bytes\t" << c.allocated_bytes
+               << '\n';
+        }
+    }
+
+private:
+    std::string name_;
+    tenant_quota quota_;
+    ledger ledger_;
+    history_segments history_;
+    audit_log audit_;
+    std::mutex verify_mutex_;
+
+    std::mutex rate_mutex_;
+    double tokens_;
+    std::chrono::steady_clock::time_point last_refill_;
+
+    std::atomic<std::size_t> sessions_active_ = 0;
+    std::atomic<std::uint64_t> sessions_total_ = 0;
+    std::atomic<std::uint64_t> sessions_rejected_ = 0;
+    std::atomic<std::uint64_t> commands_ = 0;
+    std::atomic<std::uint64_t> transfers_ok_ = 0;
+    std::atomic<std::uint64_t> transfers_failed_ = 0;
+    std::atomic<std::uint64_t> transfers_throttled_ = 0;
+    std::atomic<std::uint64_t> cache_hits_ = 0;
+    std::atomic<std::uint64_t> cache_misses_ = 0;
+    std::atomic<std::uint64_t> segment_sends_ = 0;
+    std::atomic<std::uint64_t> zerocopy_sends_ = 0;
+    std::atomic<std::uint64_t> zerocopy_copied_ = 0;
+
+    struct command_cost {
+        std::atomic<std::uint64_t> count = 0;
+        std::atomic<std::uint64_t> cpu_ns = 0;
+        std::atomic<std::uint64_t> allocations = 0;
+        std::atomic<std::uint64_t> allocated_bytes = 0;
+    };
+    std::array<command_cost, COMMAND_COUNT> command_costs_;
+};
+
+// Tenants are configured at startup and never removed, so lookups need no
+// locking. The unnamed tenant serves logins without an "@tenant" suffix.
+using tenant_map = std::map<std::string, std::unique_ptr<tenant>>;
+
+// How `transactions` replies send sealed history segments (--history-send):
+// formatted into the stream like the rest (STREAM), or from the shared
+// pre-serialized text with send() (SEGMENTS) or with MSG_ZEROCOPY. Zero
+// copy pays off only for large sends to a real NIC; loopback and most
+// virtual devices copy anyway, on top of the completion notifications.
+enum class history_send { STREAM, SEGMENTS, ZEROCOPY };
+
+// State shared by all sessions of one server process.
+struct server_state {
+    tenant_map tenants;
+    // Held shared while a command runs and exclusively during a hot restart
+    // handoff, so that the snapshot sees no half-done commands.
+    std::shared_mutex commands_mutex;
+    std::atomic<bool> draining = false;
+    // Record CPU time and allocations of every command (--instrument).
+    bool instrument = false;
+    history_send large_replies = history_send::SEGMENTS;
+    std::unique_ptr<command_scheduler> scheduler;
+    // Worker pool running commands, if --workers is given.
+    std::unique_ptr<task_executor> executor;
+    // CPUs for busy-polling sessions (--busy-poll), at most one session per
+    // CPU, and which of them are taken.
+    std::mutex busy_poll_mutex;
+    std::vector<int> busy_poll_cpus;
+    std::vector<bool> busy_poll_taken;
+    std::mutex sessions_mutex;
+    std::unordered_set<tcp::socket::native_handle_type> sessions;
+};
+
 class client_connection {
 public:
     client_connection(  // NOLINT(cppcoreguidelines-pro-type-member-init)
         tcp::socket socket,
-        ledger &ledger
+        server_state &state
+    )
+        : socket_stream_(std::move(socket)),
+          client_(socket_stream_),
+          state_(state) {
+    }
+
+    // A logical session of a multiplexed connection, see serve_mux().
+    client_connection(  // NOLINT(cppcoreguidelines-pro-type-member-init)
+        logical_session &channel,
+        server_state &state
     )
-        : client_(std::move(socket)), ledger_(ledger) {
+        : client_(channel.stream()), state_(state), channel_(&channel) {
     }
 
     void run() {
-        const auto remote_ep = client_.socket().remote_endpoint();
-        const auto local_ep = client_.socket().local_endpoint();
+        const auto remote_ep = socket_stream_.socket().remote_endpoint();
+        const auto local_ep = socket_stream_.socket().local_endpoint();
+        const auto handle = socket_stream_.socket().native_handle();
         std::cout << "Connected " << remote_ep << " --> " << local_ep << '\n';
+        {
+            const std::unique_lock lock(state_.sessions_mutex);
+            state_.sessions.insert(handle);
+        }
 
-        authentication();
-        std::string command;  //
-        while (std::getline(client_, command)) {
-            std::istringstream iss(command);
-            std::string cmd;
-            iss >> cmd;
-            switch (get_command(cmd)) {
-                case Commands::BALANCE:
-                    client_ << user_->balance_xts() << '\n' << std::flush;
-                    break;
-                case Commands::TRANSACTIONS: {
-                    std::size_t n;  // NOLINT(cppcoreguidelines-init-variables)
-                    iss >> n;
-                    get_transactions(n);
-                } break;
-                case Commands::MONITOR: {
-                    std::size_t n;  // NOLINT(cppcoreguidelines-init-variables)
-                    iss >> n;
-                    monitor(n);
-                } break;
-                case Commands::TRANSFER: {
-                    std::string counterparty;
-                    std::string comment;
-                    int amount;  // NOLINT(cppcoreguidelines-init-variables)
-                    iss >> counterparty >> amount;
-                    std::getline(iss, comment);
-                    transfer(counterparty, amount, comment);
-                } break;
-                case Commands::BAD_COMMAND:
-                    client_ << "Unknown command: '" << cmd << "'\n"
-                            << std::flush;
+        std::string name;
+        client_ << "What is your name?\n" << std::flush;
+        std::getline(client_, name);
+        if (name == MUX_LOGIN) {
+            serve_mux();
+        } else if (login(name)) {
+            start_busy_poll();
+            serve();
+            stop_busy_poll();
+            tenant_->close_session();
+            if (const std::uint64_t lookups =
+                    counterparties_.hits() + counterparties_.misses();
+                lookups > 0) {
+                std::cout << "Counterparty cache " << remote_ep << ": "
+                          << counterparties_.hits() << '/' << lookups
+                          << " hits\n";
             }
         }
+        {
+            const std::unique_lock lock(state_.sessions_mutex);
+            state_.sessions.erase(handle);
+        }
         std::cout << "Disconnected " << remote_ep << " --> " << local_ep
                   << '\n';
     }
 
+    // Runs a logical session that logged in as `name`.
+    void run_logical(const std::string &name) {
+        if (login(name)) {
+            serve();
+            tenant_->close_session();
+        }
+    }
+
 private:
-    tcp::iostream client_;
-    ledger &ledger_;
+    // Unused by logical sessions.
+    tcp::iostream socket_stream_;
+    std::iostream &client_;
+    server_state &state_;
+    // The channel of a logical session, null for a session that has the
+    // connection to itself.
+    logical_session *channel_ = nullptr;
+    tenant *tenant_ = nullptr;
+    ledger *ledger_ = nullptr;
     user *user_ = nullptr;
+    counterparty_cache counterparties_;
+    // Execution slot of the command being run, if it is scheduled.
+    command_scheduler::slot *slot_ = nullptr;
+    // Shared hold on state_.commands_mutex of the command being run, if it
+    // takes one.
+    std::shared_lock<std::shared_mutex> *command_lock_ = nullptr;
+    // Reply of the command being run, unless it is a stream.
+    reply_buffer reply_;
+    // Worker affinity key: commands of one user go to one worker.
+    std::size_t shard_ = task_executor::NO_AFFINITY;
+    // Index into state_.busy_poll_cpus if this session busy-polls.
+    std::optional<std::size_t> busy_poll_;
+    // MSG_ZEROCOPY state: whether SO_ZEROCOPY could be set, the sequence
+    // number of the next zero-copy send, and the segments of sends the
+    // kernel hasn't reported done yet.
+    std::optional<bool> zerocopy_;
+    std::uint32_t zerocopy_sequence_ = 0;
+    std::deque<std::pair<std::uint32_t, history_segments::segment>>
+        zerocopy_pending_;
 
-    void authentication() {
-        std::string name;
-        client_ << "What is your name?\n" << std::flush;
-        std::getline(client_, name);
-        user_ = &ledger_.get_or_create_user(name);
-        client_ << "Hi " << name << '\n' << std::flush;
+    static constexpr std::size_t HISTORY_CHUNK = 256;
+    // Kernel busy-poll budget per socket read, see SO_BUSY_POLL in socket(7).
+    static constexpr int SOCKET_BUSY_POLL_US = 50;
+    // Spins between checks for a closed connection or an expired netting
+    // batch while busy-polling.
+    static constexpr int BUSY_POLL_SPINS = 4096;
+    static constexpr std::chrono::seconds WATCH_IDLE_CHECK{1};
+    // Threads hashing for one `audit-verify` at most, the session's own
+    // included.
+    static constexpr unsigned AUDIT_VERIFY_THREADS = 4;
+    // How often a long-poll checks whether a hot restart is draining.
+    static constexpr std::chrono::milliseconds DRAIN_CHECK{100};
+    // Login that switches a connection to multiplexed mode, and the frame
+    // credit each of its logical sessions starts with.
+    static constexpr std::string_view MUX_LOGIN = "*mux";
+    static constexpr std::size_t MUX_CREDIT = 64 * 1024;
+
+    void serve() {
+        // Reused across commands, so that parsing a command allocates only
+        // for arguments longer than std::string's inline buffer.
+        std::string command;
+        std::istringstream iss;
+        std::string cmd;
+        while (poll_socket(), std::getline(client_, command)) {
+            iss.str(command);
+            iss.clear();
+            cmd.clear();
+            iss >> cmd;
+            const Commands type = get_command(cmd);
+            std::shared_lock command_lock(
+                state_.commands_mutex, std::defer_lock
+            );
+            if (!is_stream(type)) {
+                command_lock.lock();
+                command_lock_ = &command_lock;
+            }
+            if (state_.draining) {
+                break;
+            }
+            tenant_->count_command();
+            // Streams are not scheduled: they mostly sleep and would hold
+            // a slot forever. Nor are their replies buffered: they write as
+            // they go, holding nothing else up.
+            std::optional<command_scheduler::slot> slot;
+            std::streambuf *connection = nullptr;
+            if (!is_stream(type)) {
+                slot.emplace(*state_.scheduler, classify(type));
+                slot_ = &*slot;
+                connection = client_.rdbuf(&reply_);
+            }
+            auto execute = [&] {
+                if (state_.instrument) {
+                    const cost_meter meter;
+                    dispatch(type, cmd, iss);
+                    tenant_->count_command_cost(type, meter.cost());
+                } else {
+                    dispatch(type, cmd, iss);
+                }
+            };
+            // Commands that may block for long stay on the session thread
+            // rather than occupying a worker, and so do all commands of a
+            // busy-polling session: its pinned thread is the fast path.
+            if (state_.executor && !busy_poll_ &&
+                !may_block(type, command)) {
+                state_.executor->run(execute, shard_);
+            } else {
+                execute();
+            }
+            slot_ = nullptr;
+            command_lock_ = nullptr;
+            if (connection != nullptr) {
+                slot.reset();
+                command_lock.unlock();
+                client_.rdbuf(connection);
+                send_reply();
+            }
+        }
+    }
+
+    // Writes the reply the last command rendered into reply_, on the
+    // session thread and holding neither a slot nor the command lock.
+    void send_reply() {
+        reply_.for_each_piece(
+            [&](std::string_view text) {
+                client_.write(
+                    text.data(), static_cast<std::streamsize>(text.size())
+                );
+            },
+            [&](const history_segments::segment &s) { send_segment(s); }
+        );
+        client_.flush();
+        reply_.clear();
     }
 
-    void get_transactions(std::size_t n) {
-        user_->snapshot_transactions([&](const auto &transactions,
-                                         int balance) {
-            client_ << "CPTY\tBAL\tCOMM\n";
-            const int start =
-                std::max(static_cast<int>(transactions.size() - n), 0);
-            for (int i = start; i < static_cast<int>(transactions.size());
-                 i++) {
-                const bank::transaction &cur_transaction = transactions[i];
-                client_ << (cur_transaction.counterparty == nullptr
-                                ? "-"
-                                : cur_transaction.counterparty->name())
-                        << "\t" << cur_transaction.balance_delta_xts << "\t"
-                        << cur_transaction.comment << "\n";
+    // Multiplexed mode: the connection carries any number of logical
+    // sessions as "<id> <line>" frames both ways, with ids the client picks.
+    // The first frame of an id is that session's login, the next ones are
+    // its commands, except "<id> *credit <bytes>", which grants it frame
+    // credit (see logical_session), and "<id> *close". "<id> *closed" is
+    // the last frame of every session. Each logical session runs on its
+    // own thread like a session with its own connection, so streams and
+    // long-polls of one don't hold up the others.
+    void serve_mux() {
+        std::mutex mutex;
+        std::condition_variable all_done;
+        std::unordered_map<std::uint32_t, std::shared_ptr<logical_session>>
+            sessions;
+        std::mutex write_mutex;
+        bool broken = false;
+        auto write = [&](std::string_view frames) {
+            const std::unique_lock lock(write_mutex);
+            broken = broken || !send_all(frames);
+            return !broken;
+        };
+        client_ << MUX_LOGIN << ' ' << MUX_CREDIT << '\n' << std::flush;
+
+        std::string line;
+        while (std::getline(client_, line) && !state_.draining) {
+            std::uint32_t id = 0;
+            const char *last = line.data() + line.size();
+            const auto [end, ec] = std::from_chars(line.data(), last, id);
+            if (ec != std::errc{} || end == last || *end != ' ') {
+                write("*error Invalid frame\n");
+                continue;
+            }
+            std::string payload(end + 1, last);
+            const std::unique_lock lock(mutex);
+            if (const auto it = sessions.find(id); it != sessions.end()) {
+                logical_session &channel = *it->second;
+                if (payload.rfind("*credit ", 0) == 0) {
+                    std::size_t bytes = 0;
+                    std::from_chars(
+                        payload.data() + 8, payload.data() + payload.size(),
+                        bytes
+                    );
+                    channel.grant(bytes);
+                } else if (payload == "*close") {
+                    channel.close();
+                } else if (!channel.push(std::move(payload))) {
+                    write(std::to_string(id) + " Too many queued commands\n");
+                    channel.close();
+                }
+                continue;
             }
+            if (payload.empty() || payload[0] == '*') {
+                continue;  // Late credit or close for an ended session.
+            }
+            auto channel =
+                std::make_shared<logical_session>(id, MUX_CREDIT, write);
+            sessions.emplace(id, channel);
+            std::thread([&, id, channel, name = std::move(payload)]() {
+                {
+                    client_connection session(*channel, state_);
+                    session.run_logical(name);
+                }
+                channel->finish();
+                // Under the lock, so that the id isn't reused before.
+                const std::unique_lock lock(mutex);
+                write(std::to_string(id) + " *closed\n");
+                sessions.erase(id);
+                all_done.notify_all();
+            }).detach();
+        }
 
-            client_ << "===== BALANCE: " << balance << " XTS =====\n"
-                    << std::flush;
-        });
+        // The connection is gone: close every session and wait for them.
+        std::unique_lock lock(mutex);
+        for (const auto &[id, channel] : sessions) {
+            channel->close();
+        }
+        all_done.wait(lock, [&] { return sessions.empty(); });
     }
 
-    void monitor(std::size_t n) {
-        get_transactions(n);
-        auto it = user_->monitor();
-        while (true) {
-            const auto &cur_transaction = it.wait_next_transaction();
-            client_ << (cur_transaction.counterparty == nullptr
-                            ? "-"
-                            : cur_transaction.counterparty->name())
-                    << "\t" << cur_transaction.balance_delta_xts << "\t"
-                    << cur_transaction.comment << "\n";
+    // Writes all of `data` to the socket, bypassing the stream buffer.
+    // Returns false if the connection failed.
+    bool send_all(std::string_view data) {
+#ifdef __linux__
+        const int fd = socket_stream_.socket().native_handle();
+        for (std::size_t sent = 0; sent < data.size();) {
+            const ssize_t written = ::send(
+                fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL
+            );
+            if (written < 0 && errno == EINTR) {
+                continue;
+            }
+            if (written < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                pollfd writable{fd, POLLOUT, 0};
+                ::poll(&writable, 1, -1);
+                continue;
+            }
+            if (written <= 0) {
+                return false;
+            }
+            sent += static_cast<std::size_t>(written);
         }
+        return true;
+#else
+        boost::system::error_code ec;
+        boost::asio::write(
+            socket_stream_.socket(),
+            boost::asio::buffer(data.data(), data.size()), ec
+        );
+        return !ec;
+#endif
     }
 
-    void transfer(
-        const std::string &counterparty,
-        int amount,
-        std::string &comment
+    // Streams and long-polls wait for other sessions' transfers.
+    static bool may_block(Commands type, const std::string &command) {
+        if (is_stream(type)) {
+            return true;
+        }
+        if (type != Commands::BALANCE && type != Commands::TRANSACTIONS) {
+            return false;
+        }
+        std::istringstream iss(command);
+        std::string word;
+        iss >> word;
+        if (type == Commands::TRANSACTIONS) {
+            iss >> word;
+        }
+        return get_version_condition(iss).type ==
+               version_condition::kind::WAIT;
+    }
+
+    void dispatch(
+        Commands type,
+        const std::string &cmd,
+        std::istringstream &iss
     ) {
-        if (!comment.empty() && comment[0] == ' ') {
-            comment = comment.substr(1);
+        switch (type) {
+            case Commands::BALANCE:
+                balance(get_version_condition(iss));
+                break;
+            case Commands::TRANSACTIONS: {
+                std::size_t n;  // NOLINT(cppcoreguidelines-init-variables)
+                iss >> n;
+                const version_condition cond = get_version_condition(iss);
+                if (cond.type == version_condition::kind::NONE) {
+                    get_transactions(n);
+                } else if (is_modified(cond)) {
+                    get_transactions(n, true);
+                }
+            } break;
+            case Commands::MONITOR: {
+                std::size_t n;  // NOLINT(cppcoreguidelines-init-variables)
+                iss >> n;
+                monitor(n);
+            } break;
+            case Commands::WATCH:
+                watch(iss);
+                break;
+            case Commands::SUB_ACCOUNT: {
+                std::string name;
+                if (!(iss >> name)) {
+                    client_ << "Invalid sub-account\n" << std::flush;
+                    break;
+                }
+                try {
+                    ledger_->get_or_create_sub_account(*user_, name);
+                    client_ << "OK\n" << std::flush;
+                } catch (const bank::hierarchy_error &e) {
+                    client_ << e.what() << '\n' << std::flush;
+                } catch (const bank::capacity_exceeded_error &e) {
+                    client_ << e.what() << '\n' << std::flush;
+                }
+            } break;
+            case Commands::ROLLUP:
+                client_ << user_->rollup_xts() << '\n' << std::flush;
+                break;
+            case Commands::GROUP:
+                group_statement();
+                break;
+            case Commands::GROUP_MONITOR:
+                group_monitor();
+                break;
+            case Commands::TRANSFER: {
+                std::string counterparty;
+                std::string comment;
+                int amount;  // NOLINT(cppcoreguidelines-init-variables)
+                iss >> counterparty >> amount;
+                std::getline(iss, comment);
+                transfer(counterparty, amount, comment);
+            } break;
+            case Commands::TRANSFER_IF: {
+                std::string condition;
+                // NOLINTNEXTLINE(cppcoreguidelines-init-variables)
+                long long expected;
+                std::string counterparty;
+                std::string comment;
+                int amount;  // NOLINT(cppcoreguidelines-init-variables)
+                iss >> condition >> expected >> counterparty >> amount;
+                std::getline(iss, comment);
+                transfer_if(
+                    condition, expected, counterparty, amount, comment
+                );
+            } break;
+            case Commands::NETTING: {
+                long long window_us = -1;
+                iss >> window_us;
+                if (window_us < 0) {
+                    client_ << "Invalid netting window\n" << std::flush;
+                    break;
+                }
+                try {
+                    user_->set_netting_window(
+                        std::chrono::microseconds(window_us)
+                    );
+                    client_ << "OK\n" << std::flush;
+                } catch (const bank::capacity_exceeded_error &e) {
+                    client_ << e.what() << '\n' << std::flush;
+                }
+            } break;
+            case Commands::SYNC: {
+                std::size_t known = 0;
+                std::string checksum_hex;
+                if (!(iss >> known)) {
+                    client_ << "Invalid sync\n" << std::flush;
+                    break;
+                }
+                std::optional<std::uint64_t> checksum;
+                if (iss >> checksum_hex) {
+                    try {
+                        checksum = std::stoull(checksum_hex, nullptr, 16);
+                    } catch (const std::logic_error &) {
+                        client_ << "Invalid sync\n" << std::flush;
+                        break;
+                    }
+                }
+                sync(known, checksum);
+            } break;
+            case Commands::ACTIVITY: {
+                const auto now = std::chrono::floor<std::chrono::seconds>(
+                    std::chrono::system_clock::now()
+                );
+                std::string from_text;
+                std::string to_text;
+                std::string scope;
+                iss >> from_text >> to_text >> scope;
+                const auto from = parse_time_bound(from_text, now);
+                const auto to = parse_time_bound(to_text, now);
+                if (!from || !to || (!scope.empty() && scope != "all")) {
+                    client_ << "Invalid activity\n" << std::flush;
+                    break;
+                }
+                const bank::activity_totals totals =
+                    scope.empty() ? user_->activity(*from, *to)
+                                  : ledger_->activity(*from, *to);
+                client_ << "ACTIVITY " << totals.from.time_since_epoch().count()
+                        << ' ' << totals.to.time_since_epoch().count()
+                        << " TRANSFERS " << totals.transfers << " IN "
+                        << totals.in_xts << " OUT " << totals.out_xts << '\n'
+                        << std::flush;
+            } break;
+            case Commands::AUDIT: {
+                tenant_->audit().update(*user_);
+                const bank::audit_head head = tenant_->audit().head(*user_);
+                client_ << "AUDIT " << head.records << ' '
+                        << bank::to_hex(head.digest) << '\n'
+                        << std::flush;
+            } break;
+            case Commands::AUDIT_VERIFY: {
+                const std::unique_lock verifying = tenant_->try_start_verify();
+                if (!verifying.owns_lock()) {
+                    client_ << "Audit verification already running\n"
+                            << std::flush;
+                    break;
+                }
+                // This command's thread and a few helpers, however many
+                // cores there are.
+                const bank::audit_report report = tenant_->audit().verify(
+                    ledger_->users(),
+                    std::clamp(
+                        std::thread::hardware_concurrency(), 1U,
+                        AUDIT_VERIFY_THREADS
+                    )
+                );
+                for (const auto &[name, segment] : report.mismatches) {
+                    client_ << "MISMATCH " << name << ' ' << segment << '\n';
+                }
+                client_ << "===== VERIFIED: " << report.records
+                        << " RECORDS, " << report.segments << " SEGMENTS, "
+                        << report.mismatches.size() << " MISMATCHES =====\n"
+                        << std::flush;
+            } break;
+            case Commands::METRICS:
+                client_ << "METRIC\tVALUE\n";
+                tenant_->print_metrics(client_);
+                state_.scheduler->print_metrics(client_);
+                if (state_.executor) {
+                    state_.executor->print_metrics(client_);
+                }
+                client_ << "===== END METRICS =====\n" << std::flush;
+                break;
+            case Commands::BAD_COMMAND:
+                client_ << "Unknown command: '" << cmd << "'\n"
+                        << std::flush;
+        }
+    }
+
+    // Logins are "<name>" or "<name>@<tenant>", see split_login().
+    bool login(const std::string &login_name) {
+        const auto [user_name, tenant_view] = bank::split_login(
+            login_name,
+            [&](std::string_view t) {
+                return state_.tenants.contains(std::string(t));
+            }
+        );
+        const std::string name(user_name);
+        const std::string tenant_name(tenant_view);
+        auto it = state_.tenants.find(tenant_name);
+        if (it == state_.tenants.end()) {
+            client_ << "Unknown tenant: '" << tenant_name << "'\n"
+                    << std::flush;
+            return false;
+        }
+        if (!it->second->try_open_session()) {
+            client_ << "Session limit reached\n" << std::flush;
+            return false;
         }
-        auto &to = ledger_.get_or_create_user(counterparty);
+        tenant_ = it->second.get();
+        ledger_ = &tenant_->get_ledger();
         try {
-            user_->transfer(to, amount, comment);
-            client_ << "OK\n" << std::flush;
-        } catch (bank::transfer_error &e) {
+            user_ = &ledger_->get_or_create_user(name);
+            shard_ = std::hash<std::string>{}(tenant_name + '@' + name);
+        } catch (const bank::capacity_exceeded_error &e) {
             client_ << e.what() << '\n' << std::flush;
+            tenant_->close_session();
+            return false;
         }
+        client_ << "Hi " << name << '\n' << std::flush;
+        return true;
     }
-};
 
-class server {
-public:
-    server(  // NOLINT(cppcoreguidelines-pro-type-member-init)
-        boost::asio::io_context &io_context,
-        unsigned short port
-    )
-        : acceptor_(io_context, tcp::endpoint(tcp::v4(), port)) {
+    // Busy-poll mode: the session takes a free CPU from --busy-poll, pins
+    // its thread there and from then on spins instead of sleeping, both on
+    // the socket and on the ledger. Sessions that find every CPU taken are
+    // served as usual.
+    void start_busy_poll() {
+#ifdef __linux__
+        std::size_t index = 0;
+        {
+            const std::unique_lock lock(state_.busy_poll_mutex);
+            while (index < state_.busy_poll_cpus.size() &&
+                   state_.busy_poll_taken[index]) {
+                index++;
+            }
+            if (index == state_.busy_poll_cpus.size()) {
+                return;
+            }
+            state_.busy_poll_taken[index] = true;
+        }
+        busy_poll_ = index;
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(state_.busy_poll_cpus[index], &cpus);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) !=
+            0) {
+            std::cerr << "Unable to pin a session to CPU "
+                      << state_.busy_poll_cpus[index] << '\n';
+        }
+        // Raising the budget above net.core.busy_read needs CAP_NET_ADMIN;
+        // without it the user-space spinning below still applies.
+        const int busy_poll_us = SOCKET_BUSY_POLL_US;
+        static_cast<void>(::setsockopt(
+            socket_stream_.socket().native_handle(), SOL_SOCKET, SO_BUSY_POLL,
+            &busy_poll_us, sizeof(busy_poll_us)
+        ));
+#endif
     }
 
-    void setup(  // NOLINT(readability-convert-member-functions-to-static)
-        const std::string &port_file
+    void stop_busy_poll() {
+        if (busy_poll_) {
+            const std::unique_lock lock(state_.busy_poll_mutex);
+            state_.busy_poll_taken[*busy_poll_] = false;
+            busy_poll_.reset();
+        }
+    }
+
+    // Spins until the next command can be read without blocking, or the
+    // connection is closed so that the read fails at once.
+    void poll_socket() {
+#ifndef _WIN32
+        if (!busy_poll_ || client_.rdbuf()->in_avail() > 0) {
+            return;
+        }
+        while (peek_socket() < 0) {
+            cpu_relax();
+        }
+#endif
+    }
+
+    // Looks at the socket without blocking: 1 if data is waiting, 0 if the
+    // connection is closed or failed, -1 if there is nothing yet. Logical
+    // sessions only tell whether they are closed.
+    int peek_socket() {
+        if (channel_ != nullptr) {
+            return channel_->closed() ? 0 : -1;
+        }
+#ifndef _WIN32
+        char c = 0;
+        const auto received = ::recv(
+            socket_stream_.socket().native_handle(), &c, 1,
+            MSG_PEEK | MSG_DONTWAIT
+        );
+        if (received > 0) {
+            return 1;
+        }
+        if (received == 0 ||
+            (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+            return 0;
+        }
+        return -1;
+#else
+        return -1;
+#endif
+    }
+
+    // wait_for_change() without sleeping.
+    std::uint64_t spin_for_change(
+        std::uint64_t known_version,
+        std::chrono::milliseconds timeout
     ) {
+        const auto deadline = std::chrono::steady_clock::now() + timeout;
+        for (int spins = 1; user_->version() == known_version; spins++) {
+            if (spins % BUSY_POLL_SPINS == 0 &&
+                std::chrono::steady_clock::now() >= deadline) {
+                break;
+            }
+            cpu_relax();
+        }
+        return user_->version();
+    }
+
+    // wait_next_transaction() without sleeping: spins on the lock-free
+    // version and takes the account lock only once it moves, or now and
+    // then to close an expired netting batch. Returns nothing once the
+    // client is gone, since a monitor never reads from the socket.
+    std::optional<bank::transaction>
+    spin_for_transaction(bank::user_transactions_iterator &it) {
+        while (true) {
+            const std::uint64_t seen = user_->version();
+            if (auto t = it.try_next_transaction()) {
+                return t;
+            }
+            for (int spins = 0;
+                 spins < BUSY_POLL_SPINS && user_->version() == seen;
+                 spins++) {
+                cpu_relax();
+            }
+            if (user_->version() == seen && peek_socket() == 0) {
+                return std::nullopt;
+            }
+        }
+    }
+
+    // Resolves the counterparty and applies the tenant's transfer rate limit.
+    // Replies to the client and returns nullptr if the transfer can't start.
+    user *start_transfer(const std::string &counterparty) {
+        if (!tenant_->try_start_transfer()) {
+            client_ << "Rate limit exceeded\n" << std::flush;
+            return nullptr;
+        }
         try {
-            std::ofstream f(port_file);
-            f << acceptor_.local_endpoint().port();
-        } catch (...) {
-            std::cerr << "Unable to store port to file " << port_file << '\n';
-            return;
+            bool hit = false;
+            user &u = counterparties_.resolve(*ledger_, counterparty, hit);
+            tenant_->count_counterparty_lookup(hit);
+            return &u;
+        } catch (const bank::capacity_exceeded_error &e) {
+            client_ << e.what() << '\n' << std::flush;
+            tenant_->count_transfer(false);
+            return nullptr;
         }
-    };
+    }
 
-    void run() {
-        std::cout << "Listening at " << acceptor_.local_endpoint() << '\n';
+    // Waits for the user's version to move past cond.known_version, in
+    // slices, so that a hot restart ends the wait early. Returns the version
+    // observed last.
+    std::uint64_t wait_for_change(const version_condition &cond) {
+        const auto deadline = std::chrono::steady_clock::now() + cond.timeout;
         while (true) {
-            tcp::socket socket = acceptor_.accept();  // NOLINT
-            std::thread([socket = std::move(socket), this]() mutable {
-                client_connection session(std::move(socket), ledger_);
-                session.run();
-            }).detach();
+            const auto left =
+                std::chrono::duration_cast<std::chrono::milliseconds>(
+                    deadline - std::chrono::steady_clock::now()
+                );
+            const auto slice = std::min(left, DRAIN_CHECK);
+            const std::uint64_t current =
+                busy_poll_ ? spin_for_change(cond.known_version, slice)
+                           : user_->wait_for_change(cond.known_version, slice);
+            if (current != cond.known_version || left <= DRAIN_CHECK ||
+                state_.draining) {
+                return current;
+            }
         }
     }
 
-private:
-    tcp::acceptor acceptor_;
-    ledger ledger_;
-};
-}  // namespace bank
+    // Resolves a version condition, replying on its own when the client's
+    // copy is still current. Returns true if the caller should answer.
+    bool is_modified(const version_condition &cond) {
+        std::uint64_t current = user_->version();
+        switch (cond.type) {
+            case version_condition::kind::NONE:
+                return true;
+            case version_condition::kind::INVALID:
+                client_ << "Invalid version condition\n" << std::flush;
+                return false;
+            case version_condition::kind::WAIT:
+                // Don't occupy an execution slot while long-polling, nor
+                // hold up a hot restart: the wait reads nothing a snapshot
+                // could tear.
+                if (slot_ != nullptr) {
+                    slot_->pause();
+                }
+                if (command_lock_ != nullptr) {
+                    command_lock_->unlock();
+                }
+                current = wait_for_change(cond);
+                if (command_lock_ != nullptr) {
+                    command_lock_->lock();
+                }
+                if (slot_ != nullptr) {
+                    slot_->resume();
+                }
+                [[fallthrough]];
+            case version_condition::kind::IF_CHANGED:
+                if (current == cond.known_version) {
+                    client_ << "NOT MODIFIED " << current << '\n'
+                            << std::flush;
+                    return false;
+                }
+        }
+        return true;
+    }
 
-int main(int argc, char *argv[]) {
-#ifdef _MSC_VER
-    _CrtSetReportMode(_CRT_ASSERT, _CRTDBG_MODE_FILE | _CRTDBG_MODE_DEBUG);
-    _CrtSetReportFile(_CRT_ASSERT, _CRTDBG_FILE_STDERR);
-    _CrtSetReportMode(_CRT_ERROR, _CRTDBG_MODE_FILE | _CRTDBG_MODE_DEBUG);
-    _CrtSetReportFile(_CRT_ERROR, _CRTDBG_FILE_STDERR);
-#endif
-    if (argc != 3) {
-        std::cerr << "You're lose, seems in PMI3";
-        return 1;
+    void balance(const version_condition &cond) {
+        if (cond.type == version_condition::kind::NONE) {
+            client_ << user_->balance_xts() << '\n' << std::flush;
+            return;
+        }
+        if (!is_modified(cond)) {
+            return;
+        }
+        const auto [balance, version] = user_->versioned_balance_xts();
+        client_ << balance << " VERSION " << version << '\n' << std::flush;
     }
-    // NOLINTBEGIN(cppcoreguidelines-pro-bounds-pointer-arithmetic)
-    const int port = std::stoi(argv[1]);
-    const std::string port_file = argv[2];
-    // NOLINTEND(cppcoreguidelines-pro-bounds-pointer-arithmetic)
-    boost::asio::io_context io_context;  // NOLINT
-    bank::server server(io_context, static_cast<unsigned short>(port));
-    server.setup(port_file);
+
+    // The first snapshot fixes a consistent end of history, balance and
+    // version. History is append-only, so the records before that end are
+    // then copied in chunks, each under a short lock, instead of writing to
+    // the socket under the lock.
+    void get_transactions(std::size_t n, bool with_version = false) {
+        std::size_t end = 0;
+        int balance = 0;
+        std::uint64_t version = 0;
+        user_->snapshot_transactions([&](const auto &transactions, int b) {
+            end = transactions.size();
+            balance = b;
+            version = user_->version();
+        });
+        client_ << "CPTY\tBAL\tCOMM\n";
+        send_records(end - std::min(n, end), end);
+        client_ << "===== BALANCE: " << balance << " XTS";
+        if (with_version) {
+            client_ << ", VERSION: " << version;
+        }
+        client_ << " =====\n" << std::flush;
+    }
+
+    // Writes history records [begin, end), which must exist, in chunks and
+    // sealed segments: into the reply being rendered, or straight to the
+    // client for a stream.
+    void send_records(std::size_t begin, std::size_t end) {
+        constexpr std::size_t SEGMENT = history_segments::SEGMENT_RECORDS;
+        const bool segments = state_.large_replies != history_send::STREAM;
+        const bool buffered = client_.rdbuf() == &reply_;
+        std::string chunk;
+        for (std::size_t from = begin, to = 0; from < end; from = to) {
+            // A worker must not block on the scheduler: the command holding
+            // the slot may be queued behind it. yield() is its preemption
+            // point instead.
+            const bool preempt =
+                slot_ != nullptr && !task_executor::on_worker();
+            history_segments::segment sealed;
+            if (segments && from % SEGMENT == 0 && from + SEGMENT <= end) {
+                to = from + SEGMENT;
+                sealed = tenant_->history().get(*user_, from / SEGMENT);
+            } else {
+                // Chunks stop at multiples of their size, so the first
+                // sealed segment in range starts right where one ends.
+                to = std::min(end, (from / HISTORY_CHUNK + 1) * HISTORY_CHUNK);
+                chunk.clear();
+                user_->snapshot_transactions([&](const auto &transactions,
+                                                 int) {
+                    for (std::size_t i = from; i < to; i++) {
+                        append_history_record(chunk, transactions[i]);
+                    }
+                });
+            }
+            if (sealed && buffered) {
+                reply_.append_segment(std::move(sealed));
+            } else if (sealed) {
+                send_segment(sealed);
+            } else {
+                client_ << chunk;
+            }
+            // Let waiting commands, interactive ones first, run between
+            // chunks of a long reply. On a worker they run inline, which
+            // is only safe while this command renders into memory.
+            if (preempt) {
+                slot_->pause();
+                slot_->resume();
+            }
+            if (buffered) {
+                task_executor::yield();
+            }
+        }
+    }
+
+    // Delta sync for client-side mirrors: the records after the first
+    // `known` ones, provided the client's copy of those matches ours.
+    void sync(std::size_t known, const std::optional<std::uint64_t> &checksum) {
+        std::size_t end = 0;
+        int balance = 0;
+        user_->snapshot_transactions([&](const auto &transactions, int b) {
+            end = transactions.size();
+            balance = b;
+        });
+        const std::optional<std::uint64_t> known_checksum =
+            user_->history_checksum(known);
+        if (!known_checksum || (checksum && *checksum != *known_checksum)) {
+            client_ << "RESYNC REQUIRED " << end << '\n' << std::flush;
+            return;
+        }
+        client_ << "SYNC " << known << ' ' << end << '\n';
+        send_records(known, end);
+        std::array<char, 17> hex{};
+        std::snprintf(
+            hex.data(), hex.size(), "%016llx",
+            static_cast<unsigned long long>(*user_->history_checksum(end))
+        );
+        client_ << "===== BALANCE: " << balance
+                << " XTS, CHECKSUM: " << hex.data() << " =====\n"
+                << std::flush;
+    }
+
+    // Writes a sealed segment to the socket straight from the shared text,
+    // bypassing the stream buffer. With MSG_ZEROCOPY the kernel sends from
+    // those pages as well, and reports when it is done with them. Logical
+    // sessions need every line framed, so they stream it.
+    void send_segment(const history_segments::segment &text) {
+        if (channel_ != nullptr) {
+            client_ << *text;
+            return;
+        }
+#ifdef __linux__
+        client_.flush();
+        if (!client_) {
+            return;
+        }
+        const int fd = socket_stream_.socket().native_handle();
+        bool zerocopy = state_.large_replies == history_send::ZEROCOPY &&
+                        enable_zerocopy();
+        for (std::size_t sent = 0; sent < text->size();) {
+            const ssize_t written = ::send(
+                fd, text->data() + sent, text->size() - sent,
+                MSG_NOSIGNAL | (zerocopy ? MSG_ZEROCOPY : 0)
+            );
+            if (written < 0 && errno == EINTR) {
+                continue;
+            }
+            if (written < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                // The stream keeps the socket non-blocking; wait like it
+                // would.
+                pollfd writable{fd, POLLOUT, 0};
+                ::poll(&writable, 1, -1);
+                continue;
+            }
+            if (written < 0 && errno == ENOBUFS && zerocopy) {
+                // No room to track more zero-copy sends: copy this one.
+                zerocopy = false;
+                continue;
+            }
+            if (written <= 0) {
+                client_.setstate(std::ios::badbit);
+                return;
+            }
+            sent += static_cast<std::size_t>(written);
+            if (zerocopy) {
+                zerocopy_pending_.emplace_back(zerocopy_sequence_++, text);
+            }
+            tenant_->count_history_send(zerocopy);
+        }
+        reap_zerocopy();
+#else
+        client_ << *text;
+#endif
+    }
+
+#ifdef __linux__
+    bool enable_zerocopy() {
+        if (!zerocopy_) {
+            const int one = 1;
+            zerocopy_ = ::setsockopt(
+                            socket_stream_.socket().native_handle(),
+                            SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)
+                        ) == 0;
+        }
+        return *zerocopy_;
+    }
+
+    // Takes completion notices off the socket error queue and drops the
+    // references to segments the kernel no longer reads. The cache keeps
+    // segments alive anyway; this bounds the queue and the bookkeeping.
+    void reap_zerocopy() {
+        const int fd = socket_stream_.socket().native_handle();
+        while (!zerocopy_pending_.empty()) {
+            alignas(cmsghdr) std::array<
+                char, CMSG_SPACE(sizeof(sock_extended_err) + 64)>
+                control{};
+            msghdr msg{};
+            msg.msg_control = control.data();
+            msg.msg_controllen = control.size();
+            if (::recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+                return;
+            }
+            for (cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr;
+                 cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+                if (!(cmsg->cmsg_level == SOL_IP &&
+                      cmsg->cmsg_type == IP_RECVERR) &&
+                    !(cmsg->cmsg_level == SOL_IPV6 &&
+                      cmsg->cmsg_type == IPV6_RECVERR)) {
+                    continue;
+                }
+                sock_extended_err err{};
+                std::memcpy(&err, CMSG_DATA(cmsg), sizeof(err));
+                if (err.ee_errno != 0 ||
+                    err.ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+                    continue;
+                }
+                // One notice covers the send calls [ee_info, ee_data].
+                const std::uint32_t first = err.ee_info;
+                const std::uint32_t count = err.ee_data - first + 1;
+                if ((err.ee_code & SO_EE_CODE_ZEROCOPY_COPIED) != 0) {
+                    tenant_->count_zerocopy_copied(count);
+                }
+                std::erase_if(zerocopy_pending_, [&](const auto &pending) {
+                    return pending.first - first < count;
+                });
+            }
+        }
+    }
+#endif
+
+    // The monitor's next transaction, or nothing once the client is gone.
+    std::optional<bank::transaction>
+    next_transaction(bank::user_transactions_iterator &it) {
+        if (busy_poll_) {
+            return spin_for_transaction(it);
+        }
+        if (channel_ == nullptr) {
+            return it.wait_next_transaction();
+        }
+        // A logical session may be closed without its connection.
+        while (!channel_->closed()) {
+            if (auto t = it.wait_next_transaction(WATCH_IDLE_CHECK)) {
+                return t;
+            }
+        }
+        return std::nullopt;
+    }
+
+    void monitor(std::size_t n) {
+        get_transactions(n);
+        auto it = user_->monitor();
+        while (true) {
+            const std::optional<bank::transaction> next = next_transaction(it);
+            if (!next) {
+                return;
+            }
+            const auto &cur_transaction = *next;
+            client_ << (cur_transaction.counterparty == nullptr
+                            ? "-"
+                            : cur_transaction.counterparty->name())
+                    << "\t" << cur_transaction.balance_delta_xts << "\t"
+                    << cur_transaction.comment << "\n"
+                    << std::flush;
+        }
+    }
+
+    // `watch below|above <limit> ...`: registers balance threshold watches
+    // and from then on, like monitor, only sends an ALERT line whenever the
+    // balance crosses one of them. Transfers just queue the alert; this
+    // thread writes it.
+    void watch(std::istringstream &iss) {
+        struct alert {
+            bank::threshold direction;
+            int limit_xts;
+            int balance_xts;
+        };
+        struct alert_queue {
+            std::mutex mutex;
+            std::condition_variable cv;
+            std::deque<alert> alerts;
+        };
+        std::vector<std::pair<bank::threshold, int>> limits;
+        std::string direction;
+        while (iss >> direction) {
+            int limit = 0;
+            if (!(iss >> limit) ||
+                (direction != "below" && direction != "above")) {
+                limits.clear();
+                break;
+            }
+            limits.emplace_back(
+                direction == "below" ? bank::threshold::BELOW
+                                     : bank::threshold::ABOVE,
+                limit
+            );
+        }
+        if (limits.empty()) {
+            client_ << "Invalid watch\n" << std::flush;
+            return;
+        }
+
+        // Shared with the callbacks, which may outlive this call by one run.
+        auto queue = std::make_shared<alert_queue>();
+        std::vector<std::uint64_t> ids;
+        for (const auto &[d, limit] : limits) {
+            ids.push_back(user_->watch_balance(
+                d, limit,
+                [queue, d = d, limit = limit](int balance_xts) {
+                    {
+                        const std::unique_lock lock(queue->mutex);
+                        queue->alerts.push_back({d, limit, balance_xts});
+                    }
+                    queue->cv.notify_one();
+                }
+            ));
+        }
+        client_ << "WATCHING BALANCE " << user_->balance_xts() << '\n'
+                << std::flush;
+
+        std::unique_lock lock(queue->mutex);
+        while (client_) {
+            if (queue->alerts.empty()) {
+                // Wake up now and then to notice a client that has left.
+                queue->cv.wait_for(lock, WATCH_IDLE_CHECK);
+                if (queue->alerts.empty() && peek_socket() == 0) {
+                    break;
+                }
+                continue;
+            }
+            const alert a = queue->alerts.front();
+            queue->alerts.pop_front();
+            lock.unlock();
+            client_ << "ALERT "
+                    << (a.direction == bank::threshold::BELOW ? "BELOW "
+                                                               : "ABOVE ")
+                    << a.limit_xts << " BALANCE " << a.balance_xts << '\n'
+                    << std::flush;
+            lock.lock();
+        }
+        lock.unlock();
+        for (const std::uint64_t id : ids) {
+            user_->unwatch_balance(id);
+        }
+    }
+
+    // Balances and rollups of the user and all its sub-accounts, depth
+    // first. Each line is read on its own, so concurrent transfers may show
+    // up in some lines and not others.
+    void group_statement() {
+        client_ << "ACCOUNT\tPARENT\tBAL\tROLLUP\n";
+        std::vector<const bank::user *> pending = {user_};
+        while (!pending.empty()) {
+            const bank::user *u = pending.back();
+            pending.pop_back();
+            client_ << u->name() << '\t'
+                    << (u->parent() == nullptr ? "-" : u->parent()->name())
+                    << '\t' << u->balance_xts() << '\t' << u->rollup_xts()
+                    << '\n';
+            const std::vector<const bank::user *> children = u->sub_accounts();
+            pending.insert(pending.end(), children.rbegin(), children.rend());
+        }
+        client_ << "===== ROLLUP: " << user_->rollup_xts() << " XTS =====\n"
+                << std::flush;
+    }
+
+    // Stream of every transfer leg of the user and its sub-accounts:
+    // "<account>\t<counterparty>\t<delta>\t<comment>", preceded by
+    // "DROPPED <n>" where the client fell too far behind.
+    void group_monitor() {
+        bank::group_monitor feed(*user_);
+        client_ << "MONITORING GROUP ROLLUP " << user_->rollup_xts() << '\n'
+                << std::flush;
+        while (client_) {
+            const std::optional<bank::group_event> event =
+                feed.wait_next_event(WATCH_IDLE_CHECK);
+            if (!event) {
+                // Notice a client that has left even when nothing happens.
+                if (peek_socket() == 0) {
+                    break;
+                }
+                continue;
+            }
+            if (event->dropped_before != 0) {
+                client_ << "DROPPED " << event->dropped_before << '\n';
+            }
+            client_ << event->account->name() << '\t'
+                    << (event->counterparty == nullptr
+                            ? "-"
+                            : event->counterparty->name())
+                    << '\t' << event->balance_delta_xts << '\t'
+                    << event->comment << '\n'
+                    << std::flush;
+        }
+    }
+
+    void transfer(
+        const std::string &counterparty,
+        int amount,
+        std::string &comment
+    ) {
+        if (!comment.empty() && comment[0] == ' ') {
+            comment = comment.substr(1);
+        }
+        user *to = start_transfer(counterparty);
+        if (to == nullptr) {
+            return;
+        }
+        try {
+            user_->transfer(*to, amount, comment);
+            tenant_->count_transfer(true);
+            client_ << "OK\n" << std::flush;
+        } catch (bank::transfer_error &e) {
+            tenant_->count_transfer(false);
+            client_ << e.what() << '\n' << std::flush;
+        }
+    }
+
+    // transfer-if version <v> <counterparty> <amount> <comment>
+    // transfer-if balance <xts> <counterparty> <amount> <comment>
+    void transfer_if(
+        const std::string &condition,
+        long long expected,
+        const std::string &counterparty,
+        int amount,
+        std::string &comment
+    ) {
+        if (!comment.empty() && comment[0] == ' ') {
+            comment = comment.substr(1);
+        }
+        if ((condition != "version" && condition != "balance") ||
+            expected < 0 ||
+            (condition == "balance" &&
+             expected > std::numeric_limits<int>::max())) {
+            client_ << "Invalid transfer condition: '" << condition << "'\n"
+                    << std::flush;
+            return;
+        }
+        user *to = start_transfer(counterparty);
+        if (to == nullptr) {
+            return;
+        }
+        try {
+            const std::uint64_t version =
+                condition == "version"
+                    ? user_->transfer_if_version(
+                          *to, amount, comment,
+                          static_cast<std::uint64_t>(expected)
+                      )
+                    : user_->transfer_if_balance(
+                          *to, amount, comment, static_cast<int>(expected)
+                      );
+            tenant_->count_transfer(true);
+            client_ << "OK VERSION " << version << '\n' << std::flush;
+        } catch (bank::transfer_error &e) {
+            tenant_->count_transfer(false);
+            client_ << e.what() << '\n' << std::flush;
+        }
+    }
+};
+
+// A connection to the HTTP/JSON gateway (--http). Input is read into one
+// buffer and requests are parsed in place; every complete request in it,
+// pipelined or not, is answered into one output buffer that is sent when
+// the input runs dry. Accounts are named in the path, tenants by the
+// X-Bank-Tenant header. Requests run like line-protocol commands: under
+// the QoS scheduler, on the worker pool if there is one, and counted in
+// the tenant's metrics.
+//
+//   GET  /users/<name>/balance
+//   POST /users/<name>/transfers        {"to", "amount", "comment",
+//                                        "if_version" or "if_balance"}
+//   POST /users/<name>/transfers/batch  {"transfers": [<transfer>, ...]}
+//   GET  /users/<name>/history?from=<record>&limit=<count>
+//   GET  /users/<name>/monitor          one JSON line per new transaction
+class http_connection {
+public:
+    http_connection(tcp::socket socket, server_state &state)
+        : socket_(std::move(socket)), state_(state) {
+    }
+
+    void run() {
+        boost::system::error_code ec;
+        const auto remote_ep = socket_.remote_endpoint(ec);
+        std::cout << "HTTP connected " << remote_ep << '\n';
+        serve();
+        for (tenant *t : sessions_) {
+            t->close_session();
+        }
+        std::cout << "HTTP disconnected " << remote_ep << '\n';
+    }
+
+private:
+    struct transfer_spec {
+        std::string to;
+        long long amount = 0;
+        std::string comment;
+        std::optional<long long> if_version;
+        std::optional<long long> if_balance;
+    };
+
+    struct route {
+        std::string_view action;
+        std::string_view method;
+        Commands type;
+        qos_class qos;
+    };
+    static constexpr std::array<route, 5> ROUTES = {
+        route{"balance", "GET", Commands::BALANCE, qos_class::INTERACTIVE},
+        route{"transfers", "POST", Commands::TRANSFER, qos_class::INTERACTIVE},
+        route{"transfers/batch", "POST", Commands::TRANSFER, qos_class::BULK},
+        route{"history", "GET", Commands::TRANSACTIONS, qos_class::BULK},
+        route{"monitor", "GET", Commands::MONITOR, qos_class::BULK}};
+
+    static constexpr std::size_t READ_CHUNK = 16 * 1024;
+    // Replies to a long pipeline are sent in parts of about this size.
+    static constexpr std::size_t FLUSH_BYTES = 256 * 1024;
+    static constexpr std::size_t MAX_BATCH = 1000;
+    static constexpr std::size_t DEFAULT_PAGE = 100;
+    static constexpr std::size_t MAX_PAGE = 1000;
+    // How often an idle monitor checks whether its client has left.
+    static constexpr std::chrono::seconds MONITOR_IDLE_CHECK{1};
+
+    tcp::socket socket_;
+    server_state &state_;
+    // Tenants the connection counts as a session in, like a line-protocol
+    // login: from its first request to each until it closes.
+    std::vector<tenant *> sessions_;
+    // Buffers reused from request to request.
+    std::string input_;
+    std::string output_;
+    std::string body_;
+    std::string name_;
+    std::vector<transfer_spec> batch_;
+    // Of the request being answered.
+    bool keep_alive_ = true;
+    int minor_version_ = 1;
+
+    void serve() {
+        std::size_t parsed = 0;
+        bool continued = false;
+        while (true) {
+            user *stream = nullptr;
+            bool close = false;
+            while (!close && stream == nullptr) {
+                http_request request;
+                std::size_t size = 0;
+                const http_parse_status status = parse_http_request(
+                    std::string_view(input_).substr(parsed), request, size
+                );
+                if (status == http_parse_status::INCOMPLETE) {
+                    if (request.expect_continue && !continued) {
+                        output_ += "HTTP/1.1 100 Continue\r\n\r\n";
+                        continued = true;
+                    }
+                    break;
+                }
+                if (status != http_parse_status::COMPLETE) {
+                    keep_alive_ = false;
+                    minor_version_ = 1;
+                    if (status == http_parse_status::TOO_LARGE) {
+                        error(413, "Request too large");
+                    } else {
+                        error(400, "Malformed request");
+                    }
+                    close = true;
+                    break;
+                }
+                parsed += size;
+                continued = false;
+                keep_alive_ = request.keep_alive;
+                minor_version_ = request.minor_version;
+                stream = handle(request);
+                close = !keep_alive_;
+                if (output_.size() >= FLUSH_BYTES && !flush()) {
+                    return;
+                }
+            }
+            if (!flush()) {
+                return;
+            }
+            if (stream != nullptr) {
+                monitor(*stream);
+                return;
+            }
+            if (close) {
+                return;
+            }
+            input_.erase(0, parsed);
+            parsed = 0;
+            const std::size_t old_size = input_.size();
+            input_.resize(old_size + READ_CHUNK);
+            boost::system::error_code ec;
+            const std::size_t n = socket_.read_some(
+                boost::asio::buffer(input_.data() + old_size, READ_CHUNK), ec
+            );
+            input_.resize(old_size + n);
+            if (ec) {
+                return;
+            }
+        }
+    }
+
+    bool flush() {
+        boost::system::error_code ec;
+        boost::asio::write(socket_, boost::asio::buffer(output_), ec);
+        output_.clear();
+        return !ec;
+    }
+
+    // Looks at the socket without blocking: false once the client has
+    // closed or reset the connection. Requests it sends meanwhile are left
+    // unread.
+    bool client_connected() {
+#ifndef _WIN32
+        char c = 0;
+        const auto received = ::recv(
+            socket_.native_handle(), &c, 1, MSG_PEEK | MSG_DONTWAIT
+        );
+        return received > 0 ||
+               (received < 0 &&
+                (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR));
+#else
+        return true;
+#endif
+    }
+
+    // Answers a request into output_. Returns the account to stream to if
+    // it is a monitor, which the caller starts once the replies before it
+    // are sent.
+    user *handle(const http_request &request) {
+        constexpr std::string_view PREFIX = "/users/";
+        if (request.path.substr(0, PREFIX.size()) != PREFIX) {
+            error(404, "Not found");
+            return nullptr;
+        }
+        const std::string_view rest = request.path.substr(PREFIX.size());
+        const std::size_t slash = rest.find('/');
+        if (slash == std::string_view::npos) {
+            error(404, "Not found");
+            return nullptr;
+        }
+        const std::string_view action = rest.substr(slash + 1);
+        const auto r = std::find_if(
+            ROUTES.begin(), ROUTES.end(),
+            [&](const route &x) { return x.action == action; }
+        );
+        if (r == ROUTES.end()) {
+            error(404, "Not found");
+            return nullptr;
+        }
+        if (request.method != r->method) {
+            error(405, "Method not allowed");
+            return nullptr;
+        }
+        if (!percent_decode(rest.substr(0, slash), name_) || name_.empty()) {
+            error(400, "Invalid account name");
+            return nullptr;
+        }
+        const std::string tenant_name(request.header("X-Bank-Tenant"));
+        const auto it = state_.tenants.find(tenant_name);
+        if (it == state_.tenants.end()) {
+            error(404, "Unknown tenant");
+            return nullptr;
+        }
+        tenant &t = *it->second;
+        if (!open_session(t)) {
+            error(429, "Session limit reached");
+            return nullptr;
+        }
+        user *u = nullptr;
+        try {
+            u = &t.get_ledger().get_or_create_user(name_);
+        } catch (const bank::capacity_exceeded_error &e) {
+            error(503, e.what());
+            return nullptr;
+        }
+        t.count_command();
+        if (r->type == Commands::MONITOR) {
+            return u;
+        }
+        execute(t, tenant_name, r->type, r->qos, [&] {
+            if (r->type == Commands::BALANCE) {
+                balance(*u);
+            } else if (r->type == Commands::TRANSACTIONS) {
+                history(*u, request.query);
+            } else if (r->qos == qos_class::BULK) {
+                transfer_batch(t, *u, request.body);
+            } else {
+                transfer(t, *u, request.body);
+            }
+        });
+        return nullptr;
+    }
+
+    // Takes one of the tenant's sessions unless the connection has one.
+    bool open_session(tenant &t) {
+        if (std::find(sessions_.begin(), sessions_.end(), &t) !=
+            sessions_.end()) {
+            return true;
+        }
+        if (!t.try_open_session()) {
+            return false;
+        }
+        sessions_.push_back(&t);
+        return true;
+    }
+
+    template <typename F>
+    void execute(
+        tenant &t,
+        const std::string &tenant_name,
+        Commands type,
+        qos_class qos,
+        F &&f
+    ) {
+        const std::shared_lock command_lock(state_.commands_mutex);
+        command_scheduler::slot slot(*state_.scheduler, qos);
+        auto run = [&] {
+            if (!state_.instrument) {
+                f();
+                return;
+            }
+            const cost_meter meter;
+            f();
+            t.count_command_cost(type, meter.cost());
+        };
+        if (state_.executor) {
+            // The same worker as the account's line-protocol commands.
+            state_.executor->run(
+                run, std::hash<std::string>{}(tenant_name + '@' + name_)
+            );
+        } else {
+            run();
+        }
+    }
+
+    static std::string_view status_line(int status) {
+        switch (status) {
+            case 200:
+                return "200 OK";
+            case 400:
+                return "400 Bad Request";
+            case 404:
+                return "404 Not Found";
+            case 405:
+                return "405 Method Not Allowed";
+            case 409:
+                return "409 Conflict";
+            case 412:
+                return "412 Precondition Failed";
+            case 413:
+                return "413 Content Too Large";
+            case 429:
+                return "429 Too Many Requests";
+            case 503:
+                return "503 Service Unavailable";
+            default:
+                return "500 Internal Server Error";
+        }
+    }
+
+    // Appends a response with body_ as its body.
+    void respond(int status) {
+        output_ += "HTTP/1.1 ";
+        output_ += status_line(status);
+        output_ += "\r\nContent-Type: application/json\r\nContent-Length: ";
+        std::array<char, 24> digits{};
+        const auto length = std::to_chars(
+            digits.data(), digits.data() + digits.size(), body_.size()
+        );
+        output_.append(digits.data(), length.ptr);
+        if (!keep_alive_) {
+            output_ += "\r\nConnection: close";
+        } else if (minor_version_ == 0) {
+            output_ += "\r\nConnection: keep-alive";
+        }
+        output_ += "\r\n\r\n";
+        output_ += body_;
+    }
+
+    void error(int status, std::string_view message) {
+        body_.clear();
+        json_writer(body_)
+            .begin_object()
+            .key("error")
+            .string(message)
+            .end_object();
+        respond(status);
+    }
+
+    void balance(const user &u) {
+        const auto [balance, version] = u.versioned_balance_xts();
+        body_.clear();
+        json_writer(body_)
+            .begin_object()
+            .key("user")
+            .string(name_)
+            .key("balance")
+            .number(balance)
+            .key("version")
+            .number(static_cast<long long>(version))
+            .end_object();
+        respond(200);
+    }
+
+    // A page of history records, [from, from + limit), with the balance and
+    // version they end at. "next" is where the following page starts.
+    void history(const user &u, std::string_view query) {
+        auto parameter = [&](std::string_view name, std::size_t fallback) {
+            const auto text = query_parameter(query, name);
+            if (!text) {
+                return std::optional(fallback);
+            }
+            const char *last = text->data() + text->size();
+            std::size_t value = 0;
+            const auto [end, ec] = std::from_chars(text->data(), last, value);
+            if (text->empty() || ec != std::errc{} || end != last) {
+                return std::optional<std::size_t>();
+            }
+            return std::optional(value);
+        };
+        const auto from = parameter("from", 0);
+        const auto limit = parameter("limit", DEFAULT_PAGE);
+        if (!from || !limit) {
+            error(400, "Invalid page");
+            return;
+        }
+        body_.clear();
+        json_writer w(body_);
+        // A page is at most MAX_PAGE records, so it is encoded under the
+        // account lock in one go.
+        u.snapshot_transactions([&](const auto &transactions, int balance) {
+            const std::size_t total = transactions.size();
+            const std::size_t begin = std::min(*from, total);
+            const std::size_t end =
+                begin + std::min({*limit, MAX_PAGE, total - begin});
+            w.begin_object()
+                .key("user")
+                .string(name_)
+                .key("balance")
+                .number(balance)
+                .key("version")
+                .number(static_cast<long long>(u.version()))
+                .key("total")
+                .number(static_cast<long long>(total))
+                .key("records")
+                .begin_array();
+            for (std::size_t i = begin; i < end; i++) {
+                const bank::transaction &t = transactions[i];
+                w.begin_object()
+                    .key("seq")
+                    .number(static_cast<long long>(i))
+                    .key("counterparty");
+                if (t.counterparty == nullptr) {
+                    w.null();
+                } else {
+                    w.string(t.counterparty->name());
+                }
+                w.key("delta")
+                    .number(t.balance_delta_xts)
+                    .key("comment")
+                    .string(t.comment)
+                    .end_object();
+            }
+            w.end_array().key("next");
+            if (end < total) {
+                w.number(static_cast<long long>(end));
+            } else {
+                w.null();
+            }
+            w.end_object();
+        });
+        respond(200);
+    }
+
+    static void read_transfer(json_reader &j, transfer_spec &spec) {
+        bool has_to = false;
+        bool has_amount = false;
+        spec.comment.clear();
+        spec.if_version.reset();
+        spec.if_balance.reset();
+        j.object([&](std::string_view key) {
+            if (key == "to") {
+                spec.to = j.string();
+                has_to = true;
+            } else if (key == "amount") {
+                spec.amount = j.integer();
+                has_amount = true;
+            } else if (key == "comment") {
+                spec.comment = j.string();
+            } else if (key == "if_version") {
+                spec.if_version = j.integer();
+            } else if (key == "if_balance") {
+                spec.if_balance = j.integer();
+            } else {
+                j.skip();
+            }
+        });
+        if (!has_to || !has_amount) {
+            throw json_error("A transfer needs \"to\" and \"amount\"");
+        }
+    }
+
+    // Runs one transfer and writes its result object. Returns the HTTP
+    // status it corresponds to.
+    static int run_transfer(
+        tenant &t,
+        user &from,
+        const transfer_spec &s,
+        json_writer &w
+    ) {
+        auto fail = [&](int status, std::string_view message) {
+            w.begin_object()
+                .key("ok")
+                .boolean(false)
+                .key("status")
+                .number(status)
+                .key("error")
+                .string(message)
+                .end_object();
+            return status;
+        };
+        constexpr long long INT_LOWEST = std::numeric_limits<int>::min();
+        constexpr long long INT_HIGHEST = std::numeric_limits<int>::max();
+        if (s.amount < INT_LOWEST || s.amount > INT_HIGHEST ||
+            (s.if_version && *s.if_version < 0) ||
+            (s.if_balance &&
+             (*s.if_balance < 0 || *s.if_balance > INT_HIGHEST))) {
+            return fail(400, "Value out of range");
+        }
+        if (!t.try_start_transfer()) {
+            return fail(429, "Rate limit exceeded");
+        }
+        const int amount = static_cast<int>(s.amount);
+        try {
+            user &to = t.get_ledger().get_or_create_user(s.to);
+            std::optional<std::uint64_t> version;
+            if (s.if_version) {
+                version = from.transfer_if_version(
+                    to, amount, s.comment,
+                    static_cast<std::uint64_t>(*s.if_version)
+                );
+            } else if (s.if_balance) {
+                version = from.transfer_if_balance(
+                    to, amount, s.comment, static_cast<int>(*s.if_balance)
+                );
+            } else {
+                from.transfer(to, amount, s.comment);
+            }
+            t.count_transfer(true);
+            w.begin_object().key("ok").boolean(true);
+            if (version) {
+                w.key("version").number(static_cast<long long>(*version));
+            }
+            w.end_object();
+            return 200;
+        } catch (const bank::precondition_failed_error &e) {
+            t.count_transfer(false);
+            return fail(412, e.what());
+        } catch (const bank::not_enough_funds_error &e) {
+            t.count_transfer(false);
+            return fail(409, e.what());
+        } catch (const bank::capacity_exceeded_error &e) {
+            t.count_transfer(false);
+            return fail(503, e.what());
+        } catch (const bank::transfer_error &e) {
+            t.count_transfer(false);
+            return fail(400, e.what());
+        }
+    }
+
+    void transfer(tenant &t, user &from, std::string_view body) {
+        batch_.resize(1);
+        try {
+            json_reader j(body);
+            read_transfer(j, batch_[0]);
+            j.end();
+        } catch (const json_error &e) {
+            error(400, e.what());
+            return;
+        }
+        body_.clear();
+        json_writer w(body_);
+        respond(run_transfer(t, from, batch_[0], w));
+    }
+
+    // Transfers run one by one, each on its own: a failed one doesn't stop
+    // or undo the others. The body is parsed in full first, so that a
+    // malformed one runs none.
+    void transfer_batch(tenant &t, user &from, std::string_view body) {
+        std::size_t count = 0;
+        try {
+            json_reader j(body);
+            j.object([&](std::string_view key) {
+                if (key != "transfers") {
+                    j.skip();
+                    return;
+                }
+                j.array([&] {
+                    if (count == MAX_BATCH) {
+                        throw json_error(
+                            "At most " + std::to_string(MAX_BATCH) +
+                            " transfers per batch"
+                        );
+                    }
+                    if (batch_.size() == count) {
+                        batch_.emplace_back();
+                    }
+                    read_transfer(j, batch_[count++]);
+                });
+            });
+            j.end();
+        } catch (const json_error &e) {
+            error(400, e.what());
+            return;
+        }
+        body_.clear();
+        json_writer w(body_);
+        w.begin_object().key("results").begin_array();
+        for (std::size_t i = 0; i < count; i++) {
+            run_transfer(t, from, batch_[i], w);
+        }
+        w.end_array().end_object();
+        respond(200);
+    }
+
+    // Sends the account's new transactions until the client goes away:
+    // chunked, or for HTTP/1.0 until the connection closes.
+    void monitor(const user &u) {
+        const bool chunked = minor_version_ == 1;
+        output_ += "HTTP/1.1 200 OK\r\nContent-Type: application/x-ndjson\r\n";
+        output_ += chunked ? "Transfer-Encoding: chunked\r\n\r\n"
+                           : "Connection: close\r\n\r\n";
+        if (!flush()) {
+            return;
+        }
+        auto it = u.monitor();
+        while (true) {
+            const std::optional<bank::transaction> next =
+                it.wait_next_transaction(MONITOR_IDLE_CHECK);
+            if (!next) {
+                if (!client_connected()) {
+                    return;
+                }
+                continue;
+            }
+            const bank::transaction &t = *next;
+            body_.clear();
+            json_writer w(body_);
+            w.begin_object().key("counterparty");
+            if (t.counterparty == nullptr) {
+                w.null();
+            } else {
+                w.string(t.counterparty->name());
+            }
+            w.key("delta")
+                .number(t.balance_delta_xts)
+                .key("comment")
+                .string(t.comment)
+                .end_object();
+            body_ += '\n';
+            if (chunked) {
+                std::array<char, 16> digits{};
+                const auto size = std::to_chars(
+                    digits.data(), digits.data() + digits.size(), body_.size(),
+                    16
+                );
+                output_.append(digits.data(), size.ptr);
+                output_ += "\r\n";
+                output_ += body_;
+                output_ += "\r\n";
+            } else {
+                output_ += body_;
+            }
+            if (!flush()) {
+                return;
+            }
+        }
+    }
+};
+
+struct server_options {
+    unsigned short port = 0;
+    std::string port_file;
+    std::vector<std::pair<std::string, tenant_quota>> tenants;
+    // Hot restart: accept takeover requests on this Unix socket, and/or take
+    // over the listening socket and state of the process serving it.
+    std::string control_path;
+    std::string takeover_path;
+    // Startup tuning applied to every tenant's ledger before listening.
+    std::size_t expect_users = 0;
+    std::size_t expect_history = 0;
+    bool prefault = false;
+    // Fixed-capacity mode, see ledger::set_fixed_capacity(); off if zero.
+    std::size_t fixed_users = 0;
+    std::size_t fixed_history = 0;
+    bool instrument = false;
+    // Commands executing at once, zero to disable QoS scheduling, and the
+    // interactive, bulk and admin weights.
+    unsigned qos_slots = std::max(std::thread::hardware_concurrency(), 1U);
+    std::array<unsigned, QOS_CLASS_COUNT> qos_weights = {16, 1, 4};
+    // Commands run on this many pooled workers; zero runs them on the
+    // session threads.
+    unsigned workers = 0;
+    task_executor::mode executor_mode = task_executor::mode::STEALING;
+    // CPUs given to busy-polling sessions; empty to never busy-poll.
+    std::vector<int> busy_poll_cpus;
+    history_send large_replies = history_send::SEGMENTS;
+    // How often the audit chains of all accounts are extended in the
+    // background; zero leaves it to the `audit` command.
+    std::chrono::milliseconds audit_interval{0};
+    // HTTP/JSON gateway port and port file; not served if the file is empty.
+    unsigned short http_port = 0;
+    std::string http_port_file;
+};
+
+#ifndef _WIN32
+// Sends `message` and, unless fd is -1, a file descriptor over a Unix socket.
+static void send_with_fd(int sock, const std::string &message, int fd) {
+    iovec iov{const_cast<char *>(message.data()), message.size()};
+    msghdr msg{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    alignas(cmsghdr) std::array<char, CMSG_SPACE(sizeof(int))> control{};
+    if (fd != -1) {
+        msg.msg_control = control.data();
+        msg.msg_controllen = control.size();
+        cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        std::memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+    if (::sendmsg(sock, &msg, MSG_NOSIGNAL) < 0) {
+        throw std::system_error(errno, std::generic_category(), "sendmsg");
+    }
+}
+
+// Returns the received file descriptor or -1 if none was attached.
+static int receive_with_fd(int sock, std::string &message) {
+    std::array<char, 512> buffer{};
+    iovec iov{buffer.data(), buffer.size()};
+    msghdr msg{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    alignas(cmsghdr) std::array<char, CMSG_SPACE(sizeof(int))> control{};
+    msg.msg_control = control.data();
+    msg.msg_controllen = control.size();
+    const ssize_t received = ::recvmsg(sock, &msg, 0);
+    if (received < 0) {
+        throw std::system_error(errno, std::generic_category(), "recvmsg");
+    }
+    message.assign(buffer.data(), static_cast<std::size_t>(received));
+    int fd = -1;
+    for (cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr;
+         cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            std::memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+        }
+    }
+    return fd;
+}
+
+static sockaddr_un unix_address(const std::string &path) {
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path)) {
+        throw std::invalid_argument("Control socket path is too long");
+    }
+    std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+    return address;
+}
+
+// Where the process listening at control_path writes its snapshot for a
+// takeover. Derived from the control path, which only the operator sets,
+// rather than taken from the request.
+static std::string takeover_snapshot_path(const std::string &control_path) {
+    return control_path + ".snapshot";
+}
+
+// Asks the process listening at control_path to hand over. It stops
+// accepting, writes a snapshot to takeover_snapshot_path() and sends back
+// the listening socket.
+static int request_takeover(const std::string &control_path) {
+    const int sock = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    const sockaddr_un address = unix_address(control_path);
+    // NOLINTNEXTLINE(cppcoreguidelines-pro-type-reinterpret-cast)
+    if (::connect(sock, reinterpret_cast<const sockaddr *>(&address),
+                  sizeof(address)) < 0) {
+        const int error = errno;
+        ::close(sock);
+        throw std::system_error(error, std::generic_category(), "connect");
+    }
+    send_with_fd(sock, "TAKEOVER\n", -1);
+    std::string reply;
+    const int fd = receive_with_fd(sock, reply);
+    ::close(sock);
+    if (fd == -1) {
+        throw std::runtime_error("Takeover refused: " + reply);
+    }
+    return fd;
+}
+#endif
+
+class server {
+public:
+    server(  // NOLINT(cppcoreguidelines-pro-type-member-init)
+        boost::asio::io_context &io_context,
+        const server_options &options
+    )
+        : acceptor_(io_context), http_acceptor_(io_context) {
+        state_.instrument = options.instrument;
+        count_allocations(options.instrument);
+        state_.large_replies = options.large_replies;
+        state_.scheduler = std::make_unique<command_scheduler>(
+            options.qos_slots, options.qos_weights
+        );
+        if (options.workers > 0) {
+            state_.executor = std::make_unique<task_executor>(
+                options.workers, options.executor_mode
+            );
+        }
+        state_.busy_poll_cpus = options.busy_poll_cpus;
+        state_.busy_poll_taken.assign(options.busy_poll_cpus.size(), false);
+        for (const auto &[name, quota] : options.tenants) {
+            state_.tenants.emplace(name, std::make_unique<tenant>(name, quota));
+        }
+        if (state_.tenants.empty()) {
+            state_.tenants.emplace(
+                "", std::make_unique<tenant>("", tenant_quota{})
+            );
+        }
+        warm_up(options);
+#ifndef _WIN32
+        if (!options.takeover_path.empty()) {
+            take_over(options.takeover_path);
+        } else {
+            open_acceptors(options);
+        }
+#else
+        open_acceptors(options);
+#endif
+        // Last, so that a constructor that throws has no thread to stop.
+        if (options.audit_interval.count() > 0) {
+            start_auditor(options.audit_interval);
+        }
+    }
+
+    server(const server &) = delete;
+    server(server &&) = delete;
+    server &operator=(const server &) = delete;
+    server &operator=(server &&) = delete;
+
+    ~server() {
+        {
+            const std::unique_lock lock(auditor_mutex_);
+            auditor_stopping_ = true;
+        }
+        auditor_cv_.notify_all();
+        if (auditor_.joinable()) {
+            auditor_.join();
+        }
+    }
+
+    void setup(  // NOLINT(readability-convert-member-functions-to-static)
+        const std::string &port_file
+    ) {
+        try {
+            std::ofstream f(port_file);
+            f << acceptor_.local_endpoint().port();
+        } catch (...) {
+            std::cerr << "Unable to store port to file " << port_file << '\n';
+            return;
+        }
+    };
+
+#ifndef _WIN32
+    // Serves takeover requests from a newer process in the background.
+    void listen_for_takeover(const std::string &control_path) {
+        ::unlink(control_path.c_str());
+        snapshot_path_ = takeover_snapshot_path(control_path);
+        control_fd_ = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        const sockaddr_un address = unix_address(control_path);
+        // NOLINTNEXTLINE(cppcoreguidelines-pro-type-reinterpret-cast)
+        if (::bind(control_fd_, reinterpret_cast<const sockaddr *>(&address),
+                   sizeof(address)) < 0 ||
+            ::listen(control_fd_, 1) < 0) {
+            throw std::system_error(
+                errno, std::generic_category(), "control socket"
+            );
+        }
+        if (::pipe(wakeup_pipe_.data()) < 0) {
+            throw std::system_error(errno, std::generic_category(), "pipe");
+        }
+        std::thread([this]() {
+            while (true) {
+                const int client = ::accept(control_fd_, nullptr, nullptr);
+                if (client >= 0 && hand_off(client)) {
+                    return;
+                }
+            }
+        }).detach();
+    }
+#endif
+
+    void run() {
+        std::cout << "Listening at " << acceptor_.local_endpoint() << '\n';
+        if (http_acceptor_.is_open()) {
+            std::cout << "HTTP listening at " << http_acceptor_.local_endpoint()
+                      << '\n';
+            std::thread([this]() {
+                while (true) {
+                    serve_next(http_acceptor_, [this](tcp::socket socket) {
+                        http_connection connection(std::move(socket), state_);
+                        connection.run();
+                    });
+                }
+            }).detach();
+        }
+        while (wait_for_connection()) {
+            serve_next(acceptor_, [this](tcp::socket socket) {
+                client_connection session(std::move(socket), state_);
+                session.run();
+            });
+        }
+    }
+
+private:
+    static constexpr std::chrono::milliseconds ACCEPT_RETRY_DELAY{100};
+
+    tcp::acceptor acceptor_;
+    tcp::acceptor http_acceptor_;
+    server_state state_;
+    int control_fd_ = -1;
+    std::string snapshot_path_;
+    std::array<int, 2> wakeup_pipe_{-1, -1};
+    std::mutex handoff_mutex_;
+    std::condition_variable handoff_cv_;
+    bool accepting_stopped_ = false;
+    bool handoff_done_ = false;
+    std::thread auditor_;
+    std::mutex auditor_mutex_;
+    std::condition_variable auditor_cv_;
+    bool auditor_stopping_ = false;
+
+    // Accepts a connection and serves it on a thread of its own. Failures,
+    // such as running out of file descriptors, are logged and followed by a
+    // short pause, as the condition usually persists for a while.
+    template <typename Serve>
+    static void serve_next(tcp::acceptor &acceptor, const Serve &serve) {
+        try {
+            tcp::socket socket = acceptor.accept();  // NOLINT
+            // Replies and monitor lines are small writes; don't let Nagle
+            // hold them back waiting for a delayed ACK.
+            socket.set_option(tcp::no_delay(true));
+            std::thread([socket = std::move(socket), serve]() mutable {
+                serve(std::move(socket));
+            }).detach();
+        } catch (const std::exception &e) {
+            std::cerr << "Unable to accept a connection: " << e.what()
+                      << '\n';
+            std::this_thread::sleep_for(ACCEPT_RETRY_DELAY);
+        }
+    }
+
+    // Fresh listening sockets, when not taking over those of a running
+    // server.
+    void open_acceptors(const server_options &options) {
+        const tcp::endpoint endpoint(tcp::v4(), options.port);
+        acceptor_.open(endpoint.protocol());
+        acceptor_.set_option(tcp::acceptor::reuse_address(true));
+        acceptor_.bind(endpoint);
+        acceptor_.listen();
+        if (!options.http_port_file.empty()) {
+            const tcp::endpoint http_endpoint(tcp::v4(), options.http_port);
+            http_acceptor_.open(http_endpoint.protocol());
+            http_acceptor_.set_option(tcp::acceptor::reuse_address(true));
+            http_acceptor_.bind(http_endpoint);
+            http_acceptor_.listen();
+            std::ofstream f(options.http_port_file);
+            f << http_acceptor_.local_endpoint().port();
+        }
+    }
+
+    // Reserves and pre-faults ledgers so that the first minutes of traffic
+    // don't pay for table growth and first-touch page faults.
+    void warm_up(const server_options &options) {
+        if (options.expect_users == 0 && options.expect_history == 0 &&
+            options.fixed_users == 0 && !options.prefault) {
+            return;
+        }
+        const auto start = std::chrono::steady_clock::now();
+        std::size_t bytes = 0;
+        std::size_t per_user = 0;
+        for (auto &[name, t] : state_.tenants) {
+            if (options.fixed_users != 0) {
+                t->get_ledger().set_fixed_capacity(
+                    options.fixed_users, options.fixed_history
+                );
+            } else {
+                t->get_ledger().reserve(
+                    options.expect_users, options.expect_history
+                );
+            }
+            per_user = t->get_ledger().reserved_bytes_per_user();
+            if (options.prefault) {
+                bytes += t->get_ledger().prefault(
+                    std::thread::hardware_concurrency()
+                );
+            }
+        }
+        std::cout << "Warmed up in "
+                  << std::chrono::duration<double, std::milli>(
+                         std::chrono::steady_clock::now() - start
+                     )
+                         .count()
+                  << " ms, pre-faulted " << bytes / (1024 * 1024)
+                  << " MiB, reserving " << per_user / 1024
+                  << " KiB per new account, ready\n"
+                  << std::flush;
+    }
+
+    // Keeps every account's audit chain current, so that hashing stays off
+    // the transfer path and an `audit` only hashes the last few records.
+    // Runs until the server is destroyed.
+    void start_auditor(std::chrono::milliseconds interval) {
+        auditor_ = std::thread([this, interval]() {
+            std::unique_lock lock(auditor_mutex_);
+            while (!auditor_cv_.wait_for(lock, interval, [this] {
+                return auditor_stopping_;
+            })) {
+                lock.unlock();
+                for (auto &[name, t] : state_.tenants) {
+                    for (const user *u : t->get_ledger().users()) {
+                        t->audit().update(*u);
+                    }
+                }
+                lock.lock();
+            }
+        });
+    }
+
+    // Waits for a connection to accept. Returns false once the server has
+    // been handed over.
+    bool wait_for_connection() {
+#ifndef _WIN32
+        while (control_fd_ != -1) {
+            std::array<pollfd, 2> fds{
+                pollfd{acceptor_.native_handle(), POLLIN, 0},
+                pollfd{wakeup_pipe_[0], POLLIN, 0}};
+            while (::poll(fds.data(), fds.size(), -1) < 0 && errno == EINTR) {
+            }
+            if ((fds[1].revents & POLLIN) != 0) {
+                std::array<char, 16> wakeups{};
+                static_cast<void>(
+                    ::read(wakeup_pipe_[0], wakeups.data(), wakeups.size())
+                );
+            }
+            if (state_.draining) {
+                // Stop accepting until the handoff completes or fails.
+                std::unique_lock lock(handoff_mutex_);
+                accepting_stopped_ = true;
+                handoff_cv_.notify_all();
+                handoff_cv_.wait(lock, [this] {
+                    return handoff_done_ || !accepting_stopped_;
+                });
+                if (handoff_done_) {
+                    return false;
+                }
+            } else if ((fds[0].revents & POLLIN) != 0) {
+                return true;
+            }
+        }
+#endif
+        return true;
+    }
+
+#ifndef _WIN32
+    // Old process side of a hot restart. Returns true if handed over; a
+    // failed handoff is rolled back and the server goes on serving.
+    bool hand_off(int client) {
+        const auto start = std::chrono::steady_clock::now();
+        std::string request;
+        try {
+            receive_with_fd(client, request);
+        } catch (const std::system_error &) {
+            ::close(client);
+            return false;
+        }
+        if (request != "TAKEOVER\n") {
+            reply_to_takeover(client, "ERROR bad request\n");
+            ::close(client);
+            return false;
+        }
+
+        // Stop accepting, then wait for in-flight commands to finish.
+        state_.draining = true;
+        static_cast<void>(::write(wakeup_pipe_[1], "x", 1));
+        {
+            std::unique_lock lock(handoff_mutex_);
+            handoff_cv_.wait(lock, [this] { return accepting_stopped_; });
+        }
+        std::unique_lock freeze(state_.commands_mutex);
+        try {
+            save_snapshot(snapshot_path_);
+            send_with_fd(client, "READY\n", acceptor_.native_handle());
+        } catch (const std::exception &e) {
+            std::cerr << "Handoff failed, serving on: " << e.what() << '\n';
+            reply_to_takeover(client, std::string("ERROR ") + e.what() + "\n");
+            ::close(client);
+            ::unlink(snapshot_path_.c_str());
+            ::unlink((snapshot_path_ + ".tmp").c_str());
+            // Sessions waiting for the lock go on with their commands
+            // instead of disconnecting, and the accept loop resumes.
+            state_.draining = false;
+            freeze.unlock();
+            {
+                const std::unique_lock lock(handoff_mutex_);
+                accepting_stopped_ = false;
+            }
+            handoff_cv_.notify_all();
+            return false;
+        }
+        ::close(client);
+        {
+            // Idle sessions notice on their next read, busy ones after the
+            // current command. Clients reconnect to the new process.
+            const std::unique_lock lock(state_.sessions_mutex);
+            for (const auto session : state_.sessions) {
+                ::shutdown(session, SHUT_RDWR);
+            }
+        }
+        std::cout << "Handed over in "
+                  << std::chrono::duration<double, std::milli>(
+                         std::chrono::steady_clock::now() - start
+                     )
+                         .count()
+                  << " ms\n";
+        const std::unique_lock lock(handoff_mutex_);
+        handoff_done_ = true;
+        handoff_cv_.notify_all();
+        return true;
+    }
+
+    // The requester may be gone already.
+    static void reply_to_takeover(int client, const std::string &reply) {
+        try {
+            send_with_fd(client, reply, -1);
+        } catch (const std::system_error &) {
+        }
+    }
+
+    // New process side of a hot restart.
+    void take_over(const std::string &control_path) {
+        const auto start = std::chrono::steady_clock::now();
+        const std::string snapshot_path = takeover_snapshot_path(control_path);
+        const int fd = request_takeover(control_path);
+        load_snapshot(snapshot_path);
+        ::unlink(snapshot_path.c_str());
+        acceptor_.assign(tcp::v4(), fd);
+        std::cout << "Took over in "
+                  << std::chrono::duration<double, std::milli>(
+                         std::chrono::steady_clock::now() - start
+                     )
+                         .count()
+                  << " ms\n";
+    }
+
+    // Format: "bank-server-snapshot 1 <tenants>", then for each tenant its
+    // name on a separate line followed by ledger::save() output.
+    void save_snapshot(const std::string &path) {
+        const std::string tmp_path = path + ".tmp";
+        {
+            std::ofstream f(tmp_path, std::ios::binary);
+            f << "bank-server-snapshot 1 " << state_.tenants.size() << '\n';
+            for (auto &[name, t] : state_.tenants) {
+                f << name << '\n';
+                t->get_ledger().save(f);
+            }
+            if (!f) {
+                throw std::runtime_error("Unable to write " + tmp_path);
+            }
+        }
+        if (std::rename(tmp_path.c_str(), path.c_str()) != 0) {
+            throw std::system_error(errno, std::generic_category(), "rename");
+        }
+    }
+
+    void load_snapshot(const std::string &path) {
+        std::ifstream f(path, std::ios::binary);
+        std::string magic;
+        int format = 0;
+        std::size_t tenants = 0;
+        if (!(f >> magic >> format >> tenants) ||
+            magic != "bank-server-snapshot" || format != 1) {
+            throw snapshot_error("Not a server snapshot: " + path);
+        }
+        for (std::size_t i = 0; i < tenants; i++) {
+            // Finish the previous line; tenant names may be empty.
+            f.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+            std::string name;
+            std::getline(f, name);
+            auto &t = state_.tenants[name];
+            if (!t) {
+                std::cerr << "Tenant '" << name
+                          << "' is not configured, restoring without quotas\n";
+                t = std::make_unique<tenant>(name, tenant_quota{});
+            }
+            t->get_ledger().load(f);
+        }
+    }
+#endif
+};
+
+// --tenant <name>[,sessions=N][,users=N][,rate=N]
+// The name may be empty to configure logins without "@tenant".
+static tenant_quota parse_tenant(const std::string &spec, std::string &name) {
+    tenant_quota quota;
+    std::istringstream iss(spec);
+    std::getline(iss, name, ',');
+    std::string option;
+    while (std::getline(iss, option, ',')) {
+        const auto eq = option.find('=');
+        if (eq == std::string::npos) {
+            throw std::invalid_argument("Bad tenant option: " + option);
+        }
+        const std::string key = option.substr(0, eq);
+        const std::string value = option.substr(eq + 1);
+        if (key == "sessions") {
+            quota.max_sessions = std::stoull(value);
+        } else if (key == "users") {
+            quota.max_users = std::stoull(value);
+        } else if (key == "rate") {
+            quota.transfers_per_second = std::stod(value);
+        } else {
+            throw std::invalid_argument("Bad tenant option: " + option);
+        }
+    }
+    return quota;
+}
+
+static server_options parse_options(const std::vector<std::string> &args) {
+    if (args.size() < 2) {
+        throw std::invalid_argument("Usage: bank-server <port> <port-file>");
+    }
+    server_options options;
+    options.port = static_cast<unsigned short>(std::stoi(args[0]));
+    options.port_file = args[1];
+    for (std::size_t i = 2; i < args.size(); i++) {
+        if (args[i] == "--tenant" && i + 1 < args.size()) {
+            std::string name;
+            const tenant_quota quota = parse_tenant(args[++i], name);
+            options.tenants.emplace_back(name, quota);
+        } else if (args[i] == "--control" && i + 1 < args.size()) {
+            options.control_path = args[++i];
+        } else if (args[i] == "--takeover" && i + 1 < args.size()) {
+            options.takeover_path = args[++i];
+        } else if (args[i] == "--expect-users" && i + 1 < args.size()) {
+            options.expect_users = std::stoull(args[++i]);
+        } else if (args[i] == "--expect-history" && i + 1 < args.size()) {
+            options.expect_history = std::stoull(args[++i]);
+        } else if (args[i] == "--prefault") {
+            options.prefault = true;
+        } else if (args[i] == "--qos-slots" && i + 1 < args.size()) {
+            options.qos_slots = static_cast<unsigned>(std::stoul(args[++i]));
+        } else if (args[i] == "--qos-weights" && i + 1 < args.size()) {
+            // <interactive>,<bulk>,<admin>
+            std::istringstream weights(args[++i]);
+            char comma1 = 0;
+            char comma2 = 0;
+            if (!(weights >> options.qos_weights[0] >> comma1 >>
+                  options.qos_weights[1] >> comma2 >>
+                  options.qos_weights[2]) ||
+                comma1 != ',' || comma2 != ',') {
+                throw std::invalid_argument("Bad QoS weights: " + args[i]);
+            }
+        } else if (args[i] == "--workers" && i + 1 < args.size()) {
+            options.workers = static_cast<unsigned>(std::stoul(args[++i]));
+        } else if (args[i] == "--scheduler" && i + 1 < args.size()) {
+            const std::string &m = args[++i];
+            if (m == "shared") {
+                options.executor_mode = task_executor::mode::SHARED;
+            } else if (m == "stealing") {
+                options.executor_mode = task_executor::mode::STEALING;
+            } else {
+                throw std::invalid_argument("Unknown scheduler: " + m);
+            }
+        } else if (args[i] == "--busy-poll" && i + 1 < args.size()) {
+            // <cpu>[,<cpu>...]
+#ifdef __linux__
+            std::istringstream cpus(args[++i]);
+            std::string cpu;
+            while (std::getline(cpus, cpu, ',')) {
+                options.busy_poll_cpus.push_back(std::stoi(cpu));
+                if (options.busy_poll_cpus.back() < 0 ||
+                    options.busy_poll_cpus.back() >= CPU_SETSIZE) {
+                    throw std::invalid_argument("Bad busy-poll CPU: " + cpu);
+                }
+            }
+#else
+            throw std::invalid_argument("Busy polling needs Linux");
+#endif
+        } else if (args[i] == "--history-send" && i + 1 < args.size()) {
+            const std::string &m = args[++i];
+            if (m == "stream") {
+                options.large_replies = history_send::STREAM;
+            } else if (m == "segments") {
+                options.large_replies = history_send::SEGMENTS;
+            } else if (m == "zerocopy") {
+                options.large_replies = history_send::ZEROCOPY;
+            } else {
+                throw std::invalid_argument("Unknown history send mode: " + m);
+            }
+        } else if (args[i] == "--audit" && i + 1 < args.size()) {
+            const long long ms = std::stoll(args[++i]);
+            if (ms <= 0) {
+                throw std::invalid_argument("Bad audit interval: " + args[i]);
+            }
+            options.audit_interval = std::chrono::milliseconds(ms);
+        } else if (args[i] == "--http" && i + 1 < args.size()) {
+            // <port>,<port-file>
+            const std::string &spec = args[++i];
+            const auto comma = spec.find(',');
+            if (comma == std::string::npos || comma + 1 == spec.size()) {
+                throw std::invalid_argument("Bad HTTP listener: " + spec);
+            }
+            options.http_port =
+                static_cast<unsigned short>(std::stoi(spec.substr(0, comma)));
+            options.http_port_file = spec.substr(comma + 1);
+        } else if (args[i] == "--instrument") {
+            options.instrument = true;
+        } else if (args[i] == "--fixed-capacity" && i + 1 < args.size()) {
+            // <users>,<history per user>
+            const std::string &spec = args[++i];
+            const auto comma = spec.find(',');
+            if (comma == std::string::npos) {
+                throw std::invalid_argument("Bad fixed capacity: " + spec);
+            }
+            options.fixed_users = std::stoull(spec.substr(0, comma));
+            options.fixed_history = std::stoull(spec.substr(comma + 1));
+        } else {
+            throw std::invalid_argument("Unknown option: " + args[i]);
+        }
+    }
+    // A hot restart hands over only the line-protocol socket.
+    if (!options.http_port_file.empty() &&
+        (!options.control_path.empty() || !options.takeover_path.empty())) {
+        throw std::invalid_argument("--http doesn't support hot restart");
+    }
+    return options;
+}
+}  // namespace bank
+
+int main(int argc, char *argv[]) {
+#ifdef _MSC_VER
+    _CrtSetReportMode(_CRT_ASSERT, _CRTDBG_MODE_FILE | _CRTDBG_MODE_DEBUG);
+    _CrtSetReportFile(_CRT_ASSERT, _CRTDBG_FILE_STDERR);
+    _CrtSetReportMode(_CRT_ERROR, _CRTDBG_MODE_FILE | _CRTDBG_MODE_DEBUG);
+    _CrtSetReportFile(_CRT_ERROR, _CRTDBG_FILE_STDERR);
+#endif
+    bank::server_options options;
+    try {
+        options = bank::parse_options(
+            // NOLINTNEXTLINE(cppcoreguidelines-pro-bounds-pointer-arithmetic)
+            std::vector<std::string>(argv + 1, argv + argc)
+        );
+    } catch (const std::exception &e) {
+        std::cerr << "You're lose, seems in PMI3: " << e.what() << '\n';
+        return 1;
+    }
+    boost::asio::io_context io_context;  // NOLINT
+    bank::server server(io_context, options);
+    server.setup(options.port_file);
+#ifndef _WIN32
+    if (!options.control_path.empty()) {
+        server.listen_for_takeover(options.control_path);
+    }
+#endif
     server.run();
+    // Only returns after a hot restart handoff. Detached sessions may still
+    // reference the server, so skip destructors.
+    std::cout << std::flush;
+    std::_Exit(0);
 }
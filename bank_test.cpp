@@ -1,17 +1,53 @@
 #include "bank.hpp"
+#include <algorithm>
 #include <array>
+#include <atomic>
+#include <chrono>
 #include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <memory>
 #include <mutex>
+#include <new>
+#include <optional>
 #include <set>
 #include <sstream>
+#include <stdexcept>
 #include <string>
 #include <thread>
 #include <type_traits>
 #include <utility>
 #include <vector>
+#include "activity_buckets.hpp"
+#include "audit_log.hpp"
+#include "command_scheduler.hpp"
+#include "cost_meter.hpp"
+#include "counterparty_cache.hpp"
 #include "doctest.h"
+#include "history_segments.hpp"
+#include "http.hpp"
+#include "login.hpp"
+#include "reply_buffer.hpp"
+#include "ledger_diff.hpp"
+#include "sha256.hpp"
+#include "session_mux.hpp"
+#include "task_executor.hpp"
+#include "workload.hpp"
 //#include "test_utils.hpp"
 
+#ifndef _WIN32
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
 #ifdef EXPECT_VALGRIND
 #define SMALL_TESTS
 #endif
@@ -94,6 +130,44 @@ TEST_CASE("Create and get user") {
     CHECK(&alice1 == &alice2);
 }
 
+TEST_CASE("Counterparty cache entries stay valid for their ledger") {
+    bank::ledger l;
+    bank::counterparty_cache cache;
+    bool hit = true;
+    bank::user &bob = cache.resolve(l, "Bob", hit);
+    CHECK_FALSE(hit);
+    CHECK(&bob == &l.get_or_create_user("Bob"));
+
+    SUBCASE("while the ledger grows") {
+        for (int i = 0; i < 10000; i++) {
+            l.get_or_create_user("user" + std::to_string(i));
+        }
+        CHECK(&cache.resolve(l, "Bob", hit) == &bob);
+        CHECK(hit);
+    }
+
+    SUBCASE("but not for another ledger") {
+        bank::ledger other;
+        bank::user &other_bob = cache.resolve(other, "Bob", hit);
+        CHECK_FALSE(hit);
+        CHECK(&other_bob == &other.get_or_create_user("Bob"));
+        CHECK(&cache.resolve(l, "Bob", hit) == &bob);
+        CHECK_FALSE(hit);
+    }
+
+    SUBCASE("and are dropped when the cache is full") {
+        for (std::size_t i = 1; i < bank::counterparty_cache::MAX_ENTRIES;
+             i++) {
+            cache.resolve(l, "user" + std::to_string(i), hit);
+        }
+        CHECK(&cache.resolve(l, "Bob", hit) == &bob);
+        CHECK(hit);
+        cache.resolve(l, "one too many", hit);
+        CHECK(&cache.resolve(l, "Bob", hit) == &bob);
+        CHECK_FALSE(hit);
+    }
+}
+
 namespace {
 template <typename T>
 constexpr bool is_cvref_v =
@@ -615,5 +689,1859 @@ TEST_CASE("Single producer, snapshot_transaction is atomic") {
     };
 }
 
+TEST_CASE("Versions") {
+    bank::ledger l;
+    bank::user &alice = l.get_or_create_user("Alice");
+    bank::user &bob = l.get_or_create_user("Bob");
+    CHECK(alice.version() == 1);
+    CHECK(bob.version() == 1);
+    CHECK(noexcept(std::declval<const bank::user>().version()));
+
+    alice.transfer(bob, 10, "A2B");
+    CHECK(alice.version() == 2);
+    CHECK(bob.version() == 2);
+    CHECK(alice.versioned_balance_xts() == std::pair{90, std::uint64_t{2}});
+
+    CHECK_THROWS_AS(
+        alice.transfer(bob, 1000, "Too much"), bank::not_enough_funds_error
+    );
+    CHECK(alice.version() == 2);
+
+    SUBCASE("wait_for_change returns immediately if already changed") {
+        CHECK(alice.wait_for_change(1, std::chrono::hours(1)) == 2);
+    }
+    SUBCASE("wait_for_change times out") {
+        CHECK(alice.wait_for_change(2, std::chrono::milliseconds(10)) == 2);
+    }
+    SUBCASE("wait_for_change wakes up on commit") {
+        std::thread t([&]() { bob.transfer(alice, 5, "B2A"); });
+        CHECK(alice.wait_for_change(2, std::chrono::hours(1)) == 3);
+        t.join();
+    }
+}
+
+TEST_CASE("Conditional transfer") {
+    bank::ledger l;
+    bank::user &alice = l.get_or_create_user("Alice");
+    bank::user &bob = l.get_or_create_user("Bob");
+
+    CHECK(alice.transfer_if_version(bob, 10, "A2B", 1) == 2);
+    CHECK(alice.balance_xts() == 90);
+    CHECK(bob.balance_xts() == 110);
+
+    SUBCASE("stale version") {
+        try {
+            alice.transfer_if_version(bob, 10, "A2B", 1);
+            FAIL("Expected precondition_failed_error");
+        } catch (const bank::precondition_failed_error &e) {
+            CHECK(e.current_version() == 2);
+        }
+        CHECK(std::is_convertible_v<
+              bank::precondition_failed_error &, bank::transfer_error &>);
+    }
+    SUBCASE("stale balance") {
+        CHECK_THROWS_AS_MESSAGE(
+            alice.transfer_if_balance(bob, 10, "A2B", 100),
+            bank::precondition_failed_error,
+            "Precondition failed: expected balance 100 XTS, current balance "
+            "90 XTS, current version 2"
+        );
+        CHECK(alice.transfer_if_balance(bob, 10, "A2B", 90) == 3);
+    }
+    SUBCASE("funds are still checked") {
+        CHECK_THROWS_AS(
+            alice.transfer_if_version(bob, 1000, "A2B", 2),
+            bank::not_enough_funds_error
+        );
+    }
+    CHECK(alice.balance_xts() + bob.balance_xts() == 200);
+}
+
+TEST_CASE("Netting") {
+    bank::ledger l;
+    bank::user &alice = l.get_or_create_user("Alice");
+    bank::user &bob = l.get_or_create_user("Bob");
+    bank::user &carol = l.get_or_create_user("Carol");
+    alice.set_netting_window(std::chrono::hours(1));
+    bob.set_netting_window(std::chrono::hours(1));
+
+    for (int op = 0; op < 30; op++) {
+        alice.transfer(bob, 10, "A2B");
+        bob.transfer(alice, 7, "B2A");
+    }
+    CHECK(alice.balance_xts() == 10);
+    CHECK(bob.balance_xts() == 190);
+    CHECK(alice.version() == 61);
+    CHECK_THROWS_AS(
+        alice.transfer(bob, 11, "A2B"), bank::not_enough_funds_error
+    );
+
+    SUBCASE("snapshot closes the batch") {
+        alice.snapshot_transactions([&](const auto &ts, int balance_xts) {
+            REQUIRE(ts.size() == 2);
+            CHECK(
+                ts[1] == bank::transaction{&bob, -90, "Netted 60 transfers"}
+            );
+            REQUIRE(ts[1].items != nullptr);
+            CHECK(ts[1].items->size() == 60);
+            CHECK((*ts[1].items)[0].balance_delta_xts == -10);
+            CHECK((*ts[1].items)[0].comment == "A2B");
+            CHECK((*ts[1].items)[1].balance_delta_xts == 7);
+            CHECK((*ts[1].items)[1].comment == "B2A");
+            CHECK(
+                balance_xts ==
+                ts[0].balance_delta_xts + ts[1].balance_delta_xts
+            );
+        });
+    }
+    SUBCASE("another counterparty closes the batch") {
+        carol.transfer(bob, 1, "C2B");
+        bob.snapshot_transactions([&](const auto &ts, int balance_xts) {
+            REQUIRE(ts.size() == 3);
+            CHECK(
+                ts[1] == bank::transaction{&alice, 90, "Netted 60 transfers"}
+            );
+            CHECK(ts[2] == bank::transaction{&carol, 1, "C2B"});
+            CHECK(ts[2].items == nullptr);
+            CHECK(balance_xts == 191);
+        });
+    }
+    SUBCASE("monitor sees the batch once the window closes") {
+        bank::user &dave = l.get_or_create_user("Dave");
+        dave.set_netting_window(std::chrono::milliseconds(20));
+        auto it = dave.monitor();
+        dave.transfer(carol, 1, "D2C-1");
+        dave.transfer(carol, 2, "D2C-2");
+        CHECK(
+            it.wait_next_transaction() ==
+            bank::transaction{&carol, -3, "Netted 2 transfers"}
+        );
+    }
+}
+
+TEST_CASE("User limit") {
+    bank::ledger l;
+    l.set_max_users(2);
+    bank::user &alice = l.get_or_create_user("Alice");
+    l.get_or_create_user("Bob");
+    CHECK(l.user_count() == 2);
+    CHECK_THROWS_AS_MESSAGE(
+        l.get_or_create_user("Carol"), bank::capacity_exceeded_error,
+        "User limit reached: 2 users"
+    );
+    CHECK(&l.get_or_create_user("Alice") == &alice);
+    CHECK(l.user_count() == 2);
+}
+
+TEST_CASE("Snapshot save and load") {
+    std::stringstream snapshot;
+    {
+        bank::ledger l;
+        bank::user &alice = l.get_or_create_user("Alice");
+        bank::user &bob = l.get_or_create_user("Bob with spaces\t");
+        alice.transfer(bob, 10, "Line 1");
+        bob.transfer(alice, 5, "");
+        bob.set_netting_window(std::chrono::hours(1));
+        bob.transfer(alice, 1, "N1");
+        bob.transfer(alice, 2, "N2");
+        l.save(snapshot);
+    }
+
+    bank::ledger l;
+    l.load(snapshot);
+    CHECK(l.user_count() == 2);
+    bank::user &alice = l.get_or_create_user("Alice");
+    bank::user &bob = l.get_or_create_user("Bob with spaces\t");
+    CHECK(l.user_count() == 2);
+    CHECK(alice.balance_xts() == 98);
+    CHECK(bob.balance_xts() == 102);
+    CHECK(alice.version() == 5);
+    CHECK(bob.version() == 5);
+    alice.snapshot_transactions([&](const auto &ts, int) {
+        CHECK(
+            std::vector(ts.begin(), ts.end()) ==
+            std::vector{
+                bank::transaction{nullptr, 100, "Initial deposit for Alice"},
+                bank::transaction{&bob, -10, "Line 1"},
+                bank::transaction{&bob, 5, ""},
+                bank::transaction{&bob, 1, "N1"},
+                bank::transaction{&bob, 2, "N2"}}
+        );
+    });
+    bob.snapshot_transactions([&](const auto &ts, int) {
+        REQUIRE(ts.size() == 4);
+        CHECK(ts[3] == bank::transaction{&alice, -3, "Netted 2 transfers"});
+        REQUIRE(ts[3].items != nullptr);
+        CHECK(ts[3].items->size() == 2);
+        CHECK((*ts[3].items)[1].comment == "N2");
+    });
+    // Netting settings survive as well.
+    bob.transfer(alice, 1, "N3");
+    bob.transfer(alice, 1, "N4");
+    bob.snapshot_transactions([&](const auto &ts, int) {
+        CHECK(ts.size() == 5);
+    });
+
+    SUBCASE("Only into an empty ledger") {
+        snapshot.seekg(0);
+        CHECK_THROWS_AS(l.load(snapshot), bank::snapshot_error);
+    }
+    SUBCASE("Malformed input") {
+        bank::ledger other;
+        std::stringstream garbage("bank-ledger 1 2\n5:Alice\n");
+        CHECK_THROWS_AS(other.load(garbage), bank::snapshot_error);
+    }
+}
+
+TEST_CASE("User references are stable while the table grows") {
+#ifndef SMALL_TESTS
+    const int USERS = 200'000;
+#else
+    const int USERS = 20'000;
+#endif
+    bank::ledger l;
+    std::vector<const bank::user *> users;
+    users.reserve(USERS);
+    for (int i = 0; i < USERS; i++) {
+        users.push_back(&l.get_or_create_user("user-" + std::to_string(i)));
+        // Look up a few older users, some of which are mid-migration.
+        const int old = i / 2;
+        REQUIRE(
+            &l.get_or_create_user("user-" + std::to_string(old)) == users[old]
+        );
+    }
+    CHECK(l.user_count() == USERS);
+    for (int i = 0; i < USERS; i++) {
+        REQUIRE(&l.get_or_create_user("user-" + std::to_string(i)) == users[i]);
+        REQUIRE(users[i]->name() == "user-" + std::to_string(i));
+    }
+    CHECK(l.user_count() == USERS);
+}
+
+TEST_CASE("Reserve and prefault") {
+    bank::ledger l;
+    bank::user &alice = l.get_or_create_user("Alice");
+    l.reserve(10'000, 4);
+    CHECK(l.prefault(2) > 0);
+    CHECK(&l.get_or_create_user("Alice") == &alice);
+    for (int i = 0; i < 10'000; i++) {
+        l.get_or_create_user(std::to_string(i)).transfer(alice, 1, "");
+    }
+    CHECK(l.user_count() == 10'001);
+    CHECK(alice.balance_xts() == 10'100);
+    CHECK(&l.get_or_create_user("Alice") == &alice);
+
+    SUBCASE("concurrently with transfers between live users") {
+        bank::user &bob = l.get_or_create_user("Bob");
+        std::thread transfers([&] {
+            for (int i = 0; i < 10'000; i++) {
+                alice.transfer(bob, 1, "");
+            }
+        });
+        for (int i = 0; i < 10; i++) {
+            l.prefault(2);
+        }
+        transfers.join();
+        CHECK(alice.balance_xts() == 100);
+        CHECK(bob.balance_xts() == 10'100);
+    }
+}
+
+TEST_CASE("Fixed capacity mode does not allocate in steady state") {
+#ifndef SMALL_TESTS
+    const int OPERATIONS = 100'000;
+#else
+    const int OPERATIONS = 1'000;
+#endif
+    bank::ledger l;
+    l.set_fixed_capacity(2, 1 + 2 * OPERATIONS);
+    bank::user &alice = l.get_or_create_user("Alice");
+    bank::user &bob = l.get_or_create_user("Bob");
+    bank::user_transactions_iterator alice_it = alice.monitor();
+    bank::user_transactions_iterator bob_it = bob.monitor();
+
+    long long balances_xts = 0;
+    bool monitors_ok = true;
+    bank::count_allocations(true);
+    const bank::cost_meter meter;
+    for (int op = 0; op < OPERATIONS; op++) {
+        alice.transfer(bob, 10, "A2B");
+        bob.transfer(alice, 10, "B2A");
+        balances_xts += alice.balance_xts() + bob.balance_xts();
+        monitors_ok =
+            monitors_ok &&
+            alice_it.wait_next_transaction().balance_delta_xts == -10 &&
+            alice_it.wait_next_transaction().balance_delta_xts == 10 &&
+            bob_it.wait_next_transaction().comment == "A2B" &&
+            bob_it.wait_next_transaction().comment == "B2A";
+    }
+    CHECK(meter.cost().allocations == 0);
+    bank::count_allocations(false);
+    CHECK(balances_xts == 200LL * OPERATIONS);
+    CHECK(monitors_ok);
+
+    CHECK_THROWS_AS(
+        alice.transfer(bob, 1, "Full"), bank::capacity_exceeded_error
+    );
+    CHECK(alice.balance_xts() == 100);
+    CHECK(bob.balance_xts() == 100);
+    CHECK_THROWS_AS(
+        l.get_or_create_user("Carol"), bank::capacity_exceeded_error
+    );
+    CHECK_THROWS_AS(
+        alice.set_netting_window(std::chrono::seconds(1)),
+        bank::capacity_exceeded_error
+    );
+
+    // Make sure the hook actually sees allocations of a regular ledger.
+    bank::ledger regular;
+    bank::user &carol = regular.get_or_create_user("Carol");
+    bank::user &dave = regular.get_or_create_user("Dave");
+    bank::count_allocations(true);
+    const bank::cost_meter regular_meter;
+    carol.transfer(dave, 1, "A comment that does not fit inline");
+    CHECK(regular_meter.cost().allocations > 0);
+    bank::count_allocations(false);
+}
+
+TEST_CASE("Cost meters count the current thread's work") {
+    struct alignas(64) aligned {
+        std::array<char, 64> bytes;
+    };
+    bank::count_allocations(true);
+    const bank::cost_meter meter;
+    auto a = std::make_unique<int>(1);
+    auto b = std::make_unique<std::array<char, 100>>();
+    auto c = std::make_unique<aligned>();
+    std::thread([] { auto other = std::make_unique<int>(2); }).join();
+    const bank::work_cost cost = meter.cost();
+    CHECK(cost.allocations >= 3);
+    CHECK(cost.allocated_bytes >= sizeof(int) + 100 + sizeof(aligned));
+    // The thread object's own state is allocated here too, but not what
+    // the other thread allocated.
+    CHECK(cost.allocations <= 4);
+
+    bank::count_allocations(false);
+    const bank::cost_meter disabled;
+    auto d = std::make_unique<int>(3);
+    CHECK(disabled.cost().allocations == 0);
+    CHECK(disabled.cost().allocated_bytes == 0);
+
+    volatile std::uint64_t sum = 0;
+    for (std::uint64_t i = 0; i < 10'000'000; i++) {
+        sum = sum + i;
+    }
+    CHECK(meter.cost().cpu_ns > 0);
+}
+
+TEST_CASE("Fixed capacity mode limits comment length") {
+    bank::ledger l;
+    l.set_fixed_capacity(2, 10);
+    bank::user &alice = l.get_or_create_user("Alice");
+    bank::user &bob = l.get_or_create_user("Bob");
+    alice.transfer(bob, 1, "Short comment");
+    CHECK_THROWS_AS(
+        alice.transfer(bob, 1, "A comment that does not fit inline"),
+        bank::capacity_exceeded_error
+    );
+    CHECK(alice.balance_xts() == 99);
+    CHECK(alice.version() == 2);
+}
+
+TEST_CASE("Fixed capacity reserves activity for the history it allows") {
+    using std::chrono::minutes;
+    const std::size_t full = bank::activity_buckets::reserved_bytes(SIZE_MAX);
+    CHECK(bank::activity_buckets::reserved_bytes(8) * 40 < full);
+    CHECK(bank::activity_buckets::reserved_bytes(100'000) == full);
+
+    bank::ledger l;
+    l.set_fixed_capacity(2, 8);
+    CHECK(
+        l.reserved_bytes_per_user() ==
+        8 * sizeof(bank::transaction) +
+            bank::activity_buckets::reserved_bytes(8)
+    );
+
+    // One bucket per transfer, each in a minute, hour and day of its own.
+    bank::activity_buckets b;
+    b.reserve(8);
+    const std::chrono::sys_seconds start{std::chrono::seconds(1'700'006'400)};
+    bank::count_allocations(true);
+    const bank::cost_meter meter;
+    for (int i = 0; i < 8; i++) {
+        b.add(start + i * minutes(24 * 60 + 61), 1, 0);
+    }
+    CHECK(meter.cost().allocations == 0);
+    bank::count_allocations(false);
+    const auto end = start + 8 * minutes(24 * 60 + 61);
+    CHECK(b.query(start, end, end).transfers == 8);
+}
+
+TEST_CASE("Workload generator is deterministic") {
+    bank::workload_options options;
+    options.seed = 42;
+    options.users_distribution = bank::workload_options::distribution::ZIPF;
+    options.arrivals = bank::workload_options::arrival::BURSTY;
+    bank::workload_generator a(options);
+    bank::workload_generator b(options);
+    options.seed = 43;
+    bank::workload_generator c(options);
+    bool differs = false;
+    for (int i = 0; i < 1000; i++) {
+        const bank::workload_operation x = a.next();
+        const bank::workload_operation y = b.next();
+        const bank::workload_operation z = c.next();
+        REQUIRE(x.command() == y.command());
+        REQUIRE(x.user == y.user);
+        REQUIRE(x.at == y.at);
+        differs = differs || x.command() != z.command() || x.user != z.user;
+        CHECK(x.user < options.users);
+        if (x.type == bank::workload_operation::kind::TRANSFER) {
+            CHECK(x.counterparty != x.user);
+            CHECK(x.amount >= 1);
+            CHECK(x.amount <= options.max_amount);
+            CHECK(x.comment.size() <= options.max_comment_length);
+        }
+    }
+    CHECK(differs);
+}
+
+TEST_CASE("Workload user distributions") {
+    const int DRAWS = 100'000;
+    auto top_share = [&](bank::workload_options options) {
+        options.users = 1000;
+        bank::workload_generator g(options);
+        int top = 0;
+        for (int i = 0; i < DRAWS; i++) {
+            if (g.next_user() < 10) {
+                top++;
+            }
+        }
+        return static_cast<double>(top) / DRAWS;
+    };
+    bank::workload_options options;
+    // 10 of 1000 users.
+    CHECK(top_share(options) == doctest::Approx(0.01).epsilon(0.3));
+    options.users_distribution = bank::workload_options::distribution::ZIPF;
+    // H(10) / H(1000) for s = 1.
+    CHECK(top_share(options) == doctest::Approx(0.39).epsilon(0.05));
+    options.users_distribution = bank::workload_options::distribution::HOT_SET;
+    options.hot_fraction = 0.01;
+    options.hot_probability = 0.9;
+    CHECK(top_share(options) == doctest::Approx(0.9).epsilon(0.02));
+}
+
+TEST_CASE("Workload command mix and arrivals") {
+    bank::workload_options options;
+    options.transfer_weight = 1;
+    options.balance_weight = 1;
+    options.transactions_weight = 2;
+    options.rate = 1000;
+    options.burst_size = 10;
+    options.arrivals = bank::workload_options::arrival::BURSTY;
+    bank::workload_generator g(options);
+    const int OPS = 40'000;
+    std::array<int, 3> kinds{};
+    int zero_gaps = 0;
+    std::chrono::nanoseconds last{0};
+    for (int i = 0; i < OPS; i++) {
+        const bank::workload_operation op = g.next();
+        kinds.at(static_cast<std::size_t>(op.type))++;
+        CHECK(op.at >= last);
+        zero_gaps += op.at == last ? 1 : 0;
+        last = op.at;
+    }
+    CHECK(kinds[0] == doctest::Approx(OPS / 4).epsilon(0.05));
+    CHECK(kinds[1] == doctest::Approx(OPS / 4).epsilon(0.05));
+    CHECK(kinds[2] == doctest::Approx(OPS / 2).epsilon(0.05));
+    // Nine of every ten operations arrive together with the previous one.
+    CHECK(zero_gaps == doctest::Approx(OPS * 9 / 10).epsilon(0.01));
+    // 40 seconds at 1000 operations per second.
+    CHECK(std::chrono::duration<double>(last).count() ==
+          doctest::Approx(40).epsilon(0.1));
+
+    options.users = 1;
+    CHECK_THROWS_AS(bank::workload_generator{options}, std::invalid_argument);
+}
+
+namespace {
+// Starts one thread per class in `classes`, each taking a slot of `s` in
+// turn, and returns the order in which they got it. The caller holds the
+// only slot until all of them are queued.
+std::vector<bank::qos_class> grant_order(
+    bank::command_scheduler &s,
+    const std::vector<bank::qos_class> &classes
+) {
+    std::mutex m;
+    std::vector<bank::qos_class> order;
+    std::vector<std::thread> threads;
+    {
+        const bank::command_scheduler::slot held(s, bank::qos_class::ADMIN);
+        for (const bank::qos_class c : classes) {
+            const std::size_t before = s.queued(c);
+            threads.emplace_back([&, c] {
+                const bank::command_scheduler::slot slot(s, c);
+                const std::unique_lock lock(m);
+                order.push_back(c);
+            });
+            // Queue them one at a time to fix the FIFO order.
+            while (s.queued(c) == before) {
+                std::this_thread::yield();
+            }
+        }
+    }
+    for (auto &t : threads) {
+        t.join();
+    }
+    return order;
+}
+}  // namespace
+
+TEST_CASE("Command scheduler without slots does not block") {
+    bank::command_scheduler s(0, {1, 1, 1});
+    const bank::command_scheduler::slot a(s, bank::qos_class::BULK);
+    const bank::command_scheduler::slot b(s, bank::qos_class::BULK);
+    CHECK(s.queued(bank::qos_class::BULK) == 0);
+}
+
+TEST_CASE("Command scheduler prefers interactive commands") {
+    using bank::qos_class;
+    bank::command_scheduler s(1, {16, 1, 4});
+    const std::vector<qos_class> order = grant_order(
+        s, {qos_class::BULK, qos_class::BULK, qos_class::INTERACTIVE}
+    );
+    CHECK(order.front() == qos_class::INTERACTIVE);
+    CHECK(s.stats(qos_class::BULK).waited == 2);
+    CHECK(s.stats(qos_class::INTERACTIVE).commands == 1);
+}
+
+TEST_CASE("Command scheduler shares slots by weight") {
+    using bank::qos_class;
+    bank::command_scheduler s(1, {3, 1, 1});
+    std::vector<qos_class> classes;
+    for (int i = 0; i < 12; i++) {
+        classes.push_back(qos_class::BULK);
+        classes.push_back(qos_class::INTERACTIVE);
+    }
+    const std::vector<qos_class> order = grant_order(s, classes);
+    // While both are backlogged, three interactive per bulk command.
+    const auto bulk_in_first_16 = std::count(
+        order.begin(), order.begin() + 16, qos_class::BULK
+    );
+    CHECK(bulk_in_first_16 == 4);
+    // Bulk is not starved: it finishes once interactive runs out.
+    CHECK(std::count(order.begin(), order.end(), qos_class::BULK) == 12);
+}
+
+TEST_CASE("Command scheduler resumes paused commands after waiting ones") {
+    using bank::qos_class;
+    bank::command_scheduler s(1, {16, 1, 4});
+    bank::command_scheduler::slot bulk(s, qos_class::BULK);
+    bulk.pause();
+    CHECK_FALSE(bulk.resume());
+
+    std::atomic<bool> interactive_done = false;
+    std::thread interactive([&] {
+        const bank::command_scheduler::slot slot(s, qos_class::INTERACTIVE);
+        interactive_done = true;
+    });
+    while (s.queued(qos_class::INTERACTIVE) == 0) {
+        std::this_thread::yield();
+    }
+    bulk.pause();
+    // The slot went to the interactive command; resume() gets it back only
+    // after that one is done.
+    bulk.resume();
+    CHECK(interactive_done);
+    interactive.join();
+    CHECK(s.stats(qos_class::BULK).commands == 1);
+
+    bulk.pause();
+    const bank::command_scheduler::slot other(s, qos_class::ADMIN);
+    CHECK(s.queued(qos_class::ADMIN) == 0);
+}
+
+TEST_CASE("Task executor runs every task") {
+    for (const auto mode :
+         {bank::task_executor::mode::SHARED,
+          bank::task_executor::mode::STEALING}) {
+        std::atomic<int> done = 0;
+        {
+            bank::task_executor executor(4, mode);
+            for (int i = 0; i < 1000; i++) {
+                const std::size_t affinity =
+                    i % 3 == 0 ? static_cast<std::size_t>(i)
+                               : bank::task_executor::NO_AFFINITY;
+                executor.submit([&] { done++; }, affinity);
+            }
+            executor.run([&] { done++; });
+            CHECK_THROWS_AS(
+                executor.run([] { throw std::runtime_error("Failed"); }),
+                std::runtime_error
+            );
+        }
+        CHECK(done == 1001);
+    }
+}
+
+TEST_CASE("Task executor steals from a busy worker") {
+    bank::task_executor executor(2, bank::task_executor::mode::STEALING);
+    std::atomic<bool> release = false;
+    std::atomic<int> done = 0;
+    executor.submit(
+        [&] {
+            while (!release) {
+                std::this_thread::yield();
+            }
+        },
+        0
+    );
+    for (int i = 0; i < 10; i++) {
+        executor.submit([&] { done++; }, 0);
+    }
+    // Worker 0 is stuck, so worker 1 has to take its queued tasks.
+    while (done < 10) {
+        std::this_thread::yield();
+    }
+    release = true;
+    CHECK(executor.stats(1).stolen >= 10);
+}
+
+TEST_CASE("Task executor yield runs queued tasks") {
+    for (const auto mode :
+         {bank::task_executor::mode::SHARED,
+          bank::task_executor::mode::STEALING}) {
+        bank::task_executor executor(1, mode);
+        std::atomic<bool> started = false;
+        std::atomic<bool> queued = false;
+        std::atomic<bool> short_done = false;
+        bool yielded_early = true;
+        bool yielded = false;
+        bool short_done_after_yield = false;
+        executor.submit([&] {
+            yielded_early = bank::task_executor::yield();
+            started = true;
+            while (!queued) {
+                std::this_thread::yield();
+            }
+            yielded = bank::task_executor::yield();
+            short_done_after_yield = short_done;
+        });
+        while (!started) {
+            std::this_thread::yield();
+        }
+        executor.submit([&] { short_done = true; });
+        queued = true;
+        executor.run([] {});
+        CHECK_FALSE(yielded_early);
+        CHECK(yielded);
+        CHECK(short_done_after_yield);
+        // Not on a worker thread.
+        CHECK_FALSE(bank::task_executor::yield());
+    }
+}
+
+TEST_CASE("Polling for transactions") {
+    bank::ledger l;
+    bank::user &alice = l.get_or_create_user("Alice");
+    bank::user &bob = l.get_or_create_user("Bob");
+    auto it = alice.monitor();
+    CHECK(!it.try_next_transaction());
+
+    alice.transfer(bob, 10, "A2B");
+    const std::optional<bank::transaction> t = it.try_next_transaction();
+    REQUIRE(t);
+    CHECK(*t == bank::transaction{&bob, -10, "A2B"});
+    CHECK(!it.try_next_transaction());
+
+    SUBCASE("an expired netting batch is closed") {
+        alice.set_netting_window(std::chrono::milliseconds(20));
+        alice.transfer(bob, 1, "A2B-1");
+        alice.transfer(bob, 2, "A2B-2");
+        CHECK(!it.try_next_transaction());
+        std::this_thread::sleep_for(std::chrono::milliseconds(30));
+        const std::optional<bank::transaction> netted =
+            it.try_next_transaction();
+        REQUIRE(netted);
+        CHECK(*netted == bank::transaction{&bob, -3, "Netted 2 transfers"});
+    }
+
+    SUBCASE("waiting gives up after the timeout") {
+        CHECK(!it.wait_next_transaction(std::chrono::milliseconds(10)));
+        alice.set_netting_window(std::chrono::milliseconds(20));
+        alice.transfer(bob, 1, "A2B-1");
+        // Closing the batch doesn't wait for the timeout.
+        const auto start = std::chrono::steady_clock::now();
+        const std::optional<bank::transaction> netted =
+            it.wait_next_transaction(std::chrono::seconds(10));
+        REQUIRE(netted);
+        CHECK(*netted == bank::transaction{&bob, -1, "A2B-1"});
+        const auto waited = std::chrono::steady_clock::now() - start;
+        CHECK(waited < std::chrono::seconds(5));
+    }
+}
+
+TEST_CASE("History segments are built once from sealed history") {
+    constexpr std::size_t SEGMENT = bank::history_segments::SEGMENT_RECORDS;
+    bank::ledger l;
+    bank::user &alice = l.get_or_create_user("Alice");
+    bank::user &bob = l.get_or_create_user("Bob");
+    // Plus the initial deposit: the first segment is sealed, the second one
+    // is one record short.
+    for (std::size_t i = 0; i < 2 * SEGMENT - 2; i++) {
+        alice.transfer(bob, 0, "A2B-" + std::to_string(i));
+    }
+
+    bank::history_segments segments;
+    const bank::history_segments::segment first = segments.get(alice, 0);
+    std::string expected;
+    alice.snapshot_transactions([&](const auto &transactions, int) {
+        for (std::size_t i = 0; i < SEGMENT; i++) {
+            bank::append_history_record(expected, transactions[i]);
+        }
+    });
+    CHECK(*first == expected);
+    CHECK(first->rfind("-\t100\tInitial deposit for Alice\n", 0) == 0);
+    CHECK(segments.get(alice, 0) == first);
+    CHECK(segments.segments() == 1);
+    CHECK(segments.bytes() == expected.size());
+    CHECK_THROWS_AS(
+        static_cast<void>(segments.get(alice, 1)), std::logic_error
+    );
+
+    alice.transfer(bob, 0, "sealing");
+    CHECK(segments.get(alice, 1)->find("Bob\t0\tsealing\n") !=
+          std::string::npos);
+    CHECK(segments.segments() == 2);
+}
+
+TEST_CASE("History segments beyond the budget are evicted") {
+    constexpr std::size_t SEGMENT = bank::history_segments::SEGMENT_RECORDS;
+    bank::ledger l;
+    bank::user &alice = l.get_or_create_user("Alice");
+    bank::user &bob = l.get_or_create_user("Bob");
+    for (std::size_t i = 0; i < 3 * SEGMENT; i++) {
+        alice.transfer(bob, 0, "A2B");
+    }
+
+    // Room for two of Alice's segments, not three.
+    const std::size_t size = bank::history_segments().get(alice, 1)->size();
+    bank::history_segments segments(2 * size + size / 2);
+    const bank::history_segments::segment first = segments.get(alice, 0);
+    static_cast<void>(segments.get(alice, 1));
+    CHECK(segments.get(alice, 0) == first);
+    static_cast<void>(segments.get(alice, 2));
+    CHECK(segments.segments() == 2);
+    CHECK(segments.bytes() <= 2 * size + size / 2);
+    CHECK(segments.evictions() == 1);
+
+    // Segment 1 was the least recently used one.
+    CHECK(segments.get(alice, 0) == first);
+    CHECK(segments.evictions() == 1);
+    const bank::history_segments::segment rebuilt = segments.get(alice, 1);
+    CHECK(segments.evictions() == 2);
+    CHECK(*rebuilt == *bank::history_segments().get(alice, 1));
+
+    // A segment larger than the whole budget is still returned.
+    bank::history_segments tiny(1);
+    CHECK(*tiny.get(alice, 0) == *first);
+    CHECK(tiny.segments() == 1);
+    static_cast<void>(tiny.get(alice, 1));
+    CHECK(tiny.segments() == 1);
+    CHECK(tiny.evictions() == 1);
+}
+
+TEST_CASE("History checksums cover a prefix of the reply text") {
+    bank::ledger l;
+    bank::user &alice = l.get_or_create_user("Alice");
+    bank::user &bob = l.get_or_create_user("Bob");
+    alice.transfer(bob, 10, "A2B");
+    bob.transfer(alice, 3, "B2A");
+
+    auto fnv1a = [](const std::string &text) {
+        std::uint64_t h = bank::user::EMPTY_HISTORY_CHECKSUM;
+        for (const char c : text) {
+            h = (h ^ static_cast<unsigned char>(c)) * 0x100000001b3ULL;
+        }
+        return h;
+    };
+    std::string first;
+    std::string text;
+    alice.snapshot_transactions([&](const auto &transactions, int) {
+        REQUIRE(transactions.size() == 3);
+        bank::append_history_record(first, transactions[0]);
+        for (const auto &t : transactions) {
+            bank::append_history_record(text, t);
+        }
+    });
+    CHECK(alice.history_checksum(0) == bank::user::EMPTY_HISTORY_CHECKSUM);
+    CHECK(alice.history_checksum(1) == fnv1a(first));
+    CHECK(alice.history_checksum(3) == fnv1a(text));
+    CHECK(!alice.history_checksum(4));
+
+    // Earlier prefixes keep their checksums as the history grows.
+    const std::optional<std::uint64_t> before = alice.history_checksum(3);
+    alice.transfer(bob, 1, "more");
+    CHECK(alice.history_checksum(3) == before);
+    CHECK(alice.history_checksum(4) != before);
+}
+
+TEST_CASE("Balance watches fire on threshold crossings") {
+    bank::ledger l;
+    bank::user &alice = l.get_or_create_user("Alice");
+    bank::user &bob = l.get_or_create_user("Bob");
+    std::vector<std::string> alerts;
+    auto record = [&](const std::string &what) {
+        return [&alerts, what, &alice](int balance_xts) {
+            // Runs after the locks are released: reading is fine.
+            CHECK(alice.balance_xts() == balance_xts);
+            alerts.push_back(what + ' ' + std::to_string(balance_xts));
+        };
+    };
+    const std::uint64_t low =
+        alice.watch_balance(bank::threshold::BELOW, 50, record("below"));
+    alice.watch_balance(bank::threshold::ABOVE, 120, record("above"));
+
+    alice.transfer(bob, 30, "");  // 70
+    CHECK(alerts.empty());
+    alice.transfer(bob, 30, "");  // 40
+    alice.transfer(bob, 5, "");   // 35, still below
+    CHECK(alerts == std::vector<std::string>{"below 40"});
+    bob.transfer(alice, 40, "");  // 75, re-armed
+    bob.transfer(alice, 60, "");  // 135
+    alice.transfer(bob, 100, "");  // 35
+    CHECK(
+        alerts ==
+        std::vector<std::string>{"below 40", "above 135", "below 35"}
+    );
+
+    CHECK(alice.unwatch_balance(low));
+    CHECK(!alice.unwatch_balance(low));
+    bob.transfer(alice, 100, "");  // 135
+    alice.transfer(bob, 100, "");  // 35
+    CHECK(alerts.size() == 4);
+    CHECK(alerts.back() == "above 135");
+
+    SUBCASE("already beyond the limit at registration") {
+        alice.watch_balance(bank::threshold::BELOW, 40, record("low"));
+        alice.transfer(bob, 1, "");
+        CHECK(alerts.size() == 4);
+    }
+}
+
+TEST_CASE("Sub-account rollups") {
+    bank::ledger l;
+    bank::user &corp = l.get_or_create_user("Corp");
+    bank::user &sales = l.get_or_create_sub_account(corp, "Sales");
+    bank::user &east = l.get_or_create_sub_account(sales, "East");
+    bank::user &ops = l.get_or_create_sub_account(corp, "Ops");
+    bank::user &bob = l.get_or_create_user("Bob");
+    CHECK(&l.get_or_create_sub_account(corp, "Sales") == &sales);
+    CHECK(east.parent() == &sales);
+    CHECK(corp.parent() == nullptr);
+    CHECK(corp.sub_accounts() == std::vector<const bank::user *>{&sales, &ops});
+
+    // Initial deposits count towards every ancestor.
+    CHECK(corp.rollup_xts() == 400);
+    CHECK(sales.rollup_xts() == 200);
+    CHECK(east.rollup_xts() == 100);
+
+    // Transfers inside a group leave its rollup alone.
+    east.transfer(ops, 30, "");
+    CHECK(corp.rollup_xts() == 400);
+    CHECK(sales.rollup_xts() == 170);
+    CHECK(ops.rollup_xts() == 130);
+    east.transfer(sales, 20, "");
+    CHECK(sales.rollup_xts() == 170);
+    CHECK(east.rollup_xts() == 50);
+
+    // Transfers out of a group move every rollup up to the root.
+    bob.transfer(east, 50, "");
+    CHECK(east.rollup_xts() == 100);
+    CHECK(sales.rollup_xts() == 220);
+    CHECK(corp.rollup_xts() == 450);
+    CHECK(bob.rollup_xts() == bob.balance_xts());
+
+    CHECK_THROWS_AS(
+        l.get_or_create_sub_account(ops, "East"), bank::hierarchy_error
+    );
+    CHECK_THROWS_AS(
+        l.get_or_create_sub_account(corp, "Bob"), bank::hierarchy_error
+    );
+    bank::ledger other;
+    CHECK_THROWS_AS(
+        other.get_or_create_sub_account(corp, "X"), bank::hierarchy_error
+    );
+
+    SUBCASE("group monitor") {
+        bank::group_monitor monitor(sales);
+        bob.transfer(east, 1, "in");
+        east.transfer(sales, 2, "inside");
+        ops.transfer(corp, 3, "elsewhere");
+        bank::group_event e = monitor.wait_next_event();
+        CHECK(e.account == &east);
+        CHECK(e.counterparty == &bob);
+        CHECK(e.balance_delta_xts == 1);
+        CHECK(e.comment == "in");
+        // Both legs of a transfer within the group.
+        e = monitor.wait_next_event();
+        CHECK(e.account == &east);
+        CHECK(e.balance_delta_xts == -2);
+        e = monitor.wait_next_event();
+        CHECK(e.account == &sales);
+        CHECK(e.counterparty == &east);
+        CHECK(!monitor.wait_next_event(std::chrono::milliseconds(10)));
+    }
+    SUBCASE("a group monitor that falls behind") {
+        bank::group_monitor monitor(sales, 2);
+        for (int i = 0; i < 5; i++) {
+            bob.transfer(east, 1, std::to_string(i));
+        }
+        bank::group_event e = monitor.wait_next_event();
+        CHECK(e.comment == "3");
+        CHECK(e.dropped_before == 3);
+        e = monitor.wait_next_event();
+        CHECK(e.comment == "4");
+        CHECK(e.dropped_before == 0);
+        CHECK(!monitor.wait_next_event(std::chrono::milliseconds(10)));
+    }
+    SUBCASE("snapshot") {
+        std::stringstream snapshot;
+        l.save(snapshot);
+        bank::ledger copy;
+        copy.load(snapshot);
+        bank::user &copy_corp = copy.get_or_create_user("Corp");
+        bank::user &copy_east = copy.get_or_create_user("East");
+        REQUIRE(copy_east.parent() != nullptr);
+        CHECK(copy_east.parent()->name() == "Sales");
+        CHECK(copy_east.parent()->parent() == &copy_corp);
+        CHECK(copy_corp.rollup_xts() == 450);
+        CHECK(copy_east.parent()->rollup_xts() == 220);
+        CHECK(copy_corp.sub_accounts().size() == 2);
+    }
+}
+
+TEST_CASE("Activity buckets answer windows from the finest level kept") {
+    using std::chrono::days;
+    using std::chrono::hours;
+    using std::chrono::minutes;
+    using std::chrono::seconds;
+    const std::chrono::sys_seconds midnight{seconds(1'700'006'400)};
+    const std::chrono::sys_seconds now = midnight + hours(10);
+    bank::activity_buckets b;
+    b.add(now - days(400), 1, 0);  // Past all retention.
+    b.add(now - days(3), 0, 13);
+    b.add(now - hours(5), 11, 0);
+    b.add(now - seconds(30), 5, 0);
+    b.add(now - minutes(90), 0, 7);  // Out of order.
+
+    bank::activity_totals t =
+        b.query(now - minutes(1), now + seconds(1), now);
+    CHECK(t.transfers == 1);
+    CHECK(t.in_xts == 5);
+    CHECK(t.from == now - minutes(1));
+    CHECK(t.to == now + minutes(1));
+
+    // Minutes are kept for two hours; the older half hour is answered by
+    // its hour bucket.
+    t = b.query(now - hours(2), now, now);
+    CHECK(t.transfers == 2);
+    CHECK(t.out_xts == 7);
+    CHECK(t.from == now - hours(2));
+    CHECK(t.to == now);
+    t = b.query(now - minutes(90), now - minutes(89), now);
+    CHECK(t.transfers == 1);
+    CHECK(t.from == now - hours(2));
+    CHECK(t.to == now - hours(1));
+
+    t = b.query(now - days(7) + seconds(100), now, now);
+    CHECK(t.transfers == 4);
+    CHECK(t.in_xts == 16);
+    CHECK(t.out_xts == 20);
+    CHECK(t.from == midnight - days(7));
+
+    t = b.query(now - days(400), now - days(380), now);
+    CHECK(t.transfers == 0);
+    CHECK(t.from == t.to);
+
+    SUBCASE("expired buckets are dropped without losing coarser ones") {
+        bank::activity_buckets busy;
+        for (int i = 0; i < 1000; i++) {
+            busy.add(now + minutes(i), 1, 2);
+        }
+        const auto end = now + minutes(1000);
+        t = busy.query(end - days(1), end, end);
+        CHECK(t.transfers == 1000);
+        CHECK(t.out_xts == 2000);
+        t = busy.query(end - minutes(30), end, end);
+        CHECK(t.transfers == 30);
+    }
+}
+
+TEST_CASE("Transfers update user and ledger activity") {
+    bank::ledger l;
+    bank::user &alice = l.get_or_create_user("Alice");
+    bank::user &bob = l.get_or_create_user("Bob");
+    bank::user &carol = l.get_or_create_user("Carol");
+    alice.transfer(bob, 10, "");
+    bob.transfer(alice, 3, "");
+    bob.transfer(carol, 4, "");
+
+    const auto now = std::chrono::floor<std::chrono::seconds>(
+        std::chrono::system_clock::now()
+    );
+    const auto from = now - std::chrono::hours(1);
+    const auto to = now + std::chrono::hours(1);
+    bank::activity_totals t = alice.activity(from, to);
+    CHECK(t.transfers == 2);
+    CHECK(t.in_xts == 3);
+    CHECK(t.out_xts == 10);
+    t = bob.activity(from, to);
+    CHECK(t.transfers == 3);
+    CHECK(t.in_xts == 10);
+    CHECK(t.out_xts == 7);
+    t = l.activity(from, to);
+    CHECK(t.transfers == 3);
+    CHECK(t.in_xts == 17);
+    CHECK(t.out_xts == 17);
+    CHECK(l.activity(from, now - std::chrono::minutes(30)).transfers == 0);
+}
+
+TEST_CASE("SHA-256 test vectors") {
+    auto hash = [](const std::string &text, std::size_t piece) {
+        bank::sha256 h;
+        for (std::size_t i = 0; i < text.size(); i += piece) {
+            h.update(text.data() + i, std::min(piece, text.size() - i));
+        }
+        return bank::to_hex(h.finish());
+    };
+    CHECK(
+        hash("", 1) ==
+        "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855"
+    );
+    CHECK(
+        hash("abc", 1) ==
+        "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad"
+    );
+    const std::string two_blocks =
+        "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq";
+    for (const std::size_t piece : {1, 7, 64, 1000}) {
+        CHECK(
+            hash(two_blocks, piece) ==
+            "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1"
+        );
+    }
+    CHECK(
+        hash(std::string(1'000'000, 'a'), 4096) ==
+        "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0"
+    );
+}
+
+TEST_CASE("Audit chains detect changed history") {
+    bank::ledger l;
+    bank::user &alice = l.get_or_create_user("Alice");
+    bank::user &bob = l.get_or_create_user("Bob");
+    const int ROUNDS = 2500;
+    for (int i = 0; i < ROUNDS; i++) {
+        alice.transfer(bob, 1, "a" + std::to_string(i));
+        bob.transfer(alice, 1, "b" + std::to_string(i));
+    }
+    const std::size_t records = 1 + 2 * ROUNDS;
+    static_assert(bank::audit_log::SEGMENT_RECORDS < 1 + 2 * ROUNDS);
+
+    bank::audit_log audit;
+    CHECK(audit.update(alice) == records);
+    CHECK(audit.update(alice) == 0);
+    CHECK(audit.update(bob) == records);
+    const bank::audit_head head = audit.head(alice);
+    CHECK(head.records == records);
+    CHECK(audit.seals(alice).size() == 1);
+    CHECK(audit.head(bob).digest != head.digest);
+
+    // Extending the chain gives the same digest as hashing in one go.
+    alice.transfer(bob, 1, "more");
+    CHECK(audit.update(alice) == 1);
+    bank::audit_log fresh;
+    fresh.update(alice);
+    CHECK(fresh.head(alice).digest == audit.head(alice).digest);
+    CHECK(fresh.seals(alice)[0].root == audit.seals(alice)[0].root);
+
+    bank::audit_report report = audit.verify(l.users(), 4);
+    CHECK(report.mismatches.empty());
+    CHECK(report.records == 2 * records + 1);
+    CHECK(report.segments == 4);
+    // On the calling thread alone.
+    CHECK(audit.verify(l.users(), 1).records == report.records);
+
+    // A restored ledger whose snapshot was edited fails in the edited
+    // segment only; the first occurrence of the comment is Alice's record.
+    std::stringstream snapshot;
+    l.save(snapshot);
+    std::string text = snapshot.str();
+    const std::string edited = "5:a4000";
+    REQUIRE(text.find("5:a2100") != std::string::npos);
+    text.replace(text.find("5:a2100"), edited.size(), edited);
+    std::stringstream tampered(text);
+    bank::ledger restored;
+    restored.load(tampered);
+    report = audit.verify(restored.users(), 2);
+    CHECK(
+        report.mismatches ==
+        std::vector<std::pair<std::string, std::size_t>>{{"Alice", 1}}
+    );
+}
+
+TEST_CASE("Snapshot diff reads only the new records") {
+    const std::filesystem::path dir = std::filesystem::temp_directory_path();
+    const std::string before_path = (dir / "bank-test-before.snapshot");
+    const std::string after_path = (dir / "bank-test-after.snapshot");
+    auto save = [](bank::ledger &l, const std::string &path) {
+        std::ofstream f(path, std::ios::binary);
+        l.save(f);
+    };
+    auto index = [](const std::string &path) {
+        std::ifstream f(path, std::ios::binary);
+        return bank::snapshot_index::read(f);
+    };
+
+    bank::ledger l;
+    std::vector<bank::user *> users;
+    for (int i = 0; i < 300; i++) {
+        users.push_back(&l.get_or_create_user("user " + std::to_string(i)));
+    }
+    for (int i = 0; i < 3000; i++) {
+        users[i % 300]->transfer(*users[(i + 1) % 300], 1, "old");
+    }
+    save(l, before_path);
+    users[7]->transfer(*users[250], 5, "new 1");
+    users[250]->transfer(*users[7], 2, "new\n2");
+    bank::user &carol = l.get_or_create_user("Carol");
+    carol.transfer(*users[7], 10, "");
+    save(l, after_path);
+
+    const bank::snapshot_index before = index(before_path);
+    const bank::snapshot_index after = index(after_path);
+    CHECK(before.format == 4);
+    REQUIRE(after.accounts.size() == 301);
+    CHECK(after.accounts[7].balance_xts == users[7]->balance_xts());
+    CHECK(after.accounts[7].transactions == 24);
+
+    for (const unsigned threads : {1U, 4U}) {
+        const bank::ledger_diff diff =
+            bank::diff_snapshots(before, after_path, after, threads);
+        CHECK(diff.unchanged == 298);
+        CHECK(diff.removed.empty());
+        REQUIRE(diff.changed.size() == 3);
+        const bank::account_diff &d = diff.changed[0];
+        CHECK(d.name == "user 7");
+        CHECK_FALSE(d.added);
+        CHECK(d.balance_before_xts == 100);
+        CHECK(d.balance_after_xts == 107);
+        CHECK(d.version_after == d.version_before + 3);
+        CHECK(d.first_record == 21);
+        CHECK(
+            d.records ==
+            std::vector<bank::diff_record>{
+                {21, "user 250", -5, "new 1"},
+                {22, "user 250", 2, "new\n2"},
+                {23, "Carol", 10, ""}}
+        );
+        CHECK(diff.changed[1].name == "user 250");
+        CHECK(diff.changed[1].records.size() == 2);
+        CHECK(diff.changed[2].added);
+        CHECK(diff.changed[2].records.size() == 2);
+        CHECK(diff.bytes_parsed < 200);
+    }
+
+    // Reversed, the new account is gone and the histories got shorter.
+    const bank::ledger_diff reversed =
+        bank::diff_snapshots(after, before_path, before, 2);
+    CHECK(reversed.removed == std::vector<std::string>{"Carol"});
+    REQUIRE(reversed.changed.size() == 2);
+    CHECK(reversed.changed[0].first_record == 0);
+    CHECK(reversed.changed[0].records.size() == 21);
+
+    // Snapshots without history sizes are indexed by parsing them.
+    std::stringstream old_format(
+        "bank-ledger 2 2\n5:Alice\n3:Bob\n"
+        "90 2 0 -1 2\n-1 100 0: 0\n1 -10 3:a b 0\n"
+        "110 2 0 0 2\n-1 100 0: 0\n0 10 3:a b 0\n"
+    );
+    const bank::snapshot_index old = bank::snapshot_index::read(old_format);
+    REQUIRE(old.accounts.size() == 2);
+    CHECK(old.accounts[1].name == "Bob");
+    CHECK(old.accounts[1].balance_xts == 110);
+    CHECK(old.accounts[1].history_bytes == 25);
+    CHECK(old.accounts[1].history_checksum.has_value());
+    CHECK(old_format.peek() == std::char_traits<char>::eof());
+
+    std::filesystem::remove(before_path);
+    std::filesystem::remove(after_path);
+}
+
+TEST_CASE("Snapshot diff checks that histories extend each other") {
+    const std::filesystem::path dir = std::filesystem::temp_directory_path();
+    const std::string before_path = (dir / "bank-test-forged-before.snapshot");
+    const std::string after_path = (dir / "bank-test-forged-after.snapshot");
+    auto save = [](bank::ledger &l, const std::string &path) {
+        std::ofstream f(path, std::ios::binary);
+        l.save(f);
+    };
+    auto index = [](const std::string &path) {
+        std::ifstream f(path, std::ios::binary);
+        return bank::snapshot_index::read(f);
+    };
+
+    bank::ledger before;
+    bank::user &alice = before.get_or_create_user("Alice");
+    alice.transfer(before.get_or_create_user("Bob"), 1, "aaa");
+    save(before, before_path);
+    // Rewritten history of the same size, then extended.
+    bank::ledger after;
+    bank::user &forged = after.get_or_create_user("Alice");
+    bank::user &bob = after.get_or_create_user("Bob");
+    forged.transfer(bob, 1, "bbb");
+    forged.transfer(bob, 1, "new");
+    save(after, after_path);
+
+    const bank::snapshot_index b = index(before_path);
+    const bank::snapshot_index a = index(after_path);
+    REQUIRE(a.accounts[0].history_checksum);
+    CHECK(*a.accounts[0].history_checksum == forged.history_checksum(3));
+    const bank::ledger_diff diff = bank::diff_snapshots(b, after_path, a, 1);
+    REQUIRE(diff.changed.size() == 2);
+    CHECK(diff.changed[0].first_record == 0);
+    CHECK(diff.changed[0].records.size() == 3);
+    CHECK(diff.changed[0].records[1].comment == "bbb");
+    CHECK(diff.changed[1].first_record == 0);
+
+    // A genuine extension is parsed from where the earlier history ends.
+    alice.transfer(before.get_or_create_user("Bob"), 1, "new");
+    save(before, after_path);
+    const bank::snapshot_index extended = index(after_path);
+    const bank::ledger_diff tail =
+        bank::diff_snapshots(b, after_path, extended, 1);
+    REQUIRE(tail.changed.size() == 2);
+    CHECK(tail.changed[0].first_record == 2);
+    CHECK(tail.changed[0].records.size() == 1);
+
+    std::filesystem::remove(before_path);
+    std::filesystem::remove(after_path);
+}
+
+TEST_CASE("HTTP requests are parsed in place") {
+    const std::string input =
+        "POST /users/a%20b/transfers?x=1 HTTP/1.1\r\n"
+        "Host: bank\r\ncontent-length: 4\r\nX-Bank-Tenant: t1\r\n\r\n"
+        "{}\r\n"
+        "GET /users/b/balance HTTP/1.0\r\nConnection: keep-alive\r\n\r\n"
+        "GET /users/c/history HTTP/1.1\r\nConnection: close\r\n\r\n";
+    std::string_view rest = input;
+    bank::http_request r;
+    std::size_t size = 0;
+    REQUIRE(
+        bank::parse_http_request(rest, r, size) ==
+        bank::http_parse_status::COMPLETE
+    );
+    CHECK(r.method == "POST");
+    CHECK(r.path == "/users/a%20b/transfers");
+    CHECK(r.query == "x=1");
+    CHECK(r.body == "{}\r\n");
+    CHECK(r.header("Content-Length") == "4");
+    CHECK(r.header("x-bank-tenant") == "t1");
+    CHECK(r.header("Accept").empty());
+    CHECK(r.keep_alive);
+    const std::size_t first_size = size;
+
+    // Pipelined requests follow one another.
+    rest.remove_prefix(size);
+    r = {};
+    REQUIRE(
+        bank::parse_http_request(rest, r, size) ==
+        bank::http_parse_status::COMPLETE
+    );
+    CHECK(r.minor_version == 0);
+    CHECK(r.keep_alive);
+    CHECK(r.body.empty());
+    rest.remove_prefix(size);
+    r = {};
+    REQUIRE(
+        bank::parse_http_request(rest, r, size) ==
+        bank::http_parse_status::COMPLETE
+    );
+    CHECK_FALSE(r.keep_alive);
+    CHECK(size == rest.size());
+
+    // HTTP/1.0 closes by default.
+    r = {};
+    CHECK(
+        bank::parse_http_request("GET / HTTP/1.0\r\n\r\n", r, size) ==
+        bank::http_parse_status::COMPLETE
+    );
+    CHECK_FALSE(r.keep_alive);
+
+    // Any prefix of a request is incomplete; the head is there once it is.
+    for (std::size_t n = 0; n < first_size; n++) {
+        r = {};
+        CHECK(
+            bank::parse_http_request(input.substr(0, n), r, size) ==
+            bank::http_parse_status::INCOMPLETE
+        );
+    }
+    r = {};
+    CHECK(
+        bank::parse_http_request(
+            "POST /x HTTP/1.1\r\nExpect: 100-continue\r\n"
+            "Content-Length: 10\r\n\r\n",
+            r, size
+        ) == bank::http_parse_status::INCOMPLETE
+    );
+    CHECK(r.expect_continue);
+
+    for (const char *bad :
+         {"GET /\r\n\r\n", "GET / HTTP/2.0\r\n\r\n", "GET  / HTTP/1.1\r\n\r\n",
+          "GET / HTTP/1.1\r\nNo colon\r\n\r\n",
+          "POST / HTTP/1.1\r\nContent-Length: x\r\n\r\n",
+          "POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n"}) {
+        r = {};
+        CHECK(
+            bank::parse_http_request(bad, r, size) ==
+            bank::http_parse_status::INVALID
+        );
+    }
+    r = {};
+    CHECK(
+        bank::parse_http_request(
+            "POST / HTTP/1.1\r\nContent-Length: 99999999\r\n\r\n", r, size
+        ) == bank::http_parse_status::TOO_LARGE
+    );
+    std::string many = "GET / HTTP/1.1\r\n";
+    for (std::size_t i = 0; i <= bank::http_request::MAX_HEADERS; i++) {
+        many += "A: b\r\n";
+    }
+    many += "\r\n";
+    r = {};
+    CHECK(
+        bank::parse_http_request(many, r, size) ==
+        bank::http_parse_status::TOO_LARGE
+    );
+}
+
+TEST_CASE("Percent-decoding and query parameters") {
+    std::string out;
+    CHECK(bank::percent_decode("b%C3%B6b%20x+y", out));
+    CHECK(out == "b\xC3\xB6" "b x+y");
+    CHECK_FALSE(bank::percent_decode("a%2", out));
+    CHECK_FALSE(bank::percent_decode("a%zz", out));
+    CHECK(bank::query_parameter("from=10&limit=5", "limit") == "5");
+    CHECK(bank::query_parameter("from=10&limit=5", "from") == "10");
+    CHECK(bank::query_parameter("xfrom=1&from=", "from") == "");
+    CHECK_FALSE(bank::query_parameter("from=10", "limit").has_value());
+    CHECK_FALSE(bank::query_parameter("", "from").has_value());
+}
+
+TEST_CASE("JSON is written and read back") {
+    std::string out;
+    bank::json_writer w(out);
+    w.begin_object()
+        .key("s")
+        .string("a\"b\\c\n\x01\xC3\xB6")
+        .key("n")
+        .number(-12)
+        .key("list")
+        .begin_array()
+        .boolean(true)
+        .null()
+        .begin_object()
+        .end_object()
+        .end_array()
+        .end_object();
+    CHECK(
+        out == R"({"s":"a\"b\\c\n\u0001)"
+               "\xC3\xB6"
+               R"(","n":-12,"list":[true,null,{}]})"
+    );
+
+    bank::json_reader r(out);
+    std::string s;
+    long long n = 0;
+    r.object([&](std::string_view key) {
+        if (key == "s") {
+            s = r.string();
+        } else if (key == "n") {
+            n = r.integer();
+        } else {
+            r.skip();
+        }
+    });
+    r.end();
+    CHECK(s == "a\"b\\c\n\x01\xC3\xB6");
+    CHECK(n == -12);
+
+    // \u escapes, surrogate pairs included, come out as UTF-8.
+    bank::json_reader u(R"( ["ö😀\/", null, 7] )");
+    std::vector<std::string> strings;
+    int nulls = 0;
+    u.array([&] {
+        if (u.null()) {
+            nulls++;
+        } else if (strings.empty()) {
+            strings.emplace_back(u.string());
+        } else {
+            CHECK(u.integer() == 7);
+        }
+    });
+    u.end();
+    CHECK(strings == std::vector<std::string>{"\xC3\xB6\xF0\x9F\x98\x80/"});
+    CHECK(nulls == 1);
+
+    auto fails = [](std::string_view text) {
+        bank::json_reader j(text);
+        CHECK_THROWS_AS(
+            j.object([&](std::string_view) { j.skip(); }), bank::json_error
+        );
+    };
+    fails(R"({"a":1,})");
+    fails(R"({"a" 1})");
+    fails(R"({"a":"\ud83d"})");
+    fails(R"({"a":"x)");
+    fails(R"({"a":[1,2)");
+    fails(std::string(100, '[') + std::string(100, ']'));
+    bank::json_reader trailing(R"({} x)");
+    trailing.object([&](std::string_view) {});
+    CHECK_THROWS_AS(trailing.end(), bank::json_error);
+    bank::json_reader big("99999999999999999999");
+    CHECK_THROWS_AS(big.integer(), bank::json_error);
+}
+
+TEST_CASE("Logical sessions frame lines and wait for credit") {
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::string sent;
+    bool connected = true;
+    auto write = [&](std::string_view frames) {
+        {
+            const std::unique_lock lock(mutex);
+            sent += frames;
+        }
+        cv.notify_all();
+        return connected;
+    };
+    bank::logical_session session(7, 20, write);
+
+    CHECK(session.push("balance"));
+    CHECK(session.push("transfer Bob 1 a b"));
+    std::string line;
+    REQUIRE(std::getline(session.stream(), line));
+    CHECK(line == "balance");
+    REQUIRE(std::getline(session.stream(), line));
+    CHECK(line == "transfer Bob 1 a b");
+
+    // Only whole lines leave, each as a frame.
+    session.stream() << "partial" << std::flush;
+    CHECK(sent.empty());
+    session.stream() << " line\nsecond\n" << std::flush;
+    CHECK(sent == "7 partial line\n7 second\n");
+
+    // The credit is spent: the next line waits for a grant.
+    std::thread writer([&] { session.stream() << "third\n" << std::flush; });
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    {
+        const std::unique_lock lock(mutex);
+        CHECK(sent == "7 partial line\n7 second\n");
+    }
+    session.grant(100);
+    {
+        std::unique_lock lock(mutex);
+        cv.wait(lock, [&] { return sent.size() > 24; });
+        CHECK(sent == "7 partial line\n7 second\n7 third\n");
+    }
+    writer.join();
+
+    // A blocked reader wakes up at the end of input once closed; then
+    // credit no longer applies and input is dropped.
+    std::thread reader([&] {
+        std::string rest;
+        CHECK(std::getline(session.stream(), rest));
+        CHECK(rest == "last");
+        CHECK_FALSE(std::getline(session.stream(), rest));
+    });
+    CHECK(session.push("last"));
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    session.close();
+    reader.join();
+    CHECK(session.closed());
+    CHECK(session.push("dropped"));
+    const std::string big(1000, 'x');
+    session.stream().clear();
+    session.stream() << big << '\n' << std::flush;
+    CHECK(sent.size() == 32 + 2 + big.size() + 1);
+
+    // A connection that is gone fails the stream.
+    connected = false;
+    session.stream().clear();
+    session.stream() << "lost\n" << std::flush;
+    CHECK_FALSE(session.stream());
+}
+
+TEST_CASE("A session out of credit waits without holding a slot") {
+    bank::command_scheduler scheduler(1, {1, 1, 1});
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::string sent;
+    auto write = [&](std::string_view frames) {
+        {
+            const std::unique_lock lock(mutex);
+            sent += frames;
+        }
+        cv.notify_all();
+        return true;
+    };
+    bank::logical_session starved(1, 0, write);
+    bank::logical_session other(2, 100, write);
+    // As the server runs a command: the reply is rendered under the slot
+    // and sent once it is released.
+    auto serve = [&](bank::logical_session &session, const char *reply) {
+        bank::reply_buffer buffer;
+        {
+            const bank::command_scheduler::slot slot(
+                scheduler, bank::qos_class::INTERACTIVE
+            );
+            std::ostream out(&buffer);
+            out << reply << std::flush;
+        }
+        buffer.for_each_piece(
+            [&](std::string_view text) {
+                session.stream().write(
+                    text.data(), static_cast<std::streamsize>(text.size())
+                );
+            },
+            [&](const bank::history_segments::segment &s) {
+                session.stream() << *s;
+            }
+        );
+        session.stream().flush();
+    };
+
+    std::thread a([&] { serve(starved, "A\n"); });
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    std::thread b([&] { serve(other, "B\n"); });
+    {
+        std::unique_lock lock(mutex);
+        CHECK(cv.wait_for(lock, std::chrono::seconds(5), [&] {
+            return sent == "2 B\n";
+        }));
+    }
+    starved.grant(100);
+    a.join();
+    b.join();
+    CHECK(sent == "2 B\n1 A\n");
+}
+
+TEST_CASE("Logical sessions limit queued input") {
+    bank::logical_session session(
+        1, 100, [](std::string_view) { return true; }
+    );
+    for (std::size_t i = 0; i < bank::logical_session::MAX_QUEUED_LINES;
+         i++) {
+        REQUIRE(session.push("balance"));
+    }
+    CHECK_FALSE(session.push("balance"));
+    std::string line;
+    std::getline(session.stream(), line);
+    CHECK(session.push("balance"));
+}
+
+TEST_CASE("Logins split off configured tenants only") {
+    using split = std::pair<std::string_view, std::string_view>;
+    std::set<std::string_view> tenants{"", "acme"};
+    const auto is_tenant = [&](std::string_view t) {
+        return tenants.count(t) != 0;
+    };
+    CHECK(bank::split_login("alice", is_tenant) == split{"alice", ""});
+    CHECK(bank::split_login("alice@acme", is_tenant) == split{"alice", "acme"});
+    CHECK(
+        bank::split_login("alice@example.com", is_tenant) ==
+        split{"alice@example.com", ""}
+    );
+    CHECK(
+        bank::split_login("alice@example.com@acme", is_tenant) ==
+        split{"alice@example.com", "acme"}
+    );
+
+    SUBCASE("without the unnamed tenant, unknown tenants are reported") {
+        tenants.erase("");
+        CHECK(
+            bank::split_login("alice@example.com", is_tenant) ==
+            split{"alice", "example.com"}
+        );
+        CHECK(bank::split_login("alice", is_tenant) == split{"alice", ""});
+    }
+}
+
+TEST_CASE("Replies keep segments by reference among the text") {
+    bank::reply_buffer reply;
+    std::ostream out(&reply);
+    const bank::history_segments::segment first =
+        std::make_shared<const std::string>("segment 1\n");
+    const bank::history_segments::segment second =
+        std::make_shared<const std::string>("segment 2\n");
+    out << "head " << 42 << '\n';
+    reply.append_segment(first);
+    reply.append_segment(second);
+    out << "tail\n" << std::flush;
+    reply.append_segment(first);
+
+    std::string sent;
+    std::vector<const std::string *> segments;
+    reply.for_each_piece(
+        [&](std::string_view text) { sent += text; },
+        [&](const bank::history_segments::segment &s) {
+            sent += *s;
+            segments.push_back(s.get());
+        }
+    );
+    CHECK(sent == "head 42\nsegment 1\nsegment 2\ntail\nsegment 1\n");
+    CHECK(segments == std::vector{first.get(), second.get(), first.get()});
+    CHECK(reply.size() == sent.size());
+
+    reply.clear();
+    CHECK(reply.size() == 0);
+    CHECK(first.use_count() == 1);
+    out << "next\n";
+    sent.clear();
+    reply.for_each_piece(
+        [&](std::string_view text) { sent += text; },
+        [&](const bank::history_segments::segment &) { FAIL(""); }
+    );
+    CHECK(sent == "next\n");
+}
+
+#if !defined(_WIN32) && defined(BANK_SERVER_PATH)
+namespace {
+// A bank-server process, killed unless it has exited on its own.
+class server_process {
+public:
+    explicit server_process(std::vector<std::string> args) {
+        args.insert(args.begin(), BANK_SERVER_PATH);
+        std::vector<char *> argv;
+        for (std::string &a : args) {
+            argv.push_back(a.data());
+        }
+        argv.push_back(nullptr);
+        pid_ = ::fork();
+        if (pid_ == 0) {
+            const int null = ::open("/dev/null", O_WRONLY);
+            ::dup2(null, STDOUT_FILENO);
+            ::dup2(null, STDERR_FILENO);
+            ::execv(BANK_SERVER_PATH, argv.data());
+            std::_Exit(127);
+        }
+        REQUIRE(pid_ > 0);
+    }
+    server_process(const server_process &) = delete;
+    server_process(server_process &&) = delete;
+    server_process &operator=(const server_process &) = delete;
+    server_process &operator=(server_process &&) = delete;
+    ~server_process() {
+        if (pid_ > 0) {
+            ::kill(pid_, SIGKILL);
+            ::waitpid(pid_, nullptr, 0);
+        }
+    }
+
+    bool exited_within(std::chrono::milliseconds timeout) {
+        const auto deadline = std::chrono::steady_clock::now() + timeout;
+        while (::waitpid(pid_, nullptr, WNOHANG) != pid_) {
+            if (std::chrono::steady_clock::now() >= deadline) {
+                return false;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        pid_ = -1;
+        return true;
+    }
+
+private:
+    pid_t pid_ = -1;
+};
+
+// The port a server writes to its port file once it is listening.
+unsigned short wait_for_port(const std::string &port_file) {
+    const auto deadline =
+        std::chrono::steady_clock::now() + std::chrono::seconds(10);
+    while (std::chrono::steady_clock::now() < deadline) {
+        std::ifstream f(port_file);
+        unsigned short port = 0;
+        if (f >> port && port != 0) {
+            return port;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    FAIL("No port in " << port_file);
+    return 0;
+}
+
+// Line protocol client; reads fail after ten seconds without data.
+class line_client {
+public:
+    explicit line_client(unsigned short port)
+        : fd_(::socket(AF_INET, SOCK_STREAM, 0)) {
+        sockaddr_in address{};
+        address.sin_family = AF_INET;
+        address.sin_port = htons(port);
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        const timeval timeout{10, 0};
+        ::setsockopt(fd_, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        // NOLINTNEXTLINE(cppcoreguidelines-pro-type-reinterpret-cast)
+        REQUIRE(::connect(fd_, reinterpret_cast<const sockaddr *>(&address),
+                          sizeof(address)) == 0);
+    }
+    line_client(const line_client &) = delete;
+    line_client(line_client &&) = delete;
+    line_client &operator=(const line_client &) = delete;
+    line_client &operator=(line_client &&) = delete;
+    ~line_client() {
+        ::close(fd_);
+    }
+
+    void send(const std::string &line) {
+        const std::string text = line + '\n';
+        REQUIRE(
+            ::send(fd_, text.data(), text.size(), MSG_NOSIGNAL) ==
+            static_cast<ssize_t>(text.size())
+        );
+    }
+
+    // Empty once the connection is closed.
+    std::string read_line() {
+        std::size_t end = input_.find('\n');
+        while (end == std::string::npos) {
+            std::array<char, 4096> chunk{};
+            const ssize_t received = ::recv(fd_, chunk.data(), chunk.size(), 0);
+            if (received <= 0) {
+                return {};
+            }
+            input_.append(chunk.data(), static_cast<std::size_t>(received));
+            end = input_.find('\n');
+        }
+        std::string line = input_.substr(0, end);
+        input_.erase(0, end + 1);
+        return line;
+    }
+
+    void login(const std::string &name) {
+        CHECK(read_line() == "What is your name?");
+        send(name);
+        CHECK(read_line() == "Hi " + name);
+    }
+
+private:
+    int fd_;
+    std::string input_;
+};
+}  // namespace
+
+TEST_CASE("A pending long-poll doesn't hold up a hot restart") {
+    const std::filesystem::path dir = std::filesystem::temp_directory_path();
+    const std::string tag = "bank-test-" + std::to_string(::getpid());
+    const std::string control = dir / (tag + ".control");
+    const std::string old_port_file = dir / (tag + ".port");
+    const std::string new_port_file = dir / (tag + ".port2");
+
+    server_process old_server({"0", old_port_file, "--control", control});
+    const unsigned short port = wait_for_port(old_port_file);
+    line_client alice(port);
+    alice.login("Alice");
+    alice.send("balance if-changed 0");
+    const std::string reply = alice.read_line();
+    REQUIRE(reply.find(" VERSION ") != std::string::npos);
+    const std::string version = reply.substr(reply.find(" VERSION ") + 9);
+    alice.send("balance wait " + version + " 3600000");
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+    const auto start = std::chrono::steady_clock::now();
+    server_process new_server({"0", new_port_file, "--takeover", control});
+    CHECK(wait_for_port(new_port_file) == port);
+    CHECK(old_server.exited_within(std::chrono::seconds(5)));
+    CHECK(std::chrono::steady_clock::now() - start < std::chrono::seconds(2));
+
+    line_client bob(port);
+    bob.login("Bob");
+    bob.send("balance");
+    CHECK(bob.read_line() == "100");
+
+    for (const std::string &path : {old_port_file, new_port_file, control}) {
+        std::filesystem::remove(path);
+    }
+}
+
+TEST_CASE("transfer-if rejects a balance out of range") {
+    const std::filesystem::path dir = std::filesystem::temp_directory_path();
+    const std::string port_file =
+        dir / ("bank-test-" + std::to_string(::getpid()) + ".port");
+
+    server_process server({"0", port_file});
+    line_client alice(wait_for_port(port_file));
+    alice.login("Alice");
+    // 2^32 + 100 would pass for 100 if narrowed to int.
+    alice.send("transfer-if balance 4294967396 Bob 1 narrowed");
+    CHECK(alice.read_line() == "Invalid transfer condition: 'balance'");
+    alice.send("balance");
+    CHECK(alice.read_line() == "100");
+
+    std::filesystem::remove(port_file);
+}
+
+TEST_CASE("HTTP connections count against the tenant session quota") {
+    const std::filesystem::path dir = std::filesystem::temp_directory_path();
+    const std::string tag = "bank-test-" + std::to_string(::getpid());
+    const std::string port_file = dir / (tag + ".port");
+    const std::string http_port_file = dir / (tag + ".http");
+
+    server_process server(
+        {"0", port_file, "--tenant", ",sessions=1", "--http",
+         "0," + http_port_file}
+    );
+    const unsigned short port = wait_for_port(port_file);
+    const unsigned short http_port = wait_for_port(http_port_file);
+    const auto get_balance = [&] {
+        line_client http(http_port);
+        http.send("GET /users/Bob/balance HTTP/1.1\r\nHost: bank\r\n\r");
+        return http.read_line();
+    };
+
+    {
+        line_client alice(port);
+        alice.login("Alice");
+        CHECK(get_balance() == "HTTP/1.1 429 Too Many Requests\r");
+    }
+    // The server notices the closed line session on its own time.
+    std::string status;
+    for (int attempt = 0; attempt < 100; attempt++) {
+        status = get_balance();
+        if (status != "HTTP/1.1 429 Too Many Requests\r") {
+            break;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    }
+    CHECK(status == "HTTP/1.1 200 OK\r");
+
+    {
+        line_client http(http_port);
+        http.send("GET /users/Bob/balance HTTP/1.1\r\nHost: bank\r\n\r");
+        CHECK(http.read_line() == "HTTP/1.1 200 OK\r");
+        line_client alice(port);
+        CHECK(alice.read_line() == "What is your name?");
+        alice.send("Alice");
+        CHECK(alice.read_line() == "Session limit reached");
+    }
+
+    for (const std::string &path : {port_file, http_port_file}) {
+        std::filesystem::remove(path);
+    }
+}
+#endif
+
 // NOLINTEND(misc-use-anonymous-namespace)
 // NOLINTEND(readability-function-cognitive-complexity)
@@ -0,0 +1,144 @@
+#include "command_scheduler.hpp"
+#include <algorithm>
+
+std::string bank::qos_class_name(qos_class c) {
+    switch (c) {
+        case qos_class::INTERACTIVE:
+            return "interactive";
+        case qos_class::BULK:
+            return "bulk";
+        case qos_class::ADMIN:
+            return "admin";
+    }
+    return "unknown";
+}
+
+bank::command_scheduler::command_scheduler(
+    unsigned slots,
+    const std::array<unsigned, QOS_CLASS_COUNT> &weights
+)
+    : slots_(slots), free_slots_(slots) {
+    for (std::size_t i = 0; i < QOS_CLASS_COUNT; i++) {
+        strides_[i] = STRIDE_SCALE / std::max(weights[i], 1U);
+    }
+}
+
+bool bank::command_scheduler::acquire(qos_class c, bool counted) {
+    const auto index = static_cast<std::size_t>(c);
+    std::unique_lock lock(mutex_);
+    if (counted) {
+        stats_[index].commands++;
+    }
+    const bool queues_empty = std::all_of(
+        queues_.begin(), queues_.end(), [](const auto &q) { return q.empty(); }
+    );
+    if (free_slots_ > 0 && queues_empty) {
+        free_slots_--;
+        return false;
+    }
+    // A class that was idle must not bank credit for the time it didn't
+    // compete.
+    if (queues_[index].empty()) {
+        pass_[index] = std::max(pass_[index], global_pass_);
+    }
+    const auto start = std::chrono::steady_clock::now();
+    waiter w;
+    queues_[index].push_back(&w);
+    grant_waiting();
+    w.cv.wait(lock, [&] { return w.granted; });
+    stats_[index].waited++;
+    stats_[index].wait_time += std::chrono::steady_clock::now() - start;
+    if (!counted) {
+        stats_[index].preempted++;
+    }
+    return true;
+}
+
+void bank::command_scheduler::release() {
+    const std::unique_lock lock(mutex_);
+    free_slots_++;
+    grant_waiting();
+}
+
+void bank::command_scheduler::grant_waiting() {
+    while (free_slots_ > 0) {
+        std::size_t next = QOS_CLASS_COUNT;
+        for (std::size_t i = 0; i < QOS_CLASS_COUNT; i++) {
+            if (!queues_[i].empty() &&
+                (next == QOS_CLASS_COUNT || pass_[i] < pass_[next])) {
+                next = i;
+            }
+        }
+        if (next == QOS_CLASS_COUNT) {
+            return;
+        }
+        waiter *w = queues_[next].front();
+        queues_[next].pop_front();
+        global_pass_ = pass_[next];
+        pass_[next] += strides_[next];
+        free_slots_--;
+        w->granted = true;
+        w->cv.notify_one();
+    }
+}
+
+bank::command_scheduler::class_stats
+bank::command_scheduler::stats(qos_class c) {
+    const std::unique_lock lock(mutex_);
+    return stats_[static_cast<std::size_t>(c)];
+}
+
+std::size_t bank::command_scheduler::queued(qos_class c) {
+    const std::unique_lock lock(mutex_);
+    return queues_[static_cast<std::size_t>(c)].size();
+}
+
+void bank::command_scheduler::print_metrics(std::ostream &os) {
+    if (slots_ == 0) {
+        return;
+    }
+    for (std::size_t i = 0; i < QOS_CLASS_COUNT; i++) {
+        const auto c = static_cast<qos_class>(i);
+        const class_stats s = stats(c);
+        const std::string prefix = "qos." + qos_class_name(c) + '.';
+        os << prefix << "commands\t" << s.commands << '\n'
+           << prefix << "queued\t" << queued(c) << '\n'
+           << prefix << "waited\t" << s.waited << '\n'
+           << prefix << "wait_us\t"
+           << std::chrono::duration_cast<std::chrono::microseconds>(
+                  s.wait_time
+              )
+                  .count()
+           << '\n'
+           << prefix << "preempted\t" << s.preempted << '\n';
+    }
+}
+
+bank::command_scheduler::slot::slot(command_scheduler &scheduler, qos_class c)
+    : scheduler_(scheduler), class_(c) {
+    if (scheduler_.slots_ != 0) {
+        scheduler_.acquire(class_, true);
+        held_ = true;
+    }
+}
+
+bank::command_scheduler::slot::~slot() {
+    if (held_) {
+        scheduler_.release();
+    }
+}
+
+void bank::command_scheduler::slot::pause() {
+    if (held_) {
+        scheduler_.release();
+        held_ = false;
+    }
+}
+
+bool bank::command_scheduler::slot::resume() {
+    if (held_ || scheduler_.slots_ == 0) {
+        return false;
+    }
+    held_ = true;
+    return scheduler_.acquire(class_, false);
+}
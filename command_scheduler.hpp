@@ -0,0 +1,98 @@
+#ifndef COMMAND_SCHEDULER_H
+#define COMMAND_SCHEDULER_H
+
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <ostream>
+#include <string>
+
+namespace bank {
+enum class qos_class { INTERACTIVE, BULK, ADMIN };
+constexpr std::size_t QOS_CLASS_COUNT = 3;
+
+[[nodiscard]] std::string qos_class_name(qos_class c);
+
+// Admission control for server commands. At most `slots` commands execute
+// at a time; the others wait in a FIFO queue per class. When a slot frees
+// up, the next class is picked by stride scheduling, so backlogged classes
+// share slots in proportion to their weights. Long commands give their slot
+// up between chunks of work (pause() and resume()), which lets waiting
+// commands, interactive ones first, run in between.
+class command_scheduler {
+public:
+    // Zero slots disables scheduling: every acquire succeeds at once.
+    command_scheduler(
+        unsigned slots,
+        const std::array<unsigned, QOS_CLASS_COUNT> &weights
+    );
+
+    // RAII execution slot, held for the duration of one command.
+    class slot {
+    public:
+        slot(command_scheduler &scheduler, qos_class c);
+        slot(const slot &) = delete;
+        slot(slot &&) = delete;
+        slot &operator=(const slot &) = delete;
+        slot &operator=(slot &&) = delete;
+        ~slot();
+
+        // Gives the slot up while blocking on something else, such as a
+        // long-poll.
+        void pause();
+        // Takes a slot again, queueing behind waiting commands if any.
+        // Returns true if it had to wait, i.e. the command was preempted.
+        bool resume();
+
+    private:
+        command_scheduler &scheduler_;
+        qos_class class_;
+        bool held_ = false;
+    };
+
+    struct class_stats {
+        std::uint64_t commands = 0;
+        std::uint64_t waited = 0;
+        std::chrono::nanoseconds wait_time{0};
+        std::uint64_t preempted = 0;
+    };
+
+    [[nodiscard]] class_stats stats(qos_class c);
+    // Commands of the class currently waiting for a slot.
+    [[nodiscard]] std::size_t queued(qos_class c);
+    [[nodiscard]] unsigned slots() const noexcept {
+        return slots_;
+    }
+    void print_metrics(std::ostream &os);
+
+private:
+    struct waiter {
+        std::condition_variable cv;
+        bool granted = false;
+    };
+
+    static constexpr std::uint64_t STRIDE_SCALE = 1 << 20;
+
+    const unsigned slots_;
+    std::array<std::uint64_t, QOS_CLASS_COUNT> strides_{};
+    std::mutex mutex_;
+    unsigned free_slots_;
+    std::array<std::deque<waiter *>, QOS_CLASS_COUNT> queues_;
+    // Stride scheduling state: the class with the lowest pass goes next.
+    std::array<std::uint64_t, QOS_CLASS_COUNT> pass_{};
+    std::uint64_t global_pass_ = 0;
+    std::array<class_stats, QOS_CLASS_COUNT> stats_{};
+
+    // Returns true if the caller had to wait.
+    bool acquire(qos_class c, bool counted);
+    void release();
+    // Hands free slots to waiters. Must be called under mutex_.
+    void grant_waiting();
+};
+}  // namespace bank
+
+#endif  // COMMAND_SCHEDULER_H
@@ -0,0 +1,100 @@
+#include "cost_meter.hpp"
+#include <atomic>
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+
+#ifdef _WIN32
+#include <malloc.h>
+#else
+#include <ctime>
+#endif
+
+namespace {
+std::atomic<bool> counting = false;
+thread_local std::uint64_t thread_allocations = 0;
+thread_local std::uint64_t thread_allocated_bytes = 0;
+
+void count(std::size_t size) noexcept {
+    if (counting.load(std::memory_order_relaxed)) {
+        thread_allocations++;
+        thread_allocated_bytes += size;
+    }
+}
+
+std::uint64_t thread_cpu_time_ns() noexcept {
+#ifndef _WIN32
+    timespec ts{};
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return static_cast<std::uint64_t>(ts.tv_sec) * 1'000'000'000U +
+           static_cast<std::uint64_t>(ts.tv_nsec);
+#else
+    return 0;
+#endif
+}
+}  // namespace
+
+void bank::count_allocations(bool enabled) noexcept {
+    counting.store(enabled, std::memory_order_relaxed);
+}
+
+bank::cost_meter::cost_meter() noexcept
+    : start_{thread_cpu_time_ns(), thread_allocations, thread_allocated_bytes} {
+}
+
+bank::work_cost bank::cost_meter::cost() const noexcept {
+    return {
+        thread_cpu_time_ns() - start_.cpu_ns,
+        thread_allocations - start_.allocations,
+        thread_allocated_bytes - start_.allocated_bytes};
+}
+
+// NOLINTBEGIN(cppcoreguidelines-no-malloc)
+void *operator new(std::size_t size) {
+    count(size);
+    if (void *p = std::malloc(size == 0 ? 1 : size)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void *operator new(std::size_t size, std::align_val_t alignment) {
+    count(size);
+    const auto align = static_cast<std::size_t>(alignment);
+    // aligned_alloc() wants a multiple of the alignment.
+    const std::size_t rounded = (size + align - 1) / align * align;
+#ifdef _WIN32
+    void *p = _aligned_malloc(rounded == 0 ? align : rounded, align);
+#else
+    void *p = std::aligned_alloc(align, rounded == 0 ? align : rounded);
+#endif
+    if (p != nullptr) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept {
+    std::free(p);
+}
+
+void operator delete(void *p, std::size_t /*size*/) noexcept {
+    std::free(p);
+}
+
+void operator delete(void *p, std::align_val_t /*alignment*/) noexcept {
+#ifdef _WIN32
+    _aligned_free(p);
+#else
+    std::free(p);
+#endif
+}
+
+void operator delete(
+    void *p,
+    std::size_t /*size*/,
+    std::align_val_t alignment
+) noexcept {
+    operator delete(p, alignment);
+}
+// NOLINTEND(cppcoreguidelines-no-malloc)
@@ -0,0 +1,34 @@
+#ifndef COST_METER_H
+#define COST_METER_H
+
+#include <cstdint>
+
+namespace bank {
+// Heap allocations are counted by the global operator new and delete that
+// cost_meter.cpp replaces, per thread and only while counting is enabled:
+// otherwise the hooks cost one relaxed load. Linking cost_meter.cpp into a
+// program replaces them for the whole program. The aligned forms are
+// replaced as well; array and nothrow forms forward to these.
+void count_allocations(bool enabled) noexcept;
+
+// Resources spent by one thread on a piece of work, such as a command.
+struct work_cost {
+    std::uint64_t cpu_ns = 0;
+    std::uint64_t allocations = 0;
+    std::uint64_t allocated_bytes = 0;
+};
+
+// Measures what the current thread spends between construction and cost():
+// its CPU time and the allocations it makes while counting is enabled.
+class cost_meter {
+public:
+    cost_meter() noexcept;
+
+    [[nodiscard]] work_cost cost() const noexcept;
+
+private:
+    work_cost start_;
+};
+}  // namespace bank
+
+#endif  // COST_METER_H
@@ -0,0 +1,25 @@
+#include "counterparty_cache.hpp"
+
+bank::user &bank::counterparty_cache::resolve(
+    ledger &l,
+    const std::string &name,
+    bool &hit
+) {
+    if (&l != ledger_) {
+        entries_.clear();
+        ledger_ = &l;
+    }
+    if (auto it = entries_.find(name); it != entries_.end()) {
+        hits_++;
+        hit = true;
+        return *it->second;
+    }
+    misses_++;
+    hit = false;
+    user &u = l.get_or_create_user(name);
+    if (entries_.size() >= MAX_ENTRIES) {
+        entries_.clear();
+    }
+    entries_.emplace(name, &u);
+    return u;
+}
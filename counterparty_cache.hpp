@@ -0,0 +1,40 @@
+#ifndef COUNTERPARTY_CACHE_H
+#define COUNTERPARTY_CACHE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include "bank.hpp"
+
+namespace bank {
+// Per-session map from counterparty name to user, which skips hashing and
+// locking in the ledger for repeated counterparties.
+//
+// Entries never go stale: a ledger never removes users and a user keeps its
+// address as the ledger grows. They are only valid for the ledger they were
+// resolved in, so resolving in another ledger drops them. The map is also
+// dropped when it holds MAX_ENTRIES names.
+class counterparty_cache {
+public:
+    static constexpr std::size_t MAX_ENTRIES = 64;
+
+    user &resolve(ledger &l, const std::string &name, bool &hit);
+
+    [[nodiscard]] std::uint64_t hits() const noexcept {
+        return hits_;
+    }
+
+    [[nodiscard]] std::uint64_t misses() const noexcept {
+        return misses_;
+    }
+
+private:
+    const ledger *ledger_ = nullptr;
+    std::unordered_map<std::string, user *> entries_;
+    std::uint64_t hits_ = 0;
+    std::uint64_t misses_ = 0;
+};
+}  // namespace bank
+
+#endif  // COUNTERPARTY_CACHE_H
@@ -0,0 +1,73 @@
+#include "history_segments.hpp"
+#include <algorithm>
+#include <stdexcept>
+
+void bank::append_history_record(std::string &out, const transaction &t) {
+    out += t.counterparty == nullptr ? "-" : t.counterparty->name();
+    out += '\t';
+    out += std::to_string(t.balance_delta_xts);
+    out += '\t';
+    out += t.comment;
+    out += '\n';
+}
+
+bank::history_segments::segment
+bank::history_segments::get(const user &u, std::size_t index) {
+    const key id{&u, index};
+    {
+        const std::unique_lock lock(mutex_);
+        const auto it = cache_.find(id);
+        if (it != cache_.end()) {
+            lru_.splice(lru_.begin(), lru_, it->second);
+            return it->second->text;
+        }
+    }
+    // Built outside the cache lock; a concurrent request for the same
+    // segment may build it too, the first one stored wins.
+    segment s = build(u, index);
+    const std::unique_lock lock(mutex_);
+    const auto [it, inserted] = cache_.try_emplace(id);
+    if (!inserted) {
+        return it->second->text;
+    }
+    lru_.push_front(entry{id, s});
+    it->second = lru_.begin();
+    segments_++;
+    bytes_ += s->size();
+    // The segment just stored is kept even if it alone exceeds the budget.
+    while (bytes_ > budget_bytes_ && lru_.size() > 1) {
+        const entry &oldest = lru_.back();
+        segments_--;
+        bytes_ -= oldest.text->size();
+        evictions_++;
+        cache_.erase(oldest.id);
+        lru_.pop_back();
+    }
+    return s;
+}
+
+bank::history_segments::segment
+bank::history_segments::build(const user &u, std::size_t index) {
+    const std::size_t begin = index * SEGMENT_RECORDS;
+    const std::size_t end = begin + SEGMENT_RECORDS;
+    auto text = std::make_shared<std::string>();
+    for (std::size_t from = begin; from < end; from += BUILD_CHUNK) {
+        u.snapshot_transactions([&](const auto &transactions, int) {
+            // Only a sealed segment is immutable.
+            if (transactions.size() < end) {
+                throw std::logic_error("History segment is not sealed");
+            }
+            for (std::size_t i = from; i < from + BUILD_CHUNK; i++) {
+                append_history_record(*text, transactions[i]);
+            }
+        });
+    }
+    text->shrink_to_fit();
+    return text;
+}
+
+void bank::history_segments::print_metrics(std::ostream &os) const {
+    os << "history.segments\t" << segments_ << '\n'
+       << "history.segment_bytes\t" << bytes_ << '\n'
+       << "history.segment_evictions\t" << evictions_ << '\n';
+}
@@ -0,0 +1,81 @@
+#ifndef HISTORY_SEGMENTS_H
+#define HISTORY_SEGMENTS_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <utility>
+#include "bank.hpp"
+
+namespace bank {
+// Appends one history record in the `transactions` reply format:
+// "<counterparty or ->\t<delta>\t<comment>\n".
+void append_history_record(std::string &out, const transaction &t);
+
+// Pre-serialized text of sealed history segments, for large `transactions`
+// replies. History is append-only, so once an account has (k + 1) *
+// SEGMENT_RECORDS records, segment k, records [k * SEGMENT_RECORDS,
+// (k + 1) * SEGMENT_RECORDS), is sealed: it never changes. Its text is built
+// on first use and shared, read-only, by every reply covering it, which can
+// hand it to the kernel without copying.
+//
+// The cache keeps at most `budget_bytes` of segment text and drops the
+// least recently used segments beyond that. A dropped segment stays alive
+// while replies still hold it and is rebuilt on its next use.
+class history_segments {
+public:
+    static constexpr std::size_t SEGMENT_RECORDS = 4096;
+    static constexpr std::size_t DEFAULT_BUDGET_BYTES = 256 * 1024 * 1024;
+    using segment = std::shared_ptr<const std::string>;
+
+    explicit history_segments(
+        std::size_t budget_bytes = DEFAULT_BUDGET_BYTES
+    ) noexcept
+        : budget_bytes_(budget_bytes) {
+    }
+
+    // Segment `index` of the user's history, which must be sealed.
+    segment get(const user &u, std::size_t index);
+
+    [[nodiscard]] std::uint64_t segments() const noexcept {
+        return segments_;
+    }
+    [[nodiscard]] std::uint64_t bytes() const noexcept {
+        return bytes_;
+    }
+    [[nodiscard]] std::uint64_t evictions() const noexcept {
+        return evictions_;
+    }
+    void print_metrics(std::ostream &os) const;
+
+private:
+    // Records formatted per snapshot_transactions() call, so that building
+    // a segment holds the account lock only briefly.
+    static constexpr std::size_t BUILD_CHUNK = 256;
+
+    using key = std::pair<const user *, std::size_t>;
+    struct entry {
+        key id;
+        segment text;
+    };
+
+    const std::size_t budget_bytes_;
+    std::mutex mutex_;
+    std::list<entry> lru_;  // Most recently used first.
+    std::map<key, std::list<entry>::iterator> cache_;
+    // Of the cached segments.
+    std::atomic<std::uint64_t> segments_ = 0;
+    std::atomic<std::uint64_t> bytes_ = 0;
+    std::atomic<std::uint64_t> evictions_ = 0;
+
+    static segment build(const user &u, std::size_t index);
+};
+}  // namespace bank
+
+#endif  // HISTORY_SEGMENTS_H
@@ -0,0 +1,534 @@
+#include "http.hpp"
+#include <array>
+#include <charconv>
+
+namespace {
+char lower(char c) noexcept {
+    return c >= 'A' && c <= 'Z' ? static_cast<char>(c - 'A' + 'a') : c;
+}
+
+bool iequals(std::string_view a, std::string_view b) noexcept {
+    if (a.size() != b.size()) {
+        return false;
+    }
+    for (std::size_t i = 0; i < a.size(); i++) {
+        if (lower(a[i]) != lower(b[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+std::string_view trim(std::string_view s) noexcept {
+    while (!s.empty() && (s.front() == ' ' || s.front() == '\t')) {
+        s.remove_prefix(1);
+    }
+    while (!s.empty() && (s.back() == ' ' || s.back() == '\t')) {
+        s.remove_suffix(1);
+    }
+    return s;
+}
+
+// Whether a comma-separated header value lists `token`.
+bool has_token(std::string_view value, std::string_view token) noexcept {
+    while (!value.empty()) {
+        const auto comma = value.find(',');
+        if (iequals(trim(value.substr(0, comma)), token)) {
+            return true;
+        }
+        if (comma == std::string_view::npos) {
+            break;
+        }
+        value.remove_prefix(comma + 1);
+    }
+    return false;
+}
+
+int hex_digit(char c) noexcept {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (lower(c) >= 'a' && lower(c) <= 'f') {
+        return lower(c) - 'a' + 10;
+    }
+    return -1;
+}
+
+void append_utf8(std::string &out, std::uint32_t code_point) {
+    auto byte = [&](std::uint32_t b) { out += static_cast<char>(b); };
+    if (code_point < 0x80) {
+        byte(code_point);
+    } else if (code_point < 0x800) {
+        byte(0xC0 | (code_point >> 6U));
+        byte(0x80 | (code_point & 0x3FU));
+    } else if (code_point < 0x10000) {
+        byte(0xE0 | (code_point >> 12U));
+        byte(0x80 | ((code_point >> 6U) & 0x3FU));
+        byte(0x80 | (code_point & 0x3FU));
+    } else {
+        byte(0xF0 | (code_point >> 18U));
+        byte(0x80 | ((code_point >> 12U) & 0x3FU));
+        byte(0x80 | ((code_point >> 6U) & 0x3FU));
+        byte(0x80 | (code_point & 0x3FU));
+    }
+}
+}  // namespace
+
+std::string_view bank::http_request::header(std::string_view name
+) const noexcept {
+    for (std::size_t i = 0; i < header_count; i++) {
+        if (iequals(headers[i].first, name)) {
+            return headers[i].second;
+        }
+    }
+    return {};
+}
+
+bank::http_parse_status bank::parse_http_request(
+    std::string_view input,
+    http_request &request,
+    std::size_t &size
+) {
+    using status = http_parse_status;
+    // Empty lines before a request are allowed (RFC 9112, section 2.2).
+    std::size_t start = 0;
+    while (input.substr(start, 2) == "\r\n") {
+        start += 2;
+    }
+    const std::size_t head_end = input.find("\r\n\r\n", start);
+    if (head_end == std::string_view::npos) {
+        return input.size() - start > http_request::MAX_HEAD_BYTES
+                   ? status::TOO_LARGE
+                   : status::INCOMPLETE;
+    }
+    if (head_end - start > http_request::MAX_HEAD_BYTES) {
+        return status::TOO_LARGE;
+    }
+    std::string_view head = input.substr(start, head_end - start + 2);
+
+    // <method> <target> HTTP/1.<minor>
+    const std::size_t line_end = head.find("\r\n");
+    std::string_view line = head.substr(0, line_end);
+    head.remove_prefix(line_end + 2);
+    const std::size_t space1 = line.find(' ');
+    const std::size_t space2 = line.find(' ', space1 + 1);
+    if (space1 == 0 || space2 == std::string_view::npos) {
+        return status::INVALID;
+    }
+    request = http_request{};
+    request.method = line.substr(0, space1);
+    const std::string_view target =
+        line.substr(space1 + 1, space2 - space1 - 1);
+    const std::string_view version = line.substr(space2 + 1);
+    if (target.empty() || target.front() != '/' ||
+        (version != "HTTP/1.1" && version != "HTTP/1.0")) {
+        return status::INVALID;
+    }
+    request.minor_version = version.back() - '0';
+    const std::size_t question = target.find('?');
+    request.path = target.substr(0, question);
+    if (question != std::string_view::npos) {
+        request.query = target.substr(question + 1);
+    }
+
+    bool keep_alive = request.minor_version == 1;
+    std::size_t content_length = 0;
+    while (!head.empty()) {
+        const std::size_t end = head.find("\r\n");
+        line = head.substr(0, end);
+        head.remove_prefix(end + 2);
+        const std::size_t colon = line.find(':');
+        // No name, whitespace before the colon or a folded line.
+        if (colon == 0 || colon == std::string_view::npos ||
+            line.substr(0, colon).find_first_of(" \t") !=
+                std::string_view::npos) {
+            return status::INVALID;
+        }
+        if (request.header_count == http_request::MAX_HEADERS) {
+            return status::TOO_LARGE;
+        }
+        const std::string_view name = line.substr(0, colon);
+        const std::string_view value = trim(line.substr(colon + 1));
+        request.headers[request.header_count++] = {name, value};
+        if (iequals(name, "Content-Length")) {
+            const auto [end_ptr, error] = std::from_chars(
+                value.data(), value.data() + value.size(), content_length
+            );
+            if (value.empty() || error != std::errc{} ||
+                end_ptr != value.data() + value.size()) {
+                return status::INVALID;
+            }
+            if (content_length > http_request::MAX_BODY_BYTES) {
+                return status::TOO_LARGE;
+            }
+        } else if (iequals(name, "Transfer-Encoding")) {
+            return status::INVALID;
+        } else if (iequals(name, "Connection")) {
+            if (has_token(value, "close")) {
+                keep_alive = false;
+            } else if (has_token(value, "keep-alive")) {
+                keep_alive = true;
+            }
+        } else if (iequals(name, "Expect")) {
+            request.expect_continue = iequals(value, "100-continue");
+        }
+    }
+    request.keep_alive = keep_alive;
+
+    const std::size_t body_start = head_end + 4;
+    if (input.size() - body_start < content_length) {
+        return status::INCOMPLETE;
+    }
+    request.body = input.substr(body_start, content_length);
+    size = body_start + content_length;
+    return status::COMPLETE;
+}
+
+bool bank::percent_decode(std::string_view in, std::string &out) {
+    out.clear();
+    for (std::size_t i = 0; i < in.size(); i++) {
+        if (in[i] != '%') {
+            out += in[i];
+            continue;
+        }
+        if (in.size() - i < 3) {
+            return false;
+        }
+        const int high = hex_digit(in[i + 1]);
+        const int low = hex_digit(in[i + 2]);
+        if (high < 0 || low < 0) {
+            return false;
+        }
+        out += static_cast<char>(high * 16 + low);
+        i += 2;
+    }
+    return true;
+}
+
+std::optional<std::string_view> bank::query_parameter(
+    std::string_view query,
+    std::string_view name
+) noexcept {
+    while (!query.empty()) {
+        const std::size_t amp = query.find('&');
+        const std::string_view parameter = query.substr(0, amp);
+        const std::size_t eq = parameter.find('=');
+        if (parameter.substr(0, eq) == name) {
+            return eq == std::string_view::npos ? std::string_view()
+                                                : parameter.substr(eq + 1);
+        }
+        if (amp == std::string_view::npos) {
+            break;
+        }
+        query.remove_prefix(amp + 1);
+    }
+    return std::nullopt;
+}
+
+void bank::json_writer::separate() {
+    if (comma_) {
+        out_ += ',';
+    }
+}
+
+bank::json_writer &bank::json_writer::begin_object() {
+    separate();
+    out_ += '{';
+    comma_ = false;
+    return *this;
+}
+
+bank::json_writer &bank::json_writer::end_object() {
+    out_ += '}';
+    comma_ = true;
+    return *this;
+}
+
+bank::json_writer &bank::json_writer::begin_array() {
+    separate();
+    out_ += '[';
+    comma_ = false;
+    return *this;
+}
+
+bank::json_writer &bank::json_writer::end_array() {
+    out_ += ']';
+    comma_ = true;
+    return *this;
+}
+
+bank::json_writer &bank::json_writer::key(std::string_view name) {
+    separate();
+    append_escaped(name);
+    out_ += ':';
+    comma_ = false;
+    return *this;
+}
+
+bank::json_writer &bank::json_writer::string(std::string_view s) {
+    separate();
+    append_escaped(s);
+    comma_ = true;
+    return *this;
+}
+
+bank::json_writer &bank::json_writer::number(long long n) {
+    separate();
+    std::array<char, 24> digits{};
+    const auto result =
+        std::to_chars(digits.data(), digits.data() + digits.size(), n);
+    out_.append(digits.data(), result.ptr);
+    comma_ = true;
+    return *this;
+}
+
+bank::json_writer &bank::json_writer::boolean(bool b) {
+    separate();
+    out_ += b ? "true" : "false";
+    comma_ = true;
+    return *this;
+}
+
+bank::json_writer &bank::json_writer::null() {
+    separate();
+    out_ += "null";
+    comma_ = true;
+    return *this;
+}
+
+void bank::json_writer::append_escaped(std::string_view s) {
+    static constexpr std::string_view HEX = "0123456789abcdef";
+    out_ += '"';
+    // Copy runs of plain characters in one go.
+    std::size_t run = 0;
+    for (std::size_t i = 0; i < s.size(); i++) {
+        const auto c = static_cast<unsigned char>(s[i]);
+        if (c >= 0x20 && c != '"' && c != '\\') {
+            continue;
+        }
+        out_.append(s.substr(run, i - run));
+        run = i + 1;
+        switch (c) {
+            case '"':
+                out_ += "\\\"";
+                break;
+            case '\\':
+                out_ += "\\\\";
+                break;
+            case '\n':
+                out_ += "\\n";
+                break;
+            case '\r':
+                out_ += "\\r";
+                break;
+            case '\t':
+                out_ += "\\t";
+                break;
+            default:
+                out_ += "\\u00";
+                out_ += HEX[c >> 4U];
+                out_ += HEX[c & 0xFU];
+        }
+    }
+    out_.append(s.substr(run));
+    out_ += '"';
+}
+
+void bank::json_reader::skip_space() noexcept {
+    while (pos_ < text_.size() &&
+           (text_[pos_] == ' ' || text_[pos_] == '\t' || text_[pos_] == '\n' ||
+            text_[pos_] == '\r')) {
+        pos_++;
+    }
+}
+
+void bank::json_reader::expect(char c) {
+    if (!consume(c)) {
+        throw json_error(std::string("Expected '") + c + "'");
+    }
+}
+
+bool bank::json_reader::consume(char c) {
+    skip_space();
+    if (pos_ < text_.size() && text_[pos_] == c) {
+        pos_++;
+        return true;
+    }
+    return false;
+}
+
+std::string_view bank::json_reader::string() {
+    return read_string(buffer_);
+}
+
+std::string_view bank::json_reader::read_string(std::string &buffer) {
+    expect('"');
+    const std::size_t start = pos_;
+    // Without escapes the string is a view of the text.
+    while (pos_ < text_.size() && text_[pos_] != '"' && text_[pos_] != '\\') {
+        if (static_cast<unsigned char>(text_[pos_]) < 0x20) {
+            throw json_error("Control character in string");
+        }
+        pos_++;
+    }
+    if (pos_ == text_.size()) {
+        throw json_error("Unterminated string");
+    }
+    if (text_[pos_] == '"') {
+        return text_.substr(start, pos_++ - start);
+    }
+    buffer.assign(text_.substr(start, pos_ - start));
+    auto read_hex4 = [&]() -> std::uint32_t {
+        if (text_.size() - pos_ < 4) {
+            throw json_error("Bad \\u escape");
+        }
+        std::uint32_t value = 0;
+        for (int i = 0; i < 4; i++) {
+            const int digit = hex_digit(text_[pos_++]);
+            if (digit < 0) {
+                throw json_error("Bad \\u escape");
+            }
+            value = value * 16 + static_cast<std::uint32_t>(digit);
+        }
+        return value;
+    };
+    while (true) {
+        if (pos_ == text_.size()) {
+            throw json_error("Unterminated string");
+        }
+        const char c = text_[pos_++];
+        if (c == '"') {
+            return buffer;
+        }
+        if (static_cast<unsigned char>(c) < 0x20) {
+            throw json_error("Control character in string");
+        }
+        if (c != '\\') {
+            buffer += c;
+            continue;
+        }
+        if (pos_ == text_.size()) {
+            throw json_error("Unterminated string");
+        }
+        switch (const char e = text_[pos_++]) {
+            case '"':
+            case '\\':
+            case '/':
+                buffer += e;
+                break;
+            case 'b':
+                buffer += '\b';
+                break;
+            case 'f':
+                buffer += '\f';
+                break;
+            case 'n':
+                buffer += '\n';
+                break;
+            case 'r':
+                buffer += '\r';
+                break;
+            case 't':
+                buffer += '\t';
+                break;
+            case 'u': {
+                std::uint32_t code_point = read_hex4();
+                if (code_point >= 0xD800 && code_point < 0xDC00) {
+                    // High surrogate: a low one must follow.
+                    if (text_.substr(pos_, 2) != "\\u") {
+                        throw json_error("Unpaired surrogate");
+                    }
+                    pos_ += 2;
+                    const std::uint32_t low = read_hex4();
+                    if (low < 0xDC00 || low >= 0xE000) {
+                        throw json_error("Unpaired surrogate");
+                    }
+                    code_point =
+                        0x10000 + ((code_point - 0xD800) << 10U) +
+                        (low - 0xDC00);
+                } else if (code_point >= 0xDC00 && code_point < 0xE000) {
+                    throw json_error("Unpaired surrogate");
+                }
+                append_utf8(buffer, code_point);
+            } break;
+            default:
+                throw json_error("Bad escape in string");
+        }
+    }
+}
+
+long long bank::json_reader::integer() {
+    skip_space();
+    long long value = 0;
+    const char *begin = text_.data() + pos_;
+    const char *end = text_.data() + text_.size();
+    const auto [ptr, error] = std::from_chars(begin, end, value);
+    if (error == std::errc::result_out_of_range) {
+        throw json_error("Integer out of range");
+    }
+    if (error != std::errc{} ||
+        (ptr != end && (*ptr == '.' || *ptr == 'e' || *ptr == 'E'))) {
+        throw json_error("Expected an integer");
+    }
+    pos_ += static_cast<std::size_t>(ptr - begin);
+    return value;
+}
+
+bool bank::json_reader::null() {
+    skip_space();
+    if (text_.substr(pos_, 4) == "null") {
+        pos_ += 4;
+        return true;
+    }
+    return false;
+}
+
+void bank::json_reader::skip() {
+    skip(0);
+}
+
+void bank::json_reader::skip(int depth) {
+    if (depth > MAX_DEPTH) {
+        throw json_error("Nested too deep");
+    }
+    skip_space();
+    if (pos_ == text_.size()) {
+        throw json_error("Expected a value");
+    }
+    switch (text_[pos_]) {
+        case '{':
+            object([&](std::string_view) { skip(depth + 1); });
+            return;
+        case '[':
+            array([&] { skip(depth + 1); });
+            return;
+        case '"':
+            string();
+            return;
+        default:
+            break;
+    }
+    for (const std::string_view literal : {"true", "false", "null"}) {
+        if (text_.substr(pos_, literal.size()) == literal) {
+            pos_ += literal.size();
+            return;
+        }
+    }
+    // A number: integer() would reject fractions and exponents.
+    const std::size_t start = pos_;
+    while (pos_ < text_.size() &&
+           std::string_view("+-.0123456789eE").find(text_[pos_]) !=
+               std::string_view::npos) {
+        pos_++;
+    }
+    if (pos_ == start) {
+        throw json_error("Expected a value");
+    }
+}
+
+void bank::json_reader::end() {
+    skip_space();
+    if (pos_ != text_.size()) {
+        throw json_error("Trailing characters");
+    }
+}
@@ -0,0 +1,157 @@
+#ifndef HTTP_H
+#define HTTP_H
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+
+namespace bank {
+// An HTTP/1.x request parsed in place: every view points into the input it
+// was parsed from and is valid as long as that is.
+struct http_request {
+    static constexpr std::size_t MAX_HEADERS = 32;
+    static constexpr std::size_t MAX_HEAD_BYTES = 16 * 1024;
+    static constexpr std::size_t MAX_BODY_BYTES = 1024 * 1024;
+
+    std::string_view method;
+    std::string_view path;   // Still percent-encoded.
+    std::string_view query;  // After '?', still percent-encoded.
+    std::string_view body;
+    int minor_version = 1;  // HTTP/1.<minor_version>.
+    bool keep_alive = true;
+    bool expect_continue = false;
+    std::size_t header_count = 0;
+    std::array<std::pair<std::string_view, std::string_view>, MAX_HEADERS>
+        headers{};
+
+    // Value of the first header called `name`, compared case-insensitively;
+    // empty if there is none.
+    [[nodiscard]] std::string_view header(std::string_view name
+    ) const noexcept;
+};
+
+enum class http_parse_status {
+    COMPLETE,
+    // Needs more input. Once the head is in, `request` has it, so that the
+    // caller can answer "Expect: 100-continue".
+    INCOMPLETE,
+    INVALID,
+    TOO_LARGE,
+};
+
+// Parses the request at the start of `input`. On COMPLETE, `size` is its
+// length, head and body, and the next pipelined request starts right after.
+// Request bodies need a Content-Length; chunked ones are INVALID.
+http_parse_status parse_http_request(
+    std::string_view input,
+    http_request &request,
+    std::size_t &size
+);
+
+// Decodes %XX escapes into `out`, leaving everything else, '+' included,
+// as is. Returns false on a malformed escape.
+bool percent_decode(std::string_view in, std::string &out);
+// Raw value of the first `name=value` parameter of a query string.
+std::optional<std::string_view>
+query_parameter(std::string_view query, std::string_view name) noexcept;
+
+// Appends JSON text to a string, adding commas between members and array
+// elements by itself. Strings are escaped as JSON requires and otherwise
+// copied byte for byte.
+class json_writer {
+public:
+    explicit json_writer(std::string &out) noexcept : out_(out) {
+    }
+
+    json_writer &begin_object();
+    json_writer &end_object();
+    json_writer &begin_array();
+    json_writer &end_array();
+    json_writer &key(std::string_view name);
+    json_writer &string(std::string_view s);
+    json_writer &number(long long n);
+    json_writer &boolean(bool b);
+    json_writer &null();
+
+private:
+    std::string &out_;
+    bool comma_ = false;
+
+    void separate();
+    void append_escaped(std::string_view s);
+};
+
+class json_error : public std::runtime_error {
+public:
+    explicit json_error(const std::string &msg) : std::runtime_error(msg){};
+};
+
+// Pull parser for request bodies. Reads values in the order the caller asks
+// for them and throws json_error on anything else. Strings are returned as
+// views: into the text itself unless they have escapes, otherwise into a
+// buffer reused by the next string() call.
+class json_reader {
+public:
+    explicit json_reader(std::string_view text) noexcept : text_(text) {
+    }
+
+    // Calls member(key) for each member of the object at the cursor, which
+    // must read or skip() the value. `key` is valid until it does.
+    template <typename F>
+    void object(F &&member) {
+        expect('{');
+        if (consume('}')) {
+            return;
+        }
+        do {
+            const std::string_view key = read_string(key_buffer_);
+            expect(':');
+            member(key);
+        } while (consume(','));
+        expect('}');
+    }
+
+    // Calls element() for each element of the array at the cursor, which
+    // must read or skip() it.
+    template <typename F>
+    void array(F &&element) {
+        expect('[');
+        if (consume(']')) {
+            return;
+        }
+        do {
+            element();
+        } while (consume(','));
+        expect(']');
+    }
+
+    std::string_view string();
+    long long integer();
+    // Consumes a null if there is one.
+    bool null();
+    void skip();
+    // Throws unless only whitespace is left.
+    void end();
+
+private:
+    static constexpr int MAX_DEPTH = 64;
+
+    std::string_view text_;
+    std::size_t pos_ = 0;
+    std::string buffer_;
+    std::string key_buffer_;
+
+    void skip_space() noexcept;
+    void expect(char c);
+    bool consume(char c);
+    std::string_view read_string(std::string &buffer);
+    void skip(int depth);
+};
+}  // namespace bank
+
+#endif  // HTTP_H
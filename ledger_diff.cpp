@@ -0,0 +1,296 @@
+#include "ledger_diff.hpp"
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <exception>
+#include <fstream>
+#include <mutex>
+#include <stdexcept>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include "snapshot_io.hpp"
+
+namespace {
+// Consecutive changed accounts parsed by one task.
+constexpr std::size_t SHARD_ACCOUNTS = 64;
+// Seeking drops the stream's buffer, so shorter histories are read through
+// instead.
+constexpr std::uint64_t SEEK_BYTES = 64 * 1024;
+
+template <typename T>
+T parse_field(std::string_view &line) {
+    while (!line.empty() && line.front() == ' ') {
+        line.remove_prefix(1);
+    }
+    T value{};
+    const auto [end, error] =
+        std::from_chars(line.data(), line.data() + line.size(), value);
+    if (error != std::errc{}) {
+        throw bank::snapshot_error("Malformed account in snapshot");
+    }
+    line.remove_prefix(static_cast<std::size_t>(end - line.data()));
+    return value;
+}
+
+void skip(std::istream &is, std::uint64_t bytes) {
+    if (bytes < SEEK_BYTES) {
+        is.ignore(static_cast<std::streamsize>(bytes));
+        if (static_cast<std::uint64_t>(is.gcount()) != bytes) {
+            throw bank::snapshot_error("Truncated snapshot");
+        }
+    } else if (!is.seekg(static_cast<std::streamoff>(bytes), std::ios::cur)) {
+        throw bank::snapshot_error("Truncated snapshot");
+    }
+}
+
+void expect_newline(std::istream &is) {
+    if (is.get() != '\n') {
+        throw bank::snapshot_error("Malformed snapshot");
+    }
+}
+
+// Name of the account a record refers to, "-" for none.
+const std::string &counterparty_name(
+    const std::vector<bank::snapshot_index::account> &accounts,
+    long long counterparty
+) {
+    static const std::string NONE = "-";
+    if (counterparty == -1) {
+        return NONE;
+    }
+    if (counterparty < 0 ||
+        static_cast<std::size_t>(counterparty) >= accounts.size()) {
+        throw bank::snapshot_error("Bad counterparty in snapshot");
+    }
+    return accounts[static_cast<std::size_t>(counterparty)].name;
+}
+}  // namespace
+
+bank::snapshot_index bank::snapshot_index::read(std::istream &is) {
+    using snapshot_io::read_number;
+    snapshot_index index;
+    std::string magic;
+    is >> magic;
+    index.format = magic == snapshot_io::MAGIC ? read_number<int>(is) : 0;
+    if (index.format < 1 || index.format > snapshot_io::FORMAT) {
+        throw snapshot_error("Not a ledger snapshot");
+    }
+    index.accounts.resize(read_number<std::size_t>(is));
+    for (account &a : index.accounts) {
+        a.name = snapshot_io::read_string(is);
+    }
+    expect_newline(is);
+
+    if (index.format >= 3) {
+        // Offsets are tracked here rather than asked of the stream, which
+        // may cost a system call each time.
+        std::streamoff offset = is.tellg();
+        std::string line;
+        for (account &a : index.accounts) {
+            if (!std::getline(is, line)) {
+                throw snapshot_error("Truncated snapshot");
+            }
+            std::string_view fields = line;
+            a.balance_xts = parse_field<int>(fields);
+            a.version = parse_field<std::uint64_t>(fields);
+            parse_field<long long>(fields);  // Netting window.
+            parse_field<long long>(fields);  // Parent.
+            a.transactions = parse_field<std::size_t>(fields);
+            a.history_bytes = parse_field<std::uint64_t>(fields);
+            if (index.format >= 4) {
+                a.history_checksum = parse_field<std::uint64_t>(fields);
+            }
+            a.history_offset =
+                offset + static_cast<std::streamoff>(line.size() + 1);
+            skip(is, a.history_bytes);
+            offset = a.history_offset +
+                     static_cast<std::streamoff>(a.history_bytes);
+        }
+        return index;
+    }
+
+    // Older formats don't record history sizes: parse the histories.
+    for (account &a : index.accounts) {
+        a.balance_xts = read_number<int>(is);
+        a.version = read_number<std::uint64_t>(is);
+        read_number<long long>(is);  // Netting window.
+        if (index.format >= 2) {
+            read_number<long long>(is);  // Parent.
+        }
+        a.transactions = read_number<std::size_t>(is);
+        expect_newline(is);
+        a.history_offset = is.tellg();
+        std::uint64_t checksum = user::EMPTY_HISTORY_CHECKSUM;
+        for (std::size_t i = 0; i < a.transactions; i++) {
+            const snapshot_io::record r = snapshot_io::read_record(is);
+            expect_newline(is);
+            checksum = extend_history_checksum(
+                checksum, counterparty_name(index.accounts, r.counterparty),
+                r.balance_delta_xts, r.comment
+            );
+        }
+        a.history_checksum = checksum;
+        a.history_bytes =
+            static_cast<std::uint64_t>(is.tellg() - a.history_offset);
+    }
+    return index;
+}
+
+bank::ledger_diff bank::diff_snapshots(
+    const snapshot_index &before,
+    const std::string &after_path,
+    const snapshot_index &after,
+    unsigned threads
+) {
+    using account = snapshot_index::account;
+    // Accounts keep their position from one snapshot to the next, so the
+    // name map is only needed if some don't.
+    std::unordered_map<std::string_view, const account *> before_by_name;
+    auto find_before = [&](std::size_t i) -> const account * {
+        const std::string &name = after.accounts[i].name;
+        if (i < before.accounts.size() && before.accounts[i].name == name) {
+            return &before.accounts[i];
+        }
+        if (before_by_name.empty()) {
+            for (const account &b : before.accounts) {
+                before_by_name.emplace(b.name, &b);
+            }
+        }
+        const auto it = before_by_name.find(name);
+        return it == before_by_name.end() ? nullptr : it->second;
+    };
+
+    struct job {
+        const account *a;
+        const account *b;  // Null for added accounts.
+    };
+    ledger_diff diff;
+    std::vector<job> jobs;
+    std::vector<bool> kept(before.accounts.size());
+    for (std::size_t i = 0; i < after.accounts.size(); i++) {
+        const account &a = after.accounts[i];
+        const account *b = find_before(i);
+        if (b != nullptr) {
+            kept[static_cast<std::size_t>(b - before.accounts.data())] = true;
+            const bool same_history =
+                !b->history_checksum || !a.history_checksum ||
+                b->history_checksum == a.history_checksum;
+            if (b->version == a.version && b->transactions == a.transactions &&
+                same_history) {
+                diff.unchanged++;
+                continue;
+            }
+        }
+        jobs.push_back({&a, b});
+    }
+    for (std::size_t i = 0; i < before.accounts.size(); i++) {
+        if (!kept[i]) {
+            diff.removed.push_back(before.accounts[i].name);
+        }
+    }
+    diff.changed.resize(jobs.size());
+
+    const std::size_t shards =
+        (jobs.size() + SHARD_ACCOUNTS - 1) / SHARD_ACCOUNTS;
+    std::atomic<std::size_t> next = 0;
+    std::atomic<std::uint64_t> bytes_parsed = 0;
+    std::mutex error_mutex;
+    std::exception_ptr error;
+    // Parses the records of `a` from `first` on, starting `offset` bytes
+    // into its history, and returns `checksum` extended by them.
+    auto parse_records = [&](std::ifstream &f, const account &a,
+                             std::uint64_t first, std::uint64_t offset,
+                             std::uint64_t checksum, account_diff &d) {
+        f.seekg(a.history_offset + static_cast<std::streamoff>(offset));
+        d.first_record = first;
+        d.records.clear();
+        d.records.reserve(std::min<std::uint64_t>(
+            a.transactions - first, snapshot_io::MAX_UNREAD_RESERVE
+        ));
+        for (std::uint64_t seq = first; seq < a.transactions; seq++) {
+            snapshot_io::record r = snapshot_io::read_record(f);
+            expect_newline(f);
+            checksum = extend_history_checksum(
+                checksum, counterparty_name(after.accounts, r.counterparty),
+                r.balance_delta_xts, r.comment
+            );
+            std::optional<std::string> counterparty;
+            if (r.counterparty != -1) {
+                counterparty =
+                    after.accounts[static_cast<std::size_t>(r.counterparty)]
+                        .name;
+            }
+            d.records.push_back(
+                {seq, std::move(counterparty), r.balance_delta_xts,
+                 std::move(r.comment)}
+            );
+        }
+        bytes_parsed += a.history_bytes - offset;
+        return checksum;
+    };
+    auto parse = [&](std::ifstream &f, const job &j, account_diff &d) {
+        const account &a = *j.a;
+        d.name = a.name;
+        d.added = j.b == nullptr;
+        d.balance_after_xts = a.balance_xts;
+        d.version_after = a.version;
+        if (j.b != nullptr) {
+            const account &b = *j.b;
+            d.balance_before_xts = b.balance_xts;
+            d.version_before = b.version;
+            // The earlier history should be a prefix of the later one. If
+            // it is not, the records past it may not even parse.
+            if (b.history_checksum && a.history_checksum &&
+                b.transactions <= a.transactions &&
+                b.history_bytes <= a.history_bytes) {
+                try {
+                    if (parse_records(
+                            f, a, b.transactions, b.history_bytes,
+                            *b.history_checksum, d
+                        ) == *a.history_checksum) {
+                        return;
+                    }
+                } catch (const snapshot_error &) {
+                    f.clear();
+                }
+            }
+        }
+        parse_records(f, a, 0, 0, user::EMPTY_HISTORY_CHECKSUM, d);
+    };
+    auto work = [&] {
+        try {
+            std::ifstream f(after_path, std::ios::binary);
+            if (!f) {
+                throw std::runtime_error("Unable to read " + after_path);
+            }
+            for (std::size_t s = next++; s < shards; s = next++) {
+                const std::size_t end =
+                    std::min(jobs.size(), (s + 1) * SHARD_ACCOUNTS);
+                for (std::size_t i = s * SHARD_ACCOUNTS; i < end; i++) {
+                    parse(f, jobs[i], diff.changed[i]);
+                }
+            }
+        } catch (...) {
+            const std::unique_lock lock(error_mutex);
+            if (!error) {
+                error = std::current_exception();
+            }
+            next = shards;  // Stop the other workers early.
+        }
+    };
+    std::vector<std::thread> workers;
+    const std::size_t count =
+        std::min<std::size_t>(std::max(threads, 1U), shards);
+    for (std::size_t i = 0; i < count; i++) {
+        workers.emplace_back(work);
+    }
+    for (auto &w : workers) {
+        w.join();
+    }
+    if (error) {
+        std::rethrow_exception(error);
+    }
+    diff.bytes_parsed = bytes_parsed;
+    return diff;
+}
@@ -0,0 +1,82 @@
+#ifndef LEDGER_DIFF_H
+#define LEDGER_DIFF_H
+
+#include <cstddef>
+#include <cstdint>
+#include <istream>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace bank {
+// Where each account's state and history sit in a ledger snapshot. From
+// format 3 on only the state lines are parsed; histories are skipped by
+// size.
+struct snapshot_index {
+    struct account {
+        std::string name;
+        int balance_xts = 0;
+        std::uint64_t version = 0;
+        std::size_t transactions = 0;
+        std::streamoff history_offset = 0;  // From the start of the stream.
+        std::uint64_t history_bytes = 0;
+        // user::history_checksum() of the whole history. Format 3
+        // snapshots don't record it.
+        std::optional<std::uint64_t> history_checksum;
+    };
+    int format = 0;
+    std::vector<account> accounts;
+
+    // Indexes the ledger snapshot at the current position of `is`, which
+    // must be seekable, and leaves `is` just past it. Throws snapshot_error
+    // on malformed input.
+    static snapshot_index read(std::istream &is);
+};
+
+struct diff_record {
+    std::uint64_t seq = 0;  // Position in the account's history.
+    std::optional<std::string> counterparty;
+    int balance_delta_xts = 0;
+    std::string comment;
+
+    bool operator==(const diff_record &) const = default;
+};
+
+struct account_diff {
+    std::string name;
+    bool added = false;  // Not in the earlier snapshot.
+    int balance_before_xts = 0;
+    int balance_after_xts = 0;
+    std::uint64_t version_before = 0;
+    std::uint64_t version_after = 0;
+    // Records [first_record, end of history) of the later snapshot. Zero
+    // for added accounts and for histories that aren't an extension of the
+    // earlier one.
+    std::uint64_t first_record = 0;
+    std::vector<diff_record> records;
+};
+
+struct ledger_diff {
+    std::size_t unchanged = 0;
+    std::vector<account_diff> changed;  // In the later snapshot's order.
+    std::vector<std::string> removed;   // Only in the earlier snapshot.
+    std::uint64_t bytes_parsed = 0;     // History bytes actually read.
+};
+
+// What changed between two snapshots of the same ledger. Only the later
+// one, indexed from the file at `after_path`, is read. Accounts whose
+// version is the same in both are skipped. Histories are append-only, so
+// for the rest only the records past the earlier history are parsed: the
+// earlier checksum extended by them must give the later one. Otherwise, or
+// without checksums, the whole later history is parsed.
+// Changed accounts are split into shards of consecutive accounts, which
+// `threads` threads parse in parallel, each with its own file stream.
+ledger_diff diff_snapshots(
+    const snapshot_index &before,
+    const std::string &after_path,
+    const snapshot_index &after,
+    unsigned threads
+);
+}  // namespace bank
+
+#endif  // LEDGER_DIFF_H
@@ -0,0 +1,15 @@
+#include "login.hpp"
+
+std::pair<std::string_view, std::string_view> bank::split_login(
+    std::string_view login,
+    const std::function<bool(std::string_view tenant)> &is_tenant
+) {
+    const auto at = login.rfind('@');
+    if (at != std::string_view::npos) {
+        const std::string_view tenant = login.substr(at + 1);
+        if (is_tenant(tenant) || !is_tenant({})) {
+            return {login.substr(0, at), tenant};
+        }
+    }
+    return {login, {}};
+}
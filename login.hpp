@@ -0,0 +1,20 @@
+#ifndef LOGIN_H
+#define LOGIN_H
+
+#include <functional>
+#include <string_view>
+#include <utility>
+
+namespace bank {
+// Splits a login "<name>@<tenant>" into the user name and the tenant name.
+// Names may contain '@' themselves ("alice@example.com"), so the part after
+// the last '@' is taken for a tenant only if it names one, or if there is
+// no unnamed tenant the whole login could belong to. Otherwise the login is
+// the name of a user of the unnamed tenant.
+std::pair<std::string_view, std::string_view> split_login(
+    std::string_view login,
+    const std::function<bool(std::string_view tenant)> &is_tenant
+);
+}  // namespace bank
+
+#endif  // LOGIN_H
@@ -0,0 +1,32 @@
+#include "reply_buffer.hpp"
+
+void bank::reply_buffer::append_segment(history_segments::segment segment) {
+    segment_bytes_ += segment->size();
+    segments_.emplace_back(text_.size(), std::move(segment));
+}
+
+std::size_t bank::reply_buffer::size() const noexcept {
+    return text_.size() + segment_bytes_;
+}
+
+void bank::reply_buffer::clear() noexcept {
+    if (text_.capacity() > RETAINED_BYTES) {
+        std::string().swap(text_);
+    } else {
+        text_.clear();
+    }
+    segments_.clear();
+    segment_bytes_ = 0;
+}
+
+bank::reply_buffer::int_type bank::reply_buffer::overflow(int_type c) {
+    if (!traits_type::eq_int_type(c, traits_type::eof())) {
+        text_ += traits_type::to_char_type(c);
+    }
+    return traits_type::not_eof(c);
+}
+
+std::streamsize bank::reply_buffer::xsputn(const char *s, std::streamsize n) {
+    text_.append(s, static_cast<std::size_t>(n));
+    return n;
+}
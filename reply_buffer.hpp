@@ -0,0 +1,59 @@
+#ifndef REPLY_BUFFER_H
+#define REPLY_BUFFER_H
+
+#include <cstddef>
+#include <ios>
+#include <streambuf>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+#include "history_segments.hpp"
+
+namespace bank {
+// A command's reply, rendered into memory while the command holds its
+// execution slot, the command lock and maybe a pooled worker, and written
+// to the client only once it has released them. A client that is slow to
+// read (or a logical session out of credit) then holds up only itself.
+//
+// Sealed history segments are kept by reference among the text rather than
+// copied into it, so they can still be sent from the shared pages.
+class reply_buffer : public std::streambuf {
+public:
+    // Memory kept between replies; a larger reply gives its memory back.
+    static constexpr std::size_t RETAINED_BYTES = 64 * 1024;
+
+    void append_segment(history_segments::segment segment);
+
+    // Calls text(std::string_view) and segment(const segment &) for the
+    // pieces of the reply in order.
+    template <typename Text, typename Segment>
+    void for_each_piece(Text &&text, Segment &&segment) const {
+        std::size_t written = 0;
+        for (const auto &[offset, s] : segments_) {
+            if (offset > written) {
+                text(std::string_view(text_).substr(written, offset - written));
+            }
+            written = offset;
+            segment(s);
+        }
+        if (written < text_.size()) {
+            text(std::string_view(text_).substr(written));
+        }
+    }
+
+    [[nodiscard]] std::size_t size() const noexcept;
+    void clear() noexcept;
+
+private:
+    std::string text_;
+    // Segments and the offsets in text_ they go before.
+    std::vector<std::pair<std::size_t, history_segments::segment>> segments_;
+    std::size_t segment_bytes_ = 0;
+
+    int_type overflow(int_type c) override;
+    std::streamsize xsputn(const char *s, std::streamsize n) override;
+};
+}  // namespace bank
+
+#endif  // REPLY_BUFFER_H
@@ -0,0 +1,122 @@
+#include "session_mux.hpp"
+#include <limits>
+#include <utility>
+
+bank::logical_session::logical_session(
+    std::uint32_t id,
+    std::size_t credit,
+    writer write
+)
+    : prefix_(std::to_string(id) + ' '),
+      write_(std::move(write)),
+      stream_(this),
+      credit_(static_cast<long long>(credit)) {
+    setp(put_.data(), put_.data() + put_.size());
+}
+
+bool bank::logical_session::push(std::string line) {
+    {
+        const std::unique_lock lock(mutex_);
+        if (closed_) {
+            return true;
+        }
+        if (input_.size() >= MAX_QUEUED_LINES) {
+            return false;
+        }
+        input_.push_back(std::move(line));
+    }
+    cv_.notify_all();
+    return true;
+}
+
+void bank::logical_session::grant(std::size_t bytes) {
+    {
+        const std::unique_lock lock(mutex_);
+        credit_ += static_cast<long long>(bytes);
+    }
+    cv_.notify_all();
+}
+
+void bank::logical_session::close() {
+    {
+        const std::unique_lock lock(mutex_);
+        closed_ = true;
+    }
+    cv_.notify_all();
+}
+
+bool bank::logical_session::closed() const {
+    const std::unique_lock lock(mutex_);
+    return closed_;
+}
+
+void bank::logical_session::finish() {
+    close();
+    // Not through the stream, which fails once the input has ended.
+    sync();
+}
+
+bank::logical_session::int_type bank::logical_session::underflow() {
+    std::unique_lock lock(mutex_);
+    cv_.wait(lock, [&] { return !input_.empty() || closed_; });
+    if (input_.empty()) {
+        return traits_type::eof();
+    }
+    line_ = std::move(input_.front());
+    input_.pop_front();
+    lock.unlock();
+    line_ += '\n';
+    setg(line_.data(), line_.data(), line_.data() + line_.size());
+    return traits_type::to_int_type(line_.front());
+}
+
+bank::logical_session::int_type bank::logical_session::overflow(int_type c) {
+    pending_.append(pbase(), pptr());
+    setp(put_.data(), put_.data() + put_.size());
+    if (!traits_type::eq_int_type(c, traits_type::eof())) {
+        pending_ += traits_type::to_char_type(c);
+    }
+    return send_lines() ? traits_type::not_eof(c) : traits_type::eof();
+}
+
+int bank::logical_session::sync() {
+    pending_.append(pbase(), pptr());
+    setp(put_.data(), put_.data() + put_.size());
+    return send_lines() ? 0 : -1;
+}
+
+bool bank::logical_session::send_lines() {
+    std::size_t begin = 0;
+    std::size_t end = pending_.find('\n');
+    while (end != std::string::npos) {
+        long long budget = std::numeric_limits<long long>::max();
+        {
+            std::unique_lock lock(mutex_);
+            cv_.wait(lock, [&] { return credit_ > 0 || closed_; });
+            if (!closed_) {
+                budget = credit_;
+            }
+        }
+        // As many whole lines as the credit covers, and at least one.
+        frames_.clear();
+        do {
+            frames_ += prefix_;
+            frames_.append(pending_, begin, end + 1 - begin);
+            begin = end + 1;
+            end = pending_.find('\n', begin);
+        } while (end != std::string::npos &&
+                 static_cast<long long>(frames_.size()) < budget);
+        {
+            const std::unique_lock lock(mutex_);
+            if (!closed_) {
+                credit_ -= static_cast<long long>(frames_.size());
+            }
+        }
+        if (!write_(frames_)) {
+            pending_.clear();
+            return false;
+        }
+    }
+    pending_.erase(0, begin);
+    return true;
+}
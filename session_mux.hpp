@@ -0,0 +1,84 @@
+#ifndef SESSION_MUX_H
+#define SESSION_MUX_H
+
+#include <array>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <streambuf>
+#include <string>
+#include <string_view>
+
+namespace bank {
+// One logical session of a multiplexed connection, as the session sees it:
+// an iostream whose input is the lines the connection routes to it and
+// whose output leaves as "<id> <line>" frames, whole lines only.
+//
+// Output is credit-based. The client grants the session bytes of frames
+// it is ready to take; a flush that finds the credit used up blocks until
+// more is granted, so a stream the client doesn't keep up with stalls on
+// its own instead of filling the shared connection. Frames may overrun
+// the credit by at most one line.
+class logical_session : private std::streambuf {
+public:
+    // Writes frames to the connection; returns false once it is gone.
+    using writer = std::function<bool(std::string_view frames)>;
+
+    // Sessions queuing more input lines than this are closed.
+    static constexpr std::size_t MAX_QUEUED_LINES = 1024;
+
+    logical_session(std::uint32_t id, std::size_t credit, writer write);
+    logical_session(const logical_session &) = delete;
+    logical_session(logical_session &&) = delete;
+    logical_session &operator=(const logical_session &) = delete;
+    logical_session &operator=(logical_session &&) = delete;
+    ~logical_session() override = default;
+
+    std::iostream &stream() noexcept {
+        return stream_;
+    }
+
+    // Queues a line of input for the session. Returns false, queueing
+    // nothing, if MAX_QUEUED_LINES are already waiting. Lines for a closed
+    // session are dropped.
+    bool push(std::string line);
+    void grant(std::size_t bytes);
+    // The session's input ends once the queued lines are read and its
+    // output is no longer limited by credit. Streams should stop.
+    void close();
+    [[nodiscard]] bool closed() const;
+    // Closes the session and sends the rest of its output.
+    void finish();
+
+private:
+    static constexpr std::size_t PUT_BUFFER = 4096;
+
+    const std::string prefix_;  // "<id> "
+    const writer write_;
+    std::iostream stream_;
+
+    mutable std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<std::string> input_;
+    long long credit_;
+    bool closed_ = false;
+
+    // Used by the session's own thread only.
+    std::string line_;     // Input line being read.
+    std::string pending_;  // Output not yet framed, ends in a partial line.
+    std::string frames_;
+    std::array<char, PUT_BUFFER> put_{};
+
+    int_type underflow() override;
+    int_type overflow(int_type c) override;
+    int sync() override;
+    // Frames and sends the complete lines in pending_.
+    bool send_lines();
+};
+}  // namespace bank
+
+#endif  // SESSION_MUX_H
@@ -0,0 +1,236 @@
+#include "sha256.hpp"
+#include <algorithm>
+#include <bit>
+#include <cstring>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define BANK_SHA_NI
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+namespace {
+// NOLINTBEGIN(cppcoreguidelines-pro-bounds-pointer-arithmetic)
+alignas(16) constexpr std::array<std::uint32_t, 64> K = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+constexpr std::array<std::uint32_t, 8> INITIAL_STATE = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+    0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+
+std::uint32_t load_be32(const std::uint8_t *p) noexcept {
+    return (std::uint32_t{p[0]} << 24U) | (std::uint32_t{p[1]} << 16U) |
+           (std::uint32_t{p[2]} << 8U) | std::uint32_t{p[3]};
+}
+
+void compress_portable(
+    std::array<std::uint32_t, 8> &state,
+    const std::uint8_t *blocks,
+    std::size_t count
+) noexcept {
+    for (; count > 0; count--, blocks += 64) {
+        std::array<std::uint32_t, 64> w{};
+        for (std::size_t i = 0; i < 16; i++) {
+            w[i] = load_be32(blocks + 4 * i);
+        }
+        for (std::size_t i = 16; i < 64; i++) {
+            const std::uint32_t s0 = std::rotr(w[i - 15], 7) ^
+                                     std::rotr(w[i - 15], 18) ^
+                                     (w[i - 15] >> 3U);
+            const std::uint32_t s1 = std::rotr(w[i - 2], 17) ^
+                                     std::rotr(w[i - 2], 19) ^
+                                     (w[i - 2] >> 10U);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+        auto [a, b, c, d, e, f, g, h] = state;
+        for (std::size_t i = 0; i < 64; i++) {
+            const std::uint32_t t1 =
+                h + (std::rotr(e, 6) ^ std::rotr(e, 11) ^ std::rotr(e, 25)) +
+                ((e & f) ^ (~e & g)) + K[i] + w[i];
+            const std::uint32_t t2 =
+                (std::rotr(a, 2) ^ std::rotr(a, 13) ^ std::rotr(a, 22)) +
+                ((a & b) ^ (a & c) ^ (b & c));
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+        state[5] += f;
+        state[6] += g;
+        state[7] += h;
+    }
+}
+
+#ifdef BANK_SHA_NI
+bool cpu_has_sha() noexcept {
+    unsigned eax = 0;
+    unsigned ebx = 0;
+    unsigned ecx = 0;
+    unsigned edx = 0;
+    if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) == 0) {
+        return false;
+    }
+    return (ebx & (1U << 29U)) != 0 && __builtin_cpu_supports("sse4.1");
+}
+
+// Four rounds per step; the message schedule lives in four registers of
+// four words each.
+// NOLINTBEGIN(cppcoreguidelines-pro-type-reinterpret-cast)
+__attribute__((target("sha,sse4.1"))) void compress_sha_ni(
+    std::array<std::uint32_t, 8> &state,
+    const std::uint8_t *blocks,
+    std::size_t count
+) noexcept {
+    const __m128i byte_swap =
+        _mm_set_epi64x(0x0c0d0e0f08090a0bLL, 0x0405060700010203LL);
+    __m128i tmp = _mm_loadu_si128(reinterpret_cast<__m128i *>(&state[0]));
+    __m128i state1 = _mm_loadu_si128(reinterpret_cast<__m128i *>(&state[4]));
+    tmp = _mm_shuffle_epi32(tmp, 0xB1);                // CDAB
+    state1 = _mm_shuffle_epi32(state1, 0x1B);          // EFGH
+    __m128i state0 = _mm_alignr_epi8(tmp, state1, 8);  // ABEF
+    state1 = _mm_blend_epi16(state1, tmp, 0xF0);       // CDGH
+
+    for (; count > 0; count--, blocks += 64) {
+        const __m128i abef = state0;
+        const __m128i cdgh = state1;
+        // A std::array would drop the vector type's alignment attributes.
+        __m128i w[4];  // NOLINT(*-avoid-c-arrays)
+#pragma GCC unroll 16
+        for (std::size_t i = 0; i < 16; i++) {
+            __m128i &wi = w[i % 4];
+            if (i < 4) {
+                wi = _mm_shuffle_epi8(
+                    _mm_loadu_si128(
+                        reinterpret_cast<const __m128i *>(blocks + 16 * i)
+                    ),
+                    byte_swap
+                );
+            } else {
+                const __m128i &w1 = w[(i + 3) % 4];  // Words t-4..t-1.
+                const __m128i &w2 = w[(i + 2) % 4];  // Words t-8..t-5.
+                __m128i x = _mm_sha256msg1_epu32(wi, w[(i + 1) % 4]);
+                x = _mm_add_epi32(x, _mm_alignr_epi8(w1, w2, 4));
+                wi = _mm_sha256msg2_epu32(x, w1);
+            }
+            __m128i msg = _mm_add_epi32(
+                wi, _mm_load_si128(reinterpret_cast<const __m128i *>(&K[4 * i]))
+            );
+            state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+            msg = _mm_shuffle_epi32(msg, 0x0E);
+            state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+        }
+        state0 = _mm_add_epi32(state0, abef);
+        state1 = _mm_add_epi32(state1, cdgh);
+    }
+
+    tmp = _mm_shuffle_epi32(state0, 0x1B);        // FEBA
+    state1 = _mm_shuffle_epi32(state1, 0xB1);     // DCHG
+    state0 = _mm_blend_epi16(tmp, state1, 0xF0);  // DCBA
+    state1 = _mm_alignr_epi8(state1, tmp, 8);     // HGFE
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(&state[0]), state0);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(&state[4]), state1);
+}
+// NOLINTEND(cppcoreguidelines-pro-type-reinterpret-cast)
+
+const bool use_sha_ni = cpu_has_sha();
+#endif
+}  // namespace
+
+bank::sha256::sha256() noexcept : state_(INITIAL_STATE) {
+}
+
+void bank::sha256::compress(const std::uint8_t *blocks, std::size_t count)
+    noexcept {
+#ifdef BANK_SHA_NI
+    if (use_sha_ni) {
+        compress_sha_ni(state_, blocks, count);
+        return;
+    }
+#endif
+    compress_portable(state_, blocks, count);
+}
+
+void bank::sha256::update(const void *data, std::size_t size) noexcept {
+    const auto *p = static_cast<const std::uint8_t *>(data);
+    length_ += size;
+    if (buffered_ > 0) {
+        const std::size_t take = std::min(size, buffer_.size() - buffered_);
+        std::memcpy(buffer_.data() + buffered_, p, take);
+        buffered_ += take;
+        p += take;
+        size -= take;
+        if (buffered_ < buffer_.size()) {
+            return;
+        }
+        compress(buffer_.data(), 1);
+        buffered_ = 0;
+    }
+    if (size >= 64) {
+        compress(p, size / 64);
+        p += size / 64 * 64;
+        size %= 64;
+    }
+    std::memcpy(buffer_.data(), p, size);
+    buffered_ = size;
+}
+
+bank::sha256_digest bank::sha256::finish() noexcept {
+    // Padding and length go straight into the buffer, so that the last one
+    // or two blocks take a single compress() call.
+    std::array<std::uint8_t, 128> tail{};
+    std::memcpy(tail.data(), buffer_.data(), buffered_);
+    tail[buffered_] = 0x80;
+    const std::size_t blocks = buffered_ < 56 ? 1 : 2;
+    const std::uint64_t bits = length_ * 8;
+    for (std::size_t i = 0; i < 8; i++) {
+        tail[64 * blocks - 1 - i] = static_cast<std::uint8_t>(bits >> (8 * i));
+    }
+    compress(tail.data(), blocks);
+    sha256_digest digest{};
+    for (std::size_t i = 0; i < 8; i++) {
+        for (std::size_t j = 0; j < 4; j++) {
+            digest[4 * i + j] =
+                static_cast<std::uint8_t>(state_[i] >> (24 - 8 * j));
+        }
+    }
+    return digest;
+}
+
+bool bank::sha256::accelerated() noexcept {
+#ifdef BANK_SHA_NI
+    return use_sha_ni;
+#else
+    return false;
+#endif
+}
+
+std::string bank::to_hex(const sha256_digest &digest) {
+    static constexpr char DIGITS[] = "0123456789abcdef";
+    std::string hex;
+    hex.reserve(2 * digest.size());
+    for (const std::uint8_t b : digest) {
+        hex += DIGITS[b >> 4U];
+        hex += DIGITS[b & 0xFU];
+    }
+    return hex;
+}
+// NOLINTEND(cppcoreguidelines-pro-bounds-pointer-arithmetic)
@@ -0,0 +1,34 @@
+#ifndef SHA256_H
+#define SHA256_H
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace bank {
+using sha256_digest = std::array<std::uint8_t, 32>;
+
+// SHA-256 (FIPS 180-4). Uses the x86 SHA extensions when the CPU has them.
+class sha256 {
+public:
+    sha256() noexcept;
+    void update(const void *data, std::size_t size) noexcept;
+    [[nodiscard]] sha256_digest finish() noexcept;
+
+    // True if the SHA extensions are in use.
+    [[nodiscard]] static bool accelerated() noexcept;
+
+private:
+    std::array<std::uint32_t, 8> state_;
+    std::array<std::uint8_t, 64> buffer_{};
+    std::size_t buffered_ = 0;
+    std::uint64_t length_ = 0;  // Bytes.
+
+    void compress(const std::uint8_t *blocks, std::size_t count) noexcept;
+};
+
+[[nodiscard]] std::string to_hex(const sha256_digest &digest);
+}  // namespace bank
+
+#endif  // SHA256_H
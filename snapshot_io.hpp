@@ -0,0 +1,50 @@
+#ifndef SNAPSHOT_IO_H
+#define SNAPSHOT_IO_H
+
+#include <cstddef>
+#include <istream>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+#include "bank.hpp"
+
+// Pieces of the ledger snapshot format shared by ledger::save() and load()
+// and by the snapshot diff.
+namespace bank::snapshot_io {
+constexpr const char *MAGIC = "bank-ledger";
+// Format 2 adds the parent account, format 3 the size of each history in
+// bytes, format 4 its checksum; older snapshots still load.
+constexpr int FORMAT = 4;
+
+// Lengths and counts read from a snapshot are trusted only this far before
+// the data they announce has actually been read, so that a corrupt number
+// fails as a truncated snapshot rather than as a huge allocation.
+constexpr std::size_t MAX_UNREAD_RESERVE = 64 * 1024;
+
+// Strings are stored as "<length>:<bytes>" so that any byte is allowed.
+void write_string(std::ostream &os, const std::string &s);
+std::string read_string(std::istream &is);
+
+template <typename T>
+T read_number(std::istream &is) {
+    T value{};
+    if (!(is >> value)) {
+        throw snapshot_error("Malformed number in snapshot");
+    }
+    return value;
+}
+
+// A history record: "<counterparty> <delta> <comment> <items>", then the
+// delta and comment of each netted item. The counterparty is a user index,
+// -1 for none.
+struct record {
+    long long counterparty = -1;
+    int balance_delta_xts = 0;
+    std::string comment;
+    std::vector<std::pair<int, std::string>> items;
+};
+record read_record(std::istream &is);
+}  // namespace bank::snapshot_io
+
+#endif  // SNAPSHOT_IO_H
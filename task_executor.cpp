@@ -0,0 +1,188 @@
+#include "task_executor.hpp"
+#include <algorithm>
+#include <exception>
+#include <future>
+#include <string>
+
+namespace {
+// Which executor and worker the current thread belongs to, and how many
+// tasks are running on it (more than one inside yield()).
+thread_local bank::task_executor *current_executor = nullptr;
+thread_local std::size_t current_worker = 0;
+thread_local int nesting = 0;
+}  // namespace
+
+bank::task_executor::task_executor(unsigned workers, mode m)
+    : mode_(m), started_(std::chrono::steady_clock::now()) {
+    workers = std::max(workers, 1U);
+    for (unsigned i = 0; i < workers; i++) {
+        workers_.push_back(std::make_unique<worker>());
+    }
+    for (std::size_t i = 0; i < workers_.size(); i++) {
+        workers_[i]->thread = std::thread([this, i] { worker_loop(i); });
+    }
+}
+
+bank::task_executor::~task_executor() {
+    {
+        const std::unique_lock lock(idle_mutex_);
+        stopping_ = true;
+    }
+    idle_cv_.notify_all();
+    for (auto &w : workers_) {
+        w->thread.join();
+    }
+}
+
+void bank::task_executor::submit(task t, std::size_t affinity) {
+    std::size_t queue = 0;
+    if (mode_ == mode::STEALING) {
+        if (affinity != NO_AFFINITY) {
+            queue = affinity % workers_.size();
+        } else if (current_executor == this) {
+            queue = current_worker;
+        } else {
+            queue = next_worker_++ % workers_.size();
+        }
+    }
+    // Counted before it is visible, so that take() never drives the
+    // counter below zero.
+    pending_++;
+    {
+        const std::unique_lock lock(workers_[queue]->mutex);
+        workers_[queue]->tasks.push_back(std::move(t));
+    }
+    {
+        // Pairs with the predicate check in worker_loop(), so the wakeup
+        // can't fall between a worker's check and its wait.
+        const std::unique_lock lock(idle_mutex_);
+    }
+    idle_cv_.notify_one();
+}
+
+void bank::task_executor::run(const task &t, std::size_t affinity) {
+    if (current_executor == this) {
+        // Waiting for a queued task from a worker could deadlock.
+        t();
+        return;
+    }
+    std::promise<void> done;
+    submit(
+        [&] {
+            try {
+                t();
+                done.set_value();
+            } catch (...) {
+                done.set_exception(std::current_exception());
+            }
+        },
+        affinity
+    );
+    done.get_future().get();
+}
+
+bool bank::task_executor::yield() {
+    task_executor *executor = current_executor;
+    // Only the outermost task yields; nested ones just run to completion.
+    if (executor == nullptr || nesting != 1) {
+        return false;
+    }
+    task t;
+    if (!executor->take(current_worker, t, false)) {
+        return false;
+    }
+    executor->execute(current_worker, t);
+    return true;
+}
+
+bool bank::task_executor::on_worker() noexcept {
+    return current_executor != nullptr;
+}
+
+bool bank::task_executor::take(std::size_t index, task &t, bool steal) {
+    const std::size_t own = mode_ == mode::SHARED ? 0 : index;
+    {
+        const std::unique_lock lock(workers_[own]->mutex);
+        if (!workers_[own]->tasks.empty()) {
+            t = std::move(workers_[own]->tasks.front());
+            workers_[own]->tasks.pop_front();
+            pending_--;
+            return true;
+        }
+    }
+    if (mode_ == mode::SHARED || !steal) {
+        return false;
+    }
+    for (std::size_t k = 1; k < workers_.size(); k++) {
+        worker &victim = *workers_[(index + k) % workers_.size()];
+        const std::unique_lock lock(victim.mutex);
+        if (!victim.tasks.empty()) {
+            t = std::move(victim.tasks.back());
+            victim.tasks.pop_back();
+            pending_--;
+            workers_[index]->stolen++;
+            return true;
+        }
+    }
+    return false;
+}
+
+void bank::task_executor::execute(std::size_t index, task &t) {
+    const auto start = std::chrono::steady_clock::now();
+    nesting++;
+    try {
+        t();
+    } catch (...) {  // NOLINT(bugprone-empty-catch)
+        // Submitted tasks handle their own errors; run() forwards them.
+    }
+    nesting--;
+    worker &w = *workers_[index];
+    w.executed++;
+    // Time of nested tasks is already inside the outer task's time.
+    if (nesting == 0) {
+        w.busy_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                         std::chrono::steady_clock::now() - start
+        )
+                         .count();
+    }
+}
+
+void bank::task_executor::worker_loop(std::size_t index) {
+    current_executor = this;
+    current_worker = index;
+    while (true) {
+        task t;
+        if (take(index, t, true)) {
+            execute(index, t);
+            continue;
+        }
+        std::unique_lock lock(idle_mutex_);
+        if (stopping_ && pending_ == 0) {
+            return;
+        }
+        idle_cv_.wait(lock, [&] { return pending_ > 0 || stopping_; });
+    }
+}
+
+bank::task_executor::worker_stats
+bank::task_executor::stats(unsigned worker) const {
+    const auto &w = *workers_.at(worker);
+    return {w.executed, w.stolen, std::chrono::nanoseconds(w.busy_ns)};
+}
+
+void bank::task_executor::print_metrics(std::ostream &os) const {
+    const double uptime = std::chrono::duration<double, std::nano>(
+                              std::chrono::steady_clock::now() - started_
+    )
+                              .count();
+    os << "executor.mode\t" << (mode_ == mode::SHARED ? "shared" : "stealing")
+       << '\n';
+    for (unsigned i = 0; i < workers(); i++) {
+        const worker_stats s = stats(i);
+        const std::string prefix = "executor.worker." + std::to_string(i) + '.';
+        os << prefix << "tasks\t" << s.tasks << '\n'
+           << prefix << "stolen\t" << s.stolen << '\n'
+           << prefix << "busy_pct\t"
+           << static_cast<double>(s.busy.count()) * 100 / uptime << '\n';
+    }
+}
@@ -0,0 +1,99 @@
+#ifndef TASK_EXECUTOR_H
+#define TASK_EXECUTOR_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <thread>
+#include <vector>
+
+namespace bank {
+// Fixed pool of worker threads running std::function tasks.
+//
+// SHARED: one FIFO queue that every worker takes from.
+// STEALING: a deque per worker. Tasks go to the worker their affinity key
+// maps to (or the submitting worker, or round-robin); a worker takes from
+// the front of its own deque and, when that is empty, steals from the back
+// of the others'.
+//
+// Long tasks call yield() between chunks of work, which runs a waiting task
+// of the same worker inline, so a long scan doesn't hold up the tasks
+// queued behind it. The task run inline may belong to anyone, so yield only
+// where such a task can't get stuck behind the caller, and only submit tasks
+// that don't block on I/O: the server's commands render their replies into
+// memory and the session threads write them.
+class task_executor {
+public:
+    enum class mode { SHARED, STEALING };
+    using task = std::function<void()>;
+    static constexpr std::size_t NO_AFFINITY = SIZE_MAX;
+
+    task_executor(unsigned workers, mode m);
+    task_executor(const task_executor &) = delete;
+    task_executor(task_executor &&) = delete;
+    task_executor &operator=(const task_executor &) = delete;
+    task_executor &operator=(task_executor &&) = delete;
+    // Runs the tasks still queued, then joins the workers.
+    ~task_executor();
+
+    void submit(task t, std::size_t affinity = NO_AFFINITY);
+    // Submits and waits for completion; exceptions are rethrown here.
+    void run(const task &t, std::size_t affinity = NO_AFFINITY);
+    // Preemption point for the task running on the calling worker thread.
+    // Returns true if another task was run meanwhile.
+    static bool yield();
+    // True on a worker thread of any executor.
+    static bool on_worker() noexcept;
+
+    struct worker_stats {
+        std::uint64_t tasks = 0;
+        std::uint64_t stolen = 0;
+        std::chrono::nanoseconds busy{0};
+    };
+
+    [[nodiscard]] unsigned workers() const noexcept {
+        return static_cast<unsigned>(workers_.size());
+    }
+    [[nodiscard]] mode get_mode() const noexcept {
+        return mode_;
+    }
+    [[nodiscard]] worker_stats stats(unsigned worker) const;
+    // Per-worker task counts and busy share since construction.
+    void print_metrics(std::ostream &os) const;
+
+private:
+    struct worker {
+        std::mutex mutex;
+        std::deque<task> tasks;
+        std::atomic<std::uint64_t> executed = 0;
+        std::atomic<std::uint64_t> stolen = 0;
+        std::atomic<std::int64_t> busy_ns = 0;
+        std::thread thread;
+    };
+
+    const mode mode_;
+    std::vector<std::unique_ptr<worker>> workers_;
+    std::atomic<std::size_t> next_worker_ = 0;
+    const std::chrono::steady_clock::time_point started_;
+
+    // Sleeping workers wait here until something is queued.
+    std::mutex idle_mutex_;
+    std::condition_variable idle_cv_;
+    std::atomic<std::size_t> pending_ = 0;
+    bool stopping_ = false;
+
+    void worker_loop(std::size_t index);
+    // Takes the next task for worker `index`; false if none is queued.
+    bool take(std::size_t index, task &t, bool steal);
+    void execute(std::size_t index, task &t);
+};
+}  // namespace bank
+
+#endif  // TASK_EXECUTOR_H
@@ -0,0 +1,269 @@
+#include "user_table.hpp"
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <functional>
+#include <new>
+#include <thread>
+#include <utility>
+#include "bank.hpp"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+struct bank::user_table::chunk {
+    alignas(user) std::array<std::byte, sizeof(user) * CHUNK_SIZE> users;
+    std::array<std::size_t, CHUNK_SIZE> hashes;
+};
+
+namespace {
+constexpr std::uint8_t control_byte(std::size_t hash) noexcept {
+    return static_cast<std::uint8_t>(0x80U | (hash & 0x7FU));
+}
+
+constexpr std::size_t group_of(std::size_t hash) noexcept {
+    return hash >> 7U;
+}
+
+// Bit i is set if control[i] == byte, for the 16 bytes of a group.
+std::uint32_t match_group(const std::uint8_t *control, std::uint8_t byte) {
+#ifdef __SSE2__
+    // NOLINTNEXTLINE(cppcoreguidelines-pro-type-reinterpret-cast)
+    const __m128i group =
+        _mm_load_si128(reinterpret_cast<const __m128i *>(control));
+    return static_cast<std::uint32_t>(_mm_movemask_epi8(
+        _mm_cmpeq_epi8(group, _mm_set1_epi8(static_cast<char>(byte)))
+    ));
+#else
+    std::uint32_t mask = 0;
+    for (std::uint32_t i = 0; i < 16; i++) {
+        // NOLINTNEXTLINE(cppcoreguidelines-pro-bounds-pointer-arithmetic)
+        if (control[i] == byte) {
+            mask |= 1U << i;
+        }
+    }
+    return mask;
+#endif
+}
+}  // namespace
+
+bank::user_table::user_table() = default;
+
+bank::user_table::~user_table() {
+    for (std::size_t i = 0; i < size_; i++) {
+        at(i).~user();
+    }
+}
+
+std::size_t bank::user_table::hash(const std::string &name) noexcept {
+    return std::hash<std::string>{}(name);
+}
+
+bank::user &bank::user_table::at(std::size_t position) const noexcept {
+    chunk &c = *chunks_[position / CHUNK_SIZE];
+    // NOLINTNEXTLINE(cppcoreguidelines-pro-type-reinterpret-cast)
+    return *std::launder(reinterpret_cast<user *>(
+        c.users.data() + sizeof(user) * (position % CHUNK_SIZE)
+    ));
+}
+
+std::size_t bank::user_table::hash_at(std::size_t position) const noexcept {
+    return chunks_[position / CHUNK_SIZE]->hashes[position % CHUNK_SIZE];
+}
+
+bank::user *bank::user_table::find(const std::string &name, std::size_t hash)
+    const {
+    if (user *u = find_in(index_, name, hash)) {
+        return u;
+    }
+    // Entries not migrated yet are still only in the old index.
+    return find_in(old_index_, name, hash);
+}
+
+bank::user *bank::user_table::find_in(
+    const index &idx,
+    const std::string &name,
+    std::size_t hash
+) const {
+    if (!idx.control) {
+        return nullptr;
+    }
+    const std::uint8_t byte = control_byte(hash);
+    std::size_t group = group_of(hash) & idx.group_mask;
+    // Triangular probing visits every group of a power-of-two table.
+    for (std::size_t step = 1;; step++) {
+        const std::size_t base = group * GROUP_SIZE;
+        const std::uint8_t *control = &idx.control[base];
+        for (std::uint32_t mask = match_group(control, byte); mask != 0;
+             mask &= mask - 1) {
+            const std::uint32_t position =
+                idx.positions[base + static_cast<std::size_t>(
+                                         std::countr_zero(mask)
+                                     )];
+            if (hash_at(position) == hash && at(position).name_ == name) {
+                return &at(position);
+            }
+        }
+        if (match_group(control, 0) != 0) {
+            return nullptr;
+        }
+        group = (group + step) & idx.group_mask;
+    }
+}
+
+void bank::user_table::insert_into(
+    index &idx,
+    std::uint32_t position,
+    std::size_t hash
+) {
+    std::size_t group = group_of(hash) & idx.group_mask;
+    for (std::size_t step = 1;; step++) {
+        const std::size_t base = group * GROUP_SIZE;
+        if (const std::uint32_t empty = match_group(&idx.control[base], 0);
+            empty != 0) {
+            const std::size_t slot =
+                base + static_cast<std::size_t>(std::countr_zero(empty));
+            idx.control[slot] = control_byte(hash);
+            idx.positions[slot] = position;
+            idx.size++;
+            return;
+        }
+        group = (group + step) & idx.group_mask;
+    }
+}
+
+bank::user_table::index bank::user_table::make_index(std::size_t groups) {
+    index idx;
+    const std::size_t slots = groups * GROUP_SIZE;
+    // calloc hands out lazily zeroed pages for big tables, so allocating
+    // the new index does not touch all of its memory up front.
+    // NOLINTBEGIN(cppcoreguidelines-no-malloc)
+    idx.control.reset(static_cast<std::uint8_t *>(std::calloc(slots, 1)));
+    idx.positions.reset(static_cast<std::uint32_t *>(
+        std::malloc(slots * sizeof(std::uint32_t))
+    ));
+    // NOLINTEND(cppcoreguidelines-no-malloc)
+    if (!idx.control || !idx.positions) {
+        throw std::bad_alloc();
+    }
+    idx.group_mask = groups - 1;
+    return idx;
+}
+
+bank::user &
+bank::user_table::emplace(const std::string &name, std::size_t hash) {
+    if (old_index_.control) {
+        migrate_some();
+    }
+    // Keep the load factor at or below 7/8.
+    if ((size_ + 1) * 8 > index_.capacity() * 7) {
+        grow();
+    }
+    if (size_ / CHUNK_SIZE == chunks_.size()) {
+        chunks_.push_back(std::make_unique<chunk>());
+    }
+    const std::size_t position = size_;
+    chunk &c = *chunks_[position / CHUNK_SIZE];
+    new (c.users.data() + sizeof(user) * (position % CHUNK_SIZE)) user(name);
+    c.hashes[position % CHUNK_SIZE] = hash;
+    size_++;
+    insert_into(index_, static_cast<std::uint32_t>(position), hash);
+    return at(position);
+}
+
+void bank::user_table::grow() {
+    // A resize still in progress is finished first; with eight groups per
+    // insert it is long done before the new index fills up.
+    while (old_index_.control) {
+        migrate_some();
+    }
+    const std::size_t groups =
+        index_.control ? (index_.group_mask + 1) * 2 : 1;
+    old_index_ = std::move(index_);
+    index_ = make_index(groups);
+    migrated_groups_ = 0;
+    if (!old_index_.control) {
+        return;
+    }
+    migrate_some();
+}
+
+void bank::user_table::migrate_some() {
+    const std::size_t groups = old_index_.group_mask + 1;
+    const std::size_t end =
+        std::min(groups, migrated_groups_ + MIGRATE_GROUPS_PER_INSERT);
+    for (; migrated_groups_ < end; migrated_groups_++) {
+        const std::size_t base = migrated_groups_ * GROUP_SIZE;
+        for (std::size_t slot = base; slot < base + GROUP_SIZE; slot++) {
+            if (old_index_.control[slot] != 0) {
+                const std::uint32_t position = old_index_.positions[slot];
+                insert_into(index_, position, hash_at(position));
+            }
+        }
+    }
+    if (migrated_groups_ == groups) {
+        old_index_ = index{};
+    }
+}
+
+void bank::user_table::reserve(std::size_t users) {
+    while (chunks_.size() * CHUNK_SIZE < users) {
+        chunks_.push_back(std::make_unique<chunk>());
+    }
+    const std::size_t groups =
+        std::bit_ceil((users * 8 / 7 + GROUP_SIZE) / GROUP_SIZE);
+    if (groups <= index_.group_mask + 1 && index_.control) {
+        return;
+    }
+    // Reserving is a startup operation, so rebuild the index in one go.
+    old_index_ = index{};
+    index_ = make_index(groups);
+    for (std::size_t position = 0; position < size_; position++) {
+        insert_into(
+            index_, static_cast<std::uint32_t>(position), hash_at(position)
+        );
+    }
+}
+
+std::size_t bank::user_table::prefault(unsigned threads) {
+    const std::size_t PAGE = 4096;
+    std::vector<std::pair<std::byte *, std::size_t>> regions;
+    // NOLINTBEGIN(cppcoreguidelines-pro-type-reinterpret-cast)
+    regions.emplace_back(
+        reinterpret_cast<std::byte *>(index_.control.get()), index_.capacity()
+    );
+    regions.emplace_back(
+        reinterpret_cast<std::byte *>(index_.positions.get()),
+        index_.capacity() * sizeof(std::uint32_t)
+    );
+    // NOLINTEND(cppcoreguidelines-pro-type-reinterpret-cast)
+    std::vector<std::byte *> pages;
+    std::size_t bytes = 0;
+    for (const auto &[begin, size] : regions) {
+        bytes += size;
+        for (std::size_t offset = 0; offset < size; offset += PAGE) {
+            pages.push_back(begin + offset);
+        }
+    }
+    // Writing back the value already there is harmless for live slots:
+    // the index only changes under the ledger mutex, which the caller holds.
+    auto touch = [&](std::size_t from, std::size_t to) {
+        for (std::size_t i = from; i < to; i++) {
+            volatile std::byte *p = pages[i];
+            *p = *p;
+        }
+    };
+    threads = std::max(threads, 1U);
+    std::vector<std::thread> workers;
+    const std::size_t per_thread = (pages.size() + threads - 1) / threads;
+    for (std::size_t from = 0; from < pages.size(); from += per_thread) {
+        workers.emplace_back(
+            touch, from, std::min(pages.size(), from + per_thread)
+        );
+    }
+    for (auto &w : workers) {
+        w.join();
+    }
+    return bytes;
+}
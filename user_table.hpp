@@ -0,0 +1,96 @@
+#ifndef USER_TABLE_H
+#define USER_TABLE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace bank {
+class user;
+
+// Name -> user map for bank::ledger. Users live in a chunked arena and never
+// move. The index is a flat open-addressing table of 16-slot groups probed
+// with SIMD (Swiss-table style) that stores arena positions. On growth the
+// old index is migrated a few groups per insert, so no single insert pays
+// for a full rehash. Not thread-safe; the ledger serializes access.
+class user_table {
+public:
+    user_table();
+    user_table(const user_table &) = delete;
+    user_table(user_table &&) = delete;
+    user_table &operator=(const user_table &) = delete;
+    user_table &operator=(user_table &&) = delete;
+    ~user_table();
+
+    // Hashing is independent of the table, so it can be done before taking
+    // the ledger lock.
+    [[nodiscard]] static std::size_t hash(const std::string &name) noexcept;
+
+    [[nodiscard]] user *find(const std::string &name, std::size_t hash) const;
+    // The name must not be present yet.
+    user &emplace(const std::string &name, std::size_t hash);
+
+    [[nodiscard]] std::size_t size() const noexcept {
+        return size_;
+    }
+
+    // Users in insertion order.
+    [[nodiscard]] user &at(std::size_t position) const noexcept;
+
+    // Sizes the index and the arena for `users` users up front, so that
+    // inserts up to that count never resize or allocate arena chunks.
+    void reserve(std::size_t users);
+    // Touches every page of the index from `threads` threads so that later
+    // inserts take no first-touch page faults. The arena needs no touching:
+    // reserve() zero-fills its chunks, and their pages hold live users that
+    // other threads update without the ledger mutex. Returns the number of
+    // bytes covered.
+    std::size_t prefault(unsigned threads);
+
+private:
+    static constexpr std::size_t GROUP_SIZE = 16;
+    static constexpr std::size_t CHUNK_SIZE = 1024;
+    static constexpr std::size_t MIGRATE_GROUPS_PER_INSERT = 8;
+
+    struct free_deleter {
+        void operator()(void *p) const noexcept {
+            std::free(p);  // NOLINT(cppcoreguidelines-no-malloc)
+        }
+    };
+
+    // Control byte per slot: 0 is empty, otherwise 0x80 | 7 bits of hash.
+    struct index {
+        std::unique_ptr<std::uint8_t[], free_deleter> control;
+        std::unique_ptr<std::uint32_t[], free_deleter> positions;
+        std::size_t group_mask = 0;
+        std::size_t size = 0;
+
+        [[nodiscard]] std::size_t capacity() const noexcept {
+            return control ? (group_mask + 1) * GROUP_SIZE : 0;
+        }
+    };
+
+    struct chunk;
+
+    std::vector<std::unique_ptr<chunk>> chunks_;
+    std::size_t size_ = 0;
+    index index_;
+    // Index being migrated into index_, if a resize is in progress.
+    index old_index_;
+    std::size_t migrated_groups_ = 0;
+
+    [[nodiscard]] std::size_t hash_at(std::size_t position) const noexcept;
+    [[nodiscard]] user *
+    find_in(const index &idx, const std::string &name, std::size_t hash) const;
+    static void
+    insert_into(index &idx, std::uint32_t position, std::size_t hash);
+    static index make_index(std::size_t groups);
+    void grow();
+    void migrate_some();
+};
+}  // namespace bank
+
+#endif  // USER_TABLE_H
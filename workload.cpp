@@ -0,0 +1,170 @@
+#include "workload.hpp"
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+std::string bank::workload_operation::command() const {
+    switch (type) {
+        case kind::TRANSFER:
+            return "transfer " + workload_generator::user_name(counterparty) +
+                   ' ' + std::to_string(amount) + ' ' + comment;
+        case kind::BALANCE:
+            return "balance";
+        case kind::TRANSACTIONS:
+            return "transactions " + std::to_string(count);
+    }
+    return {};
+}
+
+bank::workload_generator::workload_generator(const workload_options &options)
+    : options_(options), state_(options.seed) {
+    if (options_.users < 2) {
+        throw std::invalid_argument("Workload needs at least 2 users");
+    }
+    if (options_.transfer_weight < 0 || options_.balance_weight < 0 ||
+        options_.transactions_weight < 0 ||
+        options_.transfer_weight + options_.balance_weight +
+                options_.transactions_weight <=
+            0) {
+        throw std::invalid_argument("Bad workload command mix");
+    }
+    if (options_.min_comment_length > options_.max_comment_length) {
+        throw std::invalid_argument("Bad workload comment lengths");
+    }
+    if (options_.rate <= 0 || options_.burst_size == 0) {
+        throw std::invalid_argument("Bad workload arrival rate");
+    }
+    if (options_.zipf_s < 0 || options_.hot_fraction <= 0 ||
+        options_.hot_fraction > 1 || options_.hot_probability < 0 ||
+        options_.hot_probability > 1) {
+        throw std::invalid_argument("Bad workload user distribution");
+    }
+    if (options_.users_distribution ==
+        workload_options::distribution::ZIPF) {
+        zipf_cdf_.resize(options_.users);
+        double sum = 0;
+        for (std::size_t rank = 0; rank < options_.users; rank++) {
+            sum += 1 / std::pow(static_cast<double>(rank + 1), options_.zipf_s);
+            zipf_cdf_[rank] = sum;
+        }
+        for (double &p : zipf_cdf_) {
+            p /= sum;
+        }
+    }
+}
+
+std::string bank::workload_generator::user_name(std::size_t user) {
+    return "user-" + std::to_string(user);
+}
+
+// splitmix64: tiny, fast and fully specified by its constants.
+std::uint64_t bank::workload_generator::next_u64() noexcept {
+    std::uint64_t z = (state_ += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30U)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27U)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31U);
+}
+
+double bank::workload_generator::next_double() noexcept {
+    return static_cast<double>(next_u64() >> 11U) * 0x1.0p-53;
+}
+
+std::size_t bank::workload_generator::next_below(std::size_t n) noexcept {
+    return std::min(
+        n - 1, static_cast<std::size_t>(next_double() * static_cast<double>(n))
+    );
+}
+
+std::size_t bank::workload_generator::next_user() {
+    const std::size_t users = options_.users;
+    switch (options_.users_distribution) {
+        case workload_options::distribution::UNIFORM:
+            break;
+        case workload_options::distribution::ZIPF: {
+            const auto it = std::upper_bound(
+                zipf_cdf_.begin(), zipf_cdf_.end(), next_double()
+            );
+            return std::min(
+                users - 1, static_cast<std::size_t>(it - zipf_cdf_.begin())
+            );
+        }
+        case workload_options::distribution::HOT_SET: {
+            const std::size_t hot = std::max<std::size_t>(
+                1, static_cast<std::size_t>(
+                       options_.hot_fraction * static_cast<double>(users)
+                   )
+            );
+            if (hot >= users) {
+                break;
+            }
+            if (next_double() < options_.hot_probability) {
+                return next_below(hot);
+            }
+            return hot + next_below(users - hot);
+        }
+    }
+    return next_below(users);
+}
+
+std::chrono::nanoseconds bank::workload_generator::next_gap() {
+    auto exponential = [this](double mean_seconds) {
+        return std::chrono::nanoseconds(static_cast<std::int64_t>(
+            -std::log(1 - next_double()) * mean_seconds * 1e9
+        ));
+    };
+    if (options_.arrivals == workload_options::arrival::POISSON) {
+        return exponential(1 / options_.rate);
+    }
+    if (left_in_burst_ > 0) {
+        left_in_burst_--;
+        return std::chrono::nanoseconds(0);
+    }
+    left_in_burst_ = options_.burst_size - 1;
+    return exponential(
+        static_cast<double>(options_.burst_size) / options_.rate
+    );
+}
+
+bank::workload_operation bank::workload_generator::next() {
+    workload_operation op;
+    clock_ += next_gap();
+    op.at = clock_;
+    op.user = next_user();
+
+    const double total = options_.transfer_weight + options_.balance_weight +
+                         options_.transactions_weight;
+    const double pick = next_double() * total;
+    if (pick < options_.transfer_weight) {
+        op.type = workload_operation::kind::TRANSFER;
+        // Redraw on self-transfers; under extreme skew fall back to a
+        // uniform pick so this can't spin.
+        op.counterparty = next_user();
+        for (int attempt = 0; op.counterparty == op.user; attempt++) {
+            op.counterparty =
+                attempt < 16
+                    ? next_user()
+                    : (op.user + 1 + next_below(options_.users - 1)) %
+                          options_.users;
+        }
+        op.amount = 1 + static_cast<int>(next_below(
+                            static_cast<std::size_t>(
+                                std::max(options_.max_amount, 1)
+                            )
+                        ));
+        const std::size_t length =
+            options_.min_comment_length +
+            next_below(
+                options_.max_comment_length - options_.min_comment_length + 1
+            );
+        op.comment.resize(length);
+        for (char &c : op.comment) {
+            c = static_cast<char>('a' + next_below(26));
+        }
+    } else if (pick < options_.transfer_weight + options_.balance_weight) {
+        op.type = workload_operation::kind::BALANCE;
+    } else {
+        op.type = workload_operation::kind::TRANSACTIONS;
+        op.count = options_.transactions_count;
+    }
+    return op;
+}
@@ -0,0 +1,104 @@
+#ifndef WORKLOAD_H
+#define WORKLOAD_H
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace bank {
+// Synthetic traffic for benchmarks: who acts, what they do, how long their
+// comments are and when requests arrive. The random source and all
+// distributions are implemented here rather than taken from <random>, so a
+// seed yields the same sequence with every standard library.
+struct workload_options {
+    enum class distribution {
+        UNIFORM,
+        // Rank r (from 0) is chosen with probability ~ 1 / (r + 1)^zipf_s.
+        ZIPF,
+        // hot_probability of operations go to the first hot_fraction of
+        // users, the rest uniformly to the others.
+        HOT_SET,
+    };
+    enum class arrival {
+        // Exponential gaps with mean 1 / rate.
+        POISSON,
+        // Bursts of burst_size back-to-back operations, the bursts arriving
+        // as a Poisson process with the same average operation rate.
+        BURSTY,
+    };
+
+    std::uint64_t seed = 1;
+    std::size_t users = 1000;
+    distribution users_distribution = distribution::UNIFORM;
+    double zipf_s = 1.0;
+    double hot_fraction = 0.01;
+    double hot_probability = 0.9;
+
+    // Relative weights of the command mix.
+    double transfer_weight = 8;
+    double balance_weight = 1;
+    double transactions_weight = 1;
+    std::size_t transactions_count = 10;
+    int max_amount = 10;
+
+    // Comment lengths are uniform in [min, max].
+    std::size_t min_comment_length = 0;
+    std::size_t max_comment_length = 16;
+
+    arrival arrivals = arrival::POISSON;
+    double rate = 100'000;  // Operations per second.
+    std::size_t burst_size = 32;
+};
+
+struct workload_operation {
+    enum class kind { TRANSFER, BALANCE, TRANSACTIONS };
+    kind type = kind::TRANSFER;
+    std::size_t user = 0;
+    // Transfers only; always differs from user.
+    std::size_t counterparty = 0;
+    int amount = 0;
+    std::string comment;
+    // Transactions only.
+    std::size_t count = 0;
+    // Scheduled time since the start of the workload.
+    std::chrono::nanoseconds at{0};
+
+    // Wire form, e.g. "transfer user-7 3 abc".
+    [[nodiscard]] std::string command() const;
+};
+
+class workload_generator {
+public:
+    // Throws std::invalid_argument on inconsistent options.
+    explicit workload_generator(const workload_options &options);
+
+    workload_operation next();
+    // Draws a user index from the configured distribution.
+    std::size_t next_user();
+
+    [[nodiscard]] const workload_options &options() const noexcept {
+        return options_;
+    }
+
+    static std::string user_name(std::size_t user);
+
+private:
+    workload_options options_;
+    std::uint64_t state_;
+    // Cumulative probabilities by rank, for ZIPF.
+    std::vector<double> zipf_cdf_;
+    std::chrono::nanoseconds clock_{0};
+    std::size_t left_in_burst_ = 0;
+
+    std::uint64_t next_u64() noexcept;
+    // Uniform in [0, 1).
+    double next_double() noexcept;
+    // Uniform in [0, n).
+    std::size_t next_below(std::size_t n) noexcept;
+    std::chrono::nanoseconds next_gap();
+};
+}  // namespace bank
+
+#endif  // WORKLOAD_H